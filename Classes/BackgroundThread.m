@@ -13,6 +13,7 @@
 // limitations under the License.
 
 #import "BackgroundThread.h"
+#import "TaskPool.h"
 #import "Logging.h"
 
 @implementation BackgroundThread
@@ -28,6 +29,7 @@
   NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
   LOG_DEBUG(@"Started worker thread %@", [NSThread currentThread]);
   
+  double priority = [NSThread threadPriority];  // Pool threads are shared so restore the priority afterwards
   [NSThread setThreadPriority:0.0];
   [_conditionLock lockWhenCondition:0];
   _running = YES;
@@ -63,6 +65,7 @@
   }
   _running = NO;
   [_conditionLock unlockWithCondition:3];
+  [NSThread setThreadPriority:priority];
   
   LOG_DEBUG(@"Terminated worker thread %@", [NSThread currentThread]);
   [pool release];
@@ -83,7 +86,7 @@
     _runSelector = runSelector;
     _endSelector = endSelector;
     _conditionLock = [[NSConditionLock alloc] init];
-    [NSThread detachNewThreadSelector:@selector(_thread:) toTarget:self withObject:argument];
+    [[TaskPool sharedPool] submitLongRunningTaskWithTarget:self selector:@selector(_thread:) argument:argument];
     [_conditionLock lockWhenCondition:1];
     [_conditionLock unlockWithCondition:2];
   }
@@ -100,7 +103,7 @@
   if (_running) {
     [_conditionLock lockWhenCondition:3];
     [_conditionLock unlockWithCondition:0];
-    [_conditionLock release];  // Free immediately otherwise it may happen on the worker thread through -dealloc if NSThead is the last one to release 'self'
+    [_conditionLock release];  // Free immediately otherwise it may happen on the worker thread through -dealloc if the task is the last one to release 'self'
     _conditionLock = nil;
   }
   
@@ -13,6 +13,7 @@
 // limitations under the License.
 
 #import <Foundation/Foundation.h>
+#import <CommonCrypto/CommonDigest.h>
 
 #define kMD5Size 16
 #define kSHA2Size 32
@@ -28,6 +29,10 @@ typedef struct {
 extern const MD5 kNullMD5;
 extern const SHA2 kNullSHA2;
 
+// Incremental hashing contexts for data that is not available in a single buffer
+typedef CC_MD5_CTX MD5Context;
+typedef CC_SHA256_CTX SHA2Context;
+
 static inline BOOL MD5EqualToMD5(const MD5* a, const MD5* b) {
   int* ptrA = (int*)a;
   int* ptrB = (int*)b;
@@ -61,22 +66,60 @@ NSString* DataToString(NSData* data);
 MD5 MD5WithString(NSString* string);
 MD5 MD5WithData(NSData* data);
 MD5 MD5WithBytes(const void* bytes, NSUInteger length);
+void MD5WithBytesArray(const void* const* bytes, const NSUInteger* lengths, NSUInteger count, MD5* md5s);  // Large batches are split across cores
+void MD5WithStrings(NSArray* strings, MD5* md5s);  // Same digests as MD5WithString() without temporary copies
 NSString* MD5ToString(MD5* md5);
 MD5 MD5FromString(NSString* string);
 NSString* MD5HashedString(NSString* string);
 NSString* MD5HashedFormat(NSString* format, ...);
 NSString* MD5HashedData(NSData* data);
 NSString* MD5HashedBytes(const void* bytes, NSUInteger length);
+void MD5ContextInitialize(MD5Context* context);
+void MD5ContextUpdate(MD5Context* context, const void* bytes, NSUInteger length);
+MD5 MD5ContextFinalize(MD5Context* context);  // Context must be initialized again before being reused
 
 SHA2 SHA2WithString(NSString* string);
 SHA2 SHA2WithData(NSData* data);
 SHA2 SHA2WithBytes(const void* bytes, NSUInteger length);
+void SHA2WithBytesArray(const void* const* bytes, const NSUInteger* lengths, NSUInteger count, SHA2* sha2s);  // Large batches are split across cores
+void SHA2WithStrings(NSArray* strings, SHA2* sha2s);  // Same digests as SHA2WithString() without temporary copies
 NSString* SHA2ToString(SHA2* sha2);
 SHA2 SHA2FromString(NSString* string);
 NSString* SHA2HashedString(NSString* string);
 NSString* SHA2HashedFormat(NSString* format, ...);
 NSString* SHA2HashedData(NSData* data);
 NSString* SHA2HashedBytes(const void* bytes, NSUInteger length);
+void SHA2ContextInitialize(SHA2Context* context);
+void SHA2ContextUpdate(SHA2Context* context, const void* bytes, NSUInteger length);
+SHA2 SHA2ContextFinalize(SHA2Context* context);  // Context must be initialized again before being reused
 #ifdef __cplusplus
 }
 #endif
+
+enum {
+  kHashingOutputStreamAlgorithm_MD5 = (1 << 0),
+  kHashingOutputStreamAlgorithm_SHA2 = (1 << 1)
+};
+typedef NSUInteger HashingOutputStreamAlgorithms;
+
+// NSOutputStream that hashes the data as it is written e.g. when passed to +[HTTPURLConnection downloadHTTPRequest:toStream:...]
+// Data is forwarded to the wrapped stream if any and the digests are available once the stream is closed (null before)
+@interface HashingOutputStream : NSOutputStream {
+@private
+  NSOutputStream* _stream;
+  HashingOutputStreamAlgorithms _algorithms;
+  MD5Context _md5Context;
+  SHA2Context _sha2Context;
+  MD5 _md5;
+  SHA2 _sha2;
+  unsigned long long _length;
+  NSStreamStatus _status;
+  id<NSStreamDelegate> _delegate;
+}
+@property(nonatomic, readonly) NSOutputStream* outputStream;
+@property(nonatomic, readonly) HashingOutputStreamAlgorithms algorithms;
+@property(nonatomic, readonly) MD5 md5;
+@property(nonatomic, readonly) SHA2 sha2;
+@property(nonatomic, readonly) unsigned long long length;  // Number of bytes hashed so far
+- (id) initWithOutputStream:(NSOutputStream*)stream algorithms:(HashingOutputStreamAlgorithms)algorithms;  // Stream can be nil
+@end
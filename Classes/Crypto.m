@@ -12,13 +12,123 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-#import <CommonCrypto/CommonDigest.h>
-
 #import "Crypto.h"
 
+#define kStringHashingBufferLength 256  // UniChars
+#define kHashBatchStripeCount 64
+#define kHashBatchParallelMinimumLength (64 * 1024)
+
 const MD5 kNullMD5 = {{0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0}};
 const SHA2 kNullSHA2 = {{0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0}};
 
+typedef struct {
+  const void* const* bytes;
+  const NSUInteger* lengths;
+  CFArrayRef strings;
+  BOOL sha2;
+  unsigned char* hashes;
+  NSUInteger count;
+} HashBatch;
+
+static void _HashBytes(const void* bytes, NSUInteger length, BOOL sha2, unsigned char* hash) {
+  if (bytes == NULL) {
+    memset(hash, 0, sha2 ? kSHA2Size : kMD5Size);
+  } else if (sha2) {
+    CC_SHA256(bytes, length, hash);
+  } else {
+    CC_MD5(bytes, length, hash);
+  }
+}
+
+// Hashes the UTF-16 characters of the string: directly from the backing store if it is UTF-16, otherwise by converting
+// chunks of it through a stack buffer (widening the bytes directly if the backing store is ASCII)
+static void _HashString(CFStringRef string, BOOL sha2, unsigned char* hash) {
+  CFIndex length = string ? CFStringGetLength(string) : 0;
+  if (length == 0) {
+    memset(hash, 0, sha2 ? kSHA2Size : kMD5Size);
+    return;
+  }
+  const UniChar* characters = CFStringGetCharactersPtr(string);
+  if (characters) {
+    _HashBytes(characters, length * sizeof(UniChar), sha2, hash);
+    return;
+  }
+  
+  const char* ascii = CFStringGetCStringPtr(string, kCFStringEncodingASCII);
+  UniChar buffer[kStringHashingBufferLength];
+  MD5Context md5Context;
+  SHA2Context sha2Context;
+  if (sha2) {
+    CC_SHA256_Init(&sha2Context);
+  } else {
+    CC_MD5_Init(&md5Context);
+  }
+  for (CFIndex offset = 0; offset < length; offset += kStringHashingBufferLength) {
+    CFIndex count = MIN(length - offset, kStringHashingBufferLength);
+    if (ascii) {
+      for (CFIndex i = 0; i < count; ++i) {
+        buffer[i] = (unsigned char)ascii[offset + i];
+      }
+    } else {
+      CFStringGetCharacters(string, CFRangeMake(offset, count), buffer);
+    }
+    if (sha2) {
+      CC_SHA256_Update(&sha2Context, buffer, (CC_LONG)(count * sizeof(UniChar)));
+    } else {
+      CC_MD5_Update(&md5Context, buffer, (CC_LONG)(count * sizeof(UniChar)));
+    }
+  }
+  if (sha2) {
+    CC_SHA256_Final(hash, &sha2Context);
+  } else {
+    CC_MD5_Final(hash, &md5Context);
+  }
+}
+
+static void _HashBatchStripe(void* context, size_t stripe) {
+  HashBatch* batch = (HashBatch*)context;
+  size_t size = batch->sha2 ? kSHA2Size : kMD5Size;
+  NSUInteger end = MIN((stripe + 1) * kHashBatchStripeCount, batch->count);
+  for (NSUInteger i = stripe * kHashBatchStripeCount; i < end; ++i) {
+    if (batch->strings) {
+      _HashString(CFArrayGetValueAtIndex(batch->strings, i), batch->sha2, batch->hashes + i * size);
+    } else {
+      _HashBytes(batch->bytes[i], batch->lengths[i], batch->sha2, batch->hashes + i * size);
+    }
+  }
+}
+
+// Small batches are hashed on the calling thread as dispatching would cost more than the hashing itself
+static void _HashBatch(HashBatch* batch, NSUInteger totalLength) {
+  size_t stripes = (batch->count + kHashBatchStripeCount - 1) / kHashBatchStripeCount;
+  if ((stripes > 1) && (totalLength >= kHashBatchParallelMinimumLength)) {
+    dispatch_apply_f(stripes, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), batch, _HashBatchStripe);
+  } else {
+    for (size_t i = 0; i < stripes; ++i) {
+      _HashBatchStripe(batch, i);
+    }
+  }
+}
+
+static void _HashBytesArray(const void* const* bytes, const NSUInteger* lengths, NSUInteger count, BOOL sha2, unsigned char* hashes) {
+  NSUInteger totalLength = 0;
+  for (NSUInteger i = 0; i < count; ++i) {
+    totalLength += lengths[i];
+  }
+  HashBatch batch = {bytes, lengths, NULL, sha2, hashes, count};
+  _HashBatch(&batch, totalLength);
+}
+
+static void _HashStrings(NSArray* strings, BOOL sha2, unsigned char* hashes) {
+  NSUInteger count = strings.count;
+  NSUInteger totalLength = 0;
+  for (NSUInteger i = 0; i < count; ++i) {
+    totalLength += CFStringGetLength(CFArrayGetValueAtIndex((CFArrayRef)strings, i)) * sizeof(UniChar);
+  }
+  HashBatch batch = {NULL, NULL, (CFArrayRef)strings, sha2, hashes, count};
+  _HashBatch(&batch, totalLength);
+}
+
 BOOL HashFromString(NSString* string, unsigned char* hash, NSUInteger size) {
   if (string.length != 2 * size) {
     return NO;
@@ -80,20 +190,17 @@ NSString* DataToString(NSData* data) {
 }
 
 MD5 MD5WithString(NSString* string) {
-  NSUInteger length = string.length;
-  if (length) {
-    const UniChar* internalBuffer = CFStringGetCharactersPtr((CFStringRef)string);
-    if (internalBuffer) {
-      MD5 md5 = MD5WithBytes(internalBuffer, length * sizeof(UniChar));
-      return md5;
-    }
-    void* buffer = malloc(length * sizeof(unichar));
-    [string getCharacters:buffer range:NSMakeRange(0, length)];
-    MD5 md5 = MD5WithBytes(buffer, length * sizeof(unichar));
-    free(buffer);
-    return md5;
-  }
-  return kNullMD5;
+  MD5 md5;
+  _HashString((CFStringRef)string, NO, md5.bytes);
+  return md5;
+}
+
+void MD5WithBytesArray(const void* const* bytes, const NSUInteger* lengths, NSUInteger count, MD5* md5s) {
+  _HashBytesArray(bytes, lengths, count, NO, (unsigned char*)md5s);
+}
+
+void MD5WithStrings(NSArray* strings, MD5* md5s) {
+  _HashStrings(strings, NO, (unsigned char*)md5s);
 }
 
 MD5 MD5WithData(NSData* data) {
@@ -146,21 +253,37 @@ NSString* MD5HashedBytes(const void* bytes, NSUInteger length) {
   return MD5ToString(&md5);
 }
 
-SHA2 SHA2WithString(NSString* string) {
-  NSUInteger length = string.length;
-  if (length) {
-    const UniChar* internalBuffer = CFStringGetCharactersPtr((CFStringRef)string);
-    if (internalBuffer) {
-      SHA2 sha2 = SHA2WithBytes(internalBuffer, length * sizeof(UniChar));
-      return sha2;
-    }
-    void* buffer = malloc(length * sizeof(unichar));
-    [string getCharacters:buffer range:NSMakeRange(0, length)];
-    SHA2 sha2 = SHA2WithBytes(buffer, length * sizeof(unichar));
-    free(buffer);
-    return sha2;
+void MD5ContextInitialize(MD5Context* context) {
+  CC_MD5_Init(context);
+}
+
+void MD5ContextUpdate(MD5Context* context, const void* bytes, NSUInteger length) {
+  while (length > UINT32_MAX) {  // CommonCrypto takes 32 bit lengths
+    CC_MD5_Update(context, bytes, UINT32_MAX);
+    bytes = (const char*)bytes + UINT32_MAX;
+    length -= UINT32_MAX;
   }
-  return kNullSHA2;
+  CC_MD5_Update(context, bytes, (CC_LONG)length);
+}
+
+MD5 MD5ContextFinalize(MD5Context* context) {
+  MD5 md5;
+  CC_MD5_Final(md5.bytes, context);
+  return md5;
+}
+
+SHA2 SHA2WithString(NSString* string) {
+  SHA2 sha2;
+  _HashString((CFStringRef)string, YES, sha2.bytes);
+  return sha2;
+}
+
+void SHA2WithBytesArray(const void* const* bytes, const NSUInteger* lengths, NSUInteger count, SHA2* sha2s) {
+  _HashBytesArray(bytes, lengths, count, YES, (unsigned char*)sha2s);
+}
+
+void SHA2WithStrings(NSArray* strings, SHA2* sha2s) {
+  _HashStrings(strings, YES, (unsigned char*)sha2s);
 }
 
 SHA2 SHA2WithData(NSData* data) {
@@ -212,3 +335,124 @@ NSString* SHA2HashedBytes(const void* bytes, NSUInteger length) {
   SHA2 sha2 = SHA2WithBytes(bytes, length);
   return SHA2ToString(&sha2);
 }
+
+void SHA2ContextInitialize(SHA2Context* context) {
+  CC_SHA256_Init(context);
+}
+
+void SHA2ContextUpdate(SHA2Context* context, const void* bytes, NSUInteger length) {
+  while (length > UINT32_MAX) {  // CommonCrypto takes 32 bit lengths
+    CC_SHA256_Update(context, bytes, UINT32_MAX);
+    bytes = (const char*)bytes + UINT32_MAX;
+    length -= UINT32_MAX;
+  }
+  CC_SHA256_Update(context, bytes, (CC_LONG)length);
+}
+
+SHA2 SHA2ContextFinalize(SHA2Context* context) {
+  SHA2 sha2;
+  CC_SHA256_Final(sha2.bytes, context);
+  return sha2;
+}
+
+@implementation HashingOutputStream
+
+@synthesize outputStream=_stream, algorithms=_algorithms, md5=_md5, sha2=_sha2, length=_length;
+
+- (id) initWithOutputStream:(NSOutputStream*)stream algorithms:(HashingOutputStreamAlgorithms)algorithms {
+  if ((self = [super init])) {
+    _stream = [stream retain];
+    _algorithms = algorithms;
+    _md5 = kNullMD5;
+    _sha2 = kNullSHA2;
+  }
+  return self;
+}
+
+- (void) dealloc {
+  [_stream release];
+  
+  [super dealloc];
+}
+
+- (id<NSStreamDelegate>) delegate {
+  return _delegate ? _delegate : (id<NSStreamDelegate>)self;
+}
+
+- (void) setDelegate:(id<NSStreamDelegate>)delegate {
+  _delegate = delegate;
+}
+
+- (void) open {
+  if (_status == NSStreamStatusNotOpen) {
+    if (_algorithms & kHashingOutputStreamAlgorithm_MD5) {
+      MD5ContextInitialize(&_md5Context);
+    }
+    if (_algorithms & kHashingOutputStreamAlgorithm_SHA2) {
+      SHA2ContextInitialize(&_sha2Context);
+    }
+    [_stream open];
+    _status = NSStreamStatusOpen;
+  }
+}
+
+- (void) close {
+  if (_status == NSStreamStatusOpen) {
+    if (_algorithms & kHashingOutputStreamAlgorithm_MD5) {
+      _md5 = MD5ContextFinalize(&_md5Context);
+    }
+    if (_algorithms & kHashingOutputStreamAlgorithm_SHA2) {
+      _sha2 = SHA2ContextFinalize(&_sha2Context);
+    }
+    [_stream close];
+    _status = NSStreamStatusClosed;
+  }
+}
+
+- (NSStreamStatus) streamStatus {
+  return _status;
+}
+
+- (NSError*) streamError {
+  return [_stream streamError];
+}
+
+- (id) propertyForKey:(NSString*)key {
+  return [_stream propertyForKey:key];
+}
+
+- (BOOL) setProperty:(id)property forKey:(NSString*)key {
+  return [_stream setProperty:property forKey:key];
+}
+
+- (void) scheduleInRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode {
+}
+
+- (void) removeFromRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode {
+}
+
+- (BOOL) hasSpaceAvailable {
+  return _stream ? [_stream hasSpaceAvailable] : (_status == NSStreamStatusOpen);
+}
+
+// Only the bytes actually accepted by the wrapped stream are hashed
+- (NSInteger) write:(const uint8_t*)buffer maxLength:(NSUInteger)length {
+  if (_status != NSStreamStatusOpen) {
+    return -1;
+  }
+  NSInteger result = _stream ? [_stream write:buffer maxLength:length] : (NSInteger)length;
+  if (result > 0) {
+    if (_algorithms & kHashingOutputStreamAlgorithm_MD5) {
+      MD5ContextUpdate(&_md5Context, buffer, result);
+    }
+    if (_algorithms & kHashingOutputStreamAlgorithm_SHA2) {
+      SHA2ContextUpdate(&_sha2Context, buffer, result);
+    }
+    _length += result;
+  } else if (result < 0) {
+    _status = NSStreamStatusError;
+  }
+  return result;
+}
+
+@end
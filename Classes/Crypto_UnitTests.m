@@ -0,0 +1,191 @@
+// Copyright 2011 Cooliris, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#import "Crypto.h"
+#import "UnitTest.h"
+
+#define kBatchCount 2000
+#define kBenchmarkStrings 200000
+#define kBenchmarkBuffers 20000
+#define kBenchmarkBufferLength 1024
+
+@interface CryptoTests : UnitTest
+@end
+
+@implementation CryptoTests
+
+- (NSData*) _dataWithLength:(NSUInteger)length {
+  NSMutableData* data = [NSMutableData dataWithLength:length];
+  unsigned char* bytes = data.mutableBytes;
+  for (NSUInteger i = 0; i < length; ++i) {
+    bytes[i] = (i * 7 + i / 251) & 0xFF;
+  }
+  return data;
+}
+
+- (void) testIncrementalHashing {
+  AssertEqualObjects(MD5HashedBytes("", 0), @"d41d8cd98f00b204e9800998ecf8427e");
+  AssertEqualObjects(SHA2HashedBytes("abc", 3), @"ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+  
+  NSData* data = [self _dataWithLength:100000];
+  MD5 md5 = MD5WithData(data);
+  SHA2 sha2 = SHA2WithData(data);
+  MD5Context md5Context;
+  SHA2Context sha2Context;
+  MD5ContextInitialize(&md5Context);
+  SHA2ContextInitialize(&sha2Context);
+  for (NSUInteger offset = 0; offset < data.length; offset += 777) {
+    NSUInteger length = MIN(777, data.length - offset);
+    MD5ContextUpdate(&md5Context, (const char*)data.bytes + offset, length);
+    SHA2ContextUpdate(&sha2Context, (const char*)data.bytes + offset, length);
+  }
+  MD5 md5Incremental = MD5ContextFinalize(&md5Context);
+  SHA2 sha2Incremental = SHA2ContextFinalize(&sha2Context);
+  AssertTrue(MD5EqualToMD5(&md5Incremental, &md5));
+  AssertTrue(SHA2EqualToSHA2(&sha2Incremental, &sha2));
+}
+
+- (void) testHashingOutputStream {
+  NSData* data = [self _dataWithLength:100000];
+  MD5 md5 = MD5WithData(data);
+  SHA2 sha2 = SHA2WithData(data);
+  
+  // Hash only
+  HashingOutputStream* stream = [[HashingOutputStream alloc] initWithOutputStream:nil
+                                                                        algorithms:kHashingOutputStreamAlgorithm_SHA2];
+  [stream open];
+  for (NSUInteger offset = 0; offset < data.length; offset += 4096) {
+    NSUInteger length = MIN(4096, data.length - offset);
+    AssertEqual([stream write:((const uint8_t*)data.bytes + offset) maxLength:length], (NSInteger)length);
+  }
+  SHA2 sha2Stream = stream.sha2;
+  AssertTrue(SHA2IsNull(&sha2Stream));
+  [stream close];
+  sha2Stream = stream.sha2;
+  AssertTrue(SHA2EqualToSHA2(&sha2Stream, &sha2));
+  MD5 md5Stream = stream.md5;
+  AssertTrue(MD5IsNull(&md5Stream));
+  AssertEqual(stream.length, (unsigned long long)data.length);
+  [stream release];
+  
+  // Hash and forward
+  NSOutputStream* memoryStream = [NSOutputStream outputStreamToMemory];
+  stream = [[HashingOutputStream alloc] initWithOutputStream:memoryStream
+                                                  algorithms:(kHashingOutputStreamAlgorithm_MD5 | kHashingOutputStreamAlgorithm_SHA2)];
+  [stream open];
+  AssertEqual([stream write:data.bytes maxLength:data.length], (NSInteger)data.length);
+  [stream close];
+  md5Stream = stream.md5;
+  sha2Stream = stream.sha2;
+  AssertTrue(MD5EqualToMD5(&md5Stream, &md5));
+  AssertTrue(SHA2EqualToSHA2(&sha2Stream, &sha2));
+  AssertEqualObjects([memoryStream propertyForKey:NSStreamDataWrittenToMemoryStreamKey], data);
+  [stream release];
+}
+
+// Strings of varying lengths with ASCII, non-ASCII and constant backing stores
+- (NSArray*) _stringsWithCount:(NSUInteger)count {
+  NSMutableArray* array = [NSMutableArray arrayWithCapacity:count];
+  for (NSUInteger i = 0; i < count; ++i) {
+    switch (i % 4) {
+      case 0: [array addObject:[NSString stringWithFormat:@"http://example.com/path/%lu", (unsigned long)i]]; break;
+      case 1: [array addObject:[NSString stringWithFormat:@"caf\u00E9 %lu \u2603", (unsigned long)i]]; break;
+      case 2: [array addObject:[@"" stringByPaddingToLength:(i % 1000) withString:@"abcdefgh" startingIndex:0]]; break;
+      case 3: [array addObject:(i % 8 == 3 ? @"" : @"constant")]; break;
+    }
+  }
+  return array;
+}
+
+- (void) testBatchHashing {
+  NSArray* strings = [self _stringsWithCount:kBatchCount];
+  MD5* md5s = malloc(kBatchCount * sizeof(MD5));
+  SHA2* sha2s = malloc(kBatchCount * sizeof(SHA2));
+  MD5WithStrings(strings, md5s);
+  SHA2WithStrings(strings, sha2s);
+  for (NSUInteger i = 0; i < kBatchCount; ++i) {
+    NSString* string = [strings objectAtIndex:i];
+    unichar* characters = malloc(string.length * sizeof(unichar) + 1);
+    [string getCharacters:characters range:NSMakeRange(0, string.length)];
+    MD5 md5 = string.length ? MD5WithBytes(characters, string.length * sizeof(unichar)) : kNullMD5;  // Reference UTF-16 digests
+    SHA2 sha2 = string.length ? SHA2WithBytes(characters, string.length * sizeof(unichar)) : kNullSHA2;
+    free(characters);
+    AssertTrue(MD5EqualToMD5(&md5s[i], &md5));
+    AssertTrue(SHA2EqualToSHA2(&sha2s[i], &sha2));
+    md5 = MD5WithString(string);
+    AssertTrue(MD5EqualToMD5(&md5s[i], &md5));
+  }
+  
+  const void* bytes[kBatchCount];
+  NSUInteger lengths[kBatchCount];
+  NSData* data = [self _dataWithLength:(kBatchCount * 64)];
+  for (NSUInteger i = 0; i < kBatchCount; ++i) {
+    bytes[i] = (const char*)data.bytes + i * 32;
+    lengths[i] = i % 64;
+  }
+  bytes[1] = NULL;
+  MD5WithBytesArray(bytes, lengths, kBatchCount, md5s);
+  SHA2WithBytesArray(bytes, lengths, kBatchCount, sha2s);
+  for (NSUInteger i = 0; i < kBatchCount; ++i) {
+    MD5 md5 = MD5WithBytes(bytes[i], lengths[i]);
+    SHA2 sha2 = SHA2WithBytes(bytes[i], lengths[i]);
+    AssertTrue(MD5EqualToMD5(&md5s[i], &md5));
+    AssertTrue(SHA2EqualToSHA2(&sha2s[i], &sha2));
+  }
+  AssertTrue(MD5IsNull(&md5s[1]));
+  free(md5s);
+  free(sha2s);
+}
+
+- (void) testBatchHashingBenchmark {
+  NSArray* strings = [self _stringsWithCount:kBenchmarkStrings];
+  MD5* md5s = malloc(kBenchmarkStrings * sizeof(MD5));
+  CFAbsoluteTime time = CFAbsoluteTimeGetCurrent();
+  for (NSUInteger i = 0; i < kBenchmarkStrings; ++i) {
+    md5s[i] = MD5WithString([strings objectAtIndex:i]);
+  }
+  CFAbsoluteTime singleTime = CFAbsoluteTimeGetCurrent() - time;
+  time = CFAbsoluteTimeGetCurrent();
+  MD5WithStrings(strings, md5s);
+  CFAbsoluteTime batchTime = CFAbsoluteTimeGetCurrent() - time;
+  LOG_INFO(@"MD5 string hashing: %.0f strings/s one at a time, %.0f strings/s batched",
+           kBenchmarkStrings / singleTime, kBenchmarkStrings / batchTime);
+  free(md5s);
+  
+  NSData* data = [self _dataWithLength:(kBenchmarkBuffers * kBenchmarkBufferLength)];
+  const void** bytes = malloc(kBenchmarkBuffers * sizeof(void*));
+  NSUInteger* lengths = malloc(kBenchmarkBuffers * sizeof(NSUInteger));
+  for (NSUInteger i = 0; i < kBenchmarkBuffers; ++i) {
+    bytes[i] = (const char*)data.bytes + i * kBenchmarkBufferLength;
+    lengths[i] = kBenchmarkBufferLength;
+  }
+  SHA2* sha2s = malloc(kBenchmarkBuffers * sizeof(SHA2));
+  time = CFAbsoluteTimeGetCurrent();
+  for (NSUInteger i = 0; i < kBenchmarkBuffers; ++i) {
+    sha2s[i] = SHA2WithBytes(bytes[i], lengths[i]);
+  }
+  singleTime = CFAbsoluteTimeGetCurrent() - time;
+  SHA2 sha2 = sha2s[kBenchmarkBuffers - 1];
+  time = CFAbsoluteTimeGetCurrent();
+  SHA2WithBytesArray(bytes, lengths, kBenchmarkBuffers, sha2s);
+  batchTime = CFAbsoluteTimeGetCurrent() - time;
+  AssertTrue(SHA2EqualToSHA2(&sha2s[kBenchmarkBuffers - 1], &sha2));
+  LOG_INFO(@"SHA2 hashing of %i byte buffers: %.1f MB/s one at a time, %.1f MB/s batched", kBenchmarkBufferLength,
+           data.length / singleTime / (1024.0 * 1024.0), data.length / batchTime / (1024.0 * 1024.0));
+  free(sha2s);
+  free(lengths);
+  free(bytes);
+}
+
+@end
@@ -24,6 +24,8 @@
 - (NSString*) cacheFileForHash:(NSString*)hash;
 - (NSTimeInterval) getCacheFileAccessTimestamp:(NSString*)file;  // Returns 0.0 on failure
 - (NSUInteger) getCacheFileContentsVersion:(NSString*)file;  // Returns 0 on failure
+- (NSDictionary*) getCacheFileMetadata:(NSString*)file;  // Returns nil if none
+- (BOOL) setCacheFileMetadata:(NSDictionary*)metadata forFile:(NSString*)file;  // Metadata must be a property list and is lost when the file is rewritten
 - (BOOL) writeCacheFile:(NSString*)file data:(NSData*)data version:(NSUInteger)version;
 - (BOOL) writeCacheFile:(NSString*)file contents:(id<NSCoding>)contents version:(NSUInteger)version;
 - (NSData*) readCacheFileData:(NSString*)file version:(NSUInteger*)version;
@@ -24,6 +24,7 @@
 #import "Logging.h"
 
 #define kVersionExtendedAttributeName "diskcache.version"
+#define kMetadataExtendedAttributeName "diskcache.metadata"
 
 typedef struct {
   const char* path;
@@ -179,6 +180,45 @@ static void _ArrayApplierFunction(const void* value, void* context) {
   return 0;
 }
 
+- (NSDictionary*) getCacheFileMetadata:(NSString*)file {
+  const char* utf8Path = [[_path stringByAppendingPathComponent:file] UTF8String];
+  if (utf8Path) {
+    ssize_t size = getxattr(utf8Path, kMetadataExtendedAttributeName, NULL, 0, 0, XATTR_NOFOLLOW);
+    if (size > 0) {
+      NSMutableData* data = [NSMutableData dataWithLength:size];
+      if (getxattr(utf8Path, kMetadataExtendedAttributeName, data.mutableBytes, size, 0, XATTR_NOFOLLOW) == size) {
+        id metadata = [NSPropertyListSerialization propertyListFromData:data
+                                                       mutabilityOption:NSPropertyListImmutable
+                                                                 format:NULL
+                                                       errorDescription:NULL];
+        if ([metadata isKindOfClass:[NSDictionary class]]) {
+          return metadata;
+        }
+        LOG_ERROR(@"Invalid metadata for \"%@\"", file);
+        return nil;
+      }
+    }
+    if ((errno != ENOATTR) && (errno != ENOENT)) {
+      LOG_ERROR(@"Failed retrieving metadata for \"%@\" (%s)", file, strerror(errno));
+    }
+  }
+  return nil;
+}
+
+- (BOOL) setCacheFileMetadata:(NSDictionary*)metadata forFile:(NSString*)file {
+  const char* utf8Path = [[_path stringByAppendingPathComponent:file] UTF8String];
+  NSData* data = [NSPropertyListSerialization dataFromPropertyList:metadata
+                                                            format:NSPropertyListBinaryFormat_v1_0
+                                                  errorDescription:NULL];
+  if (utf8Path && data) {
+    if (setxattr(utf8Path, kMetadataExtendedAttributeName, data.bytes, data.length, 0, XATTR_NOFOLLOW) == 0) {
+      return YES;
+    }
+    LOG_ERROR(@"Failed setting metadata for \"%@\" (%s)", file, strerror(errno));
+  }
+  return NO;
+}
+
 - (BOOL) _writeCacheFile:(NSString*)file contents:(id)contents version:(NSUInteger)version useArchiver:(BOOL)useArchiver {
   NSString* path = [_path stringByAppendingPathComponent:file];
   BOOL result;
@@ -18,9 +18,14 @@
 
 #define kHTTPHeaderStringEncoding NSISOLatin1StringEncoding  // ISO 8859-1
 
+#define kDateWireFormatMaxLength 32
+
 #define kMultipartFileKey_MimeType @"mimeType" // NSString
 #define kMultipartFileKey_FileName @"fileName"  // NSString
 #define kMultipartFileKey_FileData @"fileData"  // NSData
+#define kMultipartFileKey_FilePath @"filePath"  // NSString (alternative to kMultipartFileKey_FileData)
+#define kMultipartFileKey_FileStream @"fileStream"  // NSInputStream (streaming only and requires kMultipartFileKey_FileLength)
+#define kMultipartFileKey_FileLength @"fileLength"  // NSNumber
 
 static inline BOOL NSRangeContainsIndex(NSRange range, NSUInteger index) {
   if ((range.location != NSNotFound) && range.length) {
@@ -37,19 +42,45 @@ static inline BOOL NSRangeContainsRange(NSRange range1, NSRange range2) {
   return NO;
 }
 
+typedef enum {
+  kDateWireFormat_RFC822 = 0,  // Also RFC 1123 e.g. "Sun, 06 Nov 1994 08:49:37 GMT" or "6 Nov 94 09:49 +0100"
+  kDateWireFormat_ISO8601,  // Also RFC 3339 e.g. "1994-11-06T08:49:37Z" or "1994-11-06T09:49:37.5+01:00"
+  kDateWireFormat_HTTP  // Any of RFC 1123, RFC 850 or asctime() formats when parsing and RFC 1123 when formatting
+} DateWireFormat;
+
 NSURL* MakeHTTPURLWithArguments(NSString* baseURL, NSDictionary* arguments, BOOL escapeValues);
-extern NSData* MakeHTTPBodyForMultipartForm(NSString* boundary, NSDictionary* arguments);  // Pass file attachments as dictionaries containing kMultipartFileKey_xxx keys
+extern NSString* MakeHTTPURLStringWithArguments(NSString* baseURL, NSDictionary* arguments, BOOL escapeValues);  // Keys are never escaped
+// Pass file attachments as dictionaries containing kMultipartFileKey_xxx keys (returns nil if a file cannot be read)
+extern NSData* MakeHTTPBodyForMultipartForm(NSString* boundary, NSDictionary* arguments);
+// Attachments are read lazily as the stream is read and the exact total length is returned in contentLength (returns nil if a file is missing or a stream has no length)
+extern NSInputStream* MakeHTTPBodyStreamForMultipartForm(NSString* boundary, NSDictionary* arguments, unsigned long long* contentLength);
+
+// Table-driven percent-encoding of UTF-8 bytes: everything except RFC 3986 unreserved characters and "!$'()*,;" is escaped
+// Encoding buffer must hold 3 * length bytes and bytes may be located at buffer + 2 * length for in-place encoding
+// Decoding buffer must hold length bytes and can be the same as bytes - Invalid escape sequences are copied as-is
+extern NSUInteger PercentEncodeBytes(const char* bytes, NSUInteger length, char* buffer);
+extern NSUInteger PercentDecodeBytes(const char* bytes, NSUInteger length, char* buffer, BOOL plusAsSpace);
+
+// Lock-free and allocation-free parsing and formatting of dates in common wire formats (formatting always uses UTC)
+extern BOOL ParseDateWireFormat(const char* bytes, NSUInteger length, DateWireFormat format, CFAbsoluteTime* time);
+extern NSUInteger FormatDateWireFormat(CFAbsoluteTime time, DateWireFormat format, char* buffer);  // Buffer must hold kDateWireFormatMaxLength bytes
 
 @interface NSString (Extensions)
 - (BOOL) hasCaseInsensitivePrefix:(NSString*)prefix;
-- (NSString*) urlEscapedString;  // Uses UTF-8 encoding and also escapes characters that can confuse the query part of the URL
-- (NSString*) unescapeURLString;  // Uses UTF-8 encoding
+- (NSString*) urlEscapedString;  // Uses UTF-8 encoding and escapes everything but unreserved characters (including "#", "[" and "]")
+- (NSString*) unescapeURLString;  // Uses UTF-8 encoding - Malformed escape sequences are kept as-is - Returns nil if the result is not valid UTF-8
 - (NSString*) extractFirstSentence;
 - (NSArray*) extractAllSentences;
 - (NSIndexSet*) extractSentenceIndices;
+- (NSArray*) rangesOfSentences;  // NSValues wrapping NSRanges with the same rules as -extractAllSentences
 - (NSString*) stripParenthesis;  // Remove all parenthesis and their content
 - (BOOL) containsString:(NSString*)string;
 - (NSArray*) extractAllWords;
+- (NSArray*) rangesOfWords;  // NSValues wrapping NSRanges with the same rules as -extractAllWords
+#if NS_BLOCKS_AVAILABLE
+- (void) enumerateSentenceRangesUsingBlock:(void (^)(NSRange range, BOOL* stop))block;
+- (void) enumerateWordRangesUsingBlock:(void (^)(NSRange range, BOOL* stop))block;
+#endif
 - (NSRange) rangeOfWordAtLocation:(NSUInteger)location;
 - (NSRange) rangeOfNextWordFromLocation:(NSUInteger)location;
 - (NSString*) stringByDeletingPrefix:(NSString*)prefix;
@@ -81,6 +112,7 @@ extern NSData* MakeHTTPBodyForMultipartForm(NSString* boundary, NSDictionary* ar
                   minute:(NSUInteger)minute
                   second:(NSUInteger)second;  // All numbers are 1 based
 + (NSDate*) dateWithDaysSinceReferenceDate:(NSInteger)days;
++ (NSDate*) dateWithWireString:(NSString*)string format:(DateWireFormat)format;  // Returns nil if the string is invalid
 + (NSDate*) dateWithString:(NSString*)string cachedFormat:(NSString*)format;  // Uses current locale and timezone
 + (NSDate*) dateWithString:(NSString*)string cachedFormat:(NSString*)format localIdentifier:(NSString*)identifier;  // Uses current timezone
 + (NSDate*) dateWithString:(NSString*)string
@@ -97,6 +129,7 @@ extern NSData* MakeHTTPBodyForMultipartForm(NSString* boundary, NSDictionary* ar
 - (NSDate*) dateRoundedToMidnight;
 - (NSUInteger) daySinceBeginningOfTheYear;
 - (NSInteger) daysSinceReferenceDate;
+- (NSString*) wireStringWithFormat:(DateWireFormat)format;
 - (NSString*) stringWithCachedFormat:(NSString*)format;  // Uses current locale and timezone
 - (NSString*) stringWithCachedFormat:(NSString*)format localIdentifier:(NSString*)identifier;  // Uses current timezone
 - (NSString*) stringWithCachedFormat:(NSString*)format localIdentifier:(NSString*)identifier timeZone:(NSTimeZone*)timeZone;  // Pass nil for current locale and timezone
@@ -131,6 +164,7 @@ extern NSData* MakeHTTPBodyForMultipartForm(NSString* boundary, NSDictionary* ar
 
 @interface NSMutableURLRequest (Extensions)
 - (void) setHTTPBodyWithMultipartFormArguments:(NSDictionary*)arguments;
+- (BOOL) setHTTPBodyStreamWithMultipartFormArguments:(NSDictionary*)arguments;  // Also sets "Content-Length"
 @end
 
 @interface NSTimeZone (Extensions)
@@ -25,6 +25,7 @@
 #import <unistd.h>
 #import <dirent.h>
 #import <sys/stat.h>
+#import <errno.h>
 
 #import "Extensions_Foundation.h"
 #import "Logging.h"
@@ -38,92 +39,594 @@
 #endif
 
 static OSSpinLock _calendarSpinLock = OS_SPINLOCK_INIT;
-static OSSpinLock _formattersSpinLock = OS_SPINLOCK_INIT;
 static OSSpinLock _staticSpinLock = OS_SPINLOCK_INIT;
 
+#define kDateFormatterCacheKey "ExtensionsFoundation.DateFormatterCache"  // Prefixed to avoid clashing with other thread dictionary users
+
+#define kCharacterClass_Whitespace (1 << 0)  // Includes newlines
+#define kCharacterClass_Newline (1 << 1)
+#define kCharacterClass_SentenceBoundary (1 << 2)
+#define kCharacterClass_Uppercase (1 << 3)
+#define kCharacterClass_WordBoundary (1 << 4)
+
 typedef enum {
-  kCharacterSet_Newline = 0,
-  kCharacterSet_WhitespaceAndNewline,
-  kCharacterSet_WhitespaceAndNewline_Inverted,
-  kCharacterSet_UppercaseLetters,
+  kCharacterSet_WhitespaceAndNewline_Inverted = 0,
   kCharacterSet_DecimalDigits_Inverted,
   kCharacterSet_WordBoundaries,
-  kCharacterSet_SentenceBoundaries,
-  kCharacterSet_SentenceBoundariesAndNewlineCharacter,
   kNumCharacterSets
 } CharacterSet;
 
-NSURL* MakeHTTPURLWithArguments(NSString* baseURL, NSDictionary* arguments, BOOL escapeValues) {
-  NSUInteger index = 0;
+// Characters left as-is by percent-encoding: RFC 3986 unreserved characters and the sub-delimiters that are safe in query values
+static const uint8_t _unescapedCharacters[256] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 1, 0, 0, 1, 0, 0, 1, 1, 1, 1, 0, 1, 1, 1, 0,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 0, 0, 0,
+  0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,
+  0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+static const int8_t _hexValues[256] = {
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+  -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+static const char _hexDigits[] = "0123456789ABCDEF";
+
+NSUInteger PercentEncodeBytes(const char* bytes, NSUInteger length, char* buffer) {
+  char* output = buffer;
+  for (NSUInteger i = 0; i < length; ++i) {
+    unsigned char byte = bytes[i];  // Read the byte before writing in case the buffers overlap
+    if (_unescapedCharacters[byte]) {
+      *output++ = byte;
+    } else {
+      output[0] = '%';
+      output[1] = _hexDigits[byte >> 4];
+      output[2] = _hexDigits[byte & 0x0F];
+      output += 3;
+    }
+  }
+  return output - buffer;
+}
+
+NSUInteger PercentDecodeBytes(const char* bytes, NSUInteger length, char* buffer, BOOL plusAsSpace) {
+  char* output = buffer;
+  const char* end = bytes + length;
+  while (bytes < end) {
+    unsigned char byte = *bytes++;
+    if ((byte == '%') && (end - bytes >= 2)) {
+      int high = _hexValues[(unsigned char)bytes[0]];
+      int low = _hexValues[(unsigned char)bytes[1]];
+      if ((high >= 0) && (low >= 0)) {
+        byte = (high << 4) | low;
+        bytes += 2;
+      }
+    } else if ((byte == '+') && plusAsSpace) {
+      byte = ' ';
+    }
+    *output++ = byte;
+  }
+  return output - buffer;
+}
+
+static NSUInteger _GetUTF8Length(NSString* string) {
+  CFIndex length = 0;
+  CFStringGetBytes((CFStringRef)string, CFRangeMake(0, CFStringGetLength((CFStringRef)string)), kCFStringEncodingUTF8, 0, false, NULL, 0, &length);
+  return length;
+}
+
+static NSUInteger _CopyUTF8Bytes(NSString* string, char* buffer, NSUInteger length) {
+  CFIndex count = 0;
+  CFStringGetBytes((CFStringRef)string, CFRangeMake(0, CFStringGetLength((CFStringRef)string)), kCFStringEncodingUTF8, 0, false,
+                   (UInt8*)buffer, length, &count);
+  return count;
+}
+
+// Raw bytes are copied at the end of the reserved space then percent-encoded forward in place
+static char* _AppendPercentEncodedString(char* output, NSString* string, NSUInteger length) {
+  char* bytes = output + 2 * length;
+  _CopyUTF8Bytes(string, bytes, length);
+  return output + PercentEncodeBytes(bytes, length, output);
+}
+
+// Builds the URL string in a single buffer sized from the exact UTF-8 lengths of its parts
+NSString* MakeHTTPURLStringWithArguments(NSString* baseURL, NSDictionary* arguments, BOOL escapeValues) {
+  NSUInteger capacity = _GetUTF8Length(baseURL);
   for (NSString* key in arguments) {
     NSString* value = [arguments objectForKey:key];
     DCHECK([value isKindOfClass:[NSString class]]);
+    capacity += 2 + _GetUTF8Length(key) + (escapeValues ? 3 : 1) * _GetUTF8Length(value);
+  }
+  char* buffer = malloc(capacity);
+  char* output = buffer + _CopyUTF8Bytes(baseURL, buffer, capacity);
+  NSUInteger index = 0;
+  for (NSString* key in arguments) {
+    NSString* value = [arguments objectForKey:key];
+    *output++ = index++ == 0 ? '?' : '&';
+    output += _CopyUTF8Bytes(key, output, buffer + capacity - output);
+    *output++ = '=';
     if (escapeValues) {
-      value = [value urlEscapedString];
+      output = _AppendPercentEncodedString(output, value, _GetUTF8Length(value));
+    } else {
+      output += _CopyUTF8Bytes(value, output, buffer + capacity - output);
     }
-    baseURL = [baseURL stringByAppendingFormat:@"%c%@=%@", index++ == 0 ? '?' : '&', key, value];
   }
-  return [NSURL URLWithString:baseURL];
+  NSString* string = [[NSString alloc] initWithBytesNoCopy:buffer length:(output - buffer) encoding:NSUTF8StringEncoding freeWhenDone:YES];
+  if (string == nil) {
+    free(buffer);
+  }
+  return [string autorelease];
+}
+
+NSURL* MakeHTTPURLWithArguments(NSString* baseURL, NSDictionary* arguments, BOOL escapeValues) {
+  return [NSURL URLWithString:MakeHTTPURLStringWithArguments(baseURL, arguments, escapeValues)];
+}
+
+@interface MultipartFormInputStream : NSInputStream {
+@private
+  NSArray* _parts;
+  NSArray* _lengths;
+  NSStreamStatus _status;
+  NSError* _error;
+  NSUInteger _index;
+  unsigned long long _offset;
+  NSInputStream* _stream;
+  id<NSStreamDelegate> _delegate;
+}
+- (id) initWithParts:(NSArray*)parts lengths:(NSArray*)lengths;
+@end
+
+static NSData* _MakeMultipartHeader(NSString* boundary, NSString* key, id value) {
+  NSMutableString* header = [NSMutableString stringWithFormat:@"--%@\r\n", boundary];
+  if ([value isKindOfClass:[NSDictionary class]]) {
+    NSString* filename = [[value objectForKey:kMultipartFileKey_FileName] convertToEncoding:kHTTPHeaderStringEncoding];  // TODO: Use http://tools.ietf.org/html/rfc5987
+    [header appendFormat:@"Content-Disposition: form-data; name=\"%@\"; filename=\"%@\"\r\n", key, filename];
+    [header appendFormat:@"Content-Type: %@\r\n\r\n", [value objectForKey:kMultipartFileKey_MimeType]];
+  } else {
+    [header appendFormat:@"Content-Disposition: form-data; name=\"%@\"\r\n", key];
+    [header appendString:@"Content-Type: text/plain; charset=utf-8\r\n\r\n"];  // According to specs, default Content-Type is "text/plain" anyway, but let's be extra-safe
+  }
+  return [header dataUsingEncoding:kHTTPHeaderStringEncoding];
+}
+
+static NSData* _MakeMultipartFooter(NSString* boundary) {
+  return [[NSString stringWithFormat:@"--%@--\r\n", boundary] dataUsingEncoding:NSASCIIStringEncoding];
 }
 
 // http://www.w3.org/TR/html401/interact/forms.html#h-17.13.4.2 - TODO: Use "multipart/mixed" in case of multiple file attachments
 NSData* MakeHTTPBodyForMultipartForm(NSString* boundary, NSDictionary* arguments) {
   NSMutableData* body = [NSMutableData data];
   for (NSString* key in arguments) {
-    [body appendData:[[NSString stringWithFormat:@"--%@\r\n", boundary] dataUsingEncoding:NSASCIIStringEncoding]];
     id value = [arguments objectForKey:key];
+    [body appendData:_MakeMultipartHeader(boundary, key, value)];
     if ([value isKindOfClass:[NSDictionary class]]) {
-      NSString* filename = [[value objectForKey:kMultipartFileKey_FileName] convertToEncoding:kHTTPHeaderStringEncoding];  // TODO: Use http://tools.ietf.org/html/rfc5987
-      NSString* disposition = [NSString stringWithFormat:@"Content-Disposition: form-data; name=\"%@\"; filename=\"%@\"\r\n", key, filename];
-      [body appendData:[disposition dataUsingEncoding:kHTTPHeaderStringEncoding]];
-      
-      NSString* type = [NSString stringWithFormat:@"Content-Type: %@\r\n\r\n", [value objectForKey:kMultipartFileKey_MimeType]];
-      [body appendData:[type dataUsingEncoding:kHTTPHeaderStringEncoding]];
-      
-      [body appendData:[value objectForKey:kMultipartFileKey_FileData]];
+      NSData* data = [value objectForKey:kMultipartFileKey_FileData];
+      if (data == nil) {
+        NSString* path = [value objectForKey:kMultipartFileKey_FilePath];
+        data = [NSData dataWithContentsOfFile:path options:NSDataReadingMappedIfSafe error:NULL];
+        if (data == nil) {
+          LOG_ERROR(@"Failed reading multipart file at \"%@\"", path);
+          return nil;
+        }
+      }
+      [body appendData:data];
     } else if ([value isKindOfClass:[NSString class]]) {
-      NSString* disposition = [NSString stringWithFormat:@"Content-Disposition: form-data; name=\"%@\"\r\n", key];
-      [body appendData:[disposition dataUsingEncoding:kHTTPHeaderStringEncoding]];
-      
-      NSString* type = @"Content-Type: text/plain; charset=utf-8\r\n\r\n";  // According to specs, default Content-Type is "text/plain" anyway, but let's be extra-safe
-      [body appendData:[type dataUsingEncoding:kHTTPHeaderStringEncoding]];
-      
       [body appendData:[(NSString*)value dataUsingEncoding:NSUTF8StringEncoding]];
     } else if ([value isKindOfClass:[NSData class]]) {
-      NSString* disposition = [NSString stringWithFormat:@"Content-Disposition: form-data; name=\"%@\"\r\n", key];
-      [body appendData:[disposition dataUsingEncoding:kHTTPHeaderStringEncoding]];
-      
-      NSString* type = @"Content-Type: text/plain; charset=utf-8\r\n\r\n";  // According to specs, default Content-Type is "text/plain" anyway, but let's be extra-safe
-      [body appendData:[type dataUsingEncoding:kHTTPHeaderStringEncoding]];
-      
       [body appendData:value];
     } else {
       NOT_REACHED();
     }
-    [body appendData:[@"\r\n" dataUsingEncoding:NSASCIIStringEncoding]];
+    [body appendBytes:"\r\n" length:2];
   }
-  [body appendData:[[NSString stringWithFormat:@"--%@--\r\n", boundary] dataUsingEncoding:NSASCIIStringEncoding]];
+  [body appendData:_MakeMultipartFooter(boundary)];
   return body;
 }
 
+// Consecutive in-memory parts are coalesced so only attachments backed by files or streams are read lazily
+NSInputStream* MakeHTTPBodyStreamForMultipartForm(NSString* boundary, NSDictionary* arguments, unsigned long long* contentLength) {
+  NSMutableArray* parts = [NSMutableArray array];
+  NSMutableArray* lengths = [NSMutableArray array];
+  NSMutableData* data = [NSMutableData data];
+  unsigned long long totalLength = 0;
+  for (NSString* key in arguments) {
+    id value = [arguments objectForKey:key];
+    [data appendData:_MakeMultipartHeader(boundary, key, value)];
+    if ([value isKindOfClass:[NSDictionary class]]) {
+      id part = [value objectForKey:kMultipartFileKey_FileData];
+      unsigned long long length = [part length];
+      if (part == nil) {
+        part = [value objectForKey:kMultipartFileKey_FilePath];
+        if (part) {
+          NSDictionary* attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:part error:NULL];
+          if (attributes == nil) {
+            LOG_ERROR(@"Failed retrieving size of multipart file at \"%@\"", part);
+            return nil;
+          }
+          length = [attributes fileSize];
+        } else {
+          part = [value objectForKey:kMultipartFileKey_FileStream];
+          if (![part isKindOfClass:[NSInputStream class]] || ![value objectForKey:kMultipartFileKey_FileLength]) {
+            LOG_ERROR(@"Invalid multipart file stream for \"%@\"", key);
+            return nil;
+          }
+          length = [[value objectForKey:kMultipartFileKey_FileLength] unsignedLongLongValue];
+        }
+      }
+      if ([part isKindOfClass:[NSData class]]) {
+        [data appendData:part];
+      } else {
+        totalLength += data.length;
+        [parts addObject:data];
+        [lengths addObject:[NSNumber numberWithUnsignedLongLong:data.length]];
+        totalLength += length;
+        [parts addObject:part];
+        [lengths addObject:[NSNumber numberWithUnsignedLongLong:length]];
+        data = [NSMutableData data];
+      }
+    } else if ([value isKindOfClass:[NSString class]]) {
+      [data appendData:[(NSString*)value dataUsingEncoding:NSUTF8StringEncoding]];
+    } else if ([value isKindOfClass:[NSData class]]) {
+      [data appendData:value];
+    } else {
+      NOT_REACHED();
+    }
+    [data appendBytes:"\r\n" length:2];
+  }
+  [data appendData:_MakeMultipartFooter(boundary)];
+  totalLength += data.length;
+  [parts addObject:data];
+  [lengths addObject:[NSNumber numberWithUnsignedLongLong:data.length]];
+  
+  if (contentLength) {
+    *contentLength = totalLength;
+  }
+  return [[[MultipartFormInputStream alloc] initWithParts:parts lengths:lengths] autorelease];
+}
+
+static const char* _monthNames[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+static const char* _dayNames[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+
+// Days since 1970-01-01 in the proleptic Gregorian calendar
+static inline int64_t _DaysFromCivil(int64_t year, int month, int day) {
+  year -= month <= 2;
+  int64_t era = (year >= 0 ? year : year - 399) / 400;
+  int64_t yearOfEra = year - era * 400;
+  int64_t dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  int64_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+  return era * 146097 + dayOfEra - 719468;
+}
+
+static inline void _CivilFromDays(int64_t days, int64_t* year, int* month, int* day) {
+  days += 719468;
+  int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+  int64_t dayOfEra = days - era * 146097;
+  int64_t yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+  int64_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+  int64_t monthPrime = (5 * dayOfYear + 2) / 153;
+  *day = (int)(dayOfYear - (153 * monthPrime + 2) / 5 + 1);
+  *month = (int)(monthPrime < 10 ? monthPrime + 3 : monthPrime - 9);
+  *year = yearOfEra + era * 400 + (*month <= 2);
+}
+
+static inline void _SkipSpaces(const char** bytes, const char* end) {
+  while ((*bytes < end) && ((**bytes == ' ') || (**bytes == '\t'))) {
+    ++*bytes;
+  }
+}
+
+static inline BOOL _ParseNumber(const char** bytes, const char* end, int minDigits, int maxDigits, int* value) {
+  int count = 0;
+  *value = 0;
+  while ((*bytes < end) && (count < maxDigits) && (**bytes >= '0') && (**bytes <= '9')) {
+    *value = 10 * *value + (**bytes - '0');
+    ++*bytes;
+    ++count;
+  }
+  return count >= minDigits;
+}
+
+static inline BOOL _ParseCharacter(const char** bytes, const char* end, char character) {
+  if ((*bytes < end) && (**bytes == character)) {
+    ++*bytes;
+    return YES;
+  }
+  return NO;
+}
+
+static BOOL _ParseMonth(const char** bytes, const char* end, int* month) {
+  if (end - *bytes >= 3) {
+    for (int i = 0; i < 12; ++i) {
+      if (!strncasecmp(*bytes, _monthNames[i], 3)) {
+        *bytes += 3;
+        *month = i + 1;
+        return YES;
+      }
+    }
+  }
+  return NO;
+}
+
+static void _SkipDayName(const char** bytes, const char* end) {
+  while ((*bytes < end) && (((**bytes >= 'a') && (**bytes <= 'z')) || ((**bytes >= 'A') && (**bytes <= 'Z')))) {
+    ++*bytes;
+  }
+  _ParseCharacter(bytes, end, ',');
+  _SkipSpaces(bytes, end);
+}
+
+// Parses "hh:mm[:ss[.fff]]"
+static BOOL _ParseTime(const char** bytes, const char* end, int* hour, int* minute, double* second) {
+  int value = 0;
+  if (!_ParseNumber(bytes, end, 2, 2, hour) || !_ParseCharacter(bytes, end, ':') || !_ParseNumber(bytes, end, 2, 2, minute)) {
+    return NO;
+  }
+  *second = 0.0;
+  if (_ParseCharacter(bytes, end, ':')) {
+    if (!_ParseNumber(bytes, end, 2, 2, &value)) {
+      return NO;
+    }
+    *second = value;
+    if (_ParseCharacter(bytes, end, '.') || _ParseCharacter(bytes, end, ',')) {
+      double fraction = 0.0;
+      double scale = 1.0;
+      while ((*bytes < end) && (**bytes >= '0') && (**bytes <= '9')) {
+        fraction = 10.0 * fraction + (**bytes - '0');
+        scale *= 10.0;
+        ++*bytes;
+      }
+      *second += fraction / scale;
+    }
+  }
+  return (*hour < 24) && (*minute < 60) && (*second < 61.0);  // Allow leap seconds
+}
+
+// Parses "Z", "GMT", "UT", "UTC", US zones from RFC 822 or "+hh[:]mm" and returns the offset from UTC in seconds
+static BOOL _ParseTimeZone(const char** bytes, const char* end, int* offset) {
+  static const char* names[] = {"GMT", "UTC", "UT", "Z", "EST", "EDT", "CST", "CDT", "MST", "MDT", "PST", "PDT"};
+  static const int offsets[] = {0, 0, 0, 0, -5, -4, -6, -5, -7, -6, -8, -7};
+  *offset = 0;
+  if ((*bytes < end) && ((**bytes == '+') || (**bytes == '-'))) {
+    int sign = **bytes == '-' ? -1 : 1;
+    int hours;
+    int minutes = 0;
+    ++*bytes;
+    if (!_ParseNumber(bytes, end, 2, 2, &hours)) {
+      return NO;
+    }
+    BOOL colon = _ParseCharacter(bytes, end, ':');
+    if ((colon || ((*bytes < end) && (**bytes >= '0') && (**bytes <= '9'))) && !_ParseNumber(bytes, end, 2, 2, &minutes)) {
+      return NO;  // Minutes are optional e.g. "+01 " but required after a colon
+    }
+    if ((hours > 23) || (minutes > 59)) {
+      return NO;
+    }
+    *offset = sign * (hours * 3600 + minutes * 60);
+    return YES;
+  }
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+    size_t length = strlen(names[i]);
+    if (((size_t)(end - *bytes) >= length) && !strncasecmp(*bytes, names[i], length)) {
+      *bytes += length;
+      *offset = offsets[i] * 3600;
+      return YES;
+    }
+  }
+  return NO;
+}
+
+static inline BOOL _IsAtEnd(const char** bytes, const char* end) {
+  _SkipSpaces(bytes, end);
+  return *bytes == end;
+}
+
+static inline BOOL _IsValidDay(int year, int month, int day) {
+  static const int days[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+  if ((month == 2) && (day == 29)) {
+    return ((year % 4 == 0) && (year % 100 != 0)) || (year % 400 == 0);
+  }
+  return day <= days[month - 1];
+}
+
+static inline CFAbsoluteTime _MakeTime(int year, int month, int day, int hour, int minute, double second, int offset) {
+  int64_t days = _DaysFromCivil(year, month, day);
+  return (double)(days * 86400 + hour * 3600 + minute * 60 - offset) + second - kCFAbsoluteTimeIntervalSince1970;
+}
+
+// Parses "[Sun, ]06 Nov 1994 08:49[:37] [GMT]" and "Sunday, 06-Nov-94 08:49:37 GMT"
+static BOOL _ParseRFC822(const char* bytes, const char* end, CFAbsoluteTime* time) {
+  int year, month, day, hour, minute;
+  int offset = 0;
+  double second;
+  _SkipSpaces(&bytes, end);
+  if ((bytes < end) && ((*bytes < '0') || (*bytes > '9'))) {
+    _SkipDayName(&bytes, end);
+  }
+  if (!_ParseNumber(&bytes, end, 1, 2, &day) || (day < 1) || (day > 31)) {
+    return NO;
+  }
+  BOOL dashes = _ParseCharacter(&bytes, end, '-');
+  _SkipSpaces(&bytes, end);
+  if (!_ParseMonth(&bytes, end, &month) || (dashes && !_ParseCharacter(&bytes, end, '-'))) {
+    return NO;
+  }
+  _SkipSpaces(&bytes, end);
+  const char* start = bytes;
+  if (!_ParseNumber(&bytes, end, 2, 4, &year) || (bytes - start == 3)) {
+    return NO;
+  }
+  if (bytes - start == 2) {
+    year += year < 50 ? 2000 : 1900;  // As recommended by RFC 2822
+  }
+  _SkipSpaces(&bytes, end);
+  if (!_ParseTime(&bytes, end, &hour, &minute, &second)) {
+    return NO;
+  }
+  _SkipSpaces(&bytes, end);
+  if ((bytes < end) && !_ParseTimeZone(&bytes, end, &offset)) {
+    return NO;
+  }
+  if (!_IsAtEnd(&bytes, end) || !_IsValidDay(year, month, day)) {
+    return NO;
+  }
+  *time = _MakeTime(year, month, day, hour, minute, second, offset);
+  return YES;
+}
+
+// Parses "Sun Nov  6 08:49:37 1994" which is always in GMT
+static BOOL _ParseAsctime(const char* bytes, const char* end, CFAbsoluteTime* time) {
+  int year, month, day, hour, minute;
+  double second;
+  _SkipSpaces(&bytes, end);
+  _SkipDayName(&bytes, end);
+  if (!_ParseMonth(&bytes, end, &month)) {
+    return NO;
+  }
+  _SkipSpaces(&bytes, end);
+  if (!_ParseNumber(&bytes, end, 1, 2, &day) || (day < 1) || (day > 31)) {
+    return NO;
+  }
+  _SkipSpaces(&bytes, end);
+  if (!_ParseTime(&bytes, end, &hour, &minute, &second)) {
+    return NO;
+  }
+  _SkipSpaces(&bytes, end);
+  if (!_ParseNumber(&bytes, end, 4, 4, &year) || !_IsAtEnd(&bytes, end) || !_IsValidDay(year, month, day)) {
+    return NO;
+  }
+  *time = _MakeTime(year, month, day, hour, minute, second, 0);
+  return YES;
+}
+
+// Parses "1994-11-06[(T| )08:49[:37[.123]][(Z|+01[:00])]]" and assumes UTC if the time zone is missing
+static BOOL _ParseISO8601(const char* bytes, const char* end, CFAbsoluteTime* time) {
+  int year, month, day;
+  int hour = 0;
+  int minute = 0;
+  int offset = 0;
+  double second = 0.0;
+  _SkipSpaces(&bytes, end);
+  if (!_ParseNumber(&bytes, end, 4, 4, &year) || !_ParseCharacter(&bytes, end, '-') ||
+      !_ParseNumber(&bytes, end, 2, 2, &month) || !_ParseCharacter(&bytes, end, '-') ||
+      !_ParseNumber(&bytes, end, 2, 2, &day) || (month < 1) || (month > 12) || (day < 1) || (day > 31)) {
+    return NO;
+  }
+  if (_ParseCharacter(&bytes, end, 'T') || _ParseCharacter(&bytes, end, 't') || _ParseCharacter(&bytes, end, ' ')) {
+    if (!_ParseTime(&bytes, end, &hour, &minute, &second)) {
+      return NO;
+    }
+    if ((bytes < end) && (*bytes != ' ') && !_ParseTimeZone(&bytes, end, &offset)) {
+      return NO;
+    }
+  }
+  if (!_IsAtEnd(&bytes, end) || !_IsValidDay(year, month, day)) {
+    return NO;
+  }
+  *time = _MakeTime(year, month, day, hour, minute, second, offset);
+  return YES;
+}
+
+BOOL ParseDateWireFormat(const char* bytes, NSUInteger length, DateWireFormat format, CFAbsoluteTime* time) {
+  const char* end = bytes + length;
+  switch (format) {
+    case kDateWireFormat_RFC822:
+      return _ParseRFC822(bytes, end, time);
+    case kDateWireFormat_ISO8601:
+      return _ParseISO8601(bytes, end, time);
+    case kDateWireFormat_HTTP:
+      return _ParseRFC822(bytes, end, time) || _ParseAsctime(bytes, end, time);
+  }
+  return NO;
+}
+
+static inline char* _WriteDigits(char* buffer, int64_t value, int count) {
+  for (int i = count - 1; i >= 0; --i) {
+    buffer[i] = '0' + (char)(value % 10);
+    value /= 10;
+  }
+  return buffer + count;
+}
+
+NSUInteger FormatDateWireFormat(CFAbsoluteTime time, DateWireFormat format, char* buffer) {
+  int64_t seconds = (int64_t)floor(time + kCFAbsoluteTimeIntervalSince1970);
+  int64_t days = (seconds >= 0 ? seconds : seconds - 86399) / 86400;
+  int64_t remainder = seconds - days * 86400;
+  int64_t year;
+  int month;
+  int day;
+  _CivilFromDays(days, &year, &month, &day);
+  if ((year < 0) || (year > 9999)) {
+    return 0;
+  }
+  char* bytes = buffer;
+  if (format == kDateWireFormat_ISO8601) {
+    bytes = _WriteDigits(bytes, year, 4);
+    *bytes++ = '-';
+    bytes = _WriteDigits(bytes, month, 2);
+    *bytes++ = '-';
+    bytes = _WriteDigits(bytes, day, 2);
+    *bytes++ = 'T';
+  } else {
+    bcopy(_dayNames[((days % 7) + 11) % 7], bytes, 3);  // 1970-01-01 was a Thursday
+    bytes += 3;
+    *bytes++ = ',';
+    *bytes++ = ' ';
+    bytes = _WriteDigits(bytes, day, 2);
+    *bytes++ = ' ';
+    bcopy(_monthNames[month - 1], bytes, 3);
+    bytes += 3;
+    *bytes++ = ' ';
+    bytes = _WriteDigits(bytes, year, 4);
+    *bytes++ = ' ';
+  }
+  bytes = _WriteDigits(bytes, remainder / 3600, 2);
+  *bytes++ = ':';
+  bytes = _WriteDigits(bytes, (remainder / 60) % 60, 2);
+  *bytes++ = ':';
+  bytes = _WriteDigits(bytes, remainder % 60, 2);
+  if (format == kDateWireFormat_ISO8601) {
+    *bytes++ = 'Z';
+  } else {
+    bcopy(" GMT", bytes, 4);
+    bytes += 4;
+  }
+  *bytes = 0;
+  return bytes - buffer;
+}
+
 static NSCharacterSet* _GetCachedCharacterSet(CharacterSet set) {
   static NSCharacterSet* cache[kNumCharacterSets] = {0};
   if (cache[set] == nil) {
     OSSpinLockLock(&_staticSpinLock);
     if (cache[set] == nil) {
       switch (set) {
-        case kCharacterSet_Newline:
-          cache[set] = [[NSCharacterSet newlineCharacterSet] retain];
-          break;
-        case kCharacterSet_WhitespaceAndNewline:
-          cache[set] = [[NSCharacterSet whitespaceAndNewlineCharacterSet] retain];
-          break;
         case kCharacterSet_WhitespaceAndNewline_Inverted:
           cache[set] = [[[NSCharacterSet whitespaceAndNewlineCharacterSet] invertedSet] retain];
           break;
-        case kCharacterSet_UppercaseLetters:
-          cache[set] = [[NSCharacterSet uppercaseLetterCharacterSet] retain];
-          break;
         case kCharacterSet_DecimalDigits_Inverted:
           cache[set] = [[[NSCharacterSet decimalDigitCharacterSet] invertedSet] retain];
           break;
@@ -133,15 +636,6 @@ static NSCharacterSet* _GetCachedCharacterSet(CharacterSet set) {
           [(NSMutableCharacterSet*)cache[set] formUnionWithCharacterSet:[NSCharacterSet punctuationCharacterSet]];
           [(NSMutableCharacterSet*)cache[set] removeCharactersInString:@"-"];
           break;
-        case kCharacterSet_SentenceBoundaries:
-          cache[set] = [[NSMutableCharacterSet alloc] init];
-          [(NSMutableCharacterSet*)cache[set] addCharactersInString:@".?!"];
-          break;
-        case kCharacterSet_SentenceBoundariesAndNewlineCharacter:
-          cache[set] = [[NSMutableCharacterSet alloc] init];
-          [(NSMutableCharacterSet*)cache[set] formUnionWithCharacterSet:[NSCharacterSet newlineCharacterSet]];
-          [(NSMutableCharacterSet*)cache[set] addCharactersInString:@".?!"];
-          break;
         case kNumCharacterSets:
           break;
       }
@@ -159,146 +653,266 @@ static NSCharacterSet* _GetCachedCharacterSet(CharacterSet set) {
 }
 
 - (NSString*) urlEscapedString {
-  return [(id)CFURLCreateStringByAddingPercentEscapes(kCFAllocatorDefault, (CFStringRef)self, NULL, CFSTR(":@/?&=+"),
-                                                      kCFStringEncodingUTF8) autorelease];
+  NSUInteger length = _GetUTF8Length(self);
+  char* buffer = malloc(3 * length + 1);
+  NSUInteger count = _AppendPercentEncodedString(buffer, self, length) - buffer;
+  return [[[NSString alloc] initWithBytesNoCopy:buffer length:count encoding:NSUTF8StringEncoding freeWhenDone:YES] autorelease];
 }
 
 - (NSString*) unescapeURLString {
-  return [(id)CFURLCreateStringByReplacingPercentEscapesUsingEncoding(kCFAllocatorDefault, (CFStringRef)self, CFSTR(""),
-                                                                      kCFStringEncodingUTF8) autorelease];
+  NSUInteger length = _GetUTF8Length(self);
+  char* buffer = malloc(length + 1);
+  _CopyUTF8Bytes(self, buffer, length);
+  NSUInteger count = PercentDecodeBytes(buffer, length, buffer, NO);
+  NSString* string = [[NSString alloc] initWithBytesNoCopy:buffer length:count encoding:NSUTF8StringEncoding freeWhenDone:YES];
+  if (string == nil) {
+    free(buffer);
+  }
+  return [string autorelease];
 }
 
-static NSArray* _SpecialAbreviations() {
-  static NSArray* array = nil;
-  if (array == nil) {
+// Character classes for the whole BMP computed once so segmentation never touches NSCharacterSet
+static const uint8_t* _GetCharacterClasses() {
+  static uint8_t* table = NULL;
+  if (table == NULL) {
     OSSpinLockLock(&_staticSpinLock);
-    if (array == nil) {
-      array = [[NSArray alloc] initWithObjects:@"vs", @"st", nil];
+    if (table == NULL) {
+      uint8_t* classes = malloc(65536);
+      CFCharacterSetRef whitespaceSet = CFCharacterSetGetPredefined(kCFCharacterSetWhitespaceAndNewline);
+      CFCharacterSetRef newlineSet = CFCharacterSetGetPredefined(kCFCharacterSetNewline);
+      CFCharacterSetRef uppercaseSet = CFCharacterSetGetPredefined(kCFCharacterSetUppercaseLetter);
+      CFCharacterSetRef punctuationSet = CFCharacterSetGetPredefined(kCFCharacterSetPunctuation);
+      for (NSUInteger i = 0; i < 65536; ++i) {
+        UniChar character = i;
+        uint8_t flags = 0;
+        if (CFCharacterSetIsCharacterMember(whitespaceSet, character)) {
+          flags |= kCharacterClass_Whitespace | kCharacterClass_WordBoundary;
+        }
+        if (CFCharacterSetIsCharacterMember(newlineSet, character)) {
+          flags |= kCharacterClass_Newline;
+        }
+        if (CFCharacterSetIsCharacterMember(uppercaseSet, character)) {
+          flags |= kCharacterClass_Uppercase;
+        }
+        if (CFCharacterSetIsCharacterMember(punctuationSet, character) && (character != '-')) {
+          flags |= kCharacterClass_WordBoundary;
+        }
+        if ((character == '.') || (character == '?') || (character == '!')) {
+          flags |= kCharacterClass_SentenceBoundary;
+        }
+        classes[i] = flags;
+      }
+      OSMemoryBarrier();
+      table = classes;
     }
     OSSpinLockUnlock(&_staticSpinLock);
   }
-  return array;
+  return table;
+}
+
+static BOOL _IsSpecialAbreviation(CFStringInlineBuffer* buffer, CFIndex location, CFIndex length) {
+  static const char* abreviations[] = {"vs", "st"};
+  for (size_t i = 0; i < sizeof(abreviations) / sizeof(abreviations[0]); ++i) {
+    if ((CFIndex)strlen(abreviations[i]) == length) {
+      CFIndex j = 0;
+      while (j < length) {
+        UniChar character = CFStringGetCharacterFromInlineBuffer(buffer, location + j);
+        if ((character >= 'A') && (character <= 'Z')) {
+          character += 'a' - 'A';
+        }
+        if (character != abreviations[i][j]) {
+          break;
+        }
+        ++j;
+      }
+      if (j == length) {
+        return YES;
+      }
+    }
+  }
+  return NO;
 }
 
+// Returns the end of the sentence starting at location in a single forward pass
 // http://www.attivio.com/blog/57-unified-information-access/263-doing-things-with-words-part-two-sentence-boundary-detection.html
-static void _ScanSentence(NSScanner* scanner) {
-  NSUInteger initialLocation = scanner.scanLocation;
-  while (1) {
-    // Find next sentence boundary (return if at end)
-    [scanner scanUpToCharactersFromSet:_GetCachedCharacterSet(kCharacterSet_SentenceBoundariesAndNewlineCharacter) intoString:NULL];
-    if ([scanner isAtEnd]) {
-      break;
+static CFIndex _ScanSentence(CFStringInlineBuffer* buffer, const uint8_t* classes, CFIndex location, CFIndex length) {
+  CFIndex lastWhitespace = -1;
+  CFIndex lastPeriod = -1;
+  while (location < length) {
+    // Find next sentence boundary (return if newline)
+    uint8_t flags = classes[CFStringGetCharacterFromInlineBuffer(buffer, location)];
+    if (flags & kCharacterClass_Newline) {
+      return location;
     }
-    NSUInteger boundaryLocation = scanner.scanLocation;
-    
-    // Skip sentence boundary (return if boundary is a newline or if at end)
-    if (![scanner scanCharactersFromSet:_GetCachedCharacterSet(kCharacterSet_SentenceBoundaries) intoString:NULL]) {
-      break;
+    if (!(flags & kCharacterClass_SentenceBoundary)) {
+      if (flags & kCharacterClass_Whitespace) {
+        lastWhitespace = location;
+      }
+      ++location;
+      continue;
     }
-    if ([scanner isAtEnd]) {
+    CFIndex boundaryLocation = location;
+    BOOL tokenHasPeriod = lastPeriod > lastWhitespace;
+    
+    // Skip sentence boundary (return if at end)
+    do {
+      if (CFStringGetCharacterFromInlineBuffer(buffer, location) == '.') {
+        lastPeriod = location;
+      }
+      ++location;
+    } while ((location < length) && (classes[CFStringGetCharacterFromInlineBuffer(buffer, location)] & kCharacterClass_SentenceBoundary));
+    if (location == length) {
       break;
     }
     
     // Make sure sentence boundary is followed by whitespace or newline
-    NSRange range = [scanner.string rangeOfCharacterFromSet:_GetCachedCharacterSet(kCharacterSet_WhitespaceAndNewline)
-                                                    options:NSAnchoredSearch
-                                                      range:NSMakeRange(scanner.scanLocation, 1)];
-    if (range.location == NSNotFound) {
+    if (!(classes[CFStringGetCharacterFromInlineBuffer(buffer, location)] & kCharacterClass_Whitespace)) {
       continue;
     }
     
-    // Extract previous token
-    range = [scanner.string rangeOfCharacterFromSet:_GetCachedCharacterSet(kCharacterSet_WhitespaceAndNewline)
-                                            options:NSBackwardsSearch
-                                              range:NSMakeRange(initialLocation, boundaryLocation - initialLocation)];
-    if (range.location == NSNotFound) {
+    // Make sure there is a previous token and it is not a special abreviation
+    if (lastWhitespace < 0) {
       continue;
     }
-    range = NSMakeRange(range.location + 1, boundaryLocation - range.location - 1);
-    
-    // Make sure previous token is a not special abreviation
-    BOOL match = NO;
-    for (NSString* abreviation in _SpecialAbreviations()) {
-      if (abreviation.length == range.length) {
-        NSRange temp = [scanner.string rangeOfString:abreviation options:(NSAnchoredSearch | NSCaseInsensitiveSearch) range:range];
-        if (temp.location != NSNotFound) {
-          match = YES;
-          break;
-        }
-      }
-    }
-    if (match) {
+    CFIndex tokenLocation = lastWhitespace + 1;
+    CFIndex tokenLength = boundaryLocation - tokenLocation;
+    if (_IsSpecialAbreviation(buffer, tokenLocation, tokenLength)) {
       continue;
     }
     
-    // Make sure previous token does not contain a period or is more than 4 characters long or is followed by an uppercase letter
-    NSRange subrange = [scanner.string rangeOfString:@"." options:0 range:range];
-    if ((subrange.location != NSNotFound) && (range.length < 4)) {
-      subrange = [scanner.string rangeOfCharacterFromSet:_GetCachedCharacterSet(kCharacterSet_WhitespaceAndNewline_Inverted)
-                                                 options:0
-                                                   range:NSMakeRange(scanner.scanLocation,
-                                                                     scanner.string.length - scanner.scanLocation)];
-      subrange = [scanner.string rangeOfCharacterFromSet:_GetCachedCharacterSet(kCharacterSet_UppercaseLetters)
-                                                 options:NSAnchoredSearch
-                                                   range:NSMakeRange(subrange.location != NSNotFound ?
-                                                                     subrange.location : scanner.scanLocation, 1)];
-      if (subrange.location == NSNotFound) {
+    // If previous token contains a period and is less than 4 characters long, make sure it is followed by an uppercase letter
+    if (tokenHasPeriod && (tokenLength < 4)) {
+      CFIndex index = location;
+      while ((index < length) && (classes[CFStringGetCharacterFromInlineBuffer(buffer, index)] & kCharacterClass_Whitespace)) {
+        ++index;
+      }
+      UniChar character = CFStringGetCharacterFromInlineBuffer(buffer, index < length ? index : location);
+      if (!(classes[character] & kCharacterClass_Uppercase)) {
         continue;
       }
     }
     
     // We have found a sentence
-    break;
+    return location;
   }
+  return length;
 }
 
-- (NSString*) extractFirstSentence {
-  NSScanner* scanner = [[NSScanner alloc] initWithString:self];
-  scanner.charactersToBeSkipped = nil;
-  _ScanSentence(scanner);
-  self = [self substringToIndex:scanner.scanLocation];
-  [scanner release];
-  return self;
-}
-
-- (NSArray*) extractAllSentences {
-  NSMutableArray* array = [NSMutableArray array];
-  NSScanner* scanner = [[NSScanner alloc] initWithString:self];
-  scanner.charactersToBeSkipped = nil;
+// Function returns NO to stop enumeration
+static void _EnumerateSentences(NSString* string, BOOL skipInitialWhitespace, BOOL (*function)(NSRange range, void* context), void* context) {
+  const uint8_t* classes = _GetCharacterClasses();
+  CFIndex length = CFStringGetLength((CFStringRef)string);
+  CFStringInlineBuffer buffer;
+  CFStringInitInlineBuffer((CFStringRef)string, &buffer, CFRangeMake(0, length));
+  CFIndex location = 0;
+  BOOL skipWhitespace = skipInitialWhitespace;
   while (1) {
-    [scanner scanCharactersFromSet:_GetCachedCharacterSet(kCharacterSet_WhitespaceAndNewline) intoString:NULL];
-    if ([scanner isAtEnd]) {
+    if (skipWhitespace) {
+      while ((location < length) && (classes[CFStringGetCharacterFromInlineBuffer(&buffer, location)] & kCharacterClass_Whitespace)) {
+        ++location;
+      }
+    }
+    if (location >= length) {
       break;
     }
-    NSUInteger location = scanner.scanLocation;
-    _ScanSentence(scanner);
-    if (scanner.scanLocation > location) {
-      [array addObject:[self substringWithRange:NSMakeRange(location, scanner.scanLocation - location)]];
+    CFIndex end = _ScanSentence(&buffer, classes, location, length);
+    if ((end > location) && !(*function)(NSMakeRange(location, end - location), context)) {
+      break;
     }
+    location = end;
+    skipWhitespace = YES;
   }
-  [scanner release];
-  return array;
 }
 
-- (NSIndexSet*) extractSentenceIndices {
-  NSMutableIndexSet* set = [NSMutableIndexSet indexSet];
-  NSScanner* scanner = [[NSScanner alloc] initWithString:self];
-  scanner.charactersToBeSkipped = nil;
-  while (1) {
-    NSUInteger location = scanner.scanLocation;
-    _ScanSentence(scanner);
-    if (scanner.scanLocation > location) {
-      [set addIndex:location];
+static void _EnumerateWords(NSString* string, BOOL (*function)(NSRange range, void* context), void* context) {
+  const uint8_t* classes = _GetCharacterClasses();
+  CFIndex length = CFStringGetLength((CFStringRef)string);
+  CFStringInlineBuffer buffer;
+  CFStringInitInlineBuffer((CFStringRef)string, &buffer, CFRangeMake(0, length));
+  CFIndex location = 0;
+  while (location < length) {
+    while ((location < length) && (classes[CFStringGetCharacterFromInlineBuffer(&buffer, location)] & kCharacterClass_WordBoundary)) {
+      ++location;
     }
-    [scanner scanCharactersFromSet:_GetCachedCharacterSet(kCharacterSet_WhitespaceAndNewline) intoString:NULL];
-    if ([scanner isAtEnd]) {
+    CFIndex start = location;
+    while ((location < length) && !(classes[CFStringGetCharacterFromInlineBuffer(&buffer, location)] & kCharacterClass_WordBoundary)) {
+      ++location;
+    }
+    if ((location > start) && !(*function)(NSMakeRange(start, location - start), context)) {
       break;
     }
   }
-  [scanner release];
+}
+
+static BOOL _SubstringFunction(NSRange range, void* context) {
+  void** params = (void**)context;
+  NSString* string = [(NSString*)params[1] substringWithRange:range];
+  [(NSMutableArray*)params[0] addObject:string];
+  return YES;
+}
+
+static BOOL _RangeValueFunction(NSRange range, void* context) {
+  [(NSMutableArray*)context addObject:[NSValue valueWithRange:range]];
+  return YES;
+}
+
+static BOOL _IndexFunction(NSRange range, void* context) {
+  [(NSMutableIndexSet*)context addIndex:range.location];
+  return YES;
+}
+
+// Only scans once from the start so leading whitespace results in an empty sentence
+- (NSString*) extractFirstSentence {
+  CFIndex length = CFStringGetLength((CFStringRef)self);
+  CFStringInlineBuffer buffer;
+  CFStringInitInlineBuffer((CFStringRef)self, &buffer, CFRangeMake(0, length));
+  return [self substringToIndex:_ScanSentence(&buffer, _GetCharacterClasses(), 0, length)];
+}
+
+- (NSArray*) extractAllSentences {
+  NSMutableArray* array = [NSMutableArray array];
+  void* params[] = {array, self};
+  _EnumerateSentences(self, YES, _SubstringFunction, params);
+  return array;
+}
+
+- (NSIndexSet*) extractSentenceIndices {
+  NSMutableIndexSet* set = [NSMutableIndexSet indexSet];
+  _EnumerateSentences(self, NO, _IndexFunction, set);
   return set;
 }
 
+- (NSArray*) rangesOfSentences {
+  NSMutableArray* array = [NSMutableArray array];
+  _EnumerateSentences(self, YES, _RangeValueFunction, array);
+  return array;
+}
+
+- (NSArray*) rangesOfWords {
+  NSMutableArray* array = [NSMutableArray array];
+  _EnumerateWords(self, _RangeValueFunction, array);
+  return array;
+}
+
+#if NS_BLOCKS_AVAILABLE
+
+static BOOL _BlockRangeFunction(NSRange range, void* context) {
+  void (^block)(NSRange range, BOOL* stop) = context;
+  BOOL stop = NO;
+  block(range, &stop);
+  return !stop;
+}
+
+- (void) enumerateSentenceRangesUsingBlock:(void (^)(NSRange range, BOOL* stop))block {
+  _EnumerateSentences(self, YES, _BlockRangeFunction, block);
+}
+
+- (void) enumerateWordRangesUsingBlock:(void (^)(NSRange range, BOOL* stop))block {
+  _EnumerateWords(self, _BlockRangeFunction, block);
+}
+
+#endif
+
 - (NSString*) stripParenthesis {
   NSMutableString* string = [NSMutableString string];
   NSRange range = NSMakeRange(0, self.length);
@@ -344,20 +958,10 @@ static void _ScanSentence(NSScanner* scanner) {
 }
 
 - (NSArray*) extractAllWords {
-  NSCharacterSet* characterSet = _GetCachedCharacterSet(kCharacterSet_WordBoundaries);
   if (self.length) {
     NSMutableArray* array = [NSMutableArray array];
-    NSScanner* scanner = [[NSScanner alloc] initWithString:self];
-    scanner.charactersToBeSkipped = nil;
-    while (1) {
-      [scanner scanCharactersFromSet:characterSet intoString:NULL];
-      NSString* string;
-      if (![scanner scanUpToCharactersFromSet:characterSet intoString:&string]) {
-        break;
-      }
-      [array addObject:string];
-    }
-    [scanner release];
+    void* params[] = {array, self};
+    _EnumerateWords(self, _SubstringFunction, params);
     return array;
   }
   return nil;
@@ -599,11 +1203,14 @@ static NSDate* _GetReferenceDay() {
   return components.day;
 }
 
-// NSDateFormatter is not thread-safe so this function is protected with a spinlock
+// NSDateFormatter is not thread-safe so each thread has its own cache
 static NSDateFormatter* _GetDateFormatter(NSString* format, NSString* identifier, NSTimeZone* timeZone) {
-  static NSMutableDictionary* cacheLevel0 = nil;
+  NSMutableDictionary* threadDictionary = [[NSThread currentThread] threadDictionary];
+  NSMutableDictionary* cacheLevel0 = [threadDictionary objectForKey:@kDateFormatterCacheKey];
   if (cacheLevel0 == nil) {
     cacheLevel0 = [[NSMutableDictionary alloc] init];
+    [threadDictionary setObject:cacheLevel0 forKey:@kDateFormatterCacheKey];
+    [cacheLevel0 release];
   }
   
   NSMutableDictionary* cacheLevel1 = [cacheLevel0 objectForKey:(identifier ? identifier : @"")];
@@ -633,6 +1240,22 @@ static NSDateFormatter* _GetDateFormatter(NSString* format, NSString* identifier
   return formatter;
 }
 
++ (NSDate*) dateWithWireString:(NSString*)string format:(DateWireFormat)format {
+  char buffer[64];
+  const char* bytes = CFStringGetCStringPtr((CFStringRef)string, kCFStringEncodingASCII);
+  if (bytes == NULL) {
+    if (!CFStringGetCString((CFStringRef)string, buffer, sizeof(buffer), kCFStringEncodingASCII)) {
+      return nil;
+    }
+    bytes = buffer;
+  }
+  CFAbsoluteTime time;
+  if (!ParseDateWireFormat(bytes, strlen(bytes), format, &time)) {
+    return nil;
+  }
+  return [NSDate dateWithTimeIntervalSinceReferenceDate:time];
+}
+
 + (NSDate*) dateWithString:(NSString*)string cachedFormat:(NSString*)format {
   return [self dateWithString:string cachedFormat:format localIdentifier:nil timeZone:nil];
 }
@@ -645,11 +1268,14 @@ static NSDateFormatter* _GetDateFormatter(NSString* format, NSString* identifier
               cachedFormat:(NSString*)format
            localIdentifier:(NSString*)identifier
                   timeZone:(NSTimeZone*)timeZone {
-  OSSpinLockLock(&_formattersSpinLock);
   NSDateFormatter* formatter = _GetDateFormatter(format, identifier, timeZone);
-  NSDate* date = [formatter dateFromString:string];
-  OSSpinLockUnlock(&_formattersSpinLock);
-  return date;
+  return [formatter dateFromString:string];
+}
+
+- (NSString*) wireStringWithFormat:(DateWireFormat)format {
+  char buffer[kDateWireFormatMaxLength];
+  NSUInteger length = FormatDateWireFormat([self timeIntervalSinceReferenceDate], format, buffer);
+  return length ? [[[NSString alloc] initWithBytes:buffer length:length encoding:NSASCIIStringEncoding] autorelease] : nil;
 }
 
 - (NSString*) stringWithCachedFormat:(NSString*)format {
@@ -660,11 +1286,8 @@ static NSDateFormatter* _GetDateFormatter(NSString* format, NSString* identifier
   return [self stringWithCachedFormat:format localIdentifier:identifier timeZone:nil];
 }
 - (NSString*) stringWithCachedFormat:(NSString*)format localIdentifier:(NSString*)identifier timeZone:(NSTimeZone*)timeZone {
-  OSSpinLockLock(&_formattersSpinLock);
   NSDateFormatter* formatter = _GetDateFormatter(format, identifier, timeZone);
-  NSString* string = [formatter stringFromDate:self];
-  OSSpinLockUnlock(&_formattersSpinLock);
-  return string;
+  return [formatter stringFromDate:self];
 }
 
 @end
@@ -868,36 +1491,43 @@ static NSDateFormatter* _GetDateFormatter(NSString* format, NSString* identifier
 
 @implementation NSURL (Extensions)
 
+static NSString* _CreateFormString(const char* bytes, NSUInteger length, char* buffer, BOOL unescape) {
+  if (unescape) {
+    length = PercentDecodeBytes(bytes, length, buffer, YES);
+  } else {
+    for (NSUInteger i = 0; i < length; ++i) {
+      buffer[i] = bytes[i] == '+' ? ' ' : bytes[i];
+    }
+  }
+  return (NSString*)CFStringCreateWithBytes(kCFAllocatorDefault, (const UInt8*)buffer, length, kCFStringEncodingUTF8, false);
+}
+
+// Keys and values are decoded in place in a single copy of the UTF-8 form
 + (NSDictionary*) parseURLEncodedForm:(NSString*)form unescapeKeysAndValues:(BOOL)unescape {
   NSMutableDictionary* parameters = [NSMutableDictionary dictionary];
-  NSScanner* scanner = [[NSScanner alloc] initWithString:form];
-  [scanner setCharactersToBeSkipped:nil];
-  while (1) {
-    NSString* key = nil;
-    if (![scanner scanUpToString:@"=" intoString:&key] || [scanner isAtEnd]) {
-      break;
-    }
-    [scanner setScanLocation:([scanner scanLocation] + 1)];
-    
-    NSString* value = nil;
-    if (![scanner scanUpToString:@"&" intoString:&value]) {
-      break;
-    }
-    
-    key = [key stringByReplacingOccurrencesOfString:@"+" withString:@" "];
-    value = [value stringByReplacingOccurrencesOfString:@"+" withString:@" "];
-    if (unescape) {
-      [parameters setObject:[value unescapeURLString] forKey:[key unescapeURLString]];
-    } else {
-      [parameters setObject:value forKey:key];
+  NSUInteger length = _GetUTF8Length(form);
+  char* buffer = malloc(length + 1);
+  _CopyUTF8Bytes(form, buffer, length);
+  char* end = buffer + length;
+  char* bytes = buffer;
+  while (bytes < end) {
+    char* separator = memchr(bytes, '&', end - bytes);
+    if (separator == NULL) {
+      separator = end;
     }
-    
-    if ([scanner isAtEnd]) {
-      break;
+    char* equal = memchr(bytes, '=', separator - bytes);
+    if (equal && (equal > bytes)) {
+      NSString* key = _CreateFormString(bytes, equal - bytes, bytes, unescape);
+      NSString* value = _CreateFormString(equal + 1, separator - equal - 1, equal + 1, unescape);
+      if (key && value) {
+        [parameters setObject:value forKey:key];
+      }
+      [key release];
+      [value release];
     }
-    [scanner setScanLocation:([scanner scanLocation] + 1)];
+    bytes = separator + 1;
   }
-  [scanner release];
+  free(buffer);
   return parameters;
 }
 
@@ -920,6 +1550,19 @@ static NSDateFormatter* _GetDateFormatter(NSString* format, NSString* identifier
   [self setHTTPBody:MakeHTTPBodyForMultipartForm(boundary, arguments)];
 }
 
+- (BOOL) setHTTPBodyStreamWithMultipartFormArguments:(NSDictionary*)arguments {
+  NSString* boundary = @"0xKhTmLbOuNdArY";
+  unsigned long long length = 0;
+  NSInputStream* stream = MakeHTTPBodyStreamForMultipartForm(boundary, arguments, &length);
+  if (stream == nil) {
+    return NO;
+  }
+  [self setValue:[NSString stringWithFormat:@"multipart/form-data; boundary=%@", boundary] forHTTPHeaderField:@"Content-Type"];
+  [self setValue:[NSString stringWithFormat:@"%llu", length] forHTTPHeaderField:@"Content-Length"];
+  [self setHTTPBodyStream:stream];
+  return YES;
+}
+
 @end
 
 @implementation NSTimeZone (Extensions)
@@ -934,3 +1577,136 @@ static NSDateFormatter* _GetDateFormatter(NSString* format, NSString* identifier
 }
 
 @end
+
+@implementation MultipartFormInputStream
+
+- (id) initWithParts:(NSArray*)parts lengths:(NSArray*)lengths {
+  if ((self = [super init])) {
+    _parts = [parts copy];
+    _lengths = [lengths copy];
+    _status = NSStreamStatusNotOpen;
+  }
+  return self;
+}
+
+- (void) dealloc {
+  [_stream close];
+  [_stream release];
+  [_error release];
+  [_lengths release];
+  [_parts release];
+  
+  [super dealloc];
+}
+
+- (id<NSStreamDelegate>) delegate {
+  return _delegate ? _delegate : (id<NSStreamDelegate>)self;
+}
+
+- (void) setDelegate:(id<NSStreamDelegate>)delegate {
+  _delegate = delegate;
+}
+
+- (void) open {
+  DCHECK(_status == NSStreamStatusNotOpen);
+  _status = NSStreamStatusOpen;
+}
+
+- (void) close {
+  [_stream close];
+  [_stream release];
+  _stream = nil;
+  _status = NSStreamStatusClosed;
+}
+
+- (NSStreamStatus) streamStatus {
+  return _status;
+}
+
+- (NSError*) streamError {
+  return _error;
+}
+
+- (id) propertyForKey:(NSString*)key {
+  return nil;
+}
+
+- (BOOL) setProperty:(id)property forKey:(NSString*)key {
+  return NO;
+}
+
+- (void) _failWithError:(NSError*)error {
+  [_error release];
+  _error = [error retain];
+  _status = NSStreamStatusError;
+}
+
+// Reads synchronously across as many parts as needed to fill the buffer
+- (NSInteger) read:(uint8_t*)buffer maxLength:(NSUInteger)maxLength {
+  if (_status == NSStreamStatusAtEnd) {
+    return 0;
+  }
+  if (_status != NSStreamStatusOpen) {
+    return -1;
+  }
+  _status = NSStreamStatusReading;
+  NSUInteger total = 0;
+  while ((total < maxLength) && (_index < _parts.count)) {
+    id part = [_parts objectAtIndex:_index];
+    unsigned long long length = [[_lengths objectAtIndex:_index] unsignedLongLongValue];
+    NSInteger count = MIN(maxLength - total, length - _offset);
+    if (count > 0) {
+      if ([part isKindOfClass:[NSData class]]) {
+        bcopy((const char*)[part bytes] + _offset, buffer + total, count);
+      } else {
+        if (_stream == nil) {
+          _stream = [part isKindOfClass:[NSString class]] ? [[NSInputStream alloc] initWithFileAtPath:part] : [part retain];
+          [_stream open];
+        }
+        count = [_stream read:(buffer + total) maxLength:count];
+        if (count <= 0) {
+          LOG_ERROR(@"Multipart attachment ended after %llu bytes instead of %llu", _offset, length);
+          [self _failWithError:(count < 0 ? [_stream streamError] : [NSError errorWithDomain:NSPOSIXErrorDomain code:EIO userInfo:nil])];
+          return -1;
+        }
+      }
+      _offset += count;
+      total += count;
+    } else {
+      [_stream close];
+      [_stream release];
+      _stream = nil;
+      _offset = 0;
+      _index += 1;
+    }
+  }
+  _status = _index < _parts.count ? NSStreamStatusOpen : NSStreamStatusAtEnd;
+  return total;
+}
+
+- (BOOL) getBuffer:(uint8_t**)buffer length:(NSUInteger*)length {
+  return NO;
+}
+
+- (BOOL) hasBytesAvailable {
+  return _status == NSStreamStatusOpen;
+}
+
+- (void) scheduleInRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode {
+}
+
+- (void) removeFromRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode {
+}
+
+// NSURLConnection drives HTTPBodyStream through these private CFReadStream methods which must be stubbed out by NSInputStream subclasses
+- (void) _scheduleInCFRunLoop:(CFRunLoopRef)runLoop forMode:(CFStringRef)mode {
+}
+
+- (void) _unscheduleFromCFRunLoop:(CFRunLoopRef)runLoop forMode:(CFStringRef)mode {
+}
+
+- (BOOL) _setCFClientFlags:(CFOptionFlags)flags callback:(CFReadStreamClientCallBack)callback context:(CFStreamClientContext*)context {
+  return NO;
+}
+
+@end
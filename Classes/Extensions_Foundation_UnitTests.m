@@ -0,0 +1,227 @@
+// Copyright 2011 Cooliris, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#import "Extensions_Foundation.h"
+#import "UnitTest.h"
+
+#define kBenchmarkThreads 8
+#define kBenchmarkIterations 10000
+
+#define kSegmentationIterations 200
+
+#define kTestTimestamp 784111777.0  // Sun, 06 Nov 1994 08:49:37 GMT
+#define kTestText @"Mr. Smith met Jones on St. Patrick's day vs. the other one. Was it e.g. a trap? No!\nThe end"
+
+@interface ExtensionsFoundationTests : UnitTest
+@end
+
+@implementation ExtensionsFoundationTests
+
+- (void) testDateWireFormats {
+  NSArray* strings = [NSArray arrayWithObjects:@"Sun, 06 Nov 1994 08:49:37 GMT", @"6 Nov 94 09:49:37 +0100", @"Sun, 06 Nov 1994 03:49:37 EST", nil];
+  for (NSString* string in strings) {
+    AssertEqual([[NSDate dateWithWireString:string format:kDateWireFormat_RFC822] timeIntervalSince1970], kTestTimestamp);
+  }
+  strings = [NSArray arrayWithObjects:@"Sun, 06 Nov 1994 08:49:37 GMT", @"Sunday, 06-Nov-94 08:49:37 GMT", @"Sun Nov  6 08:49:37 1994", nil];
+  for (NSString* string in strings) {
+    AssertEqual([[NSDate dateWithWireString:string format:kDateWireFormat_HTTP] timeIntervalSince1970], kTestTimestamp);
+  }
+  strings = [NSArray arrayWithObjects:@"1994-11-06T08:49:37Z", @"1994-11-06T09:49:37+01:00", @"1994-11-06 01:49:37-0700", @"1994-11-06T09:49:37+01 ", nil];
+  for (NSString* string in strings) {
+    AssertEqual([[NSDate dateWithWireString:string format:kDateWireFormat_ISO8601] timeIntervalSince1970], kTestTimestamp);
+  }
+  AssertEqual([[NSDate dateWithWireString:@"1994-11-06T08:49:37.25Z" format:kDateWireFormat_ISO8601] timeIntervalSince1970], kTestTimestamp + 0.25);
+  AssertNil([NSDate dateWithWireString:@"Sun, 06 Foo 1994 08:49:37 GMT" format:kDateWireFormat_RFC822]);
+  AssertNil([NSDate dateWithWireString:@"1994-11-06T25:49:37Z" format:kDateWireFormat_ISO8601]);
+  AssertNil([NSDate dateWithWireString:@"Sun Nov  6 08:49:37 1994" format:kDateWireFormat_RFC822]);
+  AssertNil([NSDate dateWithWireString:@"Thu, 31 Feb 1994 08:49:37 GMT" format:kDateWireFormat_RFC822]);
+  AssertNil([NSDate dateWithWireString:@"1900-02-29T08:49:37Z" format:kDateWireFormat_ISO8601]);
+  AssertNotNil([NSDate dateWithWireString:@"2000-02-29T08:49:37Z" format:kDateWireFormat_ISO8601]);
+  
+  NSDate* date = [NSDate dateWithTimeIntervalSince1970:kTestTimestamp];
+  AssertEqualObjects([date wireStringWithFormat:kDateWireFormat_RFC822], @"Sun, 06 Nov 1994 08:49:37 GMT");
+  AssertEqualObjects([date wireStringWithFormat:kDateWireFormat_HTTP], @"Sun, 06 Nov 1994 08:49:37 GMT");
+  AssertEqualObjects([date wireStringWithFormat:kDateWireFormat_ISO8601], @"1994-11-06T08:49:37Z");
+  AssertEqualObjects([[NSDate dateWithTimeIntervalSince1970:-1.0] wireStringWithFormat:kDateWireFormat_RFC822], @"Wed, 31 Dec 1969 23:59:59 GMT");
+}
+
+- (void) testDateParsingBenchmark {
+  NSString* format = @"EEE, dd MMM yyyy HH:mm:ss zzz";
+  NSString* string = @"Sun, 06 Nov 1994 08:49:37 GMT";
+  
+  CFAbsoluteTime time = CFAbsoluteTimeGetCurrent();
+  dispatch_apply(kBenchmarkThreads, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t index) {
+    for (int i = 0; i < kBenchmarkIterations; ++i) {
+      NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+      [NSDate dateWithString:string cachedFormat:format localIdentifier:@"en_US_POSIX"];
+      [pool release];
+    }
+  });
+  CFAbsoluteTime formatterTime = CFAbsoluteTimeGetCurrent() - time;
+  
+  time = CFAbsoluteTimeGetCurrent();
+  dispatch_apply(kBenchmarkThreads, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t index) {
+    for (int i = 0; i < kBenchmarkIterations; ++i) {
+      NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+      [NSDate dateWithWireString:string format:kDateWireFormat_RFC822];
+      [pool release];
+    }
+  });
+  CFAbsoluteTime wireTime = CFAbsoluteTimeGetCurrent() - time;
+  
+  AssertEqual([[NSDate dateWithString:string cachedFormat:format localIdentifier:@"en_US_POSIX"] timeIntervalSince1970], kTestTimestamp);
+  LOG_INFO(@"Date parsing on %i threads: %.0f dates/s with per-thread formatters, %.0f dates/s with wire format parser",
+           kBenchmarkThreads, kBenchmarkThreads * kBenchmarkIterations / formatterTime, kBenchmarkThreads * kBenchmarkIterations / wireTime);
+}
+
+- (void) testPercentEncoding {
+  NSString* string = @"a b&c=d+e/f?g:h@i~j-k_l.m!n\u00E9";
+  NSString* escaped = [string urlEscapedString];
+  AssertEqualObjects(escaped, @"a%20b%26c%3Dd%2Be%2Ff%3Fg%3Ah%40i~j-k_l.m!n%C3%A9");
+  AssertEqualObjects([escaped unescapeURLString], string);
+  AssertEqualObjects([@"100%" unescapeURLString], @"100%");
+  AssertNil([@"%FF" unescapeURLString]);
+  
+  char buffer[16];
+  AssertEqual(PercentDecodeBytes("a+b%2B", 6, buffer, YES), (NSUInteger)4);
+  AssertTrue(!memcmp(buffer, "a b+", 4));
+  
+  NSDictionary* form = [NSURL parseURLEncodedForm:@"a=1&b=x+y%26z&empty=&novalue&=skipped&c=%C3%A9" unescapeKeysAndValues:YES];
+  AssertEqualObjects(form, ([NSDictionary dictionaryWithObjectsAndKeys:@"1", @"a", @"x y&z", @"b", @"", @"empty", @"\u00E9", @"c", nil]));
+  form = [NSURL parseURLEncodedForm:@"a=x+y%26z" unescapeKeysAndValues:NO];
+  AssertEqualObjects([form objectForKey:@"a"], @"x y%26z");
+  
+  NSDictionary* arguments = [NSDictionary dictionaryWithObject:@"x y&z" forKey:@"key"];
+  AssertEqualObjects(MakeHTTPURLStringWithArguments(@"http://example.com/path", arguments, YES), @"http://example.com/path?key=x%20y%26z");
+  NSURL* url = MakeHTTPURLWithArguments(@"http://example.com/", [NSDictionary dictionaryWithObjectsAndKeys:@"1", @"a", @"2", @"b", nil], NO);
+  AssertEqualObjects([url parseQueryParameters:YES], ([NSDictionary dictionaryWithObjectsAndKeys:@"1", @"a", @"2", @"b", nil]));
+}
+
+- (NSData*) _readStream:(NSInputStream*)stream {
+  NSMutableData* data = [NSMutableData data];
+  uint8_t buffer[7];  // Force reads to straddle parts
+  [stream open];
+  while (1) {
+    NSInteger count = [stream read:buffer maxLength:sizeof(buffer)];
+    if (count <= 0) {
+      AssertEqual(count, (NSInteger)0);
+      break;
+    }
+    [data appendBytes:buffer length:count];
+  }
+  AssertTrue([stream streamStatus] == NSStreamStatusAtEnd);
+  [stream close];
+  return data;
+}
+
+- (void) testMultipartFormStream {
+  NSData* fileData = [@"Contents of the attachment" dataUsingEncoding:NSUTF8StringEncoding];
+  NSString* path = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]];
+  AssertTrue([fileData writeToFile:path atomically:YES]);
+  NSDictionary* memoryFile = [NSDictionary dictionaryWithObjectsAndKeys:@"a.txt", kMultipartFileKey_FileName, @"text/plain", kMultipartFileKey_MimeType,
+                              fileData, kMultipartFileKey_FileData, nil];
+  NSDictionary* pathFile = [NSDictionary dictionaryWithObjectsAndKeys:@"a.txt", kMultipartFileKey_FileName, @"text/plain", kMultipartFileKey_MimeType,
+                            path, kMultipartFileKey_FilePath, nil];
+  NSDictionary* streamFile = [NSDictionary dictionaryWithObjectsAndKeys:@"a.txt", kMultipartFileKey_FileName, @"text/plain", kMultipartFileKey_MimeType,
+                              [NSInputStream inputStreamWithData:fileData], kMultipartFileKey_FileStream,
+                              [NSNumber numberWithUnsignedInteger:fileData.length], kMultipartFileKey_FileLength, nil];
+  
+  NSData* expected = MakeHTTPBodyForMultipartForm(@"boundary", [NSDictionary dictionaryWithObjectsAndKeys:@"value", @"text", memoryFile, @"file", nil]);
+  NSArray* files = [NSArray arrayWithObjects:memoryFile, pathFile, streamFile, nil];
+  for (NSDictionary* file in files) {
+    unsigned long long length = 0;
+    NSInputStream* stream = MakeHTTPBodyStreamForMultipartForm(@"boundary", [NSDictionary dictionaryWithObjectsAndKeys:@"value", @"text", file, @"file", nil], &length);
+    AssertNotNil(stream);
+    AssertEqual(length, (unsigned long long)expected.length);
+    AssertEqualObjects([self _readStream:stream], expected);
+  }
+  AssertEqualObjects(MakeHTTPBodyForMultipartForm(@"boundary", [NSDictionary dictionaryWithObject:pathFile forKey:@"file"]),
+                     MakeHTTPBodyForMultipartForm(@"boundary", [NSDictionary dictionaryWithObject:memoryFile forKey:@"file"]));
+  
+  [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+  AssertNil(MakeHTTPBodyStreamForMultipartForm(@"boundary", [NSDictionary dictionaryWithObject:pathFile forKey:@"file"], NULL));
+  AssertNil(MakeHTTPBodyForMultipartForm(@"boundary", [NSDictionary dictionaryWithObject:pathFile forKey:@"file"]));
+  NSDictionary* invalidFile = [NSDictionary dictionaryWithObjectsAndKeys:@"a.txt", kMultipartFileKey_FileName, @"text/plain", kMultipartFileKey_MimeType,
+                               [NSInputStream inputStreamWithData:fileData], kMultipartFileKey_FileStream, nil];  // Missing length
+  AssertNil(MakeHTTPBodyStreamForMultipartForm(@"boundary", [NSDictionary dictionaryWithObject:invalidFile forKey:@"file"], NULL));
+}
+
+- (void) testSegmentation {
+  NSArray* sentences = [kTestText extractAllSentences];
+  AssertEqualObjects(sentences, ([NSArray arrayWithObjects:@"Mr. Smith met Jones on St. Patrick's day vs. the other one.", @"Was it e.g. a trap?", @"No!", @"The end", nil]));
+  NSArray* ranges = [kTestText rangesOfSentences];
+  AssertEqual(ranges.count, sentences.count);
+  for (NSUInteger i = 0; i < ranges.count; ++i) {
+    AssertEqualObjects([kTestText substringWithRange:[[ranges objectAtIndex:i] rangeValue]], [sentences objectAtIndex:i]);
+  }
+  AssertEqualObjects([@"  Hello world. Bye" extractFirstSentence], @"  Hello world.");
+  AssertEqualObjects([@"\nFoo. Bar" extractFirstSentence], @"");
+  AssertEqual([[@"  Hello world. Bye" extractSentenceIndices] count], (NSUInteger)2);
+  AssertEqual([@"" rangesOfSentences].count, (NSUInteger)0);
+  
+  AssertEqualObjects([@"Hello, well-known world!" extractAllWords], ([NSArray arrayWithObjects:@"Hello", @"well-known", @"world", nil]));
+  __block NSUInteger count = 0;
+  [kTestText enumerateWordRangesUsingBlock:^(NSRange range, BOOL* stop) {
+    if (++count == 2) {
+      *stop = YES;
+    }
+  }];
+  AssertEqual(count, (NSUInteger)2);
+}
+
+- (void) testSegmentationBenchmark {
+  NSMutableString* text = [NSMutableString string];
+  for (int i = 0; i < 1000; ++i) {
+    [text appendString:kTestText];
+    [text appendString:@" "];
+  }
+  
+  __block NSUInteger foundationCount = 0;
+  CFAbsoluteTime time = CFAbsoluteTimeGetCurrent();
+  for (int i = 0; i < kSegmentationIterations; ++i) {
+    NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+    [text enumerateSubstringsInRange:NSMakeRange(0, text.length) options:(NSStringEnumerationBySentences | NSStringEnumerationSubstringNotRequired)
+                          usingBlock:^(NSString* substring, NSRange substringRange, NSRange enclosingRange, BOOL* stop) {
+      ++foundationCount;
+    }];
+    [pool release];
+  }
+  CFAbsoluteTime foundationTime = CFAbsoluteTimeGetCurrent() - time;
+  
+  __block NSUInteger sentenceCount = 0;
+  time = CFAbsoluteTimeGetCurrent();
+  for (int i = 0; i < kSegmentationIterations; ++i) {
+    [text enumerateSentenceRangesUsingBlock:^(NSRange range, BOOL* stop) {
+      ++sentenceCount;
+    }];
+  }
+  CFAbsoluteTime sentenceTime = CFAbsoluteTimeGetCurrent() - time;
+  
+  __block NSUInteger wordCount = 0;
+  time = CFAbsoluteTimeGetCurrent();
+  for (int i = 0; i < kSegmentationIterations; ++i) {
+    [text enumerateWordRangesUsingBlock:^(NSRange range, BOOL* stop) {
+      ++wordCount;
+    }];
+  }
+  CFAbsoluteTime wordTime = CFAbsoluteTimeGetCurrent() - time;
+  
+  AssertGreaterThan(sentenceCount, (NSUInteger)0);
+  AssertGreaterThan(wordCount, sentenceCount);
+  LOG_INFO(@"Segmentation of %i characters: %.1f MB/s for Foundation sentences, %.1f MB/s for sentence ranges, %.1f MB/s for word ranges",
+           (int)text.length, text.length * kSegmentationIterations / foundationTime / 1000000.0,
+           text.length * kSegmentationIterations / sentenceTime / 1000000.0, text.length * kSegmentationIterations / wordTime / 1000000.0);
+}
+
+@end
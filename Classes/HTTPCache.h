@@ -0,0 +1,43 @@
+// Copyright 2011 Cooliris, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#import "HTTPURLConnection.h"
+#import "DiskCache.h"
+
+// Conditional GET cache storing response bodies in a DiskCache with their validators and expiration date as file metadata
+// Fresh responses according to "Cache-Control: max-age" or "Expires" are served without any network access, stale ones are
+// revalidated with "If-None-Match" and "If-Modified-Since" and served from disk on a 304 response
+@interface HTTPCache : NSObject {
+@private
+  DiskCache* _diskCache;
+  int32_t _hitCount;
+  int32_t _revalidationCount;
+  int32_t _missCount;
+}
+@property(nonatomic, readonly) DiskCache* diskCache;
+@property(nonatomic, readonly) NSUInteger hitCount;  // Served from disk without network access
+@property(nonatomic, readonly) NSUInteger revalidationCount;  // Served from disk after a 304 response
+@property(nonatomic, readonly) NSUInteger missCount;  // Downloaded (including failures)
+- (id) initWithDiskCache:(DiskCache*)diskCache;
+// Only GET requests go through the cache - Returns nil on failure or if the final HTTP status is not 200
+- (NSData*) fetchHTTPRequest:(NSURLRequest*)request
+                    delegate:(id<HTTPURLConnectionDelegate>)delegate
+                headerFields:(NSDictionary**)headerFields;
+- (NSData*) fetchContentsFromHTTPURL:(NSURL*)url
+                           userAgent:(NSString*)userAgent
+                       handleCookies:(BOOL)handleCookies
+                            delegate:(id<HTTPURLConnectionDelegate>)delegate
+                        headerFields:(NSDictionary**)headerFields;
+- (void) resetCounters;
+@end
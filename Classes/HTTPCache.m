@@ -0,0 +1,204 @@
+// Copyright 2011 Cooliris, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#import <libkern/OSAtomic.h>
+
+#import "HTTPCache.h"
+#import "Extensions_Foundation.h"
+#import "Logging.h"
+
+#define kCacheFileVersion 1
+
+#define kMetadataKey_ETag @"etag"
+#define kMetadataKey_LastModified @"lastModified"
+#define kMetadataKey_Expiration @"expiration"  // NSNumber (CFAbsoluteTime)
+#define kMetadataKey_HeaderFields @"headerFields"
+
+@implementation HTTPCache
+
+@synthesize diskCache=_diskCache;
+
+- (id) initWithDiskCache:(DiskCache*)diskCache {
+  CHECK(diskCache);
+  if ((self = [super init])) {
+    _diskCache = [diskCache retain];
+  }
+  return self;
+}
+
+- (void) dealloc {
+  [_diskCache release];
+  
+  [super dealloc];
+}
+
+- (NSUInteger) hitCount {
+  return _hitCount;
+}
+
+- (NSUInteger) revalidationCount {
+  return _revalidationCount;
+}
+
+- (NSUInteger) missCount {
+  return _missCount;
+}
+
+- (void) resetCounters {
+  _hitCount = 0;
+  _revalidationCount = 0;
+  _missCount = 0;
+}
+
+// Returns -1.0 if the response must not be stored or 0.0 if it must always be revalidated
+static CFAbsoluteTime _ExpirationFromHeaderFields(NSDictionary* headerFields, CFAbsoluteTime now) {
+  NSString* cacheControl = [HTTPURLConnectionGetHeaderField(headerFields, @"Cache-Control") lowercaseString];
+  if (cacheControl) {
+    if ([cacheControl containsString:@"no-store"]) {
+      return -1.0;
+    }
+    if ([cacheControl containsString:@"no-cache"]) {
+      return 0.0;
+    }
+    NSRange range = [cacheControl rangeOfString:@"max-age="];
+    if (range.location != NSNotFound) {
+      NSInteger maxAge = [[cacheControl substringFromIndex:(range.location + range.length)] integerValue];
+      return maxAge > 0 ? now + maxAge : 0.0;
+    }
+  }
+  NSString* expires = HTTPURLConnectionGetHeaderField(headerFields, @"Expires");
+  if (expires) {
+    NSDate* date = [NSDate dateWithWireString:expires format:kDateWireFormat_HTTP];  // Invalid dates mean already expired
+    return date && ([date timeIntervalSinceReferenceDate] > now) ? [date timeIntervalSinceReferenceDate] : 0.0;
+  }
+  return 0.0;
+}
+
+// Only the header fields that are property list compatible are stored
+static NSDictionary* _MakeMetadata(NSDictionary* headerFields, CFAbsoluteTime expiration) {
+  NSMutableDictionary* metadata = [NSMutableDictionary dictionary];
+  [metadata setValue:HTTPURLConnectionGetHeaderField(headerFields, @"ETag") forKey:kMetadataKey_ETag];
+  [metadata setValue:HTTPURLConnectionGetHeaderField(headerFields, @"Last-Modified") forKey:kMetadataKey_LastModified];
+  [metadata setObject:[NSNumber numberWithDouble:expiration] forKey:kMetadataKey_Expiration];
+  NSMutableDictionary* fields = [NSMutableDictionary dictionary];
+  for (NSString* key in headerFields) {
+    id value = [headerFields objectForKey:key];
+    if ([value isKindOfClass:[NSString class]]) {
+      [fields setObject:value forKey:key];
+    }
+  }
+  [metadata setObject:fields forKey:kMetadataKey_HeaderFields];
+  return metadata;
+}
+
+- (NSData*) _downloadHTTPRequest:(NSURLRequest*)request
+                        delegate:(id<HTTPURLConnectionDelegate>)delegate
+                          status:(NSInteger*)status
+                    headerFields:(NSDictionary**)headerFields {
+  NSOutputStream* stream = [[NSOutputStream alloc] initToMemory];
+  *status = [HTTPURLConnection downloadHTTPRequest:request toStream:stream delegate:delegate headerFields:headerFields];
+  NSData* data = [[[stream propertyForKey:NSStreamDataWrittenToMemoryStreamKey] retain] autorelease];
+  [stream release];
+  return data ? data : [NSData data];
+}
+
+- (NSData*) fetchHTTPRequest:(NSURLRequest*)request
+                    delegate:(id<HTTPURLConnectionDelegate>)delegate
+                headerFields:(NSDictionary**)headerFields {
+  NSInteger status;
+  NSDictionary* fields = nil;
+  if (![[request HTTPMethod] isEqualToString:@"GET"]) {
+    NSData* data = [self _downloadHTTPRequest:request delegate:delegate status:&status headerFields:headerFields];
+    return status == 200 ? data : nil;
+  }
+  
+  // Serve fresh responses from disk
+  NSString* file = [_diskCache cacheFileForHash:[request.URL absoluteString]];
+  NSDictionary* metadata = [_diskCache getCacheFileMetadata:file];
+  CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+  if (metadata && ([[metadata objectForKey:kMetadataKey_Expiration] doubleValue] > now)) {
+    NSData* data = [_diskCache readCacheFileData:file version:NULL];
+    if (data) {
+      LOG_VERBOSE(@"(CACHE HIT) %@", request.URL);
+      OSAtomicIncrement32(&_hitCount);
+      if (headerFields) {
+        *headerFields = [metadata objectForKey:kMetadataKey_HeaderFields];
+      }
+      return data;
+    }
+  }
+  
+  // Revalidate stale responses
+  NSURLRequest* originalRequest = request;
+  NSString* etag = [metadata objectForKey:kMetadataKey_ETag];
+  NSString* lastModified = [metadata objectForKey:kMetadataKey_LastModified];
+  if (etag || lastModified) {
+    NSMutableURLRequest* conditionalRequest = [[request mutableCopy] autorelease];
+    [conditionalRequest setValue:etag forHTTPHeaderField:@"If-None-Match"];
+    [conditionalRequest setValue:lastModified forHTTPHeaderField:@"If-Modified-Since"];
+    request = conditionalRequest;
+  }
+  NSData* data = [self _downloadHTTPRequest:request delegate:delegate status:&status headerFields:&fields];
+  if (status == 304) {
+    data = [_diskCache readCacheFileData:file version:NULL];
+    if (data) {
+      LOG_VERBOSE(@"(CACHE REVALIDATED) %@", request.URL);
+      OSAtomicIncrement32(&_revalidationCount);
+      NSMutableDictionary* mergedFields = [NSMutableDictionary dictionaryWithDictionary:[metadata objectForKey:kMetadataKey_HeaderFields]];
+      for (NSString* key in fields) {
+        if (![key hasPrefix:@"."]) {  // Servers may send updated validators and caching headers with a 304
+          [mergedFields setObject:[fields objectForKey:key] forKey:key];
+        }
+      }
+      CFAbsoluteTime expiration = _ExpirationFromHeaderFields(mergedFields, now);
+      [_diskCache setCacheFileMetadata:_MakeMetadata(mergedFields, MAX(expiration, 0.0)) forFile:file];
+      if (headerFields) {
+        *headerFields = mergedFields;
+      }
+      return data;
+    }
+    LOG_WARNING(@"Cached response for \"%@\" disappeared during revalidation", request.URL);
+    data = [self _downloadHTTPRequest:originalRequest delegate:delegate status:&status headerFields:&fields];
+  }
+  
+  // Store new responses
+  OSAtomicIncrement32(&_missCount);
+  if (headerFields) {
+    *headerFields = fields;
+  }
+  if (status != 200) {
+    if (status) {
+      LOG_ERROR(@"Failed fetching \"%@\" (unexpected %i status)", request.URL, status);
+    }
+    return nil;
+  }
+  CFAbsoluteTime expiration = _ExpirationFromHeaderFields(fields, now);
+  if ((expiration >= 0.0) && ((expiration > now) || HTTPURLConnectionGetHeaderField(fields, @"ETag") || HTTPURLConnectionGetHeaderField(fields, @"Last-Modified"))) {
+    if ([_diskCache writeCacheFile:file data:data version:kCacheFileVersion]) {
+      [_diskCache setCacheFileMetadata:_MakeMetadata(fields, expiration) forFile:file];
+    }
+  }
+  return data;
+}
+
+- (NSData*) fetchContentsFromHTTPURL:(NSURL*)url
+                           userAgent:(NSString*)userAgent
+                       handleCookies:(BOOL)handleCookies
+                            delegate:(id<HTTPURLConnectionDelegate>)delegate
+                        headerFields:(NSDictionary**)headerFields {
+  NSMutableURLRequest* request = [HTTPURLConnection HTTPRequestWithURL:url method:@"GET" userAgent:userAgent handleCookies:handleCookies];
+  return [self fetchHTTPRequest:request delegate:delegate headerFields:headerFields];
+}
+
+@end
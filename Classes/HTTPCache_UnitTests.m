@@ -0,0 +1,102 @@
+// Copyright 2011 Cooliris, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#import <libkern/OSAtomic.h>
+#import <unistd.h>
+
+#import "HTTPCache.h"
+#import "UnitTestHTTPServer.h"
+#import "UnitTest.h"
+
+#define kTestETag "\"v1\""
+
+@interface HTTPCacheTests : UnitTest {
+@private
+  NSString* _path;
+  UnitTestHTTPServer* _server;
+  volatile int32_t _requestCount;
+}
+- (void) _handleRequest:(const char*)buffer socket:(int)fd;
+@end
+
+static void _ServerFunction(int socket, const char* request, void* context) {
+  [(HTTPCacheTests*)context _handleRequest:request socket:socket];
+}
+
+@implementation HTTPCacheTests
+
+// Loopback server handler: "/etag" always requires revalidation and "/fresh" can be cached for a minute
+- (void) _handleRequest:(const char*)buffer socket:(int)fd {
+  OSAtomicIncrement32(&_requestCount);
+  const char* response;
+  if (strncmp(buffer, "GET /etag ", 10) == 0) {
+    if (strcasestr(buffer, "If-None-Match: " kTestETag)) {
+      response = "HTTP/1.1 304 Not Modified\r\nETag: " kTestETag "\r\nConnection: close\r\n\r\n";
+    } else {
+      response = "HTTP/1.1 200 OK\r\nETag: " kTestETag "\r\nCache-Control: no-cache\r\nContent-Length: 4\r\nConnection: close\r\n\r\netag";
+    }
+  } else if (strncmp(buffer, "GET /fresh ", 11) == 0) {
+    response = "HTTP/1.1 200 OK\r\nCache-Control: public, max-age=60\r\nContent-Length: 5\r\nConnection: close\r\n\r\nfresh";
+  } else {
+    response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+  }
+  write(fd, response, strlen(response));
+}
+
+- (void) setUp {
+  _path = [[NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]] retain];
+  [[NSFileManager defaultManager] createDirectoryAtPath:_path withIntermediateDirectories:NO attributes:nil error:NULL];
+  
+  _server = [[UnitTestHTTPServer alloc] initWithFunction:_ServerFunction context:self];
+  AssertNotNil(_server);
+}
+
+- (NSData*) _fetch:(NSString*)path withCache:(HTTPCache*)cache {
+  return [cache fetchContentsFromHTTPURL:[_server URLWithPath:path] userAgent:nil handleCookies:NO delegate:nil headerFields:NULL];
+}
+
+- (void) testConditionalGET {
+  DiskCache* diskCache = [[DiskCache alloc] initWithPath:_path];
+  HTTPCache* cache = [[HTTPCache alloc] initWithDiskCache:diskCache];
+  
+  AssertEqualObjects([self _fetch:@"/etag" withCache:cache], [@"etag" dataUsingEncoding:NSUTF8StringEncoding]);
+  AssertEqualObjects([self _fetch:@"/etag" withCache:cache], [@"etag" dataUsingEncoding:NSUTF8StringEncoding]);
+  AssertEqual(_requestCount, 2);
+  AssertEqual(cache.missCount, (NSUInteger)1);
+  AssertEqual(cache.revalidationCount, (NSUInteger)1);
+  
+  AssertEqualObjects([self _fetch:@"/fresh" withCache:cache], [@"fresh" dataUsingEncoding:NSUTF8StringEncoding]);
+  NSDictionary* headerFields = nil;
+  AssertEqualObjects([cache fetchContentsFromHTTPURL:[_server URLWithPath:@"/fresh"] userAgent:nil handleCookies:NO delegate:nil headerFields:&headerFields],
+                     [@"fresh" dataUsingEncoding:NSUTF8StringEncoding]);
+  AssertEqualObjects([headerFields objectForKey:kHTTPURLConnection_HeaderField_HTTPStatus], @"200");
+  AssertEqual(_requestCount, 3);
+  AssertEqual(cache.hitCount, (NSUInteger)1);
+  AssertEqual(cache.missCount, (NSUInteger)2);
+  
+  AssertNil([self _fetch:@"/missing" withCache:cache]);
+  AssertEqual(cache.missCount, (NSUInteger)3);
+  
+  [cache release];
+  [diskCache release];
+}
+
+- (void) cleanUp {
+  [_server stop];
+  [_server release];
+  [[NSFileManager defaultManager] removeItemAtPath:_path error:NULL];
+  [_path release];
+}
+
+@end
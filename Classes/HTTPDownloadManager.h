@@ -0,0 +1,73 @@
+// Copyright 2011 Cooliris, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#import "HTTPURLConnection.h"
+
+typedef enum {
+  kHTTPDownloadPriority_Low = 0,
+  kHTTPDownloadPriority_Normal,
+  kHTTPDownloadPriority_High,
+  kHTTPDownloadPriorityCount
+} HTTPDownloadPriority;
+
+@class HTTPDownload;
+
+// Status is the HTTP status code or 0 on failure - Data is nil unless the status is 2xx
+typedef void (*HTTPDownloadCompletionFunction)(HTTPDownload* download, NSInteger status, NSData* data, NSDictionary* headerFields, void* context);
+
+// Handle returned for each download request
+@interface HTTPDownload : NSObject {
+@private
+  NSURLRequest* _request;
+  HTTPDownloadPriority _priority;
+  HTTPDownloadCompletionFunction _function;
+  void* _context;
+  id _block;
+  id _task;
+  BOOL _cancelled;
+}
+@property(nonatomic, readonly) NSURLRequest* request;
+@property(nonatomic, readonly) HTTPDownloadPriority priority;
+@property(nonatomic, readonly, getter=isCancelled) BOOL cancelled;
+@end
+
+// All connections are multiplexed on a single dedicated run loop thread and completion callbacks are called on a GCD global queue
+// Pending downloads start in priority order then FIFO order, as long as both the global and the per-host limits allow it
+// Identical GET or HEAD requests in flight are coalesced into a single connection and each requester gets its own callback
+@interface HTTPDownloadManager : NSObject {
+@private
+  NSThread* _thread;
+  NSUInteger _maximumConcurrentDownloads;
+  NSUInteger _maximumConcurrentDownloadsPerHost;
+  NSMutableArray* _queues[kHTTPDownloadPriorityCount];
+  NSMutableDictionary* _tasks;
+  NSMutableSet* _activeTasks;
+  NSCountedSet* _activeHosts;
+}
+@property(nonatomic, readonly) NSUInteger maximumConcurrentDownloads;
+@property(nonatomic, readonly) NSUInteger maximumConcurrentDownloadsPerHost;
++ (HTTPDownloadManager*) sharedManager;
+- (id) initWithMaximumConcurrentDownloads:(NSUInteger)maxDownloads maximumConcurrentDownloadsPerHost:(NSUInteger)maxDownloadsPerHost;
+- (HTTPDownload*) downloadHTTPRequest:(NSURLRequest*)request
+                             priority:(HTTPDownloadPriority)priority
+                   completionFunction:(HTTPDownloadCompletionFunction)function
+                              context:(void*)context;
+#if NS_BLOCKS_AVAILABLE
+- (HTTPDownload*) downloadHTTPRequest:(NSURLRequest*)request
+                             priority:(HTTPDownloadPriority)priority
+                      completionBlock:(void (^)(HTTPDownload* download, NSInteger status, NSData* data, NSDictionary* headerFields))block;
+#endif
+- (void) cancelDownload:(HTTPDownload*)download;  // The completion callback will not be called
+- (void) cancelAllDownloads;
+@end
@@ -0,0 +1,393 @@
+// Copyright 2011 Cooliris, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#import "HTTPDownloadManager.h"
+#import "Logging.h"
+
+#define kDefaultMaximumConcurrentDownloads 8
+#define kDefaultMaximumConcurrentDownloadsPerHost 4
+
+typedef struct {
+  HTTPDownload* download;
+  NSInteger status;
+  NSData* data;
+  NSDictionary* headerFields;
+} HTTPDownloadCompletion;
+
+@class HTTPDownloadTask;
+
+@interface HTTPDownload ()
+@property(nonatomic, readwrite, getter=isCancelled) BOOL cancelled;
+@property(nonatomic) HTTPDownloadCompletionFunction function;
+@property(nonatomic) void* context;
+@property(nonatomic, copy) id block;
+@property(nonatomic, assign) HTTPDownloadTask* task;  // Only accessed from the manager thread
+- (id) initWithRequest:(NSURLRequest*)request priority:(HTTPDownloadPriority)priority;
+@end
+
+// A single connection shared by all the identical downloads coalesced into it
+@interface HTTPDownloadTask : NSObject {
+@private
+  HTTPDownloadManager* _manager;
+  NSURLRequest* _request;
+  id _key;
+  NSString* _host;
+  HTTPDownloadPriority _priority;
+  NSMutableArray* _downloads;
+  HTTPURLConnection* _connection;
+  NSOutputStream* _stream;
+}
+@property(nonatomic, assign) HTTPDownloadManager* manager;
+@property(nonatomic, readonly) NSURLRequest* request;
+@property(nonatomic, readonly) id key;
+@property(nonatomic, readonly) NSString* host;
+@property(nonatomic) HTTPDownloadPriority priority;
+@property(nonatomic, readonly) NSMutableArray* downloads;
+@property(nonatomic, retain) HTTPURLConnection* connection;
+@property(nonatomic, retain) NSOutputStream* stream;
+- (id) initWithRequest:(NSURLRequest*)request key:(id)key priority:(HTTPDownloadPriority)priority;
+@end
+
+@interface HTTPDownloadManager ()
+- (void) _completeTask:(HTTPDownloadTask*)task status:(NSInteger)status headerFields:(NSDictionary*)headerFields;
+- (void) _cancelAllDownloads;
+@end
+
+@implementation HTTPDownload
+
+@synthesize request=_request, priority=_priority, cancelled=_cancelled, function=_function, context=_context, block=_block, task=_task;
+
+- (id) initWithRequest:(NSURLRequest*)request priority:(HTTPDownloadPriority)priority {
+  if ((self = [super init])) {
+    _request = [request copy];
+    _priority = priority;
+  }
+  return self;
+}
+
+- (void) dealloc {
+  [_request release];
+  [_block release];
+  
+  [super dealloc];
+}
+
+@end
+
+@implementation HTTPDownloadTask
+
+@synthesize manager=_manager, request=_request, key=_key, host=_host, priority=_priority, downloads=_downloads,
+            connection=_connection, stream=_stream;
+
+- (id) initWithRequest:(NSURLRequest*)request key:(id)key priority:(HTTPDownloadPriority)priority {
+  if ((self = [super init])) {
+    _request = [request retain];
+    _key = [key retain];
+    _host = [[[request.URL host] lowercaseString] retain];
+    if (_host == nil) {
+      _host = @"";
+    }
+    _priority = priority;
+    _downloads = [[NSMutableArray alloc] init];
+  }
+  return self;
+}
+
+- (void) dealloc {
+  [_request release];
+  [_key release];
+  [_host release];
+  [_downloads release];
+  [_connection release];
+  [_stream release];
+  
+  [super dealloc];
+}
+
+@end
+
+static void _DeliverCompletion(void* context) {
+  NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+  HTTPDownloadCompletion* completion = (HTTPDownloadCompletion*)context;
+  HTTPDownload* download = completion->download;
+  if (!download.cancelled) {
+    if (download.function) {
+      (*download.function)(download, completion->status, completion->data, completion->headerFields, download.context);
+    }
+#if NS_BLOCKS_AVAILABLE
+    else if (download.block) {
+      ((void (^)(HTTPDownload*, NSInteger, NSData*, NSDictionary*))download.block)(download, completion->status, completion->data,
+                                                                                 completion->headerFields);
+    }
+#endif
+  }
+  [completion->download release];
+  [completion->data release];
+  [completion->headerFields release];
+  free(completion);
+  [pool release];
+}
+
+static void _ConnectionCompletionFunction(HTTPURLConnection* connection, NSInteger status, NSDictionary* headerFields, void* context) {
+  HTTPDownloadTask* task = (HTTPDownloadTask*)context;
+  [task.manager _completeTask:task status:status headerFields:headerFields];
+}
+
+@implementation HTTPDownloadManager
+
+@synthesize maximumConcurrentDownloads=_maximumConcurrentDownloads, maximumConcurrentDownloadsPerHost=_maximumConcurrentDownloadsPerHost;
+
++ (HTTPDownloadManager*) sharedManager {
+  static HTTPDownloadManager* manager = nil;
+  static dispatch_once_t token = 0;
+  dispatch_once(&token, ^{
+    manager = [[HTTPDownloadManager alloc] init];
+  });
+  return manager;
+}
+
++ (void) _threadMain:(id)argument {
+  NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+  NSRunLoop* runLoop = [NSRunLoop currentRunLoop];
+  [runLoop addPort:[NSPort port] forMode:NSDefaultRunLoopMode];  // Prevent the run loop from exiting when there are no connections
+  while (![[NSThread currentThread] isCancelled]) {
+    NSAutoreleasePool* localPool = [[NSAutoreleasePool alloc] init];
+    [runLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]];
+    [localPool release];
+  }
+  [pool release];
+}
+
+// Called on the manager thread from -dealloc so the manager must not be retained
++ (void) _shutdownManager:(NSValue*)value {
+  [(HTTPDownloadManager*)[value nonretainedObjectValue] _cancelAllDownloads];
+  [[NSThread currentThread] cancel];
+}
+
+- (id) init {
+  return [self initWithMaximumConcurrentDownloads:kDefaultMaximumConcurrentDownloads
+                maximumConcurrentDownloadsPerHost:kDefaultMaximumConcurrentDownloadsPerHost];
+}
+
+- (id) initWithMaximumConcurrentDownloads:(NSUInteger)maxDownloads maximumConcurrentDownloadsPerHost:(NSUInteger)maxDownloadsPerHost {
+  CHECK(maxDownloads > 0);
+  CHECK(maxDownloadsPerHost > 0);
+  if ((self = [super init])) {
+    _maximumConcurrentDownloads = maxDownloads;
+    _maximumConcurrentDownloadsPerHost = maxDownloadsPerHost;
+    for (int i = 0; i < kHTTPDownloadPriorityCount; ++i) {
+      _queues[i] = [[NSMutableArray alloc] init];
+    }
+    _tasks = [[NSMutableDictionary alloc] init];
+    _activeTasks = [[NSMutableSet alloc] init];
+    _activeHosts = [[NSCountedSet alloc] init];
+    _thread = [[NSThread alloc] initWithTarget:[HTTPDownloadManager class] selector:@selector(_threadMain:) object:nil];
+    [_thread start];
+  }
+  return self;
+}
+
+- (void) dealloc {
+  [[HTTPDownloadManager class] performSelector:@selector(_shutdownManager:)
+                                      onThread:_thread
+                                    withObject:[NSValue valueWithNonretainedObject:self]
+                                 waitUntilDone:YES];
+  [_thread release];
+  for (int i = 0; i < kHTTPDownloadPriorityCount; ++i) {
+    [_queues[i] release];
+  }
+  [_tasks release];
+  [_activeTasks release];
+  [_activeHosts release];
+  
+  [super dealloc];
+}
+
+- (void) _startTask:(HTTPDownloadTask*)task {
+  LOG_DEBUG(@"Starting download of \"%@\" (%i requesters)", task.request.URL, task.downloads.count);
+  NSOutputStream* stream = [[NSOutputStream alloc] initToMemory];
+  task.stream = stream;
+  task.connection = [HTTPURLConnection startHTTPRequest:task.request
+                                               toStream:stream
+                                            runLoopMode:NSDefaultRunLoopMode
+                                     completionFunction:_ConnectionCompletionFunction
+                                                context:task];
+  [stream release];
+  [_activeTasks addObject:task];
+  [_activeHosts addObject:task.host];
+}
+
+// Pending tasks whose host is saturated are skipped so they do not block tasks for other hosts
+- (void) _startPendingTasks {
+  for (int priority = kHTTPDownloadPriorityCount - 1; priority >= 0; --priority) {
+    NSMutableArray* queue = _queues[priority];
+    NSUInteger index = 0;
+    while ((index < queue.count) && (_activeTasks.count < _maximumConcurrentDownloads)) {
+      HTTPDownloadTask* task = [queue objectAtIndex:index];
+      if ([_activeHosts countForObject:task.host] < _maximumConcurrentDownloadsPerHost) {
+        [self _startTask:task];
+        [queue removeObjectAtIndex:index];
+      } else {
+        ++index;
+      }
+    }
+  }
+}
+
+- (void) _removeActiveTask:(HTTPDownloadTask*)task {
+  [[task retain] autorelease];
+  [[task.connection retain] autorelease];  // We may be called from the connection itself
+  task.connection = nil;
+  task.stream = nil;
+  if (task.key) {
+    [_tasks removeObjectForKey:task.key];
+  }
+  [_activeHosts removeObject:task.host];
+  [_activeTasks removeObject:task];
+}
+
+- (void) _completeTask:(HTTPDownloadTask*)task status:(NSInteger)status headerFields:(NSDictionary*)headerFields {
+  NSData* data = nil;
+  if ((status >= 200) && (status < 300)) {
+    data = [task.stream propertyForKey:NSStreamDataWrittenToMemoryStreamKey];
+    if (data == nil) {
+      data = [NSData data];
+    }
+  }
+  for (HTTPDownload* download in task.downloads) {
+    download.task = nil;
+    HTTPDownloadCompletion* completion = malloc(sizeof(HTTPDownloadCompletion));
+    completion->download = [download retain];
+    completion->status = status;
+    completion->data = [data retain];
+    completion->headerFields = [headerFields retain];
+    dispatch_async_f(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), completion, _DeliverCompletion);
+  }
+  [self _removeActiveTask:task];
+  [self _startPendingTasks];
+}
+
+// Only GET and HEAD requests without a body are coalesced and only if they also have the same header fields
+- (void) _addDownload:(HTTPDownload*)download {
+  NSURLRequest* request = download.request;
+  NSString* method = [request HTTPMethod];
+  id key = nil;
+  if (([method isEqualToString:@"GET"] || [method isEqualToString:@"HEAD"]) && !request.HTTPBody && !request.HTTPBodyStream) {
+    key = [NSArray arrayWithObjects:method, [request.URL absoluteString], [request allHTTPHeaderFields], nil];
+  }
+  HTTPDownloadTask* task = key ? [_tasks objectForKey:key] : nil;
+  if (task) {
+    LOG_DEBUG(@"Coalescing download of \"%@\"", request.URL);
+    [task.downloads addObject:download];
+    if ((task.connection == nil) && (download.priority > task.priority)) {
+      [task retain];
+      [_queues[task.priority] removeObjectIdenticalTo:task];
+      task.priority = download.priority;
+      [_queues[task.priority] addObject:task];
+      [task release];
+    }
+  } else {
+    task = [[HTTPDownloadTask alloc] initWithRequest:request key:key priority:download.priority];
+    task.manager = self;
+    [task.downloads addObject:download];
+    if (key) {
+      [_tasks setObject:task forKey:key];
+    }
+    [_queues[task.priority] addObject:task];
+    [task release];
+  }
+  download.task = task;
+  [self _startPendingTasks];
+}
+
+- (void) _cancelDownload:(HTTPDownload*)download {
+  HTTPDownloadTask* task = download.task;
+  if (task) {
+    download.task = nil;
+    [task.downloads removeObjectIdenticalTo:download];
+    if (task.downloads.count == 0) {
+      if (task.connection) {
+        LOG_DEBUG(@"Cancelling download of \"%@\"", task.request.URL);
+        [task.connection cancel];
+        [self _removeActiveTask:task];
+        [self _startPendingTasks];
+      } else {
+        if (task.key) {
+          [_tasks removeObjectForKey:task.key];
+        }
+        [_queues[task.priority] removeObjectIdenticalTo:task];
+      }
+    }
+  }
+}
+
+- (void) _cancelAllDownloads {
+  for (HTTPDownloadTask* task in [_activeTasks allObjects]) {
+    for (HTTPDownload* download in task.downloads) {
+      download.cancelled = YES;
+      download.task = nil;
+    }
+    [task.connection cancel];
+    [self _removeActiveTask:task];
+  }
+  for (int i = 0; i < kHTTPDownloadPriorityCount; ++i) {
+    for (HTTPDownloadTask* task in _queues[i]) {
+      for (HTTPDownload* download in task.downloads) {
+        download.cancelled = YES;
+        download.task = nil;
+      }
+    }
+    [_queues[i] removeAllObjects];
+  }
+  [_tasks removeAllObjects];
+}
+
+- (HTTPDownload*) downloadHTTPRequest:(NSURLRequest*)request
+                             priority:(HTTPDownloadPriority)priority
+                   completionFunction:(HTTPDownloadCompletionFunction)function
+                              context:(void*)context {
+  DCHECK(function);
+  HTTPDownload* download = [[HTTPDownload alloc] initWithRequest:request priority:priority];
+  download.function = function;
+  download.context = context;
+  [self performSelector:@selector(_addDownload:) onThread:_thread withObject:download waitUntilDone:NO];
+  return [download autorelease];
+}
+
+#if NS_BLOCKS_AVAILABLE
+
+- (HTTPDownload*) downloadHTTPRequest:(NSURLRequest*)request
+                             priority:(HTTPDownloadPriority)priority
+                      completionBlock:(void (^)(HTTPDownload* download, NSInteger status, NSData* data, NSDictionary* headerFields))block {
+  DCHECK(block);
+  HTTPDownload* download = [[HTTPDownload alloc] initWithRequest:request priority:priority];
+  download.block = block;
+  [self performSelector:@selector(_addDownload:) onThread:_thread withObject:download waitUntilDone:NO];
+  return [download autorelease];
+}
+
+#endif
+
+// Marking the download as cancelled right away also suppresses a completion callback that may already be in flight
+- (void) cancelDownload:(HTTPDownload*)download {
+  download.cancelled = YES;
+  [self performSelector:@selector(_cancelDownload:) onThread:_thread withObject:download waitUntilDone:NO];
+}
+
+// Completion callbacks already in flight are suppressed as well
+- (void) cancelAllDownloads {
+  [self performSelector:@selector(_cancelAllDownloads) onThread:_thread withObject:nil waitUntilDone:YES];
+}
+
+@end
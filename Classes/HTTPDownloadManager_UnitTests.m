@@ -0,0 +1,157 @@
+// Copyright 2011 Cooliris, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#import <libkern/OSAtomic.h>
+#import <unistd.h>
+
+#import "HTTPDownloadManager.h"
+#import "UnitTestHTTPServer.h"
+#import "UnitTest.h"
+
+#define kTimeOut 10.0
+
+@interface HTTPDownloadManagerTests : UnitTest {
+@private
+  UnitTestHTTPServer* _server;
+  volatile int32_t _requestCount;
+  volatile int32_t _activeCount;
+  volatile int32_t _maxActiveCount;
+}
+- (void) _handleRequest:(const char*)request socket:(int)fd;
+@end
+
+static void _ServerFunction(int socket, const char* request, void* context) {
+  [(HTTPDownloadManagerTests*)context _handleRequest:request socket:socket];
+}
+
+@implementation HTTPDownloadManagerTests
+
+// Loopback server handler: "/<delay in ms>/<name>" responds after the delay with the path as the body
+- (void) _handleRequest:(const char*)request socket:(int)fd {
+  char path[1024];
+  int delay = 0;
+  if ((sscanf(request, "GET %1023s HTTP/", path) == 1) && (sscanf(path, "/%i/", &delay) == 1)) {
+    OSAtomicIncrement32(&_requestCount);
+    int32_t active = OSAtomicIncrement32(&_activeCount);
+    int32_t maxActive;
+    do {
+      maxActive = _maxActiveCount;
+    } while ((active > maxActive) && !OSAtomicCompareAndSwap32(maxActive, active, &_maxActiveCount));
+    usleep(delay * 1000);
+    OSAtomicDecrement32(&_activeCount);
+    NSString* response = [NSString stringWithFormat:@"HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %i\r\nConnection: close\r\n\r\n%s",
+                                                    (int)strlen(path), path];
+    write(fd, [response UTF8String], strlen([response UTF8String]));
+  }
+}
+
+- (void) setUp {
+  _requestCount = 0;
+  _activeCount = 0;
+  _maxActiveCount = 0;
+  _server = [[UnitTestHTTPServer alloc] initWithFunction:_ServerFunction context:self];
+  AssertNotNil(_server);
+}
+
+- (NSURLRequest*) _requestWithPath:(NSString*)path {
+  return [HTTPURLConnection HTTPRequestWithURL:[_server URLWithPath:path] method:@"GET" userAgent:nil handleCookies:NO];
+}
+
+- (BOOL) _waitForResults:(NSMutableArray*)results count:(NSUInteger)count {
+  CFAbsoluteTime time = CFAbsoluteTimeGetCurrent();
+  while (CFAbsoluteTimeGetCurrent() - time < kTimeOut) {
+    @synchronized(results) {
+      if (results.count >= count) {
+        return YES;
+      }
+    }
+    usleep(10000);
+  }
+  return NO;
+}
+
+- (HTTPDownload*) _download:(NSString*)path
+                  withManager:(HTTPDownloadManager*)manager
+                     priority:(HTTPDownloadPriority)priority
+                      results:(NSMutableArray*)results {
+  return [manager downloadHTTPRequest:[self _requestWithPath:path] priority:priority completionBlock:^(HTTPDownload* download, NSInteger status,
+                                                                                                      NSData* data, NSDictionary* headerFields) {
+    NSString* string = status == 200 ? [[[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding] autorelease] : nil;
+    @synchronized(results) {
+      [results addObject:(string ? string : @"")];
+    }
+  }];
+}
+
+- (void) testConcurrencyLimits {
+  HTTPDownloadManager* manager = [[HTTPDownloadManager alloc] initWithMaximumConcurrentDownloads:8 maximumConcurrentDownloadsPerHost:2];
+  NSMutableArray* results = [NSMutableArray array];
+  NSMutableSet* paths = [NSMutableSet set];
+  for (int i = 0; i < 10; ++i) {
+    NSString* path = [NSString stringWithFormat:@"/100/%i", i];
+    [paths addObject:path];
+    [self _download:path withManager:manager priority:kHTTPDownloadPriority_Normal results:results];
+  }
+  AssertTrue([self _waitForResults:results count:10]);
+  AssertEqualObjects([NSSet setWithArray:results], paths);
+  AssertEqual(_requestCount, (int32_t)10);
+  AssertTrue(_maxActiveCount <= 2);
+  [manager release];
+}
+
+- (void) testCoalescing {
+  HTTPDownloadManager* manager = [[HTTPDownloadManager alloc] init];
+  NSMutableArray* results = [NSMutableArray array];
+  for (int i = 0; i < 3; ++i) {
+    [self _download:@"/200/same" withManager:manager priority:kHTTPDownloadPriority_Normal results:results];
+  }
+  AssertTrue([self _waitForResults:results count:3]);
+  AssertEqualObjects(results, ([NSArray arrayWithObjects:@"/200/same", @"/200/same", @"/200/same", nil]));
+  AssertEqual(_requestCount, (int32_t)1);
+  [manager release];
+}
+
+- (void) testPriorities {
+  HTTPDownloadManager* manager = [[HTTPDownloadManager alloc] initWithMaximumConcurrentDownloads:1 maximumConcurrentDownloadsPerHost:1];
+  NSMutableArray* results = [NSMutableArray array];
+  [self _download:@"/200/blocker" withManager:manager priority:kHTTPDownloadPriority_Normal results:results];
+  [self _download:@"/0/low" withManager:manager priority:kHTTPDownloadPriority_Low results:results];
+  [self _download:@"/0/normal" withManager:manager priority:kHTTPDownloadPriority_Normal results:results];
+  [self _download:@"/0/high" withManager:manager priority:kHTTPDownloadPriority_High results:results];
+  AssertTrue([self _waitForResults:results count:4]);
+  AssertEqualObjects(results, ([NSArray arrayWithObjects:@"/200/blocker", @"/0/high", @"/0/normal", @"/0/low", nil]));
+  [manager release];
+}
+
+- (void) testCancellation {
+  HTTPDownloadManager* manager = [[HTTPDownloadManager alloc] initWithMaximumConcurrentDownloads:1 maximumConcurrentDownloadsPerHost:1];
+  NSMutableArray* results = [NSMutableArray array];
+  HTTPDownload* download = [self _download:@"/2000/slow" withManager:manager priority:kHTTPDownloadPriority_Normal results:results];
+  [self _download:@"/0/fast" withManager:manager priority:kHTTPDownloadPriority_Normal results:results];
+  usleep(100000);
+  CFAbsoluteTime time = CFAbsoluteTimeGetCurrent();
+  [manager cancelDownload:download];
+  AssertTrue([self _waitForResults:results count:1]);
+  AssertTrue(CFAbsoluteTimeGetCurrent() - time < 1.0);  // Cancellation must not wait for the slow response
+  AssertTrue(download.cancelled);
+  AssertEqualObjects(results, [NSArray arrayWithObject:@"/0/fast"]);
+  [manager release];
+}
+
+- (void) cleanUp {
+  [_server stop];
+  [_server release];
+}
+
+@end
@@ -21,10 +21,58 @@
 #define kHTTPURLConnection_HeaderField_TextEncodingName @".TextEncodingName"
 #define kHTTPURLConnection_HeaderField_SuggestedFilename @".SuggestedFilename"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+NSString* HTTPURLConnectionGetHeaderField(NSDictionary* headerFields, NSString* name);  // Case-insensitive lookup
+#ifdef __cplusplus
+}
+#endif
+
 @protocol HTTPURLConnectionDelegate <NSObject>
 - (BOOL) isCancelled;
 @end
 
+@class HTTPURLConnection;
+
+// Status is the HTTP status code or 0 on failure - Header fields are the same as in synchronous mode
+typedef void (*HTTPURLConnectionCompletionFunction)(HTTPURLConnection* connection, NSInteger status, NSDictionary* headerFields, void* context);
+
+#define kHTTPURLConnectionMetricsWindowInterval 1.0  // Sliding window used to sample the speed
+#define kHTTPURLConnectionMetricsStallInterval 5.0  // Same idle detection used to abort stalled downloads but with a shorter time out
+#define kHTTPURLConnectionMetricsHistogramBucketCount 16
+
+// All times are in seconds relative to the start of the request and negative if the event did not happen
+typedef struct {
+  CFTimeInterval responseTime;  // Response headers received
+  CFTimeInterval firstByteTime;  // First byte of the body received
+  CFTimeInterval duration;
+  unsigned long long length;
+  double averageSpeed;  // Bytes per second over the whole body
+  double minimumWindowSpeed;  // Bytes per second over the slowest and fastest sliding windows
+  double maximumWindowSpeed;
+  NSUInteger stallCount;
+  CFTimeInterval stallDuration;
+  NSUInteger redirectCount;
+  NSInteger status;  // HTTP status code or 0 on failure
+} HTTPURLConnectionMetrics;
+
+// Histogram bucket 0 counts values below 1 and bucket i counts values in [2^(i-1), 2^i[ (last bucket is open-ended)
+typedef struct {
+  NSUInteger requestCount;
+  NSUInteger failureCount;
+  NSUInteger redirectCount;
+  NSUInteger stallCount;
+  unsigned long long totalLength;
+  CFTimeInterval totalDuration;
+  NSUInteger responseTimeHistogram[kHTTPURLConnectionMetricsHistogramBucketCount];  // Milliseconds
+  NSUInteger firstByteTimeHistogram[kHTTPURLConnectionMetricsHistogramBucketCount];  // Milliseconds
+  NSUInteger speedHistogram[kHTTPURLConnectionMetricsHistogramBucketCount];  // Kb per second
+} HTTPURLConnectionHostMetrics;
+
+// Called on the thread of the connection when it completes or fails but not if it is cancelled
+typedef void (*HTTPURLConnectionMetricsFunction)(NSURLRequest* request, const HTTPURLConnectionMetrics* metrics, void* context);
+
 // Caching is completely disabled
 @interface HTTPURLConnection : NSURLConnection {
 @private
@@ -34,7 +82,23 @@
   NSHTTPURLResponse* _response;
   NSError* _error;
   NSUInteger _length;
+  NSURLRequest* _request;
+  HTTPURLConnectionCompletionFunction _function;
+  void* _context;
+  NSTimer* _timer;
+  NSUInteger _lastLength;
+  CFAbsoluteTime _lastTime;
+  CFAbsoluteTime _startTime;
+  HTTPURLConnectionMetrics _metrics;
+  CFAbsoluteTime _lastDataTime;
+  CFAbsoluteTime _windowTime;
+  NSUInteger _windowLength;
 }
+@property(nonatomic, readonly) HTTPURLConnectionMetrics metrics;  // Final once the connection has completed
++ (void) setMetricsFunction:(HTTPURLConnectionMetricsFunction)function context:(void*)context;  // Pass NULL to remove
++ (NSArray*) hostsWithMetrics;
++ (BOOL) getMetrics:(HTTPURLConnectionHostMetrics*)metrics forHost:(NSString*)host;  // Aggregated over all requests to this host
++ (void) resetHostMetrics;
 + (NSMutableURLRequest*) HTTPRequestWithURL:(NSURL*)url
                                      method:(NSString*)method
                                   userAgent:(NSString*)userAgent
@@ -43,6 +107,13 @@
                          toStream:(NSOutputStream*)stream
                          delegate:(id<HTTPURLConnectionDelegate>)delegate
                      headerFields:(NSDictionary**)headerFields;  // Follows redirects - Delegate can be nil - Returns HTTP status code
+// Asynchronous mode: the connection is scheduled in the current run loop for the given mode and the function is called from it on completion
+// The function is not called if the connection is cancelled with -cancel
++ (HTTPURLConnection*) startHTTPRequest:(NSURLRequest*)request
+                               toStream:(NSOutputStream*)stream
+                            runLoopMode:(NSString*)mode
+                     completionFunction:(HTTPURLConnectionCompletionFunction)function
+                                context:(void*)context;
 @end
 
 @interface HTTPURLConnection (Extensions)
@@ -65,6 +136,14 @@
                       resume:(BOOL)resume
                     delegate:(id<HTTPURLConnectionDelegate>)delegate
                 headerFields:(NSDictionary**)headerFields;
+// Downloads the file over several concurrent range requests written in place into a preallocated file and retries failed segments
+// individually - On failure, a state file is kept next to the download so that calling this method again resumes each segment
+// Falls back to a single connection if the server does not support ranges or the file is too small
++ (BOOL) downloadHTTPRequest:(NSMutableURLRequest*)request
+                toFileAtPath:(NSString*)path
+                    segments:(NSUInteger)count
+                    delegate:(id<HTTPURLConnectionDelegate>)delegate
+                headerFields:(NSDictionary**)headerFields;
 + (BOOL) downloadContentsFromHTTPURL:(NSURL*)url
                         toFileAtPath:(NSString*)path
                               resume:(BOOL)resume
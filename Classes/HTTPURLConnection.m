@@ -12,6 +12,10 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#import <libkern/OSAtomic.h>
+#import <fcntl.h>
+#import <unistd.h>
+
 #import "HTTPURLConnection.h"
 #import "Logging.h"
 
@@ -19,6 +23,40 @@
 #define kURLConnectionIdleTimeOut 90.0  // Default is infinite(?)
 #define kTaskURLDownloadRunLoopMode "TaskURLDownloadMode"
 #define kTaskURLDownloadRunLoopInterval 0.5
+#define kAsynchronousIdleCheckInterval 5.0
+#define kSegmentedDownloadRunLoopMode "SegmentedDownloadMode"
+#define kSegmentedDownloadMinimumSegmentSize (256 * 1024)
+#define kSegmentedDownloadMaximumRetries 3
+#define kSegmentedDownloadStateInterval 2.0
+#define kSegmentedDownloadStateSuffix @".segments"
+
+typedef enum {
+  kDownloadSegmentState_Pending = 0,
+  kDownloadSegmentState_Active,
+  kDownloadSegmentState_Done,
+  kDownloadSegmentState_Failed
+} DownloadSegmentState;
+
+typedef struct {
+  long long offset;  // Next byte to write
+  long long end;  // Inclusive
+  DownloadSegmentState state;
+  NSUInteger retries;
+  HTTPURLConnection* connection;
+} DownloadSegment;
+
+// Writes the body of a range request at the right offset in a shared file descriptor
+@interface SegmentOutputStream : NSOutputStream {
+@private
+  int _fd;
+  DownloadSegment* _segment;
+  BOOL _validated;
+  NSStreamStatus _status;
+  NSError* _error;
+  id<NSStreamDelegate> _delegate;
+}
+- (id) initWithFileDescriptor:(int)fd segment:(DownloadSegment*)segment;
+@end
 
 @interface HTTPURLConnection ()
 @property(nonatomic, retain) NSOutputStream* stream;
@@ -27,13 +65,154 @@
 @property(nonatomic, retain) NSHTTPURLResponse* response;
 @property(nonatomic, retain) NSError* error;
 @property(nonatomic) NSUInteger length;
+- (void) _complete;
 @end
 
+static OSSpinLock _metricsSpinLock = OS_SPINLOCK_INIT;
+static HTTPURLConnectionMetricsFunction _metricsFunction = NULL;
+static void* _metricsContext = NULL;
+static NSMutableDictionary* _hostMetrics = nil;
+
+// NSHTTPURLResponse canonicalizes header names so do not rely on their case
+NSString* HTTPURLConnectionGetHeaderField(NSDictionary* headerFields, NSString* name) {
+  NSString* value = [headerFields objectForKey:name];
+  if (value == nil) {
+    for (NSString* key in headerFields) {
+      if ([key caseInsensitiveCompare:name] == NSOrderedSame) {
+        return [headerFields objectForKey:key];
+      }
+    }
+  }
+  return value;
+}
+
+static inline NSUInteger _HistogramBucket(double value) {
+  return value < 1.0 ? 0 : MIN((NSUInteger)log2(value) + 1, kHTTPURLConnectionMetricsHistogramBucketCount - 1);
+}
+
 @implementation HTTPURLConnection
 
-@synthesize stream=_stream, status=_status, redirectedURL=_redirectedURL, response=_response, error=_error, length=_length;
+@synthesize stream=_stream, status=_status, redirectedURL=_redirectedURL, response=_response, error=_error, length=_length,
+            metrics=_metrics;
+
++ (void) setMetricsFunction:(HTTPURLConnectionMetricsFunction)function context:(void*)context {
+  OSSpinLockLock(&_metricsSpinLock);
+  _metricsFunction = function;
+  _metricsContext = context;
+  OSSpinLockUnlock(&_metricsSpinLock);
+}
+
++ (NSArray*) hostsWithMetrics {
+  OSSpinLockLock(&_metricsSpinLock);
+  NSArray* hosts = [_hostMetrics allKeys];
+  OSSpinLockUnlock(&_metricsSpinLock);
+  return hosts ? hosts : [NSArray array];
+}
+
++ (BOOL) getMetrics:(HTTPURLConnectionHostMetrics*)metrics forHost:(NSString*)host {
+  OSSpinLockLock(&_metricsSpinLock);
+  NSData* data = [_hostMetrics objectForKey:[host lowercaseString]];
+  if (data) {
+    bcopy(data.bytes, metrics, sizeof(HTTPURLConnectionHostMetrics));
+  }
+  OSSpinLockUnlock(&_metricsSpinLock);
+  return data ? YES : NO;
+}
+
++ (void) resetHostMetrics {
+  OSSpinLockLock(&_metricsSpinLock);
+  [_hostMetrics removeAllObjects];
+  OSSpinLockUnlock(&_metricsSpinLock);
+}
+
+- (void) _startMetrics {
+  _startTime = CFAbsoluteTimeGetCurrent();
+  _metrics.responseTime = -1.0;
+  _metrics.firstByteTime = -1.0;
+  _metrics.duration = -1.0;
+  _lastDataTime = _startTime;
+}
+
+- (void) _updateMetricsWithLength:(NSUInteger)length {
+  CFAbsoluteTime time = CFAbsoluteTimeGetCurrent();
+  if (_metrics.firstByteTime < 0.0) {
+    _metrics.firstByteTime = time - _startTime;
+    _windowTime = time;
+  } else if (time - _lastDataTime >= kHTTPURLConnectionMetricsStallInterval) {
+    _metrics.stallCount += 1;
+    _metrics.stallDuration += time - _lastDataTime;
+  }
+  _lastDataTime = time;
+  _windowLength += length;
+  if (time - _windowTime >= kHTTPURLConnectionMetricsWindowInterval) {
+    double speed = (double)_windowLength / (time - _windowTime);
+    if ((_metrics.maximumWindowSpeed == 0.0) || (speed < _metrics.minimumWindowSpeed)) {
+      _metrics.minimumWindowSpeed = speed;
+    }
+    if (speed > _metrics.maximumWindowSpeed) {
+      _metrics.maximumWindowSpeed = speed;
+    }
+    _windowTime = time;
+    _windowLength = 0;
+  }
+}
+
+// Called exactly once per connection unless it was cancelled
+- (void) _finishMetricsForRequest:(NSURLRequest*)request statusCode:(NSInteger)statusCode {
+  CFAbsoluteTime time = CFAbsoluteTimeGetCurrent();
+  _metrics.duration = time - _startTime;
+  _metrics.length = _length;
+  _metrics.status = statusCode;
+  if ((_metrics.firstByteTime >= 0.0) && (_metrics.duration > _metrics.firstByteTime)) {
+    _metrics.averageSpeed = (double)_length / (_metrics.duration - _metrics.firstByteTime);
+  }
+  if (time - _lastDataTime >= kHTTPURLConnectionMetricsStallInterval) {  // Stalled until completion e.g. idle time out
+    _metrics.stallCount += 1;
+    _metrics.stallDuration += time - _lastDataTime;
+  }
+  
+  NSString* host = [(_redirectedURL ? _redirectedURL : request.URL).host lowercaseString];
+  OSSpinLockLock(&_metricsSpinLock);
+  if (host) {
+    if (_hostMetrics == nil) {
+      _hostMetrics = [[NSMutableDictionary alloc] init];
+    }
+    NSMutableData* data = [_hostMetrics objectForKey:host];
+    if (data == nil) {
+      data = [[NSMutableData alloc] initWithLength:sizeof(HTTPURLConnectionHostMetrics)];
+      [_hostMetrics setObject:data forKey:host];
+      [data release];
+    }
+    HTTPURLConnectionHostMetrics* hostMetrics = (HTTPURLConnectionHostMetrics*)data.mutableBytes;
+    hostMetrics->requestCount += 1;
+    if (statusCode == 0) {
+      hostMetrics->failureCount += 1;
+    }
+    hostMetrics->redirectCount += _metrics.redirectCount;
+    hostMetrics->stallCount += _metrics.stallCount;
+    hostMetrics->totalLength += _metrics.length;
+    hostMetrics->totalDuration += _metrics.duration;
+    if (_metrics.responseTime >= 0.0) {
+      hostMetrics->responseTimeHistogram[_HistogramBucket(_metrics.responseTime * 1000.0)] += 1;
+    }
+    if (_metrics.firstByteTime >= 0.0) {
+      hostMetrics->firstByteTimeHistogram[_HistogramBucket(_metrics.firstByteTime * 1000.0)] += 1;
+    }
+    if (_metrics.averageSpeed > 0.0) {
+      hostMetrics->speedHistogram[_HistogramBucket(_metrics.averageSpeed / 1024.0)] += 1;
+    }
+  }
+  HTTPURLConnectionMetricsFunction function = _metricsFunction;
+  void* context = _metricsContext;
+  OSSpinLockUnlock(&_metricsSpinLock);
+  if (function) {
+    (*function)(request, &_metrics, context);
+  }
+}
 
 - (void) dealloc {
+  DCHECK(_timer == nil);
+  [_request release];
   [_stream release];
   [_redirectedURL release];
   [_response release];
@@ -60,6 +239,7 @@
   if (response) {
     LOG_VERBOSE(@"(REDIRECT) %@ %@", [request HTTPMethod], [request URL]);
     [(HTTPURLConnection*)connection setRedirectedURL:[request URL]];
+    ((HTTPURLConnection*)connection)->_metrics.redirectCount += 1;
   }
   return request;
 }
@@ -76,6 +256,7 @@
   if ([response isKindOfClass:[NSHTTPURLResponse class]]) {
     [(HTTPURLConnection*)connection setResponse:(NSHTTPURLResponse*)response];
   }
+  ((HTTPURLConnection*)connection)->_metrics.responseTime = CFAbsoluteTimeGetCurrent() - ((HTTPURLConnection*)connection)->_startTime;
 }
 
 + (NSCachedURLResponse*) connection:(NSURLConnection*)connection willCacheResponse:(NSCachedURLResponse*)cachedResponse {
@@ -88,23 +269,112 @@
   if (stream) {
     length = [stream write:data.bytes maxLength:data.length];
     if (length != data.length) {
-      [(HTTPURLConnection*)connection cancel];
+      [[connection retain] autorelease];
       [(HTTPURLConnection*)connection setError:[stream streamError]];
       [(HTTPURLConnection*)connection setStatus:(-1)];
+      [(HTTPURLConnection*)connection _complete];
+      [(HTTPURLConnection*)connection cancel];
+      return;
     }
   } else {
     length = data.length;
   }
   [(HTTPURLConnection*)connection setLength:([(HTTPURLConnection*)connection length] + length)];
+  [(HTTPURLConnection*)connection _updateMetricsWithLength:length];
 }
 
 + (void) connectionDidFinishLoading:(NSURLConnection*)connection {
   [(HTTPURLConnection*)connection setStatus:(1)];
+  [(HTTPURLConnection*)connection _complete];
 }
 
 + (void) connection:(NSURLConnection*)connection didFailWithError:(NSError*)error {
   [(HTTPURLConnection*)connection setError:error];
   [(HTTPURLConnection*)connection setStatus:(-1)];
+  [(HTTPURLConnection*)connection _complete];
+}
+
+// Returns the HTTP status code or 0 on failure
+- (NSInteger) _statusCodeForRequest:(NSURLRequest*)request duration:(CFTimeInterval)duration headerFields:(NSDictionary**)headerFields {
+  NSInteger statusCode = 0;
+  NSHTTPURLResponse* response = _response;
+  NSDictionary* headers = response.allHeaderFields;
+  if (_status > 0) {
+    LOG_VERBOSE(@"%@ | %@ | %.3f seconds | %i bytes", [request HTTPMethod], [request URL], duration, _length);  // connection.response.URL
+    if (headerFields) {
+      *headerFields = [NSMutableDictionary dictionaryWithDictionary:headers];
+      [(NSMutableDictionary*)*headerFields setObject:[NSString stringWithFormat:@"%i", (int)response.statusCode]
+                                              forKey:kHTTPURLConnection_HeaderField_HTTPStatus];
+      [(NSMutableDictionary*)*headerFields setObject:[NSString stringWithFormat:@"%i", (int)_length]
+                                              forKey:kHTTPURLConnection_HeaderField_DataLength];
+      [(NSMutableDictionary*)*headerFields setValue:_redirectedURL forKey:kHTTPURLConnection_HeaderField_RedirectedURL];
+      [(NSMutableDictionary*)*headerFields setValue:response.MIMEType forKey:kHTTPURLConnection_HeaderField_MIMEType];
+      [(NSMutableDictionary*)*headerFields setValue:response.textEncodingName forKey:kHTTPURLConnection_HeaderField_TextEncodingName];
+      [(NSMutableDictionary*)*headerFields setValue:response.suggestedFilename forKey:kHTTPURLConnection_HeaderField_SuggestedFilename];
+    }
+    statusCode = response.statusCode;
+  } else if (_status < 0) {
+    NSError* error = _error;
+    if ([error.domain isEqualToString:NSURLErrorDomain] && (error.code == NSURLErrorNotConnectedToInternet)) {
+      LOG_VERBOSE(@"No Internet connection to download \"%@\"", request.URL);
+    } else {
+      NSString* description = [error localizedDescription];
+      if (description.length) {
+        LOG_ERROR(@"Failed downloading \"%@\": %@", request.URL, description);
+      } else {
+        LOG_ERROR(@"Failed downloading \"%@\" (%i status - %i bytes received)", request.URL, response.statusCode, _length);
+      }
+    }
+  }
+  if (_status) {
+    [self _finishMetricsForRequest:request statusCode:statusCode];
+  }
+  return statusCode;
+}
+
+- (void) _invalidateTimer {
+  [_timer invalidate];
+  [_timer release];
+  _timer = nil;
+}
+
+// Only does something in asynchronous mode
+- (void) _complete {
+  if (_function) {
+    [self _invalidateTimer];
+    [_stream close];
+    NSDictionary* headerFields = nil;
+    NSInteger statusCode = [self _statusCodeForRequest:_request duration:(CFAbsoluteTimeGetCurrent() - _startTime) headerFields:&headerFields];
+    HTTPURLConnectionCompletionFunction function = _function;
+    _function = NULL;
+    (*function)(self, statusCode, headerFields, _context);
+  }
+}
+
+- (void) _checkIdle:(NSTimer*)timer {
+  CFAbsoluteTime time = CFAbsoluteTimeGetCurrent();
+  if (_length == _lastLength) {
+    if (time - _lastTime >= kURLConnectionIdleTimeOut) {
+      LOG_ERROR(@"Aborting stalled download of \"%@\"", _request.URL);
+      [[self retain] autorelease];
+      self.error = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorTimedOut userInfo:nil];
+      self.status = -1;
+      [self _complete];
+      [self cancel];
+    }
+  } else {
+    _lastLength = _length;
+    _lastTime = time;
+  }
+}
+
+- (void) cancel {
+  if (_function) {
+    [self _invalidateTimer];
+    [_stream close];
+    _function = NULL;
+  }
+  [super cancel];
 }
 
 + (NSInteger) downloadHTTPRequest:(NSURLRequest*)request
@@ -116,6 +386,7 @@
     [stream open];
     HTTPURLConnection* connection = [[HTTPURLConnection alloc] initWithRequest:request delegate:self startImmediately:NO];
     connection.stream = stream;
+    [connection _startMetrics];
     [connection scheduleInRunLoop:[NSRunLoop currentRunLoop] forMode:@kTaskURLDownloadRunLoopMode];
     [connection start];
     CFTimeInterval lastTime = CFAbsoluteTimeGetCurrent();
@@ -132,6 +403,8 @@
       if (connection.length == lastLength) {
         if (time - lastTime >= kURLConnectionIdleTimeOut) {
           LOG_ERROR(@"Aborting stalled download of \"%@\"", request.URL);
+          connection.error = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorTimedOut userInfo:nil];
+          connection.status = -1;  // Record as a failed stalled request in metrics
           [connection cancel];
           break;
         }
@@ -140,44 +413,190 @@
         lastTime = time;
       }
     }
-    duration = CFAbsoluteTimeGetCurrent() - duration;
-    NSHTTPURLResponse* response = connection.response;
-    NSDictionary* headers = response.allHeaderFields;
-    if (connection.status > 0) {
-      LOG_VERBOSE(@"%@ | %@ | %.3f seconds | %i bytes", [request HTTPMethod], [request URL], duration, connection.length);  // connection.response.URL
-      if (headerFields) {
-        *headerFields = [NSMutableDictionary dictionaryWithDictionary:headers];
-        [(NSMutableDictionary*)*headerFields setObject:[NSString stringWithFormat:@"%i", (int)response.statusCode]
-                                                forKey:kHTTPURLConnection_HeaderField_HTTPStatus];
-        [(NSMutableDictionary*)*headerFields setObject:[NSString stringWithFormat:@"%i", (int)connection.length]
-                                                forKey:kHTTPURLConnection_HeaderField_DataLength];
-        [(NSMutableDictionary*)*headerFields setValue:connection.redirectedURL forKey:kHTTPURLConnection_HeaderField_RedirectedURL];
-        [(NSMutableDictionary*)*headerFields setValue:response.MIMEType forKey:kHTTPURLConnection_HeaderField_MIMEType];
-        [(NSMutableDictionary*)*headerFields setValue:response.textEncodingName forKey:kHTTPURLConnection_HeaderField_TextEncodingName];
-        [(NSMutableDictionary*)*headerFields setValue:response.suggestedFilename forKey:kHTTPURLConnection_HeaderField_SuggestedFilename];
-      }
-      statusCode = response.statusCode;
-    } else if (connection.status < 0) {
-      NSError* error = connection.error;
-      if ([error.domain isEqualToString:NSURLErrorDomain] && (error.code == NSURLErrorNotConnectedToInternet)) {
-        LOG_VERBOSE(@"No Internet connection to download \"%@\"", request.URL);
-      } else {
-        NSString* description = [error localizedDescription];
-        if (description.length) {
-          LOG_ERROR(@"Failed downloading \"%@\": %@", request.URL, description);
-        } else {
-          LOG_ERROR(@"Failed downloading \"%@\" (%i status - %i bytes received)", request.URL, response.statusCode, connection.length);
-        }
-      }
-    }
+    statusCode = [connection _statusCodeForRequest:request duration:(CFAbsoluteTimeGetCurrent() - duration) headerFields:headerFields];
     [connection release];
     [stream close];
   }
   return statusCode;
 }
 
++ (HTTPURLConnection*) startHTTPRequest:(NSURLRequest*)request
+                               toStream:(NSOutputStream*)stream
+                            runLoopMode:(NSString*)mode
+                     completionFunction:(HTTPURLConnectionCompletionFunction)function
+                                context:(void*)context {
+  DCHECK(function);
+  [stream open];
+  HTTPURLConnection* connection = [[HTTPURLConnection alloc] initWithRequest:request delegate:self startImmediately:NO];
+  connection.stream = stream;
+  connection->_request = [request copy];
+  connection->_function = function;
+  connection->_context = context;
+  [connection _startMetrics];
+  connection->_lastTime = connection->_startTime;
+  connection->_lastLength = -1;
+  connection->_timer = [[NSTimer alloc] initWithFireDate:[NSDate dateWithTimeIntervalSinceNow:kAsynchronousIdleCheckInterval]
+                                                interval:kAsynchronousIdleCheckInterval
+                                                  target:connection
+                                                selector:@selector(_checkIdle:)
+                                                userInfo:nil
+                                                 repeats:YES];  // Retains the connection until completion or cancellation
+  [[NSRunLoop currentRunLoop] addTimer:connection->_timer forMode:mode];
+  [connection scheduleInRunLoop:[NSRunLoop currentRunLoop] forMode:mode];
+  [connection start];
+  return [connection autorelease];
+}
+
 @end
 
+@implementation SegmentOutputStream
+
+- (id) initWithFileDescriptor:(int)fd segment:(DownloadSegment*)segment {
+  if ((self = [super init])) {
+    _fd = fd;
+    _segment = segment;
+  }
+  return self;
+}
+
+- (void) dealloc {
+  [_error release];
+  
+  [super dealloc];
+}
+
+- (id<NSStreamDelegate>) delegate {
+  return _delegate ? _delegate : (id<NSStreamDelegate>)self;
+}
+
+- (void) setDelegate:(id<NSStreamDelegate>)delegate {
+  _delegate = delegate;
+}
+
+- (void) open {
+  _status = NSStreamStatusOpen;
+}
+
+- (void) close {
+  _status = NSStreamStatusClosed;
+}
+
+- (NSStreamStatus) streamStatus {
+  return _status;
+}
+
+- (NSError*) streamError {
+  return _error;
+}
+
+- (id) propertyForKey:(NSString*)key {
+  return nil;
+}
+
+- (BOOL) setProperty:(id)property forKey:(NSString*)key {
+  return NO;
+}
+
+- (void) scheduleInRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode {
+}
+
+- (void) removeFromRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode {
+}
+
+- (BOOL) hasSpaceAvailable {
+  return _status == NSStreamStatusOpen;
+}
+
+// Only accept bodies of 206 responses whose range starts exactly where the segment resumes
+- (BOOL) _validateResponse {
+  NSHTTPURLResponse* response = _segment->connection.response;
+  NSString* range = HTTPURLConnectionGetHeaderField(response.allHeaderFields, @"Content-Range");
+  long long start = -1;
+  if ((response.statusCode == 206) && [range hasPrefix:@"bytes "]) {
+    NSScanner* scanner = [NSScanner scannerWithString:[range substringFromIndex:6]];
+    if (![scanner scanLongLong:&start] || ![scanner scanString:@"-" intoString:NULL]) {
+      start = -1;
+    }
+  }
+  if (start != _segment->offset) {
+    LOG_WARNING(@"Ignoring response for download segment at offset %lli (%i status, \"%@\" range)",
+                _segment->offset, (int)response.statusCode, range);
+    return NO;
+  }
+  return YES;
+}
+
+- (NSInteger) write:(const uint8_t*)buffer maxLength:(NSUInteger)length {
+  if (!_validated) {
+    if (![self _validateResponse]) {
+      [_error release];
+      _error = [[NSError alloc] initWithDomain:NSPOSIXErrorDomain code:EPROTO userInfo:nil];
+      _status = NSStreamStatusError;
+      return -1;
+    }
+    _validated = YES;
+  }
+  if (_segment->offset + (long long)length > _segment->end + 1) {  // Server ignored the requested range
+    [_error release];
+    _error = [[NSError alloc] initWithDomain:NSPOSIXErrorDomain code:ERANGE userInfo:nil];
+    _status = NSStreamStatusError;
+    return -1;
+  }
+  ssize_t result = pwrite(_fd, buffer, length, _segment->offset);
+  if (result < 0) {
+    [_error release];
+    _error = [[NSError alloc] initWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+    _status = NSStreamStatusError;
+    return -1;
+  }
+  _segment->offset += result;
+  return result;
+}
+
+@end
+
+static void _SegmentCompletionFunction(HTTPURLConnection* connection, NSInteger status, NSDictionary* headerFields, void* context) {
+  DownloadSegment* segment = (DownloadSegment*)context;
+  if ((status == 206) && (segment->offset > segment->end)) {  // Partial Content
+    segment->state = kDownloadSegmentState_Done;
+  } else {
+    LOG_WARNING(@"Download segment ending at %lli failed at offset %lli (%i status)", segment->end, segment->offset, status);
+    segment->state = kDownloadSegmentState_Failed;
+    segment->retries += 1;
+  }
+  [segment->connection autorelease];  // We are called from the connection itself
+  segment->connection = nil;
+}
+
+static void _SaveSegmentedDownloadState(NSString* path, long long length, NSString* validator, DownloadSegment* segments, NSUInteger count) {
+  NSMutableArray* array = [NSMutableArray arrayWithCapacity:(2 * count)];
+  for (NSUInteger i = 0; i < count; ++i) {
+    [array addObject:[NSNumber numberWithLongLong:segments[i].offset]];
+    [array addObject:[NSNumber numberWithLongLong:segments[i].end]];
+  }
+  NSDictionary* state = [NSDictionary dictionaryWithObjectsAndKeys:[NSNumber numberWithLongLong:length], @"length",
+                                                                   validator, @"validator", array, @"segments", nil];
+  if (![state writeToFile:path atomically:YES]) {
+    LOG_ERROR(@"Failed saving segmented download state to \"%@\"", path);
+  }
+}
+
+// Returns the number of segments restored or 0 if the state file does not match the remote file
+static NSUInteger _LoadSegmentedDownloadState(NSString* path, long long length, NSString* validator, DownloadSegment** segments) {
+  NSDictionary* state = [NSDictionary dictionaryWithContentsOfFile:path];
+  if (([[state objectForKey:@"length"] longLongValue] == length) && [[state objectForKey:@"validator"] isEqualToString:validator]) {
+    NSArray* array = [state objectForKey:@"segments"];
+    NSUInteger count = array.count / 2;
+    *segments = calloc(count, sizeof(DownloadSegment));
+    for (NSUInteger i = 0; i < count; ++i) {
+      (*segments)[i].offset = [[array objectAtIndex:(2 * i)] longLongValue];
+      (*segments)[i].end = [[array objectAtIndex:(2 * i + 1)] longLongValue];
+    }
+    return count;
+  }
+  return 0;
+}
+
 @implementation HTTPURLConnection (Extensions)
 
 + (NSDictionary*) downloadHeaderFieldsForHTTPRequest:(NSMutableURLRequest*)request
@@ -265,4 +684,142 @@
   return [self downloadHTTPRequest:request toFileAtPath:path resume:resume delegate:delegate headerFields:headerFields];
 }
 
+// All segments are multiplexed on the calling thread run loop
++ (BOOL) downloadHTTPRequest:(NSMutableURLRequest*)request
+                toFileAtPath:(NSString*)path
+                    segments:(NSUInteger)count
+                    delegate:(id<HTTPURLConnectionDelegate>)delegate
+                headerFields:(NSDictionary**)headerFields {
+  DCHECK(count > 0);
+  
+  // Retrieve total length and make sure the server supports ranges on the unencoded representation
+  [request setValue:@"identity" forHTTPHeaderField:@"Accept-Encoding"];
+  NSMutableURLRequest* headRequest = [[request mutableCopy] autorelease];
+  [headRequest setHTTPMethod:@"HEAD"];
+  NSDictionary* fields = [self downloadHeaderFieldsForHTTPRequest:headRequest delegate:delegate];
+  if (fields == nil) {
+    return NO;
+  }
+  if (headerFields) {
+    *headerFields = fields;
+  }
+  long long length = [HTTPURLConnectionGetHeaderField(fields, @"Content-Length") longLongValue];
+  count = MIN(count, (NSUInteger)(length / kSegmentedDownloadMinimumSegmentSize));
+  if (![HTTPURLConnectionGetHeaderField(fields, @"Accept-Ranges") isEqualToString:@"bytes"] || (count < 2)) {
+    LOG_VERBOSE(@"Using a single connection to download \"%@\"", request.URL);
+    return [self downloadHTTPRequest:request toFileAtPath:path resume:NO delegate:delegate headerFields:headerFields];
+  }
+  NSString* validator = HTTPURLConnectionGetHeaderField(fields, @"ETag");
+  if (validator == nil) {
+    validator = HTTPURLConnectionGetHeaderField(fields, @"Last-Modified");
+  }
+  if (validator == nil) {
+    validator = @"";
+  }
+  
+  // Resume from state file if it matches both the remote and the local files, otherwise preallocate the local file
+  NSString* statePath = [path stringByAppendingString:kSegmentedDownloadStateSuffix];
+  DownloadSegment* segments = NULL;
+  if ((long long)[[[NSFileManager defaultManager] attributesOfItemAtPath:path error:NULL] fileSize] == length) {
+    NSUInteger restoredCount = _LoadSegmentedDownloadState(statePath, length, validator, &segments);
+    if (restoredCount) {
+      LOG_VERBOSE(@"Resuming segmented download of \"%@\"", request.URL);
+      count = restoredCount;
+    }
+  }
+  int fd = open([path fileSystemRepresentation], O_RDWR | O_CREAT | (segments ? 0 : O_TRUNC), S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fd < 0) {
+    LOG_ERROR(@"Failed opening \"%@\" (%s)", path, strerror(errno));
+    free(segments);
+    return NO;
+  }
+  if (segments == NULL) {
+    fstore_t store = {F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, length, 0};
+    if (fcntl(fd, F_PREALLOCATE, &store) < 0) {
+      store.fst_flags = F_ALLOCATEALL;
+      fcntl(fd, F_PREALLOCATE, &store);  // Best effort
+    }
+    if (ftruncate(fd, length) < 0) {
+      LOG_ERROR(@"Failed resizing \"%@\" (%s)", path, strerror(errno));
+      close(fd);
+      return NO;
+    }
+    segments = calloc(count, sizeof(DownloadSegment));
+    long long size = length / count;
+    for (NSUInteger i = 0; i < count; ++i) {
+      segments[i].offset = i * size;
+      segments[i].end = i < count - 1 ? (i + 1) * size - 1 : length - 1;
+    }
+  }
+  
+  // Run segments until they are all complete, retrying failed ones individually
+  BOOL success = NO;
+  CFAbsoluteTime lastSave = CFAbsoluteTimeGetCurrent();
+  while (1) {
+    NSUInteger remaining = 0;
+    BOOL failed = NO;
+    for (NSUInteger i = 0; i < count; ++i) {
+      DownloadSegment* segment = &segments[i];
+      if (segment->state == kDownloadSegmentState_Failed) {
+        if (segment->retries > kSegmentedDownloadMaximumRetries) {
+          failed = YES;
+          break;
+        }
+        segment->state = kDownloadSegmentState_Pending;
+      }
+      if (segment->state == kDownloadSegmentState_Pending) {
+        if (segment->offset > segment->end) {
+          segment->state = kDownloadSegmentState_Done;
+          continue;
+        }
+        NSMutableURLRequest* segmentRequest = [[request mutableCopy] autorelease];
+        [segmentRequest setValue:[NSString stringWithFormat:@"bytes=%lli-%lli", segment->offset, segment->end] forHTTPHeaderField:@"Range"];
+        SegmentOutputStream* stream = [[SegmentOutputStream alloc] initWithFileDescriptor:fd segment:segment];
+        segment->connection = [[self startHTTPRequest:segmentRequest
+                                             toStream:stream
+                                          runLoopMode:@kSegmentedDownloadRunLoopMode
+                                   completionFunction:_SegmentCompletionFunction
+                                              context:segment] retain];
+        [stream release];
+        segment->state = kDownloadSegmentState_Active;
+      }
+      if (segment->state != kDownloadSegmentState_Done) {
+        remaining += 1;
+      }
+    }
+    if (failed) {
+      LOG_ERROR(@"Failed downloading \"%@\" (too many segment retries)", request.URL);
+      break;
+    }
+    if (remaining == 0) {
+      success = YES;
+      break;
+    }
+    CFRunLoopRunInMode(CFSTR(kSegmentedDownloadRunLoopMode), kTaskURLDownloadRunLoopInterval, true);
+    if ([delegate isCancelled]) {
+      LOG_DEBUG(@"Cancelling segmented download of \"%@\"", request.URL);
+      break;
+    }
+    CFAbsoluteTime time = CFAbsoluteTimeGetCurrent();
+    if (time - lastSave >= kSegmentedDownloadStateInterval) {
+      _SaveSegmentedDownloadState(statePath, length, validator, segments, count);
+      lastSave = time;
+    }
+  }
+  
+  // Clean up and keep state file around on failure so the download can be resumed
+  for (NSUInteger i = 0; i < count; ++i) {
+    [segments[i].connection cancel];
+    [segments[i].connection release];
+  }
+  close(fd);
+  if (success) {
+    [[NSFileManager defaultManager] removeItemAtPath:statePath error:NULL];
+  } else {
+    _SaveSegmentedDownloadState(statePath, length, validator, segments, count);
+  }
+  free(segments);
+  return success;
+}
+
 @end
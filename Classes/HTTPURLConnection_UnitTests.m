@@ -12,17 +12,128 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#import <libkern/OSAtomic.h>
+#import <unistd.h>
+#import <netinet/in.h>
+
 #import "HTTPURLConnection.h"
+#import "UnitTestHTTPServer.h"
 #import "UnitTest.h"
 
 #define kTestFileURL @"http://images.apple.com/movies/us/pr/photos/exec/stevejobs.tif.zip"  // 2.5Mb
 #define kTestPageURL @"http://www.apple.com/"
+#define kTestLength (2 * 1024 * 1024)
+#define kTestChunkSize (16 * 1024)
+#define kTestChunkDelay 20000  // Throttles each connection to about 800 Kb/s
 
-@interface HTTPURLConnectionTests : UnitTest
+@interface HTTPURLConnectionTests : UnitTest {
+@private
+  UnitTestHTTPServer* _server;
+  volatile int32_t _rangeCount;
+  volatile int32_t _failCount;
+  volatile int32_t _ignoreRangeCount;
+}
+- (void) _handleRequest:(const char*)buffer socket:(int)fd;
 @end
 
+static void _ServerFunction(int socket, const char* request, void* context) {
+  [(HTTPURLConnectionTests*)context _handleRequest:request socket:socket];
+}
+
+static void _MetricsFunction(NSURLRequest* request, const HTTPURLConnectionMetrics* metrics, void* context) {
+  *(HTTPURLConnectionMetrics*)context = *metrics;
+}
+
+static inline uint8_t _TestByte(long long offset) {
+  return (offset * 7 + offset / 251) & 0xFF;
+}
+
 @implementation HTTPURLConnectionTests
 
+// Throttled loopback server handler supporting HEAD and single byte ranges over a deterministic file
+// The first "_failCount" range responses are cut off in the middle of the body and the first "_ignoreRangeCount" range requests
+// get the full file as a 200 response
+- (void) _handleRequest:(const char*)buffer socket:(int)fd {
+  BOOL isHead = !strncmp(buffer, "HEAD ", 5);
+  long long start = 0;
+  long long end = kTestLength - 1;
+  const char* range = strstr(buffer, "Range: bytes=");
+  BOOL isRange = range && (sscanf(range, "Range: bytes=%lli-%lli", &start, &end) == 2);
+  if (isRange && (OSAtomicDecrement32(&_ignoreRangeCount) >= 0)) {
+    OSAtomicIncrement32(&_rangeCount);
+    isRange = NO;
+    start = 0;
+    end = kTestLength - 1;
+  }
+  BOOL fail = NO;
+  NSString* header;
+  if (isRange) {
+    OSAtomicIncrement32(&_rangeCount);
+    fail = OSAtomicDecrement32(&_failCount) >= 0;
+    header = [NSString stringWithFormat:@"HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %lli-%lli/%i\r\n", start, end, kTestLength];
+  } else {
+    header = @"HTTP/1.1 200 OK\r\n";
+  }
+  header = [header stringByAppendingFormat:@"Content-Type: application/octet-stream\r\nContent-Length: %lli\r\nAccept-Ranges: bytes\r\n"
+                                           @"ETag: \"test\"\r\nConnection: close\r\n\r\n", end - start + 1];
+  write(fd, [header UTF8String], strlen([header UTF8String]));
+  if (!isHead) {
+    uint8_t chunk[kTestChunkSize];
+    long long offset = start;
+    while ((offset <= end) && _server.running) {
+      size_t size = MIN(kTestChunkSize, end + 1 - offset);
+      if (fail && (offset - start >= (end - start) / 2)) {
+        break;
+      }
+      for (size_t i = 0; i < size; ++i) {
+        chunk[i] = _TestByte(offset + i);
+      }
+      if (write(fd, chunk, size) != (ssize_t)size) {
+        break;
+      }
+      offset += size;
+      usleep(kTestChunkDelay);
+    }
+  }
+}
+
+- (void) setUp {
+  _rangeCount = 0;
+  _failCount = 0;
+  _ignoreRangeCount = 0;
+  _server = [[UnitTestHTTPServer alloc] initWithFunction:_ServerFunction context:self];
+  AssertNotNil(_server);
+}
+
+- (void) cleanUp {
+  [_server stop];
+  [_server release];
+}
+
+- (BOOL) _checkFileAtPath:(NSString*)path {
+  NSData* data = [NSData dataWithContentsOfFile:path];
+  if (data.length != kTestLength) {
+    return NO;
+  }
+  const uint8_t* bytes = data.bytes;
+  for (long long i = 0; i < kTestLength; ++i) {
+    if (bytes[i] != _TestByte(i)) {
+      return NO;
+    }
+  }
+  return YES;
+}
+
+- (CFTimeInterval) _segmentedDownloadToPath:(NSString*)path segments:(NSUInteger)count {
+  NSMutableURLRequest* request = [HTTPURLConnection HTTPRequestWithURL:[_server URLWithPath:@"/file"]
+                                                                method:@"GET"
+                                                             userAgent:nil
+                                                         handleCookies:NO];
+  CFAbsoluteTime time = CFAbsoluteTimeGetCurrent();
+  BOOL result = [HTTPURLConnection downloadHTTPRequest:request toFileAtPath:path segments:count delegate:nil headerFields:NULL];
+  return result ? CFAbsoluteTimeGetCurrent() - time : -1.0;
+}
+
 - (void) testDownload {
   NSString* path = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]];
   
@@ -98,4 +209,100 @@
   [html release];
 }
 
+- (void) testSegmentedDownload {
+  NSString* path = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]];
+  
+  // Plain segmented download
+  AssertGreaterThan([self _segmentedDownloadToPath:path segments:4], 0.0);
+  AssertEqual(_rangeCount, (int32_t)4);
+  AssertTrue([self _checkFileAtPath:path]);
+  AssertFalse([[NSFileManager defaultManager] fileExistsAtPath:[path stringByAppendingString:@".segments"]]);
+  
+  // Segments cut off mid-way are retried from where they stopped
+  _rangeCount = 0;
+  _failCount = 2;
+  AssertGreaterThan([self _segmentedDownloadToPath:path segments:4], 0.0);
+  AssertEqual(_rangeCount, (int32_t)6);
+  AssertTrue([self _checkFileAtPath:path]);
+  
+  // Responses ignoring the requested range are never written to the file
+  _rangeCount = 0;
+  _ignoreRangeCount = 1;
+  AssertGreaterThan([self _segmentedDownloadToPath:path segments:4], 0.0);
+  AssertEqual(_rangeCount, (int32_t)5);
+  AssertTrue([self _checkFileAtPath:path]);
+  
+  [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+}
+
+- (void) testSegmentedDownloadBenchmark {
+  NSString* path = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]];
+  CFTimeInterval single = [self _segmentedDownloadToPath:path segments:1];
+  AssertGreaterThan(single, 0.0);
+  AssertTrue([self _checkFileAtPath:path]);
+  CFTimeInterval segmented = [self _segmentedDownloadToPath:path segments:4];
+  AssertGreaterThan(segmented, 0.0);
+  AssertTrue([self _checkFileAtPath:path]);
+  LOG_INFO(@"Throttled download of %i Kb: %.0f Kb/s with 1 connection / %.0f Kb/s with 4 segments",
+           kTestLength / 1024, kTestLength / 1024 / single, kTestLength / 1024 / segmented);
+  AssertGreaterThan(single, segmented);
+  [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+}
+
+- (void) testMetrics {
+  HTTPURLConnectionMetrics metrics;
+  bzero(&metrics, sizeof(metrics));
+  [HTTPURLConnection resetHostMetrics];
+  [HTTPURLConnection setMetricsFunction:_MetricsFunction context:&metrics];
+  
+  // Successful download
+  NSMutableURLRequest* request = [HTTPURLConnection HTTPRequestWithURL:[_server URLWithPath:@"/file"]
+                                                                method:@"GET"
+                                                             userAgent:nil
+                                                         handleCookies:NO];
+  AssertEqual([HTTPURLConnection downloadHTTPRequest:request toStream:nil delegate:nil headerFields:NULL], (NSInteger)200);
+  AssertEqual(metrics.status, (NSInteger)200);
+  AssertEqual(metrics.length, (unsigned long long)kTestLength);
+  AssertEqual(metrics.redirectCount, (NSUInteger)0);
+  AssertTrue(metrics.responseTime >= 0.0);
+  AssertTrue(metrics.firstByteTime >= metrics.responseTime);
+  AssertGreaterThan(metrics.duration, metrics.firstByteTime);
+  AssertGreaterThan(metrics.averageSpeed, 0.0);
+  AssertGreaterThan(metrics.minimumWindowSpeed, 0.0);
+  AssertTrue(metrics.maximumWindowSpeed >= metrics.minimumWindowSpeed);
+  AssertEqual(metrics.stallCount, (NSUInteger)0);
+  
+  // Failed download on a loopback port nothing listens on
+  int fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+  struct sockaddr_in addr4;
+  bzero(&addr4, sizeof(addr4));
+  addr4.sin_len = sizeof(addr4);
+  addr4.sin_family = AF_INET;
+  addr4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t length = sizeof(addr4);
+  AssertTrue(!bind(fd, (struct sockaddr*)&addr4, sizeof(addr4)) && !getsockname(fd, (struct sockaddr*)&addr4, &length));
+  close(fd);
+  NSURL* url = [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%i/file", ntohs(addr4.sin_port)]];
+  request = [HTTPURLConnection HTTPRequestWithURL:url method:@"GET" userAgent:nil handleCookies:NO];
+  AssertEqual([HTTPURLConnection downloadHTTPRequest:request toStream:nil delegate:nil headerFields:NULL], (NSInteger)0);
+  AssertEqual(metrics.status, (NSInteger)0);
+  AssertTrue(metrics.firstByteTime < 0.0);
+  
+  // Per-host aggregation
+  [HTTPURLConnection setMetricsFunction:NULL context:NULL];
+  AssertEqualObjects([HTTPURLConnection hostsWithMetrics], [NSArray arrayWithObject:@"127.0.0.1"]);
+  HTTPURLConnectionHostMetrics hostMetrics;
+  AssertTrue([HTTPURLConnection getMetrics:&hostMetrics forHost:@"127.0.0.1"]);
+  AssertEqual(hostMetrics.requestCount, (NSUInteger)2);
+  AssertEqual(hostMetrics.failureCount, (NSUInteger)1);
+  AssertEqual(hostMetrics.totalLength, (unsigned long long)kTestLength);
+  NSUInteger count = 0;
+  for (NSUInteger i = 0; i < kHTTPURLConnectionMetricsHistogramBucketCount; ++i) {
+    count += hostMetrics.speedHistogram[i];
+  }
+  AssertEqual(count, (NSUInteger)1);
+  [HTTPURLConnection resetHostMetrics];
+  AssertFalse([HTTPURLConnection getMetrics:&hostMetrics forHost:@"127.0.0.1"]);
+}
+
 @end
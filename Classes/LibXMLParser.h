@@ -21,6 +21,7 @@
 #define kLibXMLSeparator_Namespace '@'
 #define kLibXMLSeparator_Attribute '|'
 #define kLibXMLSeparator_Value '='
+#define kLibXMLSeparator_Index '#'
 
 #define LIBXML_IS_NEWLINE(C) (((C) == '\r') || ((C) == '\n'))
 #define LIBXML_IS_WHITESPACE(C) (((C) == ' ') || ((C) == '\t'))
@@ -28,6 +29,22 @@
 
 @class LibXMLNode;
 
+// Paths are made of components separated by ':' with the format "[prefix@]name[|attribute=value][#index]"
+// The index is 0-based and only counts siblings matching the rest of the component (ignored in streaming mode)
+// A "#" directly following "=" is part of the attribute value e.g. "item|id=#1" matches an "id" attribute equal to "#1"
+// LibXMLPath is immutable and can be evaluated against any number of documents from any thread without parsing the path again
+@interface LibXMLPath : NSObject {
+@private
+  NSString* _string;
+  void* _dict;
+  void* _components;
+  NSUInteger _count;
+}
+@property(nonatomic, readonly) NSString* string;
++ (LibXMLPath*) pathWithString:(NSString*)string;
+- (id) initWithString:(NSString*)string;
+@end
+
 typedef enum {
   kLibXMLNodeApplierPreFunctionState_Abort = -1,
   kLibXMLNodeApplierPreFunctionState_Skip = 0,
@@ -38,6 +55,7 @@ typedef enum {
 typedef LibXMLNodeApplierPreFunctionState (*LibXMLNodeApplierPreFunction)(const unsigned char* name, LibXMLNode* node, void* context);
 typedef void (*LibXMLNodeApplierPostFunction)(const unsigned char* name, void* context);
 typedef BOOL (*LibXMLNodeSkipFunction)(const unsigned char* name, LibXMLNode* node, void* context);
+typedef BOOL (*LibXMLNodeStreamFunction)(LibXMLNode* node, void* context);  // Return NO to stop parsing
 
 // LibXMLParser is case-sensitive for paths and attribute names
 @interface LibXMLParser : NSObject {
@@ -47,9 +65,22 @@ typedef BOOL (*LibXMLNodeSkipFunction)(const unsigned char* name, LibXMLNode* no
 @property(nonatomic, readonly) LibXMLNode* rootNode;
 + (void) setErrorReportingLogLevel:(LogLevel)level;
 + (LogLevel) errorReportingLogLevel;  // Default is kLogLevel_Debug
+// Streaming mode for large XML documents: the document is never entirely built in memory and instead each node matching the path
+// is passed to the function with its subtree then freed - The node and its descendants must NOT be used after the function returns
++ (BOOL) streamXMLUTF8Data:(NSData*)data path:(NSString*)path function:(LibXMLNodeStreamFunction)function context:(void*)context;
++ (BOOL) streamXMLFileAtPath:(NSString*)filePath path:(NSString*)path function:(LibXMLNodeStreamFunction)function context:(void*)context;
+#if NS_BLOCKS_AVAILABLE
++ (BOOL) streamXMLUTF8Data:(NSData*)data path:(NSString*)path usingBlock:(BOOL (^)(LibXMLNode* node))block;
++ (BOOL) streamXMLFileAtPath:(NSString*)filePath path:(NSString*)path usingBlock:(BOOL (^)(LibXMLNode* node))block;
+#endif
+// Parses an array of NSData documents concurrently on all cores and returns the results in the same order (NSNull on failure)
++ (NSArray*) parsersWithUTF8DataArray:(NSArray*)array isHTML:(BOOL)isHTML;
++ (NSArray*) textFromHTMLUTF8DataArray:(NSArray*)array;  // Same as -extractTextFromMergedHTML on the root node
 - (id) initWithXMLUTF8Data:(NSData*)data;
 - (id) initWithHTMLUTF8Data:(NSData*)data;
 - (LibXMLNode*) firstChildAtPath:(NSString*)path;
+- (LibXMLNode*) firstChildAtCompiledPath:(LibXMLPath*)path;
+- (NSArray*) childrenAtCompiledPath:(LibXMLPath*)path;  // All matches in document order
 - (LibXMLNode*) firstDescendantWithName:(NSString*)name attribute:(NSString*)attribute value:(NSString*)value;
 @end
 
@@ -81,6 +112,8 @@ typedef BOOL (*LibXMLNodeSkipFunction)(const unsigned char* name, LibXMLNode* no
                               postBlock:(void (^)(const unsigned char* name))postBlock;
 #endif
 - (LibXMLNode*) firstChildAtPath:(NSString*)path;
+- (LibXMLNode*) firstChildAtCompiledPath:(LibXMLPath*)path;
+- (NSArray*) childrenAtCompiledPath:(LibXMLPath*)path;  // All matches in document order
 - (LibXMLNode*) firstDescendantWithName:(NSString*)name;
 - (LibXMLNode*) firstDescendantWithName:(NSString*)name attribute:(NSString*)attribute value:(NSString*)value;
 - (LibXMLNode*) firstChildWithName:(NSString*)name;
@@ -99,3 +132,57 @@ typedef BOOL (*LibXMLNodeSkipFunction)(const unsigned char* name, LibXMLNode* no
 - (NSData*) mergeRawContentFromChildren;
 - (NSString*) extractTextFromMergedHTML;
 @end
+
+typedef enum {
+  kLibXMLCursorEvent_End = 0,
+  kLibXMLCursorEvent_Text,
+  kLibXMLCursorEvent_EnterElement,
+  kLibXMLCursorEvent_ExitElement
+} LibXMLCursorEvent;
+
+// Depth-first cursor over the native descendants of a node that does not allocate any memory
+// All returned pointers are UTF-8 C strings owned by the document and only valid as long as the parser is alive
+typedef struct {
+  void* root;
+  void* node;
+  void* attribute;
+  LibXMLCursorEvent event;
+  BOOL skipChildren;
+} LibXMLCursor;
+
+void LibXMLCursorInitialize(LibXMLCursor* cursor, void* nativeNode);
+LibXMLCursorEvent LibXMLCursorNext(LibXMLCursor* cursor);
+void LibXMLCursorSkipChildren(LibXMLCursor* cursor);  // Next event is the exit of the element just entered
+void* LibXMLCursorGetNativeNode(const LibXMLCursor* cursor);
+const unsigned char* LibXMLCursorGetName(const LibXMLCursor* cursor);  // NULL for text nodes
+const unsigned char* LibXMLCursorGetContent(const LibXMLCursor* cursor);  // NULL for elements
+const unsigned char* LibXMLCursorGetAttribute(const LibXMLCursor* cursor, const unsigned char* name);
+BOOL LibXMLCursorNextAttribute(LibXMLCursor* cursor, const unsigned char** name, const unsigned char** value);  // Restarts on each event
+
+// NSOutputStream that parses the data as it is written e.g. when passed to +[HTTPURLConnection downloadHTTPRequest:toStream:...]
+// If a function is passed, each node matching the path is passed to it as soon as it is complete then freed (see streaming mode above)
+// If the function returns NO, parsing stops and any remaining data written to the stream is ignored
+@interface LibXMLPushParser : NSOutputStream {
+@private
+  void* _xmlContext;
+  BOOL _isHTML;
+  BOOL _enableLogging;
+  BOOL _stopped;
+  NSStreamStatus _status;
+  void* _components;
+  NSUInteger _count;
+  LibXMLNodeStreamFunction _function;
+  void* _context;
+  void* _endElement;
+  void* _endElementNs;
+  id _block;
+  LibXMLParser* _parser;
+  id<NSStreamDelegate> _delegate;
+}
+@property(nonatomic, readonly) LibXMLParser* parser;  // Available after the stream is closed or nil if the document is invalid
+- (id) initWithHTML:(BOOL)isHTML;
+- (id) initWithHTML:(BOOL)isHTML path:(NSString*)path function:(LibXMLNodeStreamFunction)function context:(void*)context;
+#if NS_BLOCKS_AVAILABLE
+- (id) initWithHTML:(BOOL)isHTML path:(NSString*)path usingBlock:(BOOL (^)(LibXMLNode* node))block;
+#endif
+@end
@@ -12,7 +12,14 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#import <pthread.h>
+#if defined(__SSE2__)
+#import <emmintrin.h>
+#elif defined(__ARM_NEON__)
+#import <arm_neon.h>
+#endif
 #import <libxml/HTMLParser.h>
+#import <libxml/xmlreader.h>
 
 #import "LibXMLParser.h"
 #import "SmartDescription.h"
@@ -22,6 +29,24 @@
 #define IS_ELEMENT_NODE(__NODE__) ((__NODE__)->type == XML_ELEMENT_NODE)
 #define IS_VALID_NODE(__NODE__) (IS_TEXT_NODE(__NODE__) || IS_ELEMENT_NODE(__NODE__))
 
+#define kMaxParserContextUses 64  // Recycle contexts regularly as documents share their dictionary
+
+typedef struct {
+  xmlChar* name;
+  xmlChar* attribute;  // NULL if none
+  xmlChar* value;  // NULL if none
+  NSInteger index;  // -1 if none
+} LibXMLPathComponent;
+
+typedef BOOL (*LibXMLPathFunction)(xmlNodePtr node, void* context);  // Return NO to stop evaluation
+
+typedef struct {
+  xmlParserCtxtPtr xmlContext;
+  NSUInteger xmlUses;
+  htmlParserCtxtPtr htmlContext;
+  NSUInteger htmlUses;
+} LibXMLThreadContexts;
+
 @interface LibXMLData : NSData {
 @private
   id _owner;
@@ -35,18 +60,24 @@
 - (id) initWithParser:(LibXMLParser*)parser node:(xmlNodePtr)node;
 @end
 
+@interface LibXMLPath ()
+- (void) _applyToNode:(xmlNodePtr)root function:(LibXMLPathFunction)function context:(void*)context;
+@end
+
 @interface LibXMLParser ()
 - (id) initWithUTF8Data:(NSData*)data isHTML:(BOOL)flag;
+- (id) initWithDocument:(xmlDocPtr)document;
 @end
 
 static LogLevel _xmlLogLevel = kLogLevel_Debug;
+static pthread_key_t _contextsKey;
 
-static inline BOOL _IsNodeMatchingName(xmlNodePtr node, const xmlChar* name) {
-  if (node->name) {
-    int length = node->ns && node->ns->prefix ? xmlUTF8Strlen(node->ns->prefix) : 0;
+static inline BOOL _IsMatchingName(const xmlChar* prefix, const xmlChar* localName, const xmlChar* name) {
+  if (localName) {
+    int length = prefix ? xmlUTF8Strlen(prefix) : 0;
     if (length) {
       if (*name != kLibXMLSeparator_Namespace) {
-        if (xmlStrncmp(node->ns->prefix, name, length)) {
+        if (xmlStrncmp(prefix, name, length)) {
           return NO;
         }
         name += length;
@@ -58,11 +89,15 @@ static inline BOOL _IsNodeMatchingName(xmlNodePtr node, const xmlChar* name) {
     } else if (*name == kLibXMLSeparator_Namespace) {
       name += 1;
     }
-    return !xmlStrcmp(node->name, name);
+    return !xmlStrcmp(localName, name);
   }
   return NO;
 }
 
+static inline BOOL _IsNodeMatchingName(xmlNodePtr node, const xmlChar* name) {
+  return _IsMatchingName(node->ns ? node->ns->prefix : NULL, node->name, name);
+}
+
 static xmlNodePtr _ChildWithNameAndAttribute(xmlNodePtr child, const xmlChar* name, const xmlChar* attribute, const xmlChar* value) {
   while (child) {
     // Check if the name matches if specified
@@ -120,77 +155,347 @@ static xmlNodePtr _FirstNodeWithNameAndAttribute(xmlNodePtr root, const xmlChar*
   return node;
 }
 
-// TODO: Add support for element index with '#'
-static xmlNodePtr _FirstNodeAtPath(xmlNodePtr root, const xmlChar* path) {
-  if (path) {
-    const xmlChar* componentStart = path;
-    const xmlChar* componentEnd = path;
-    while (*componentEnd) {
-      // Scan until next component separator (:)
-      while (*componentEnd && (*componentEnd != kLibXMLSeparator_Path)) {
-        ++componentEnd;
+static inline xmlChar* _CopyPathString(const xmlChar* start, const xmlChar* end, xmlChar** buffer, xmlDictPtr dict) {
+  if (dict) {
+    return (xmlChar*)xmlDictLookup(dict, start, (int)(end - start));
+  }
+  xmlChar* string = *buffer;
+  memcpy(string, start, end - start);
+  string[end - start] = 0;
+  *buffer += end - start + 1;
+  return string;
+}
+
+// Returns the number of components in the path or 0 if empty
+static NSUInteger _CountPathComponents(const xmlChar* path) {
+  if (!path || !*path) {
+    return 0;
+  }
+  NSUInteger count = 1;
+  for (const xmlChar* bytes = path; *bytes; ++bytes) {
+    if (*bytes == kLibXMLSeparator_Path) {
+      ++count;
+    }
+  }
+  return count;
+}
+
+// Size of the buffer required by _ParsePathComponents() to hold the component strings (including terminating NULs)
+static inline size_t _PathBufferSize(const xmlChar* path, NSUInteger count) {
+  return xmlStrlen(path) + 3 * count;
+}
+
+// Splits a non-empty path into its components, copying the strings into the buffer or interning them in the dictionary if not NULL
+static void _ParsePathComponents(const xmlChar* path, LibXMLPathComponent* components, xmlChar* buffer, xmlDictPtr dict) {
+  const xmlChar* componentStart = path;
+  while (1) {
+    const xmlChar* componentEnd = componentStart;
+    while (*componentEnd && (*componentEnd != kLibXMLSeparator_Path)) {
+      ++componentEnd;
+    }
+    LibXMLPathComponent* component = components++;
+    component->name = NULL;
+    component->attribute = NULL;
+    component->value = NULL;
+    component->index = -1;
+    
+    const xmlChar* attributeSeparator = componentStart;
+    while ((attributeSeparator != componentEnd) && (*attributeSeparator != kLibXMLSeparator_Attribute)) {
+      ++attributeSeparator;
+    }
+    const xmlChar* valueSeparator = attributeSeparator;
+    while ((valueSeparator != componentEnd) && (*valueSeparator != kLibXMLSeparator_Value)) {
+      ++valueSeparator;
+    }
+    
+    // Extract trailing element index if any (#) but never from the start of an attribute value e.g. "id=#1"
+    const xmlChar* contentEnd = componentEnd;
+    const xmlChar* indexStart = componentEnd;
+    while ((indexStart > componentStart) && (indexStart[-1] >= '0') && (indexStart[-1] <= '9')) {
+      --indexStart;
+    }
+    const xmlChar* contentStart = valueSeparator != componentEnd ? valueSeparator + 1 : componentStart;
+    if ((indexStart != componentEnd) && (indexStart - 1 > contentStart) && (indexStart[-1] == kLibXMLSeparator_Index)) {
+      component->index = 0;
+      for (const xmlChar* bytes = indexStart; bytes != componentEnd; ++bytes) {
+        component->index = 10 * component->index + (*bytes - '0');
       }
-      
-      // Find attribute separator inside component if any (|)
-      const xmlChar* attributeSeparator = componentStart;
-      while ((attributeSeparator != componentEnd) && (*attributeSeparator != kLibXMLSeparator_Attribute)) {
-        ++attributeSeparator;
+      contentEnd = indexStart - 1;
+    }
+    
+    if ((attributeSeparator != componentEnd) && (valueSeparator != componentEnd)) {
+      component->name = _CopyPathString(componentStart, attributeSeparator, &buffer, dict);
+      if (valueSeparator > attributeSeparator + 1) {
+        component->attribute = _CopyPathString(attributeSeparator + 1, valueSeparator, &buffer, dict);
+        if (contentEnd > valueSeparator + 1) {
+          component->value = _CopyPathString(valueSeparator + 1, contentEnd, &buffer, dict);
+        }
       }
-      if (attributeSeparator == componentEnd) {
-        attributeSeparator = NULL;
+    } else {
+      component->name = _CopyPathString(componentStart, contentEnd, &buffer, dict);
+    }
+    if (*componentEnd != kLibXMLSeparator_Path) {
+      break;
+    }
+    componentStart = componentEnd + 1;
+  }
+}
+
+// Allocates the components and their strings as a single block to be released with free()
+static LibXMLPathComponent* _CreatePathComponents(const xmlChar* path, NSUInteger* count, xmlDictPtr dict) {
+  *count = _CountPathComponents(path);
+  if (*count == 0) {
+    return NULL;
+  }
+  size_t size = *count * sizeof(LibXMLPathComponent);
+  LibXMLPathComponent* components = malloc(size + (dict ? 0 : _PathBufferSize(path, *count)));
+  _ParsePathComponents(path, components, (xmlChar*)components + size, dict);
+  return components;
+}
+
+static BOOL _IsReaderMatchingComponent(xmlTextReaderPtr reader, const LibXMLPathComponent* component) {
+  if (!_IsMatchingName(xmlTextReaderConstPrefix(reader), xmlTextReaderConstLocalName(reader), component->name)) {
+    return NO;
+  }
+  if (component->attribute) {
+    xmlChar* value = xmlTextReaderGetAttribute(reader, component->attribute);
+    BOOL match = component->value ? (value && !xmlStrcmp(value, component->value)) : (value == NULL);
+    xmlFree(value);
+    return match;
+  }
+  return YES;
+}
+
+static BOOL _IsNodeMatchingComponent(xmlNodePtr node, const LibXMLPathComponent* component) {
+  if (!IS_VALID_NODE(node) || !_IsNodeMatchingName(node, component->name)) {  // Text nodes match the name "text"
+    return NO;
+  }
+  if (component->attribute) {
+    xmlAttrPtr property = node->properties;
+    while (property) {
+      if (property->children && !property->children->next && !xmlStrcmp(property->name, component->attribute)) {
+        return component->value && !xmlStrcmp(property->children->content, component->value);
       }
-      
-      // Find value separator inside component if any (=)
-      const xmlChar* valueSeparator = attributeSeparator;
-      if (valueSeparator) {
-        while ((valueSeparator != componentEnd) && (*valueSeparator != kLibXMLSeparator_Value)) {
-          ++valueSeparator;
+      property = property->next;
+    }
+    return component->value ? NO : YES;
+  }
+  return YES;
+}
+
+// Checks the node and its ancestors up to the document match all the path components
+static BOOL _IsNodeMatchingPathComponents(xmlNodePtr node, const LibXMLPathComponent* components, NSUInteger count) {
+  for (NSUInteger i = count; i > 0; --i) {
+    if (!node || !_IsNodeMatchingComponent(node, &components[i - 1])) {
+      return NO;
+    }
+    node = node->parent;
+  }
+  return node && ((node->type == XML_DOCUMENT_NODE) || (node->type == XML_HTML_DOCUMENT_NODE));
+}
+
+// Calls the function on all the descendants of the root matching the path components in document order
+static BOOL _ApplyPathComponents(xmlNodePtr root, const LibXMLPathComponent* components, NSUInteger count,
+                                 LibXMLPathFunction function, void* context) {
+  NSInteger index = 0;
+  for (xmlNodePtr child = root->children; child; child = child->next) {
+    if (_IsNodeMatchingComponent(child, components)) {
+      if ((components->index < 0) || (index++ == components->index)) {
+        if (count > 1) {
+          if (!_ApplyPathComponents(child, components + 1, count - 1, function, context)) {
+            return NO;
+          }
+        } else if (!(*function)(child, context)) {
+          return NO;
         }
-        if (valueSeparator == componentEnd) {
-          valueSeparator = NULL;
+        if (components->index >= 0) {
+          break;
         }
       }
-      
-      // Extract name
-      const xmlChar* nameStart = componentStart;
-      const xmlChar* nameEnd = attributeSeparator && valueSeparator ? attributeSeparator : componentEnd;
-      xmlChar name[nameEnd - nameStart + 1];
-      bcopy(nameStart, name, nameEnd - nameStart);
-      name[nameEnd - nameStart] = 0;
-      
-      // Extract attribute
-      const xmlChar* attributeStart = attributeSeparator && valueSeparator ? attributeSeparator + 1 : NULL;
-      const xmlChar* attributeEnd = attributeSeparator && valueSeparator ? valueSeparator : NULL;
-      xmlChar attribute[attributeEnd - attributeStart + 1];
-      bcopy(attributeStart, attribute, attributeEnd - attributeStart);
-      attribute[attributeEnd - attributeStart] = 0;
-      
-      // Extract value
-      const xmlChar* valueStart = attributeSeparator && valueSeparator ? valueSeparator + 1 : NULL;
-      const xmlChar* valueEnd = attributeSeparator && valueSeparator ? componentEnd : NULL;
-      xmlChar value[valueEnd - valueStart + 1];
-      bcopy(valueStart, value, valueEnd - valueStart);
-      value[valueEnd - valueStart] = 0;
-      
-      // Look for matching child
-      xmlNodePtr node = _ChildWithNameAndAttribute(root->children, name, attribute[0] ? attribute : NULL, value[0] ? value : NULL);
-      if (node == NULL) {
-        break;
-      }
-      
-      // Check if at end or skip component separator
-      if (*componentEnd == kLibXMLSeparator_Path) {
-        ++componentEnd;
-        componentStart = componentEnd;
-        root = node;
+    }
+  }
+  return YES;
+}
+
+static BOOL _FirstNodeFunction(xmlNodePtr node, void* context) {
+  *(xmlNodePtr*)context = node;
+  return NO;
+}
+
+static BOOL _AllNodesFunction(xmlNodePtr node, void* context) {
+  void** params = (void**)context;
+  LibXMLNode* wrapper = [[LibXMLNode alloc] initWithParser:params[1] node:node];
+  [(NSMutableArray*)params[0] addObject:wrapper];
+  [wrapper release];
+  return YES;
+}
+
+static xmlNodePtr _FirstNodeAtPath(xmlNodePtr root, const xmlChar* path) {
+  xmlNodePtr node = NULL;
+  NSUInteger count = _CountPathComponents(path);
+  if (count) {
+    LibXMLPathComponent components[count];
+    xmlChar buffer[_PathBufferSize(path, count)];
+    _ParsePathComponents(path, components, buffer, NULL);
+    _ApplyPathComponents(root, components, count, _FirstNodeFunction, &node);
+  }
+  return node;
+}
+
+static NSArray* _AllNodesAtPath(xmlNodePtr root, LibXMLPath* path, LibXMLParser* parser) {
+  NSMutableArray* array = [NSMutableArray array];
+  void* params[] = {array, parser};
+  [path _applyToNode:root function:_AllNodesFunction context:params];
+  return array;
+}
+
+void LibXMLCursorInitialize(LibXMLCursor* cursor, void* nativeNode) {
+  cursor->root = nativeNode;
+  cursor->node = NULL;
+  cursor->attribute = NULL;
+  cursor->event = kLibXMLCursorEvent_End;
+  cursor->skipChildren = NO;
+}
+
+static inline xmlNodePtr _NextValidNode(xmlNodePtr node) {
+  while (node && !IS_VALID_NODE(node)) {
+    node = node->next;
+  }
+  return node;
+}
+
+LibXMLCursorEvent LibXMLCursorNext(LibXMLCursor* cursor) {
+  xmlNodePtr node = cursor->node;
+  if (node == NULL) {
+    node = cursor->root ? _NextValidNode(((xmlNodePtr)cursor->root)->children) : NULL;
+  } else if (cursor->event == kLibXMLCursorEvent_EnterElement) {
+    xmlNodePtr child = cursor->skipChildren ? NULL : _NextValidNode(node->children);
+    cursor->skipChildren = NO;
+    if (child) {
+      node = child;
+    } else {
+      cursor->event = kLibXMLCursorEvent_ExitElement;
+      cursor->attribute = NULL;
+      return cursor->event;
+    }
+  } else if (cursor->event != kLibXMLCursorEvent_End) {
+    xmlNodePtr sibling = _NextValidNode(node->next);
+    if (sibling) {
+      node = sibling;
+    } else {
+      node = node->parent;
+      if (node == cursor->root) {
+        node = NULL;
       } else {
-        return node;
+        cursor->node = node;
+        cursor->event = kLibXMLCursorEvent_ExitElement;
+        cursor->attribute = NULL;
+        return cursor->event;
+      }
+    }
+  }
+  cursor->node = node;
+  cursor->attribute = NULL;
+  if (node == NULL) {
+    cursor->root = NULL;  // Make sure the cursor stays at the end
+    cursor->event = kLibXMLCursorEvent_End;
+  } else {
+    cursor->event = IS_TEXT_NODE(node) ? kLibXMLCursorEvent_Text : kLibXMLCursorEvent_EnterElement;
+  }
+  return cursor->event;
+}
+
+void LibXMLCursorSkipChildren(LibXMLCursor* cursor) {
+  if (cursor->event == kLibXMLCursorEvent_EnterElement) {
+    cursor->skipChildren = YES;
+  }
+}
+
+void* LibXMLCursorGetNativeNode(const LibXMLCursor* cursor) {
+  return cursor->node;
+}
+
+const unsigned char* LibXMLCursorGetName(const LibXMLCursor* cursor) {
+  xmlNodePtr node = cursor->node;
+  return node && IS_ELEMENT_NODE(node) ? node->name : NULL;
+}
+
+const unsigned char* LibXMLCursorGetContent(const LibXMLCursor* cursor) {
+  xmlNodePtr node = cursor->node;
+  return node && IS_TEXT_NODE(node) ? node->content : NULL;
+}
+
+const unsigned char* LibXMLCursorGetAttribute(const LibXMLCursor* cursor, const unsigned char* name) {
+  xmlNodePtr node = cursor->node;
+  if (node && IS_ELEMENT_NODE(node)) {
+    for (xmlAttrPtr property = node->properties; property; property = property->next) {
+      if (property->children && !property->children->next && !xmlStrcmp(property->name, name)) {
+        return property->children->content;
       }
     }
   }
   return NULL;
 }
 
+BOOL LibXMLCursorNextAttribute(LibXMLCursor* cursor, const unsigned char** name, const unsigned char** value) {
+  xmlNodePtr node = cursor->node;
+  if (!node || !IS_ELEMENT_NODE(node)) {
+    return NO;
+  }
+  xmlAttrPtr property = cursor->attribute ? ((xmlAttrPtr)cursor->attribute)->next : node->properties;
+  while (property && (!property->children || property->children->next)) {
+    property = property->next;
+  }
+  cursor->attribute = property;
+  if (property == NULL) {
+    return NO;
+  }
+  *name = property->name;
+  *value = property->children->content;
+  return YES;
+}
+
+@implementation LibXMLPath
+
+@synthesize string=_string;
+
++ (LibXMLPath*) pathWithString:(NSString*)string {
+  return [[[LibXMLPath alloc] initWithString:string] autorelease];
+}
+
+- (id) initWithString:(NSString*)string {
+  if ((self = [super init])) {
+    _string = [string copy];
+    _dict = xmlDictCreate();
+    _components = _CreatePathComponents((const xmlChar*)[_string UTF8String], &_count, _dict);
+    if (_components == NULL) {
+      [self release];
+      return nil;
+    }
+  }
+  return self;
+}
+
+- (void) dealloc {
+  free(_components);  // Strings are owned by the dictionary
+  if (_dict) {
+    xmlDictFree(_dict);
+  }
+  [_string release];
+  
+  [super dealloc];
+}
+
+- (void) _applyToNode:(xmlNodePtr)root function:(LibXMLPathFunction)function context:(void*)context {
+  _ApplyPathComponents(root, _components, _count, function, context);
+}
+
+- (NSString*) description {
+  return _string;
+}
+
+@end
+
 @implementation LibXMLData
 
 - (id) initWithOwner:(id)owner bytes:(const void*)bytes length:(NSUInteger)length {
@@ -413,6 +718,16 @@ static void _BlockNodeApplierPostFunction(const unsigned char* name, void* conte
   return (node ? [[[LibXMLNode alloc] initWithParser:_parser node:node] autorelease] : nil);
 }
 
+- (LibXMLNode*) firstChildAtCompiledPath:(LibXMLPath*)path {
+  xmlNodePtr node = NULL;
+  [path _applyToNode:_xmlNode function:_FirstNodeFunction context:&node];
+  return (node ? [[[LibXMLNode alloc] initWithParser:_parser node:node] autorelease] : nil);
+}
+
+- (NSArray*) childrenAtCompiledPath:(LibXMLPath*)path {
+  return _AllNodesAtPath(_xmlNode, path, _parser);
+}
+
 - (LibXMLNode*) firstDescendantWithName:(NSString*)name {
   return [self firstDescendantWithName:name attribute:nil value:nil];
 }
@@ -447,20 +762,23 @@ static void _BlockNodeApplierPostFunction(const unsigned char* name, void* conte
   return [[self _copyChildrenWithName:name] autorelease];
 }
 
-static LibXMLNodeApplierPreFunctionState _MergeContentFunction(const unsigned char* name, LibXMLNode* node, void* context) {
-  void** params = (void**)context;
-  NSMutableData* data = params[0];
-  LibXMLNodeSkipFunction skipFunction = params[1];
-  void* skipContext = params[2];
-  if (name) {
-    if (skipFunction && (*skipFunction)(name, node, skipContext)) {
-      return kLibXMLNodeApplierPreFunctionState_Skip;
+// Skip function is only called for elements and requires allocating a temporary LibXMLNode
+static void _MergeContent(LibXMLParser* parser, xmlNodePtr root, NSMutableData* data, LibXMLNodeSkipFunction skipFunction, void* skipContext) {
+  LibXMLCursor cursor;
+  LibXMLCursorInitialize(&cursor, root);
+  LibXMLCursorEvent event;
+  while ((event = LibXMLCursorNext(&cursor))) {
+    if (event == kLibXMLCursorEvent_Text) {
+      const xmlChar* content = LibXMLCursorGetContent(&cursor);
+      [data appendBytes:content length:strlen((const char*)content)];
+    } else if ((event == kLibXMLCursorEvent_EnterElement) && skipFunction) {
+      LibXMLNode* node = [[LibXMLNode alloc] initWithParser:parser node:LibXMLCursorGetNativeNode(&cursor)];
+      if ((*skipFunction)(LibXMLCursorGetName(&cursor), node, skipContext)) {
+        LibXMLCursorSkipChildren(&cursor);
+      }
+      [node release];
     }
-  } else {
-    const xmlChar* content = ((xmlNodePtr)node->_xmlNode)->content;
-    [data appendBytes:content length:strlen((const char*)content)];
   }
-  return kLibXMLNodeApplierPreFunctionState_Continue;
 }
 
 - (NSString*) mergeContentFromChildren:(BOOL)trimTrailingWhitespace {
@@ -471,8 +789,7 @@ static LibXMLNodeApplierPreFunctionState _MergeContentFunction(const unsigned ch
                           skipFunction:(LibXMLNodeSkipFunction)function
                                context:(void*)context {
   NSMutableData* data = [[NSMutableData alloc] init];
-  void* params[] = {data, function, context};
-  _ApplyFunctions(_parser, _xmlNode, _MergeContentFunction, NULL, params);
+  _MergeContent(_parser, _xmlNode, data, function, context);
   const char* bytes = data.bytes;
   NSUInteger length = data.length;
   if (trimTrailingWhitespace) {
@@ -505,95 +822,131 @@ static BOOL _BlockNodeSkipFunction(const unsigned char* name, LibXMLNode* node,
 
 - (NSData*) mergeRawContentFromChildren {
   NSMutableData* data = [[NSMutableData alloc] init];
-  void* params[] = {data, NULL, NULL};
-  _ApplyFunctions(_parser, _xmlNode, _MergeContentFunction, NULL, params);
+  _MergeContent(_parser, _xmlNode, data, NULL, NULL);
   return [data autorelease];
 }
 
-static NSUInteger __CleanUTF8Text(const xmlChar* inBytes, NSUInteger inLength, char* outBytes) {
-  NSUInteger outLength = 0;
-  
-  // Strip whitespace and newlines at the beginning
-  while (inLength && LIBXML_IS_WHITESPACE_OR_NEWLINE(inBytes[0])) {
-    ++inBytes;
-    --inLength;
+typedef struct {
+  char* bytes;
+  NSUInteger length;
+  NSUInteger capacity;
+  char pending;  // Collapsed whitespace not written yet or 0 if none
+} LibXMLTextBuffer;
+
+static inline void _ReserveTextBuffer(LibXMLTextBuffer* buffer, NSUInteger length) {
+  if (buffer->length + length > buffer->capacity) {
+    buffer->capacity = MAX(2 * buffer->capacity, buffer->length + length);
+    buffer->bytes = realloc(buffer->bytes, buffer->capacity);
   }
-  
-  // Strip whitespace and newlines at the end
-  while (inLength && LIBXML_IS_WHITESPACE_OR_NEWLINE(inBytes[inLength - 1])) {
-    --inLength;
+}
+
+// Returns the number of leading bytes that are not whitespace or newlines
+static inline NSUInteger _ScanNonWhitespace(const char* bytes, NSUInteger length) {
+  NSUInteger offset = 0;
+#if defined(__SSE2__)
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+  while (offset + 16 <= length) {
+    __m128i vector = _mm_loadu_si128((const __m128i*)(bytes + offset));
+    __m128i mask = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(vector, space), _mm_cmpeq_epi8(vector, tab)),
+                                _mm_or_si128(_mm_cmpeq_epi8(vector, cr), _mm_cmpeq_epi8(vector, lf)));
+    int bits = _mm_movemask_epi8(mask);
+    if (bits) {
+      return offset + __builtin_ctz(bits);
+    }
+    offset += 16;
   }
-  
-  // Concatenate multiple whitespaces / newlines as a single whitespace or newline
-  while (inLength) {
-    if (LIBXML_IS_WHITESPACE_OR_NEWLINE(*inBytes)) {
-      BOOL hasNewline = LIBXML_IS_NEWLINE(*inBytes);
-      ++inBytes;
-      --inLength;
-      while (inLength) {
-        if (LIBXML_IS_NEWLINE(*inBytes)) {
-          hasNewline = YES;
-        } else if (!LIBXML_IS_WHITESPACE(*inBytes)) {
-          break;
-        }
-        ++inBytes;
-        --inLength;
-      }
-      *outBytes++ = hasNewline ? '\n' : ' ';
-      ++outLength;
-    } else {
-      *outBytes++ = *inBytes++;
-      ++outLength;
-      --inLength;
+#elif defined(__ARM_NEON__)
+  const uint8x16_t space = vdupq_n_u8(' ');
+  const uint8x16_t tab = vdupq_n_u8('\t');
+  const uint8x16_t cr = vdupq_n_u8('\r');
+  const uint8x16_t lf = vdupq_n_u8('\n');
+  while (offset + 16 <= length) {
+    uint8x16_t vector = vld1q_u8((const uint8_t*)(bytes + offset));
+    uint8x16_t mask = vorrq_u8(vorrq_u8(vceqq_u8(vector, space), vceqq_u8(vector, tab)),
+                               vorrq_u8(vceqq_u8(vector, cr), vceqq_u8(vector, lf)));
+    uint64x2_t bits = vreinterpretq_u64_u8(mask);
+    if (vgetq_lane_u64(bits, 0) | vgetq_lane_u64(bits, 1)) {
+      break;  // Locate the whitespace in the scalar loop below
     }
+    offset += 16;
   }
-  
-  return outLength;
+#endif
+  while ((offset < length) && !LIBXML_IS_WHITESPACE_OR_NEWLINE(bytes[offset])) {
+    ++offset;
+  }
+  return offset;
 }
 
-static LibXMLNodeApplierPreFunctionState _ExtractTextPreFunction(const unsigned char* name, LibXMLNode* node, void* context) {
-  NSMutableData* data = (NSMutableData*)context;
-  if (name) {
-    // Convert <br> to newlines
-    if (!strcmp((char*)name, "br")) {
-      char newline = '\n';
-      [data appendBytes:&newline length:1];
+// Concatenates multiple whitespaces / newlines as a single whitespace or newline and strips them at the beginning
+static void _AppendCleanText(LibXMLTextBuffer* buffer, const char* bytes, NSUInteger length) {
+  while (length) {
+    NSUInteger count = _ScanNonWhitespace(bytes, length);
+    if (count) {
+      _ReserveTextBuffer(buffer, count + 1);
+      if (buffer->pending && buffer->length) {
+        buffer->bytes[buffer->length++] = buffer->pending;
+      }
+      buffer->pending = 0;
+      bcopy(bytes, buffer->bytes + buffer->length, count);
+      buffer->length += count;
+      bytes += count;
+      length -= count;
+    }
+    while (length && LIBXML_IS_WHITESPACE_OR_NEWLINE(*bytes)) {
+      if (LIBXML_IS_NEWLINE(*bytes)) {
+        buffer->pending = '\n';
+      } else if (!buffer->pending) {
+        buffer->pending = ' ';
+      }
+      ++bytes;
+      --length;
     }
-  } else {
-    const xmlChar* contentBytes = ((xmlNodePtr)node->_xmlNode)->content;
-    NSUInteger contentLength = strlen((const char*)contentBytes);
-    NSUInteger oldLength = data.length;
-    [data setLength:(oldLength + contentLength)];
-    bcopy(contentBytes, (char*)data.bytes + oldLength, contentLength);
   }
-  return kLibXMLNodeApplierPreFunctionState_Continue;
 }
 
-static void _ExtractTextPostFunction(const unsigned char* name, void* context) {
-  NSMutableData* data = (NSMutableData*)context;
-  if (name) {
-    // Convert <p> and <tr> to newlines
-    if (!strcmp((char*)name, "p") || !strcmp((char*)name, "tr")) {
-      char newline = '\n';
-      [data appendBytes:&newline length:1];
-    }
-    // Convert <td> to spaces
-    else if (!strcmp((char*)name, "td")) {
-      char space = ' ';
-      [data appendBytes:&space length:1];
+// Single pass over the tree writing directly the cleaned up text (trailing whitespace is stripped by never flushing it)
+static void _ExtractText(xmlNodePtr root, LibXMLTextBuffer* buffer) {
+  LibXMLCursor cursor;
+  LibXMLCursorInitialize(&cursor, root);
+  LibXMLCursorEvent event;
+  while ((event = LibXMLCursorNext(&cursor))) {
+    const char* name = (const char*)LibXMLCursorGetName(&cursor);
+    if (event == kLibXMLCursorEvent_Text) {
+      const char* content = (const char*)LibXMLCursorGetContent(&cursor);
+      _AppendCleanText(buffer, content, strlen(content));
+    } else if (event == kLibXMLCursorEvent_EnterElement) {
+      // Skip scripts and styles
+      if (!strcmp(name, "script") || !strcmp(name, "style")) {
+        LibXMLCursorSkipChildren(&cursor);
+      }
+      // Convert <br> to newlines
+      else if (!strcmp(name, "br")) {
+        _AppendCleanText(buffer, "\n", 1);
+      }
+    } else {
+      // Convert <p> and <tr> to newlines
+      if (!strcmp(name, "p") || !strcmp(name, "tr")) {
+        _AppendCleanText(buffer, "\n", 1);
+      }
+      // Convert <td> to spaces
+      else if (!strcmp(name, "td")) {
+        _AppendCleanText(buffer, " ", 1);
+      }
     }
   }
 }
 
 - (NSString*) extractTextFromMergedHTML {
-  NSMutableData* rawData = [[NSMutableData alloc] init];
-  _ApplyFunctions(_parser, _xmlNode, _ExtractTextPreFunction, _ExtractTextPostFunction, rawData);
-  NSMutableData* cleanData = [[NSMutableData alloc] initWithLength:rawData.length];
-  NSUInteger length = __CleanUTF8Text(rawData.mutableBytes, rawData.length, cleanData.mutableBytes);
-  [cleanData setLength:length];
-  NSString* string = [[NSString alloc] initWithData:cleanData encoding:NSUTF8StringEncoding];
-  [cleanData release];
-  [rawData release];
+  LibXMLTextBuffer buffer = {NULL, 0, 0, 0};
+  _ReserveTextBuffer(&buffer, 4096);
+  _ExtractText(_xmlNode, &buffer);
+  NSString* string = [[NSString alloc] initWithBytesNoCopy:buffer.bytes length:buffer.length encoding:NSUTF8StringEncoding freeWhenDone:YES];
+  if (string == nil) {
+    free(buffer.bytes);  // Not freed on failure
+  }
   return [string autorelease];
 }
 
@@ -665,6 +1018,30 @@ static void _xmlErrorHandler(void* ctx, const char* msg, ...) {
   va_end(args);
 }
 
+static void _xmlReaderErrorHandler(void* arg, const char* msg, xmlParserSeverities severity, xmlTextReaderLocatorPtr locator) {
+  NSString* message = [[NSString alloc] initWithUTF8String:msg];
+  LogMessage(_xmlLogLevel, @"LibXML: %@", [message stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]]);
+  [message release];
+}
+
+static void _FreeThreadContexts(void* data) {
+  LibXMLThreadContexts* contexts = data;
+  if (contexts->htmlContext) {
+    htmlFreeParserCtxt(contexts->htmlContext);
+  }
+  if (contexts->xmlContext) {
+    xmlFreeParserCtxt(contexts->xmlContext);
+  }
+  free(contexts);
+}
+
++ (void) initialize {
+  if (self == [LibXMLParser class]) {
+    xmlInitParser();  // Must be called once before using libxml from multiple threads - +initialize is serialized by the runtime on whichever thread first messages the class
+    pthread_key_create(&_contextsKey, _FreeThreadContexts);
+  }
+}
+
 + (void) setErrorReportingLogLevel:(LogLevel)level {
   _xmlLogLevel = level;
 }
@@ -673,6 +1050,84 @@ static void _xmlErrorHandler(void* ctx, const char* msg, ...) {
   return _xmlLogLevel;
 }
 
+// Elements whose ancestors do not match the path are skipped entirely and matching ones are expanded then freed one at a time
++ (BOOL) _streamWithReader:(xmlTextReaderPtr)reader path:(NSString*)path function:(LibXMLNodeStreamFunction)function context:(void*)context {
+  if (reader == NULL) {
+    return NO;
+  }
+  if (_xmlLogLevel >= LoggingGetMinimumLevel()) {
+    xmlTextReaderSetErrorHandler(reader, _xmlReaderErrorHandler, NULL);  // Unlike xmlSetGenericErrorFunc() this is per-reader
+  }
+  NSUInteger count;
+  LibXMLPathComponent* components = _CreatePathComponents((const xmlChar*)[path UTF8String], &count, NULL);
+  int result = count ? xmlTextReaderRead(reader) : -1;
+  while (result == 1) {
+    if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT) {
+      int depth = xmlTextReaderDepth(reader);
+      if (((NSUInteger)depth < count) && _IsReaderMatchingComponent(reader, &components[depth])) {
+        if ((NSUInteger)depth == count - 1) {
+          xmlNodePtr node = xmlTextReaderExpand(reader);
+          if (node) {
+            NSAutoreleasePool* localPool = [[NSAutoreleasePool alloc] init];
+            LibXMLNode* wrapper = [[LibXMLNode alloc] initWithParser:nil node:node];
+            BOOL success = (*function)(wrapper, context);
+            [wrapper release];
+            [localPool release];
+            if (!success) {
+              result = 0;
+              break;
+            }
+          }
+          result = xmlTextReaderNext(reader);
+          continue;
+        }
+      } else {
+        result = xmlTextReaderNext(reader);
+        continue;
+      }
+    }
+    result = xmlTextReaderRead(reader);
+  }
+  free(components);
+  xmlFreeTextReader(reader);
+  return result == 0 ? YES : NO;
+}
+
++ (int) _streamingOptions {
+  int options = XML_PARSE_NONET | XML_PARSE_RECOVER | XML_PARSE_NOBLANKS | XML_PARSE_COMPACT;
+  if (_xmlLogLevel < LoggingGetMinimumLevel()) {
+    options |= XML_PARSE_NOWARNING | XML_PARSE_NOERROR;
+  }
+  return options;
+}
+
++ (BOOL) streamXMLUTF8Data:(NSData*)data path:(NSString*)path function:(LibXMLNodeStreamFunction)function context:(void*)context {
+  xmlTextReaderPtr reader = xmlReaderForMemory(data.bytes, (int)data.length, NULL, NULL, [self _streamingOptions]);
+  return [self _streamWithReader:reader path:path function:function context:context];
+}
+
++ (BOOL) streamXMLFileAtPath:(NSString*)filePath path:(NSString*)path function:(LibXMLNodeStreamFunction)function context:(void*)context {
+  xmlTextReaderPtr reader = xmlReaderForFile([filePath fileSystemRepresentation], NULL, [self _streamingOptions]);
+  return [self _streamWithReader:reader path:path function:function context:context];
+}
+
+#if NS_BLOCKS_AVAILABLE
+
+static BOOL _BlockNodeStreamFunction(LibXMLNode* node, void* context) {
+  BOOL (^callback)(LibXMLNode* node) = context;
+  return callback(node);
+}
+
++ (BOOL) streamXMLUTF8Data:(NSData*)data path:(NSString*)path usingBlock:(BOOL (^)(LibXMLNode* node))block {
+  return [self streamXMLUTF8Data:data path:path function:_BlockNodeStreamFunction context:block];
+}
+
++ (BOOL) streamXMLFileAtPath:(NSString*)filePath path:(NSString*)path usingBlock:(BOOL (^)(LibXMLNode* node))block {
+  return [self streamXMLFileAtPath:filePath path:path function:_BlockNodeStreamFunction context:block];
+}
+
+#endif
+
 - (id) initWithXMLUTF8Data:(NSData*)data {
   return [self initWithUTF8Data:data isHTML:NO];
 }
@@ -681,29 +1136,74 @@ static void _xmlErrorHandler(void* ctx, const char* msg, ...) {
   return [self initWithUTF8Data:data isHTML:YES];
 }
 
-- (id) initWithUTF8Data:(NSData*)data isHTML:(BOOL)flag {
+- (id) initWithDocument:(xmlDocPtr)document {
   if ((self = [super init])) {
-    if (data) {
-      BOOL enableLogging = _xmlLogLevel >= LoggingGetMinimumLevel() ? YES : NO;
+    _xmlDoc = document;
+    if (!_xmlDoc || !xmlDocGetRootElement(_xmlDoc)) {
+      [self release];
+      return nil;
+    }
+  }
+  return self;
+}
+
+// Parser contexts are reused across documents on the same thread and their error handlers only apply to them
+static xmlDocPtr _ReadDocument(NSData* data, BOOL isHTML) {
+  LibXMLThreadContexts* contexts = pthread_getspecific(_contextsKey);
+  if (contexts == NULL) {
+    contexts = calloc(1, sizeof(LibXMLThreadContexts));
+    pthread_setspecific(_contextsKey, contexts);
+  }
+  BOOL enableLogging = _xmlLogLevel >= LoggingGetMinimumLevel() ? YES : NO;
+  xmlDocPtr document = NULL;
+  if (isHTML) {
+    if (contexts->htmlContext && (contexts->htmlUses >= kMaxParserContextUses)) {
+      htmlFreeParserCtxt(contexts->htmlContext);
+      contexts->htmlContext = NULL;
+    }
+    if (contexts->htmlContext == NULL) {
+      contexts->htmlContext = htmlNewParserCtxt();
+      contexts->htmlUses = 0;
+    }
+    if (contexts->htmlContext) {
+      int options = HTML_PARSE_NONET | HTML_PARSE_RECOVER | HTML_PARSE_NOBLANKS | HTML_PARSE_COMPACT;
       if (enableLogging) {
-        xmlSetGenericErrorFunc(NULL, _xmlErrorHandler);  // Warning: only applies on the current thread
-      }
-      if (flag) {
-        int options = HTML_PARSE_NONET | HTML_PARSE_RECOVER | HTML_PARSE_NOBLANKS | HTML_PARSE_COMPACT;
-        if (!enableLogging) {
-          options |= HTML_PARSE_NOWARNING | HTML_PARSE_NOERROR;
-        }
-        _xmlDoc = htmlReadMemory(data.bytes, data.length, NULL, NULL, options);  // libxml uses UTF-8 by default
+        contexts->htmlContext->sax->error = _xmlErrorHandler;  // Reset by the options if disabled
+        contexts->htmlContext->sax->warning = _xmlErrorHandler;
       } else {
-        int options = XML_PARSE_NONET | XML_PARSE_RECOVER | XML_PARSE_NOBLANKS | XML_PARSE_COMPACT;
-        if (!enableLogging) {
-          options |= XML_PARSE_NOWARNING | XML_PARSE_NOERROR;
-        }
-        _xmlDoc = xmlReadMemory(data.bytes, data.length, NULL, NULL, options);  // libxml uses UTF-8 by default
+        options |= HTML_PARSE_NOWARNING | HTML_PARSE_NOERROR;
       }
+      document = htmlCtxtReadMemory(contexts->htmlContext, data.bytes, (int)data.length, NULL, NULL, options);  // libxml uses UTF-8 by default
+      contexts->htmlUses += 1;
+    }
+  } else {
+    if (contexts->xmlContext && (contexts->xmlUses >= kMaxParserContextUses)) {
+      xmlFreeParserCtxt(contexts->xmlContext);
+      contexts->xmlContext = NULL;
+    }
+    if (contexts->xmlContext == NULL) {
+      contexts->xmlContext = xmlNewParserCtxt();
+      contexts->xmlUses = 0;
+    }
+    if (contexts->xmlContext) {
+      int options = XML_PARSE_NONET | XML_PARSE_RECOVER | XML_PARSE_NOBLANKS | XML_PARSE_COMPACT;
       if (enableLogging) {
-        xmlSetGenericErrorFunc(NULL, NULL);
+        contexts->xmlContext->sax->error = _xmlErrorHandler;  // Reset by the options if disabled
+        contexts->xmlContext->sax->warning = _xmlErrorHandler;
+      } else {
+        options |= XML_PARSE_NOWARNING | XML_PARSE_NOERROR;
       }
+      document = xmlCtxtReadMemory(contexts->xmlContext, data.bytes, (int)data.length, NULL, NULL, options);  // libxml uses UTF-8 by default
+      contexts->xmlUses += 1;
+    }
+  }
+  return document;
+}
+
+- (id) initWithUTF8Data:(NSData*)data isHTML:(BOOL)flag {
+  if ((self = [super init])) {
+    if (data) {
+      _xmlDoc = _ReadDocument(data, flag);
     }
     if (!_xmlDoc || !xmlDocGetRootElement(_xmlDoc)) {
       [self release];
@@ -713,6 +1213,59 @@ static void _xmlErrorHandler(void* ctx, const char* msg, ...) {
   return self;
 }
 
+typedef id (*LibXMLParseFunction)(NSData* data);  // Returns an autoreleased result or nil
+
+static void _ParseDocumentFunction(void* context, size_t index) {
+  void** params = (void**)context;
+  NSArray* array = params[0];
+  LibXMLParseFunction function = params[1];
+  id* results = params[2];
+  NSAutoreleasePool* localPool = [[NSAutoreleasePool alloc] init];
+  results[index] = [(*function)([array objectAtIndex:index]) retain];
+  [localPool release];
+}
+
+static NSArray* _ParseDocumentsConcurrently(NSArray* array, LibXMLParseFunction function) {
+  size_t count = array.count;
+  id* results = calloc(count, sizeof(id));
+  void* params[] = {array, function, results};
+  dispatch_apply_f(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), params, _ParseDocumentFunction);
+  for (size_t i = 0; i < count; ++i) {
+    if (results[i] == nil) {
+      results[i] = [[NSNull null] retain];
+    }
+  }
+  NSArray* objects = [NSArray arrayWithObjects:results count:count];
+  for (size_t i = 0; i < count; ++i) {
+    [results[i] release];
+  }
+  free(results);
+  return objects;
+}
+
+static id _ParseXMLFunction(NSData* data) {
+  return [[[LibXMLParser alloc] initWithUTF8Data:data isHTML:NO] autorelease];
+}
+
+static id _ParseHTMLFunction(NSData* data) {
+  return [[[LibXMLParser alloc] initWithUTF8Data:data isHTML:YES] autorelease];
+}
+
+static id _ExtractHTMLTextFunction(NSData* data) {
+  LibXMLParser* parser = [[LibXMLParser alloc] initWithUTF8Data:data isHTML:YES];
+  NSString* text = [parser.rootNode extractTextFromMergedHTML];
+  [parser release];
+  return text;
+}
+
++ (NSArray*) parsersWithUTF8DataArray:(NSArray*)array isHTML:(BOOL)isHTML {
+  return _ParseDocumentsConcurrently(array, isHTML ? _ParseHTMLFunction : _ParseXMLFunction);
+}
+
++ (NSArray*) textFromHTMLUTF8DataArray:(NSArray*)array {
+  return _ParseDocumentsConcurrently(array, _ExtractHTMLTextFunction);
+}
+
 - (void) dealloc {
   if (_xmlDoc) {
     xmlFreeDoc(_xmlDoc);
@@ -730,6 +1283,16 @@ static void _xmlErrorHandler(void* ctx, const char* msg, ...) {
   return (node ? [[[LibXMLNode alloc] initWithParser:self node:node] autorelease] : nil);
 }
 
+- (LibXMLNode*) firstChildAtCompiledPath:(LibXMLPath*)path {
+  xmlNodePtr node = NULL;
+  [path _applyToNode:_xmlDoc function:_FirstNodeFunction context:&node];
+  return (node ? [[[LibXMLNode alloc] initWithParser:self node:node] autorelease] : nil);
+}
+
+- (NSArray*) childrenAtCompiledPath:(LibXMLPath*)path {
+  return _AllNodesAtPath(_xmlDoc, path, self);
+}
+
 - (LibXMLNode*) firstDescendantWithName:(NSString*)name attribute:(NSString*)attribute value:(NSString*)value {
   xmlNodePtr node = _FirstNodeWithNameAndAttribute(_xmlDoc, (const xmlChar*)[name UTF8String],
                                                    (const xmlChar*)[attribute UTF8String], (const xmlChar*)[value UTF8String]);
@@ -741,3 +1304,208 @@ static void _xmlErrorHandler(void* ctx, const char* msg, ...) {
 }
 
 @end
+
+@implementation LibXMLPushParser
+
+static void _EndElement(LibXMLPushParser* parser, xmlParserCtxtPtr context) {
+  xmlNodePtr node = context->node;  // Still points to the element being closed
+  if (parser->_isHTML) {
+    ((endElementSAXFunc)parser->_endElement)(context, node ? node->name : NULL);
+  } else {
+    ((endElementNsSAX2Func)parser->_endElementNs)(context, node ? node->name : NULL, node && node->ns ? node->ns->prefix : NULL,
+                                                  node && node->ns ? node->ns->href : NULL);
+  }
+  if (node && !parser->_stopped && _IsNodeMatchingPathComponents(node, parser->_components, parser->_count)) {
+    NSAutoreleasePool* localPool = [[NSAutoreleasePool alloc] init];
+    LibXMLNode* wrapper = [[LibXMLNode alloc] initWithParser:nil node:node];
+    if (!(*parser->_function)(wrapper, parser->_context)) {
+      parser->_stopped = YES;
+      xmlStopParser(context);
+    }
+    [wrapper release];
+    [localPool release];
+    xmlUnlinkNode(node);  // Only keep in memory the nodes not passed to the function
+    xmlFreeNode(node);
+  }
+}
+
+static void _EndElementSAX(void* ctx, const xmlChar* name) {
+  xmlParserCtxtPtr context = ctx;
+  _EndElement(context->_private, context);
+}
+
+static void _EndElementNsSAX2(void* ctx, const xmlChar* localname, const xmlChar* prefix, const xmlChar* URI) {
+  xmlParserCtxtPtr context = ctx;
+  _EndElement(context->_private, context);
+}
+
+- (id) initWithHTML:(BOOL)isHTML {
+  return [self initWithHTML:isHTML path:nil function:NULL context:NULL];
+}
+
+- (id) initWithHTML:(BOOL)isHTML path:(NSString*)path function:(LibXMLNodeStreamFunction)function context:(void*)context {
+  if ((self = [super init])) {
+    _isHTML = isHTML;
+    _enableLogging = _xmlLogLevel >= LoggingGetMinimumLevel() ? YES : NO;
+    xmlParserCtxtPtr parserContext;
+    if (_isHTML) {
+      int options = HTML_PARSE_NONET | HTML_PARSE_RECOVER | HTML_PARSE_NOBLANKS | HTML_PARSE_COMPACT;
+      if (!_enableLogging) {
+        options |= HTML_PARSE_NOWARNING | HTML_PARSE_NOERROR;
+      }
+      parserContext = htmlCreatePushParserCtxt(NULL, NULL, NULL, 0, NULL, XML_CHAR_ENCODING_UTF8);
+      if (parserContext) {
+        htmlCtxtUseOptions(parserContext, options);
+        if (_enableLogging) {
+          parserContext->sax->error = _xmlErrorHandler;  // Per-context unlike xmlSetGenericErrorFunc()
+          parserContext->sax->warning = _xmlErrorHandler;
+        }
+      }
+    } else {
+      int options = XML_PARSE_NONET | XML_PARSE_RECOVER | XML_PARSE_NOBLANKS | XML_PARSE_COMPACT;
+      if (!_enableLogging) {
+        options |= XML_PARSE_NOWARNING | XML_PARSE_NOERROR;
+      }
+      parserContext = xmlCreatePushParserCtxt(NULL, NULL, NULL, 0, NULL);
+      if (parserContext) {
+        xmlCtxtUseOptions(parserContext, options);
+        if (_enableLogging) {
+          parserContext->sax->error = _xmlErrorHandler;  // Per-context unlike xmlSetGenericErrorFunc()
+          parserContext->sax->warning = _xmlErrorHandler;
+        }
+      }
+    }
+    if (parserContext == NULL) {
+      [self release];
+      return nil;
+    }
+    _xmlContext = parserContext;
+    if (function) {
+      _components = _CreatePathComponents((const xmlChar*)[path UTF8String], &_count, NULL);
+      _function = function;
+      _context = context;
+      parserContext->_private = self;
+      _endElement = parserContext->sax->endElement;  // Each parser context has its own copy of the SAX handler
+      _endElementNs = parserContext->sax->endElementNs;
+      if (_isHTML) {
+        parserContext->sax->endElement = _EndElementSAX;
+      } else {
+        parserContext->sax->endElementNs = _EndElementNsSAX2;
+      }
+    }
+  }
+  return self;
+}
+
+- (void) dealloc {
+  if (_xmlContext) {
+    xmlParserCtxtPtr parserContext = _xmlContext;
+    if (parserContext->myDoc) {
+      xmlFreeDoc(parserContext->myDoc);
+    }
+    if (_isHTML) {
+      htmlFreeParserCtxt(parserContext);
+    } else {
+      xmlFreeParserCtxt(parserContext);
+    }
+  }
+  if (_components) {
+    free(_components);
+  }
+#if NS_BLOCKS_AVAILABLE
+  [_block release];
+#endif
+  [_parser release];
+  
+  [super dealloc];
+}
+
+#if NS_BLOCKS_AVAILABLE
+
+- (id) initWithHTML:(BOOL)isHTML path:(NSString*)path usingBlock:(BOOL (^)(LibXMLNode* node))block {
+  block = [block copy];  // The block must outlive this call
+  if ((self = [self initWithHTML:isHTML path:path function:_BlockNodeStreamFunction context:block])) {
+    _block = block;
+  } else {
+    [block release];
+  }
+  return self;
+}
+
+#endif
+
+- (void) _parseBytes:(const uint8_t*)buffer length:(NSUInteger)length terminate:(BOOL)terminate {
+  if (_isHTML) {
+    htmlParseChunk(_xmlContext, (const char*)buffer, (int)length, terminate);
+  } else {
+    xmlParseChunk(_xmlContext, (const char*)buffer, (int)length, terminate);
+  }
+}
+
+- (void) open {
+  if (_status == NSStreamStatusNotOpen) {
+    _status = NSStreamStatusOpen;
+  }
+}
+
+- (NSInteger) write:(const uint8_t*)buffer maxLength:(NSUInteger)length {
+  if (_status != NSStreamStatusOpen) {
+    return -1;
+  }
+  if (!_stopped) {
+    [self _parseBytes:buffer length:length terminate:NO];
+  }
+  return length;
+}
+
+- (BOOL) hasSpaceAvailable {
+  return _status == NSStreamStatusOpen ? YES : NO;
+}
+
+- (void) close {
+  if (_status == NSStreamStatusOpen) {
+    if (!_stopped) {
+      [self _parseBytes:NULL length:0 terminate:YES];
+    }
+    xmlParserCtxtPtr parserContext = _xmlContext;
+    _parser = [[LibXMLParser alloc] initWithDocument:parserContext->myDoc];  // Takes ownership of the document
+    parserContext->myDoc = NULL;
+    _status = NSStreamStatusClosed;
+  }
+}
+
+- (NSStreamStatus) streamStatus {
+  return _status;
+}
+
+- (NSError*) streamError {
+  return nil;
+}
+
+- (id<NSStreamDelegate>) delegate {
+  return _delegate;
+}
+
+- (void) setDelegate:(id<NSStreamDelegate>)delegate {
+  _delegate = delegate;  // Not retained like for other streams
+}
+
+- (id) propertyForKey:(NSString*)key {
+  return nil;
+}
+
+- (BOOL) setProperty:(id)property forKey:(NSString*)key {
+  return NO;
+}
+
+- (void) scheduleInRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode {
+}
+
+- (void) removeFromRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode {
+}
+
+- (LibXMLParser*) parser {
+  return _parser;
+}
+
+@end
@@ -0,0 +1,321 @@
+// Copyright 2011 Cooliris, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#import "LibXMLParser.h"
+#import "UnitTest.h"
+
+#define kBenchmarkRows 5000
+#define kBenchmarkIterations 10
+#define kBenchmarkDocuments 200
+
+@interface LibXMLParserTests : UnitTest
+@end
+
+static LibXMLNodeApplierPreFunctionState _CountPreFunction(const unsigned char* name, LibXMLNode* node, void* context) {
+  *(NSUInteger*)context += 1;
+  return kLibXMLNodeApplierPreFunctionState_Continue;
+}
+
+static BOOL _RecordTitleFunction(LibXMLNode* node, void* context) {
+  [(NSMutableArray*)context addObject:[[node firstChildWithName:@"title"] content]];
+  return YES;
+}
+
+static BOOL _RecordFirstTitleFunction(LibXMLNode* node, void* context) {
+  [(NSMutableArray*)context addObject:[[node firstChildWithName:@"title"] content]];
+  return NO;
+}
+
+static BOOL _RecordContentFunction(LibXMLNode* node, void* context) {
+  [(NSMutableArray*)context addObject:node.content];
+  return YES;
+}
+
+@implementation LibXMLParserTests
+
+- (LibXMLParser*) _parserWithString:(NSString*)string isHTML:(BOOL)isHTML {
+  NSData* data = [string dataUsingEncoding:NSUTF8StringEncoding];
+  LibXMLParser* parser = isHTML ? [[LibXMLParser alloc] initWithHTMLUTF8Data:data] : [[LibXMLParser alloc] initWithXMLUTF8Data:data];
+  return [parser autorelease];
+}
+
+- (NSString*) _traceNode:(LibXMLNode*)node skipName:(const char*)skipName {
+  NSMutableArray* array = [NSMutableArray array];
+  LibXMLCursor cursor;
+  LibXMLCursorInitialize(&cursor, node.nativeNode);
+  LibXMLCursorEvent event;
+  while ((event = LibXMLCursorNext(&cursor))) {
+    if (event == kLibXMLCursorEvent_Text) {
+      [array addObject:[NSString stringWithFormat:@"'%s'", LibXMLCursorGetContent(&cursor)]];
+    } else if (event == kLibXMLCursorEvent_EnterElement) {
+      [array addObject:[NSString stringWithFormat:@"+%s", LibXMLCursorGetName(&cursor)]];
+      if (skipName && !strcmp((const char*)LibXMLCursorGetName(&cursor), skipName)) {
+        LibXMLCursorSkipChildren(&cursor);
+      }
+    } else {
+      [array addObject:[NSString stringWithFormat:@"-%s", LibXMLCursorGetName(&cursor)]];
+    }
+  }
+  AssertTrue(LibXMLCursorNext(&cursor) == kLibXMLCursorEvent_End);
+  return [array componentsJoinedByString:@" "];
+}
+
+- (void) testCursor {
+  LibXMLParser* parser = [self _parserWithString:@"<root><p class=\"a\" id=\"b\">Hello <b>world</b></p><c/></root>" isHTML:NO];
+  AssertNotNil(parser);
+  AssertEqualObjects([self _traceNode:parser.rootNode skipName:NULL], @"+p 'Hello ' +b 'world' -b -p +c -c");
+  AssertEqualObjects([self _traceNode:parser.rootNode skipName:"p"], @"+p -p +c -c");
+  
+  LibXMLCursor cursor;
+  LibXMLCursorInitialize(&cursor, parser.rootNode.nativeNode);
+  AssertTrue(LibXMLCursorNext(&cursor) == kLibXMLCursorEvent_EnterElement);
+  AssertTrue(!strcmp((const char*)LibXMLCursorGetAttribute(&cursor, (const unsigned char*)"id"), "b"));
+  AssertTrue(LibXMLCursorGetAttribute(&cursor, (const unsigned char*)"foo") == NULL);
+  NSMutableString* attributes = [NSMutableString string];
+  const unsigned char* name;
+  const unsigned char* value;
+  while (LibXMLCursorNextAttribute(&cursor, &name, &value)) {
+    [attributes appendFormat:@"%s=%s;", name, value];
+  }
+  AssertEqualObjects(attributes, @"class=a;id=b;");
+}
+
+- (void) testTextExtraction {
+  LibXMLParser* parser = [self _parserWithString:@"<html><body><p>Hello  <b>world</b></p><br><table><tr><td>1</td><td>2</td></tr></table></body></html>"
+                                          isHTML:YES];
+  AssertNotNil(parser);
+  AssertEqualObjects([parser.rootNode extractTextFromMergedHTML], @"Hello world\n1 2");
+  AssertEqualObjects([parser.rootNode mergeContentFromChildren:YES], @"Hello  world12");
+  NSString* string = [parser.rootNode mergeContentFromChildren:YES skipBlock:^BOOL(const unsigned char* name, LibXMLNode* node) {
+    return !strcmp((const char*)name, "table");
+  }];
+  AssertEqualObjects(string, @"Hello  world");
+  
+  parser = [self _parserWithString:@"<html><head><style>p {}</style><script>var a;</script></head><body> \t<p>A\r\n B</p>  C <td>D</td></body></html>"
+                            isHTML:YES];
+  AssertEqualObjects([parser.rootNode extractTextFromMergedHTML], @"A\nB\nC D");
+}
+
+- (void) testCompiledPath {
+  LibXMLParser* parser = [self _parserWithString:@"<rss><channel><item><title>A</title></item><item type=\"x\"><title>B</title></item>"
+                                                  "<item id=\"#1\"><title>C</title></item></channel></rss>" isHTML:NO];
+  AssertNotNil(parser);
+  LibXMLPath* path = [LibXMLPath pathWithString:@"rss:channel:item:title"];
+  AssertEqualObjects([[parser firstChildAtCompiledPath:path] content], @"A");
+  AssertEqual([[parser childrenAtCompiledPath:path] count], (NSUInteger)3);
+  AssertEqualObjects([[parser firstChildAtPath:@"rss:channel:item#2:title"] content], @"C");
+  AssertEqualObjects([[parser firstChildAtPath:@"rss:channel:item|type=x:title"] content], @"B");
+  AssertNil([parser firstChildAtPath:@"rss:channel:item#3"]);
+  AssertEqualObjects([[parser firstChildAtPath:@"rss:channel:item#1:title:text"] content], @"B");
+  AssertEqualObjects([[parser firstChildAtPath:@"rss:channel:item|id=#1:title"] content], @"C");
+  AssertNil([parser firstChildAtPath:@"rss:channel:item|id=#0"]);
+}
+
+- (void) testStreaming {
+  NSData* data = [@"<rss><channel><item type=\"x\"><title>A</title><link>a</link></item><item><title>B</title></item>"
+                   "<other><item type=\"x\"><title>Z</title></item></other><item type=\"x\"><title>C</title></item></channel></rss>"
+                  dataUsingEncoding:NSUTF8StringEncoding];
+  NSMutableArray* titles = [NSMutableArray array];
+  AssertTrue([LibXMLParser streamXMLUTF8Data:data path:@"rss:channel:item" function:_RecordTitleFunction context:titles]);
+  AssertEqualObjects(titles, ([NSArray arrayWithObjects:@"A", @"B", @"C", nil]));  // Items outside the path are skipped
+  
+  [titles removeAllObjects];
+  AssertTrue([LibXMLParser streamXMLUTF8Data:data path:@"rss:channel:item|type=x" function:_RecordTitleFunction context:titles]);
+  AssertEqualObjects(titles, ([NSArray arrayWithObjects:@"A", @"C", nil]));
+  
+  [titles removeAllObjects];
+  AssertTrue([LibXMLParser streamXMLUTF8Data:data path:@"rss:channel:item|type=" function:_RecordTitleFunction context:titles]);
+  AssertEqualObjects(titles, [NSArray arrayWithObject:@"B"]);  // Empty value matches elements without the attribute
+  
+  [titles removeAllObjects];
+  AssertTrue([LibXMLParser streamXMLUTF8Data:data path:@"rss:channel:item" function:_RecordFirstTitleFunction context:titles]);
+  AssertEqualObjects(titles, [NSArray arrayWithObject:@"A"]);
+  
+#if NS_BLOCKS_AVAILABLE
+  __block NSUInteger count = 0;
+  AssertTrue([LibXMLParser streamXMLUTF8Data:data path:@"rss:channel:item|type=x" usingBlock:^BOOL(LibXMLNode* node) {
+    AssertEqualObjects(node.name, @"item");
+    AssertEqual(node.children.count, (NSUInteger)(count ? 1 : 2));  // The whole subtree is available
+    count += 1;
+    return YES;
+  }]);
+  AssertEqual(count, (NSUInteger)2);
+#endif
+  
+  AssertFalse([LibXMLParser streamXMLUTF8Data:data path:@"" function:_RecordTitleFunction context:titles]);
+}
+
+// Writes the string in chunks of the given size and returns the number of bytes written or -1 on failure
+- (NSInteger) _writeString:(NSString*)string toStream:(NSOutputStream*)stream chunkSize:(NSUInteger)chunkSize {
+  NSData* data = [string dataUsingEncoding:NSUTF8StringEncoding];
+  const uint8_t* bytes = data.bytes;
+  for (NSUInteger offset = 0; offset < data.length; offset += chunkSize) {
+    NSUInteger length = MIN(chunkSize, data.length - offset);
+    if ([stream write:(bytes + offset) maxLength:length] != (NSInteger)length) {
+      return -1;
+    }
+  }
+  return data.length;
+}
+
+- (void) testPushParser {
+  NSString* head = @"<rss><channel><item><title>A</title></item><item><title>B</title></item>";
+  NSString* tail = @"<item><title>C</title></item></channel></rss>";
+  
+  // Nodes must be passed to the function as soon as enough data has been written, not when closing
+  NSMutableArray* titles = [NSMutableArray array];
+  LibXMLPushParser* stream = [[LibXMLPushParser alloc] initWithHTML:NO path:@"rss:channel:item" function:_RecordTitleFunction context:titles];
+  [stream open];
+  AssertEqual(stream.streamStatus, NSStreamStatusOpen);
+  AssertGreaterThan([self _writeString:head toStream:stream chunkSize:7], 0);
+  AssertGreaterThan(titles.count, (NSUInteger)0);
+  AssertEqualObjects([titles objectAtIndex:0], @"A");
+  AssertGreaterThan([self _writeString:tail toStream:stream chunkSize:7], 0);
+  [stream close];
+  AssertEqual(stream.streamStatus, NSStreamStatusClosed);
+  AssertEqualObjects(titles, ([NSArray arrayWithObjects:@"A", @"B", @"C", nil]));
+  AssertNotNil([stream.parser firstChildAtPath:@"rss:channel"]);
+  AssertNil([stream.parser firstChildAtPath:@"rss:channel:item"]);  // Nodes passed to the function are freed
+  AssertEqual([stream write:(const uint8_t*)"x" maxLength:1], (NSInteger)-1);
+  [stream release];
+  
+  // Stopping early must ignore the rest of the document
+  [titles removeAllObjects];
+  stream = [[LibXMLPushParser alloc] initWithHTML:NO path:@"rss:channel:item" function:_RecordFirstTitleFunction context:titles];
+  [stream open];
+  AssertGreaterThan([self _writeString:[head stringByAppendingString:tail] toStream:stream chunkSize:5], 0);
+  [stream close];
+  AssertEqualObjects(titles, [NSArray arrayWithObject:@"A"]);
+  [stream release];
+  
+  // Without a path the whole document is available once closed
+  stream = [[LibXMLPushParser alloc] initWithHTML:NO];
+  [stream open];
+  AssertGreaterThan([self _writeString:[head stringByAppendingString:tail] toStream:stream chunkSize:3], 0);
+  AssertNil(stream.parser);
+  [stream close];
+  AssertEqualObjects([[stream.parser firstChildAtPath:@"rss:channel:item#1:title"] content], @"B");
+  [stream release];
+  
+  // HTML documents are repaired on the fly
+  NSMutableArray* contents = [NSMutableArray array];
+  stream = [[LibXMLPushParser alloc] initWithHTML:YES path:@"html:body:p" function:_RecordContentFunction context:contents];
+  [stream open];
+  AssertGreaterThan([self _writeString:@"<html><body><p>One</p><p>Two</p><div>Three</div><p>Four</p></body></html>" toStream:stream chunkSize:4], 0);
+  [stream close];
+  AssertEqualObjects(contents, ([NSArray arrayWithObjects:@"One", @"Two", @"Four", nil]));
+  AssertNotNil([stream.parser firstChildAtPath:@"html:body:div"]);
+  [stream release];
+}
+
+- (void) testTraversalBenchmark {
+  NSMutableString* string = [NSMutableString stringWithString:@"<html><body><table>"];
+  for (int i = 0; i < kBenchmarkRows; ++i) {
+    [string appendFormat:@"<tr class=\"row\"><td><a href=\"/%i\">Item %i</a></td><td>Lorem <b>ipsum</b> dolor</td></tr>", i, i];
+  }
+  [string appendString:@"</table></body></html>"];
+  LibXMLParser* parser = [self _parserWithString:string isHTML:YES];
+  AssertNotNil(parser);
+  LibXMLNode* root = parser.rootNode;
+  
+  NSUInteger applierCount = 0;
+  CFAbsoluteTime time = CFAbsoluteTimeGetCurrent();
+  for (int i = 0; i < kBenchmarkIterations; ++i) {
+    [root applyFunctionsToChildren:_CountPreFunction postFunction:NULL context:&applierCount];
+  }
+  CFAbsoluteTime applierTime = CFAbsoluteTimeGetCurrent() - time;
+  
+  NSUInteger cursorCount = 0;
+  time = CFAbsoluteTimeGetCurrent();
+  for (int i = 0; i < kBenchmarkIterations; ++i) {
+    LibXMLCursor cursor;
+    LibXMLCursorInitialize(&cursor, root.nativeNode);
+    LibXMLCursorEvent event;
+    while ((event = LibXMLCursorNext(&cursor))) {
+      if (event != kLibXMLCursorEvent_ExitElement) {
+        cursorCount += 1;
+      }
+    }
+  }
+  CFAbsoluteTime cursorTime = CFAbsoluteTimeGetCurrent() - time;
+  AssertEqual(cursorCount, applierCount);
+  
+  time = CFAbsoluteTimeGetCurrent();
+  for (int i = 0; i < kBenchmarkIterations; ++i) {
+    NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+    AssertGreaterThan([[root extractTextFromMergedHTML] length], (NSUInteger)0);
+    [pool release];
+  }
+  CFAbsoluteTime extractTime = CFAbsoluteTimeGetCurrent() - time;
+  
+  LOG_INFO(@"Traversal of %i nodes: %.0f nodes/s with applier functions, %.0f nodes/s with cursor, %.1f ms per text extraction",
+           (int)(applierCount / kBenchmarkIterations), applierCount / applierTime, cursorCount / cursorTime,
+           1000.0 * extractTime / kBenchmarkIterations);
+}
+
+- (NSData*) _documentWithRows:(int)rows tag:(int)tag {
+  NSMutableString* string = [NSMutableString stringWithFormat:@"<html><body><h1>Document %i</h1><table>", tag];
+  for (int i = 0; i < rows; ++i) {
+    [string appendFormat:@"<tr><td>%i</td><td>Lorem <b>ipsum</b> dolor sit amet</td></tr>", i];
+  }
+  [string appendString:@"</table></body></html>"];
+  return [string dataUsingEncoding:NSUTF8StringEncoding];
+}
+
+- (void) testParallelParsing {
+  NSMutableArray* array = [NSMutableArray array];
+  for (int i = 0; i < 20; ++i) {
+    [array addObject:[self _documentWithRows:10 tag:i]];
+  }
+  [array addObject:[NSData data]];
+  
+  NSArray* parsers = [LibXMLParser parsersWithUTF8DataArray:array isHTML:YES];
+  AssertEqual(parsers.count, array.count);
+  AssertEqualObjects([parsers lastObject], [NSNull null]);
+  NSArray* texts = [LibXMLParser textFromHTMLUTF8DataArray:array];
+  AssertEqual(texts.count, array.count);
+  for (int i = 0; i < 20; ++i) {
+    NSString* title = [NSString stringWithFormat:@"Document %i", i];
+    AssertEqualObjects([[[parsers objectAtIndex:i] firstChildAtPath:@"html:body:h1"] content], title);
+    AssertTrue([[texts objectAtIndex:i] hasPrefix:title]);
+  }
+}
+
+- (void) testParallelParsingBenchmark {
+  NSMutableArray* array = [NSMutableArray array];
+  for (int i = 0; i < kBenchmarkDocuments; ++i) {
+    [array addObject:[self _documentWithRows:500 tag:i]];
+  }
+  
+  CFAbsoluteTime time = CFAbsoluteTimeGetCurrent();
+  for (NSData* data in array) {
+    NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+    LibXMLParser* parser = [[LibXMLParser alloc] initWithHTMLUTF8Data:data];
+    AssertNotNil([parser.rootNode extractTextFromMergedHTML]);
+    [parser release];
+    [pool release];
+  }
+  CFAbsoluteTime serialTime = CFAbsoluteTimeGetCurrent() - time;
+  
+  time = CFAbsoluteTimeGetCurrent();
+  NSArray* texts = [LibXMLParser textFromHTMLUTF8DataArray:array];
+  CFAbsoluteTime parallelTime = CFAbsoluteTimeGetCurrent() - time;
+  AssertEqual(texts.count, (NSUInteger)kBenchmarkDocuments);
+  
+  LOG_INFO(@"Text extraction of %i documents on %i cores: %.0f documents/s serially, %.0f documents/s concurrently (%.1fx)",
+           kBenchmarkDocuments, (int)[[NSProcessInfo processInfo] activeProcessorCount], kBenchmarkDocuments / serialTime,
+           kBenchmarkDocuments / parallelTime, serialTime / parallelTime);
+}
+
+@end
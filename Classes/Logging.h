@@ -110,17 +110,38 @@ BOOL LoggingIsStderrCaptured();
 
 BOOL LoggingIsHistoryEnabled();
 BOOL LoggingEnableHistory(NSString* path, NSUInteger appVersion);  // Create if non-existing - Pass nil to close
+BOOL LoggingEnableSegmentedHistory(NSString* path, NSUInteger appVersion, NSUInteger maxSegmentSize);  // Compact binary alternative using append-only segment files in directory - Create if non-existing - Pass 0 for default segment size
 void LoggingPurgeHistory(NSTimeInterval maxAge);  // Pass 0.0 to clear entirely
 void LoggingReplayHistory(LoggingReplayCallback callback, void* context, BOOL backward, NSUInteger limit);
+// Pass 0.0 for timestamps, kLogLevel_Debug for level, 0 for version or nil for substring to not filter on them
+// The substring match is case-insensitive for ASCII letters only (like SQLite LIKE) with both history backends
+void LoggingQueryHistory(LoggingReplayCallback callback, void* context, NSTimeInterval minTimestamp, NSTimeInterval maxTimestamp,
+                         LogLevel minLevel, NSUInteger appVersion, NSString* substring, BOOL backward, NSUInteger limit);
 #if NS_BLOCKS_AVAILABLE
 void LoggingEnumerateHistory(BOOL backward, NSUInteger limit,
                              void (^block)(NSUInteger appVersion, NSTimeInterval timestamp, LogLevel level, NSString* message));
+void LoggingEnumerateHistoryMatching(NSTimeInterval minTimestamp, NSTimeInterval maxTimestamp, LogLevel minLevel, NSUInteger appVersion,
+                                     NSString* substring, BOOL backward, NSUInteger limit,
+                                     void (^block)(NSUInteger appVersion, NSTimeInterval timestamp, LogLevel level, NSString* message));
 #endif
 void LoggingDisableHistory();
 
+BOOL LoggingIsAsynchronousModeEnabled();
+void LoggingEnableAsynchronousMode();  // Messages are queued and written to output, history and remote access from a background thread - Live callback is still called synchronously
+void LoggingDisableAsynchronousMode();  // Waits for all queued messages to be written
+void LoggingFlushAsynchronousMessages();  // Waits for all messages queued so far to be written
+NSUInteger LoggingGetDroppedMessageCount();  // Messages dropped in asynchronous mode because the queue was full
+
 BOOL LoggingIsRemoteAccessEnabled();
 BOOL LoggingEnableRemoteAccess(NSUInteger port, LoggingRemoteConnectCallback connectCallback, LoggingRemoteMessageCallback messageCallback, LoggingRemoteDisconnectCallback disconnectCallback, void* context);
 void LoggingDisableRemoteAccess(BOOL keepConnectionAlive);
+
+// Streams messages to multiple concurrent clients from a background thread - Each client has a bounded buffer and messages are dropped
+// instead of blocking logging if it cannot keep up, then it is disconnected if it stays stalled - Clients can send a digit to change their minimum level
+BOOL LoggingIsRemoteStreamingEnabled();
+BOOL LoggingEnableRemoteStreaming(NSUInteger port, LogLevel minLevel);
+void LoggingDisableRemoteStreaming();
+NSUInteger LoggingGetRemoteStreamingClientCount();
 #ifdef __cplusplus
 }
 #endif
@@ -20,6 +20,12 @@
 #endif
 #import <libkern/OSAtomic.h>
 #import <sys/fcntl.h>
+#import <sys/uio.h>
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <sys/socket.h>
+#import <poll.h>
+#import <errno.h>
 #import <netinet/in.h>
 #import <sqlite3.h>
 #import <assert.h>
@@ -33,6 +39,48 @@
 
 #define kCaptureBufferSize 1024
 #define kReadBufferSize 1024
+#define kAsyncQueueSize 4096  // Must be a power of 2
+#define kAsyncBatchSize 64
+#define kAsyncFlushInterval 1000  // microseconds
+#define kHistoryBatchSize 128
+#define kHistoryBatchInterval 1.0  // seconds
+#define kSegmentMagic 0x4C4F4753  // 'LOGS'
+#define kSegmentExtension "segment"
+#define kSegmentDefaultMaxSize (4 * 1024 * 1024)
+#define kStreamMaxClients 16
+#define kStreamClientBufferSize (64 * 1024)
+#define kStreamStallTimeOut 10.0  // seconds
+#define kStreamPollInterval 1000  // milliseconds
+
+typedef struct {
+  CFTimeInterval timestamp;
+  LogLevel level;
+  NSString* message;
+} LogRecord;
+
+typedef struct {
+  volatile int64_t sequence;
+  LogRecord record;
+} AsyncEntry;
+
+typedef struct {
+  int socket;
+  LogLevel minLevel;
+  char* buffer;  // Circular buffer of kStreamClientBufferSize bytes
+  size_t head;
+  size_t length;
+  NSUInteger droppedCount;
+  CFAbsoluteTime stallTime;  // When the buffer last overflowed or 0.0
+} StreamClient;
+
+// Segment records are laid out as header, UTF-8 payload then a copy of the payload length to allow walking backward
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  double timestamp;
+  uint32_t level;
+  uint32_t length;
+} SegmentHeader;
 
 @interface Logging : NSObject
 @end
@@ -45,6 +93,15 @@ static const char* _levelNames[] = {"DEBUG", "VERBOSE", "INFO", "WARNING", "ERRO
 static OSSpinLock _spinLock = OS_SPINLOCK_INIT;
 static sqlite3* _database = NULL;
 static sqlite3_stmt* _statement = NULL;
+static NSUInteger _historyPending = 0;
+static dispatch_source_t _historyTimer = NULL;
+static NSString* _segmentDirectory = nil;
+static char _segmentPath[PATH_MAX];
+static int _segmentFD = -1;
+static unsigned long _segmentIndex = 0;
+static off_t _segmentSize = 0;
+static off_t _segmentMaxSize = 0;
+static NSUInteger _segmentVersion = 0;
 static CFSocketRef _socket = NULL;
 static CFReadStreamRef _readStream = NULL;
 static CFWriteStreamRef _writeStream = NULL;
@@ -56,6 +113,23 @@ static void* _remoteContext = NULL;
 static int _outputFD = 0;
 static void* _stdoutCapture = NULL;
 static void* _stderrCapture = NULL;
+static AsyncEntry* _asyncQueue = NULL;
+static volatile int64_t _asyncEnqueuePosition = 0;
+static volatile int64_t _asyncDequeuePosition = 0;
+static volatile int64_t _asyncWrittenPosition = 0;  // Only advanced once the dequeued records have been output
+static volatile int32_t _asyncDroppedCount = 0;
+static volatile int32_t _asyncDrainerSleeping = 0;
+static dispatch_semaphore_t _asyncSemaphore = NULL;
+static pthread_t _asyncThread = NULL;
+static BOOL _asyncEnabled = NO;
+static OSSpinLock _streamLock = OS_SPINLOCK_INIT;
+static StreamClient* _streamClients[kStreamMaxClients];
+static volatile NSUInteger _streamClientCount = 0;
+static LogLevel _streamMinLevel = kLogLevel_Debug;
+static int _streamSocket = -1;
+static int _streamPipe[2] = {-1, -1};
+static pthread_t _streamThread = NULL;
+static volatile BOOL _streamRunning = NO;
 
 const char* LoggingGetLevelName(LogLevel level) {
   return _levelNames[level];
@@ -160,14 +234,29 @@ BOOL LoggingIsStderrCaptured() {
 }
 
 BOOL LoggingIsHistoryEnabled() {
-  return _database ? YES : NO;
+  return _database || (_segmentFD >= 0) ? YES : NO;
 }
 
 // Assumes spinlock is already taken
-static void _AppendHistory(double timestamp, int level, const char* message) {
+static void _CommitHistory() {
+  if (_historyPending > 0) {
+    int result = sqlite3_exec(_database, "COMMIT", NULL, NULL, NULL);
+    assert(result == SQLITE_OK);
+    _historyPending = 0;
+  }
+}
+
+// Assumes spinlock is already taken
+// Rows are batched in a single transaction which is committed every kHistoryBatchSize rows, after kHistoryBatchInterval or on errors
+static void _AppendDatabaseHistory(double timestamp, int level, const char* message) {
   if (message) {
     int result;
     
+    if (_historyPending == 0) {
+      result = sqlite3_exec(_database, "BEGIN", NULL, NULL, NULL);
+      assert(result == SQLITE_OK);
+    }
+    
     result = sqlite3_bind_double(_statement, 1, timestamp);
     assert(result == SQLITE_OK);
     result = sqlite3_bind_int(_statement, 2, level);
@@ -182,39 +271,293 @@ static void _AppendHistory(double timestamp, int level, const char* message) {
     
     result = sqlite3_clear_bindings(_statement);
     assert(result == SQLITE_OK);
+    
+    _historyPending += 1;
+    if ((level >= kLogLevel_Error) || (_historyPending >= kHistoryBatchSize)) {
+      _CommitHistory();  // Always commit errors immediately for crash forensics
+    }
   }
 }
 
-BOOL LoggingEnableHistory(NSString* path, NSUInteger appVersion) {
-  OSSpinLockLock(&_spinLock);
-  if (_database == NULL) {
-    int result = sqlite3_open([path fileSystemRepresentation], &_database);
-    assert(result == SQLITE_OK);
-    if (result == SQLITE_OK) {
-      result = sqlite3_exec(_database, "CREATE TABLE IF NOT EXISTS history (version INTEGER, timestamp REAL, level INTEGER, message TEXT)",
-                            NULL, NULL, NULL);
-      assert(result == SQLITE_OK);
+// Assumes spinlock is already taken
+static BOOL _OpenNextSegment() {
+  if (_segmentFD >= 0) {
+    close(_segmentFD);
+  }
+  _segmentIndex += 1;
+  snprintf(_segmentPath, sizeof(_segmentPath), "%s/%010lu.%s", [_segmentDirectory fileSystemRepresentation], _segmentIndex, kSegmentExtension);
+  _segmentFD = open(_segmentPath, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  _segmentSize = 0;
+  if (_segmentFD < 0) {
+    fprintf(stderr, "Failed opening log history segment \"%s\" (%s)\n", _segmentPath, strerror(errno));  // Cannot use LOG_ERROR() while holding the spinlock
+    return NO;
+  }
+  return YES;
+}
+
+// Assumes spinlock is already taken
+static void _AppendSegmentHistory(double timestamp, int level, const char* message) {
+  if (message) {
+    SegmentHeader header = {kSegmentMagic, (uint32_t)_segmentVersion, timestamp, level, (uint32_t)strlen(message)};
+    off_t size = sizeof(SegmentHeader) + header.length + sizeof(uint32_t);
+    if ((_segmentSize > 0) && (_segmentSize + size > _segmentMaxSize) && !_OpenNextSegment()) {
+      [_segmentDirectory release];  // History is now disabled
+      _segmentDirectory = nil;
     }
-    if (result == SQLITE_OK) {
-      NSString* statement = [NSString stringWithFormat:@"INSERT INTO history (version, timestamp, level, message) VALUES (%i, ?1, ?2, ?3)",
-                                                       (int)appVersion];
-      result = sqlite3_prepare_v2(_database, [statement UTF8String], -1, &_statement, NULL);
-      assert(result == SQLITE_OK);
+    if (_segmentFD >= 0) {
+      struct iovec vectors[3] = {{&header, sizeof(SegmentHeader)}, {(void*)message, header.length}, {&header.length, sizeof(uint32_t)}};
+      ssize_t result = writev(_segmentFD, vectors, 3);
+      if (result == size) {
+        _segmentSize += result;
+      } else {
+        ftruncate(_segmentFD, _segmentSize);  // Drop partial record so the segment stays parseable
+      }
     }
-    if (result != SQLITE_OK) {  // TODO: Check sqlite3_errmsg()
-      result = sqlite3_close(_database);
-      assert(result == SQLITE_OK);
-      _database = NULL;
+  }
+}
+
+// Assumes spinlock is already taken
+static void _AppendHistory(double timestamp, int level, const char* message) {
+  if (_database) {
+    _AppendDatabaseHistory(timestamp, level, message);
+  } else if (_segmentFD >= 0) {
+    _AppendSegmentHistory(timestamp, level, message);
+  }
+}
+
+// Assumes spinlock is already taken
+static NSArray* _SegmentPaths() {
+  NSMutableArray* paths = [NSMutableArray array];
+  NSArray* files = [[[NSFileManager defaultManager] contentsOfDirectoryAtPath:_segmentDirectory error:NULL] sortedArrayUsingSelector:@selector(compare:)];
+  for (NSString* file in files) {
+    if ([[file pathExtension] isEqualToString:@kSegmentExtension]) {
+      [paths addObject:[_segmentDirectory stringByAppendingPathComponent:file]];
     }
   }
+  return paths;
+}
+
+// Returns the offset right after the last complete record
+static size_t _ScanSegment(const char* bytes, size_t size) {
+  size_t offset = 0;
+  while (offset + sizeof(SegmentHeader) <= size) {
+    SegmentHeader header;
+    memcpy(&header, bytes + offset, sizeof(SegmentHeader));
+    size_t recordSize = sizeof(SegmentHeader) + header.length + sizeof(uint32_t);
+    if ((header.magic != kSegmentMagic) || (offset + recordSize > size)) {
+      break;  // Ignore truncated records e.g. after a crash
+    }
+    offset += recordSize;
+  }
+  return offset;
+}
+
+static inline char _ASCIILowercase(char character) {
+  return (character >= 'A') && (character <= 'Z') ? character + ('a' - 'A') : character;
+}
+
+// Same rule as SQLite LIKE so both backends match identically: only ASCII letters are compared case-insensitively
+static BOOL _ContainsSubstring(const char* bytes, size_t length, const char* substring, size_t substringLength) {
+  for (size_t i = 0; i + substringLength <= length; ++i) {
+    size_t j = 0;
+    while ((j < substringLength) && (_ASCIILowercase(bytes[i + j]) == _ASCIILowercase(substring[j]))) {
+      ++j;
+    }
+    if (j == substringLength) {
+      return YES;
+    }
+  }
+  return NO;
+}
+
+// Assumes spinlock is already taken
+static void _QuerySegments(LoggingReplayCallback callback, void* context, NSTimeInterval minTimestamp, NSTimeInterval maxTimestamp,
+                           LogLevel minLevel, NSUInteger appVersion, NSString* substring, BOOL backward, NSUInteger limit) {
+  NSArray* paths = _SegmentPaths();
+  if (backward) {
+    paths = [[paths reverseObjectEnumerator] allObjects];
+  }
+  const char* utf8Substring = substring.length ? [substring UTF8String] : NULL;
+  size_t utf8Length = utf8Substring ? strlen(utf8Substring) : 0;
+  NSUInteger count = 0;
+  BOOL done = NO;
+  for (NSString* path in paths) {
+    int fd = open([path fileSystemRepresentation], O_RDONLY);
+    if (fd < 0) {
+      continue;
+    }
+    struct stat info;
+    if ((fstat(fd, &info) == 0) && (info.st_size > 0)) {
+      const char* bytes = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (bytes != MAP_FAILED) {
+        NSAutoreleasePool* localPool = [[NSAutoreleasePool alloc] init];
+        size_t end = _ScanSegment(bytes, info.st_size);
+        size_t offset = backward ? end : 0;
+        while (!done && (backward ? offset > 0 : offset < end)) {
+          SegmentHeader header;
+          if (backward) {
+            uint32_t length;
+            memcpy(&length, bytes + offset - sizeof(uint32_t), sizeof(uint32_t));
+            offset -= sizeof(SegmentHeader) + length + sizeof(uint32_t);
+            memcpy(&header, bytes + offset, sizeof(SegmentHeader));
+          } else {
+            memcpy(&header, bytes + offset, sizeof(SegmentHeader));
+          }
+          if (((minTimestamp <= 0.0) || (header.timestamp >= minTimestamp)) && ((maxTimestamp <= 0.0) || (header.timestamp <= maxTimestamp))
+              && (header.level >= (uint32_t)minLevel) && ((appVersion == 0) || (header.version == appVersion))
+              && (!utf8Substring || _ContainsSubstring(bytes + offset + sizeof(SegmentHeader), header.length, utf8Substring, utf8Length))) {
+            NSString* message = [[NSString alloc] initWithBytes:(bytes + offset + sizeof(SegmentHeader)) length:header.length
+                                                       encoding:NSUTF8StringEncoding];
+            if (message) {
+              (*callback)(header.version, header.timestamp, header.level, message, context);
+              count += 1;
+              done = (limit > 0) && (count >= limit);
+            }
+            [message release];
+          }
+          if (!backward) {
+            offset += sizeof(SegmentHeader) + header.length + sizeof(uint32_t);
+          }
+        }
+        [localPool release];
+        munmap((void*)bytes, info.st_size);
+      }
+    }
+    close(fd);
+    if (done) {
+      break;
+    }
+  }
+}
+
+// Assumes spinlock is already taken
+static void _PurgeSegments(NSTimeInterval maxAge) {
+  NSFileManager* manager = [NSFileManager defaultManager];
+  CFAbsoluteTime minTime = CFAbsoluteTimeGetCurrent() - maxAge;
+  for (NSString* path in _SegmentPaths()) {
+    if (maxAge > 0.0) {
+      NSDate* date = [[manager attributesOfItemAtPath:path error:NULL] fileModificationDate];
+      if (!date || ([date timeIntervalSinceReferenceDate] >= minTime)) {
+        continue;
+      }
+    }
+    if (!strcmp([path fileSystemRepresentation], _segmentPath)) {
+      ftruncate(_segmentFD, 0);
+      _segmentSize = 0;
+    } else {
+      unlink([path fileSystemRepresentation]);
+    }
+  }
+}
+
+// Converting an existing database requires a one-time full VACUUM which can take a while on large ones
+static int _EnableIncrementalVacuum(sqlite3* database) {
+  sqlite3_stmt* statement = NULL;
+  int result = sqlite3_prepare_v2(database, "PRAGMA auto_vacuum", -1, &statement, NULL);
+  if (result == SQLITE_OK) {
+    int mode = (sqlite3_step(statement) == SQLITE_ROW) ? sqlite3_column_int(statement, 0) : 0;
+    result = sqlite3_finalize(statement);
+    if ((result == SQLITE_OK) && (mode != 2)) {
+      result = sqlite3_exec(database, "PRAGMA auto_vacuum=INCREMENTAL", NULL, NULL, NULL);
+      if (result == SQLITE_OK) {
+        result = sqlite3_exec(database, "VACUUM", NULL, NULL, NULL);
+      }
+    }
+  }
+  return result;
+}
+
+// The database is opened and prepared without holding the spinlock so that logging from other threads is never blocked by it
+BOOL LoggingEnableHistory(NSString* path, NSUInteger appVersion) {
+  if (LoggingIsHistoryEnabled()) {
+    return _database ? YES : NO;
+  }
+  sqlite3* database = NULL;
+  sqlite3_stmt* insertStatement = NULL;
+  int result = sqlite3_open([path fileSystemRepresentation], &database);
+  assert(result == SQLITE_OK);
+  if (result == SQLITE_OK) {
+    result = _EnableIncrementalVacuum(database);
+    assert(result == SQLITE_OK);
+  }
+  if (result == SQLITE_OK) {
+    result = sqlite3_exec(database, "PRAGMA journal_mode=WAL", NULL, NULL, NULL);
+    assert(result == SQLITE_OK);
+  }
+  if (result == SQLITE_OK) {
+    result = sqlite3_exec(database, "PRAGMA synchronous=NORMAL", NULL, NULL, NULL);
+    assert(result == SQLITE_OK);
+  }
+  if (result == SQLITE_OK) {
+    result = sqlite3_exec(database, "CREATE TABLE IF NOT EXISTS history (version INTEGER, timestamp REAL, level INTEGER, message TEXT)",
+                          NULL, NULL, NULL);
+    assert(result == SQLITE_OK);
+  }
+  if (result == SQLITE_OK) {
+    result = sqlite3_exec(database, "CREATE INDEX IF NOT EXISTS history_timestamp ON history (timestamp)", NULL, NULL, NULL);
+    assert(result == SQLITE_OK);
+  }
+  if (result == SQLITE_OK) {
+    NSString* statement = [NSString stringWithFormat:@"INSERT INTO history (version, timestamp, level, message) VALUES (%i, ?1, ?2, ?3)",
+                                                     (int)appVersion];
+    result = sqlite3_prepare_v2(database, [statement UTF8String], -1, &insertStatement, NULL);
+    assert(result == SQLITE_OK);
+  }
+  
+  BOOL success = NO;
+  OSSpinLockLock(&_spinLock);
+  if ((result == SQLITE_OK) && (_database == NULL) && (_segmentFD < 0)) {  // Another thread may have enabled history meanwhile
+    _database = database;
+    _statement = insertStatement;
+    _historyTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0));
+    dispatch_source_set_timer(_historyTimer, dispatch_time(DISPATCH_TIME_NOW, kHistoryBatchInterval * NSEC_PER_SEC),
+                              kHistoryBatchInterval * NSEC_PER_SEC, kHistoryBatchInterval * NSEC_PER_SEC / 10);
+    dispatch_source_set_event_handler(_historyTimer, ^{
+      OSSpinLockLock(&_spinLock);
+      if (_database) {
+        _CommitHistory();
+      }
+      OSSpinLockUnlock(&_spinLock);
+    });
+    dispatch_resume(_historyTimer);
+    success = YES;
+  }
   OSSpinLockUnlock(&_spinLock);
+  if (!success) {  // TODO: Check sqlite3_errmsg()
+    sqlite3_finalize(insertStatement);
+    result = sqlite3_close(database);
+    assert(result == SQLITE_OK);
+  }
   return _database ? YES : NO;
 }
 
+BOOL LoggingEnableSegmentedHistory(NSString* path, NSUInteger appVersion, NSUInteger maxSegmentSize) {
+  OSSpinLockLock(&_spinLock);
+  if ((_database == NULL) && (_segmentFD < 0)) {
+    if ([[NSFileManager defaultManager] createDirectoryAtPath:path withIntermediateDirectories:YES attributes:nil error:NULL]) {
+      _segmentDirectory = [path copy];
+      _segmentVersion = appVersion;
+      _segmentMaxSize = maxSegmentSize > 0 ? maxSegmentSize : kSegmentDefaultMaxSize;
+      NSString* lastPath = [_SegmentPaths() lastObject];
+      _segmentIndex = [[lastPath lastPathComponent] integerValue];
+      if (lastPath && ([[[NSFileManager defaultManager] attributesOfItemAtPath:lastPath error:NULL] fileSize] == 0)) {
+        _segmentIndex -= 1;  // Reuse the last segment if empty instead of leaving an empty one behind on each launch
+      }
+      if (!_OpenNextSegment()) {  // Always start a new segment so that records never follow a truncated one
+        [_segmentDirectory release];
+        _segmentDirectory = nil;
+      }
+    }
+  }
+  OSSpinLockUnlock(&_spinLock);
+  return _segmentFD >= 0 ? YES : NO;
+}
+
 void LoggingPurgeHistory(NSTimeInterval maxAge) {
   OSSpinLockLock(&_spinLock);
   if (_database) {
     int result;
+    _CommitHistory();
     if (maxAge > 0.0) {
       NSString* statement = [NSString stringWithFormat:@"DELETE FROM history WHERE timestamp < %f",
                                                        CFAbsoluteTimeGetCurrent() - maxAge];
@@ -224,24 +567,69 @@ void LoggingPurgeHistory(NSTimeInterval maxAge) {
       result = sqlite3_exec(_database, "DELETE FROM history", NULL, NULL, NULL);
       assert(result == SQLITE_OK);
     }
-    result = sqlite3_exec(_database, "VACUUM", NULL, NULL, NULL);
+    result = sqlite3_exec(_database, "PRAGMA incremental_vacuum", NULL, NULL, NULL);  // Only releases free pages instead of rebuilding the database
     assert(result == SQLITE_OK);
+  } else if (_segmentFD >= 0) {
+    _PurgeSegments(maxAge);
   }
   OSSpinLockUnlock(&_spinLock);
 }
 
 void LoggingReplayHistory(LoggingReplayCallback callback, void* context, BOOL backward, NSUInteger limit) {
+  LoggingQueryHistory(callback, context, 0.0, 0.0, kLogLevel_Debug, 0, nil, backward, limit);
+}
+
+void LoggingQueryHistory(LoggingReplayCallback callback, void* context, NSTimeInterval minTimestamp, NSTimeInterval maxTimestamp,
+                         LogLevel minLevel, NSUInteger appVersion, NSString* substring, BOOL backward, NSUInteger limit) {
   OSSpinLockLock(&_spinLock);
   if (_database && callback) {
-    NSString* string = [NSString stringWithFormat:@"SELECT version, timestamp, level, message FROM history ORDER BY timestamp %@",
-                                                  backward ? @"DESC" : @"ASC"];
+    NSMutableString* string = [NSMutableString stringWithString:@"SELECT version, timestamp, level, message FROM history WHERE 1"];
+    if (minTimestamp > 0.0) {
+      [string appendString:@" AND timestamp >= ?1"];
+    }
+    if (maxTimestamp > 0.0) {
+      [string appendString:@" AND timestamp <= ?2"];
+    }
+    if (minLevel > kLogLevel_Debug) {
+      [string appendString:@" AND level >= ?3"];
+    }
+    if (appVersion > 0) {
+      [string appendString:@" AND version = ?4"];
+    }
+    if (substring.length) {
+      [string appendString:@" AND message LIKE ?5 ESCAPE '\\'"];
+    }
+    [string appendFormat:@" ORDER BY timestamp %@", backward ? @"DESC" : @"ASC"];
     if (limit > 0) {
-      string = [string stringByAppendingFormat:@" LIMIT %i", (int)limit];
+      [string appendFormat:@" LIMIT %i", (int)limit];
     }
     sqlite3_stmt* statement = NULL;
     int result = sqlite3_prepare_v2(_database, [string UTF8String], -1, &statement, NULL);
     assert(result == SQLITE_OK);
     if (result == SQLITE_OK) {
+      if (minTimestamp > 0.0) {
+        result = sqlite3_bind_double(statement, 1, minTimestamp);
+        assert(result == SQLITE_OK);
+      }
+      if (maxTimestamp > 0.0) {
+        result = sqlite3_bind_double(statement, 2, maxTimestamp);
+        assert(result == SQLITE_OK);
+      }
+      if (minLevel > kLogLevel_Debug) {
+        result = sqlite3_bind_int(statement, 3, minLevel);
+        assert(result == SQLITE_OK);
+      }
+      if (appVersion > 0) {
+        result = sqlite3_bind_int(statement, 4, (int)appVersion);
+        assert(result == SQLITE_OK);
+      }
+      if (substring.length) {
+        NSString* pattern = [substring stringByReplacingOccurrencesOfString:@"\\" withString:@"\\\\"];
+        pattern = [pattern stringByReplacingOccurrencesOfString:@"%" withString:@"\\%"];
+        pattern = [pattern stringByReplacingOccurrencesOfString:@"_" withString:@"\\_"];
+        result = sqlite3_bind_text(statement, 5, [[NSString stringWithFormat:@"%%%@%%", pattern] UTF8String], -1, SQLITE_TRANSIENT);
+        assert(result == SQLITE_OK);
+      }
       while (1) {
         result = sqlite3_step(statement);
         assert((result == SQLITE_ROW) || (result == SQLITE_DONE));
@@ -261,6 +649,8 @@ void LoggingReplayHistory(LoggingReplayCallback callback, void* context, BOOL ba
     }
     result = sqlite3_finalize(statement);
     assert(result == SQLITE_OK);
+  } else if ((_segmentFD >= 0) && callback) {
+    _QuerySegments(callback, context, minTimestamp, maxTimestamp, minLevel, appVersion, substring, backward, limit);
   }
   OSSpinLockUnlock(&_spinLock);
 }
@@ -277,16 +667,31 @@ void LoggingEnumerateHistory(BOOL backward, NSUInteger limit,
   LoggingReplayHistory(_BlockReplayCallback, block, backward, limit);
 }
 
+void LoggingEnumerateHistoryMatching(NSTimeInterval minTimestamp, NSTimeInterval maxTimestamp, LogLevel minLevel, NSUInteger appVersion,
+                                     NSString* substring, BOOL backward, NSUInteger limit,
+                                     void (^block)(NSUInteger appVersion, NSTimeInterval timestamp, LogLevel level, NSString* message)) {
+  LoggingQueryHistory(_BlockReplayCallback, block, minTimestamp, maxTimestamp, minLevel, appVersion, substring, backward, limit);
+}
+
 #endif
 
 void LoggingDisableHistory() {
   OSSpinLockLock(&_spinLock);
   if (_database) {
+    dispatch_source_cancel(_historyTimer);
+    dispatch_release(_historyTimer);
+    _historyTimer = NULL;
+    _CommitHistory();
     int result = sqlite3_finalize(_statement);
     assert(result == SQLITE_OK);
     result = sqlite3_close(_database);
     assert(result == SQLITE_OK);
     _database = NULL;
+  } else if (_segmentFD >= 0) {
+    close(_segmentFD);
+    _segmentFD = -1;
+    [_segmentDirectory release];
+    _segmentDirectory = nil;
   }
   OSSpinLockUnlock(&_spinLock);
 }
@@ -488,6 +893,409 @@ void LoggingDisableRemoteAccess(BOOL keepConnectionAlive) {
   OSSpinLockUnlock(&_spinLock);
 }
 
+// Called from any thread: only copies bytes to the clients' buffers and never blocks on the network
+static void _StreamMessages(LogRecord* records, struct iovec* vectors, NSUInteger count) {
+  BOOL wakeUp = NO;
+  OSSpinLockLock(&_streamLock);
+  for (NSUInteger i = 0; i < _streamClientCount; ++i) {
+    StreamClient* client = _streamClients[i];
+    for (NSUInteger j = 0; j < count; ++j) {
+      if (records[j].level < client->minLevel) {
+        continue;
+      }
+      size_t size = vectors[j].iov_len;
+      if (client->length + size > kStreamClientBufferSize) {
+        client->droppedCount += 1;
+        if (client->stallTime == 0.0) {
+          client->stallTime = records[j].timestamp;
+        }
+        continue;
+      }
+      if (client->length == 0) {
+        wakeUp = YES;
+      }
+      size_t tail = (client->head + client->length) % kStreamClientBufferSize;
+      size_t chunk = MIN(size, kStreamClientBufferSize - tail);
+      memcpy(client->buffer + tail, vectors[j].iov_base, chunk);
+      memcpy(client->buffer, (char*)vectors[j].iov_base + chunk, size - chunk);
+      client->length += size;
+    }
+  }
+  OSSpinLockUnlock(&_streamLock);
+  if (wakeUp) {
+    char byte = 0;
+    write(_streamPipe[1], &byte, 1);  // Pipe is non-blocking so this fails silently if already full
+  }
+}
+
+static void _CloseStreamClient(StreamClient* client) {
+  close(client->socket);
+  free(client->buffer);
+  free(client);
+}
+
+// Returns NO if the client must be disconnected
+static BOOL _ReadStreamClient(StreamClient* client) {
+  char buffer[kReadBufferSize];
+  ssize_t count = read(client->socket, buffer, sizeof(buffer));
+  if (count == 0) {
+    return NO;
+  }
+  if (count < 0) {
+    return (errno == EAGAIN) || (errno == EINTR);
+  }
+  for (ssize_t i = 0; i < count; ++i) {  // Clients can change their level filter by sending its value as a digit
+    if ((buffer[i] >= '0') && (buffer[i] <= '0' + kLogLevel_Abort)) {
+      OSSpinLockLock(&_streamLock);
+      client->minLevel = buffer[i] - '0';
+      OSSpinLockUnlock(&_streamLock);
+    }
+  }
+  return YES;
+}
+
+// Returns NO if the client must be disconnected
+static BOOL _WriteStreamClient(StreamClient* client) {
+  OSSpinLockLock(&_streamLock);
+  char* bytes = client->buffer + client->head;
+  size_t size = MIN(client->length, kStreamClientBufferSize - client->head);  // Producers only append after the tail so this range is stable
+  OSSpinLockUnlock(&_streamLock);
+  ssize_t count = write(client->socket, bytes, size);
+  if (count < 0) {
+    return (errno == EAGAIN) || (errno == EINTR);
+  }
+  OSSpinLockLock(&_streamLock);
+  client->head = (client->head + count) % kStreamClientBufferSize;
+  client->length -= count;
+  if (client->droppedCount && (client->length < kStreamClientBufferSize / 2)) {
+    char notice[64];
+    size_t length = snprintf(notice, sizeof(notice), "<%lu MESSAGES DROPPED>\n", (unsigned long)client->droppedCount);
+    size_t tail = (client->head + client->length) % kStreamClientBufferSize;
+    size_t chunk = MIN(length, kStreamClientBufferSize - tail);
+    memcpy(client->buffer + tail, notice, chunk);
+    memcpy(client->buffer, notice + chunk, length - chunk);
+    client->length += length;
+    client->droppedCount = 0;
+    client->stallTime = 0.0;
+  }
+  OSSpinLockUnlock(&_streamLock);
+  return YES;
+}
+
+// Event loop over the listening socket, the wake up pipe and all clients - Only this thread adds or removes clients
+static void* _StreamThread(void* context) {
+  struct pollfd fds[2 + kStreamMaxClients];
+  StreamClient* clients[kStreamMaxClients];
+  while (_streamRunning) {
+    fds[0].fd = _streamPipe[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = _streamSocket;
+    fds[1].events = POLLIN;
+    OSSpinLockLock(&_streamLock);
+    NSUInteger count = _streamClientCount;
+    for (NSUInteger i = 0; i < count; ++i) {
+      clients[i] = _streamClients[i];
+      fds[2 + i].fd = clients[i]->socket;
+      fds[2 + i].events = POLLIN | (clients[i]->length ? POLLOUT : 0);
+    }
+    OSSpinLockUnlock(&_streamLock);
+    if (poll(fds, 2 + (nfds_t)count, kStreamPollInterval) < 0) {
+      continue;
+    }
+    
+    if (fds[0].revents & POLLIN) {
+      char buffer[kReadBufferSize];
+      while (read(_streamPipe[0], buffer, sizeof(buffer)) > 0) ;
+    }
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    for (NSUInteger i = 0; i < count; ++i) {
+      StreamClient* client = clients[i];
+      BOOL keep = !(fds[2 + i].revents & (POLLERR | POLLHUP | POLLNVAL));
+      if (keep && (fds[2 + i].revents & POLLIN)) {
+        keep = _ReadStreamClient(client);
+      }
+      if (keep && (fds[2 + i].revents & POLLOUT)) {
+        keep = _WriteStreamClient(client);
+      }
+      if (keep && (client->stallTime > 0.0) && (now - client->stallTime > kStreamStallTimeOut)) {
+        keep = NO;  // Drop clients which cannot keep up
+      }
+      if (!keep) {
+        OSSpinLockLock(&_streamLock);
+        for (NSUInteger j = 0; j < _streamClientCount; ++j) {
+          if (_streamClients[j] == client) {
+            _streamClients[j] = _streamClients[--_streamClientCount];
+            break;
+          }
+        }
+        OSSpinLockUnlock(&_streamLock);
+        _CloseStreamClient(client);
+      }
+    }
+    if (fds[1].revents & POLLIN) {
+      int fd = accept(_streamSocket, NULL, NULL);
+      if (fd >= 0) {
+        int yes = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        StreamClient* client = calloc(1, sizeof(StreamClient));
+        client->socket = fd;
+        client->minLevel = _streamMinLevel;
+        client->buffer = malloc(kStreamClientBufferSize);
+        OSSpinLockLock(&_streamLock);
+        if (_streamClientCount < kStreamMaxClients) {
+          _streamClients[_streamClientCount++] = client;
+          client = NULL;
+        }
+        OSSpinLockUnlock(&_streamLock);
+        if (client) {
+          _CloseStreamClient(client);
+        }
+      }
+    }
+  }
+  
+  OSSpinLockLock(&_streamLock);
+  while (_streamClientCount) {
+    _CloseStreamClient(_streamClients[--_streamClientCount]);
+  }
+  OSSpinLockUnlock(&_streamLock);
+  return NULL;
+}
+
+BOOL LoggingIsRemoteStreamingEnabled() {
+  return _streamRunning;
+}
+
+BOOL LoggingEnableRemoteStreaming(NSUInteger port, LogLevel minLevel) {
+  if (!_streamRunning) {
+    _streamSocket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (_streamSocket >= 0) {
+      int yes = 1;
+      setsockopt(_streamSocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+      
+      struct sockaddr_in addr4;
+      bzero(&addr4, sizeof(addr4));
+      addr4.sin_len = sizeof(addr4);
+      addr4.sin_family = AF_INET;
+      addr4.sin_port = htons(port);
+      addr4.sin_addr.s_addr = htonl(INADDR_ANY);
+      if ((bind(_streamSocket, (struct sockaddr*)&addr4, sizeof(addr4)) == 0) && (listen(_streamSocket, kStreamMaxClients) == 0)
+          && (pipe(_streamPipe) == 0)) {
+        fcntl(_streamSocket, F_SETFL, O_NONBLOCK);
+        fcntl(_streamPipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(_streamPipe[1], F_SETFL, O_NONBLOCK);
+        _streamMinLevel = minLevel;
+        _streamRunning = YES;
+        if (pthread_create(&_streamThread, NULL, _StreamThread, NULL) != 0) {
+          _streamRunning = NO;
+        }
+      }
+      if (!_streamRunning) {
+        if (_streamPipe[0] >= 0) {
+          close(_streamPipe[0]);
+          close(_streamPipe[1]);
+          _streamPipe[0] = _streamPipe[1] = -1;
+        }
+        close(_streamSocket);
+        _streamSocket = -1;
+      }
+    }
+  }
+  return _streamRunning;
+}
+
+void LoggingDisableRemoteStreaming() {
+  if (_streamRunning) {
+    _streamRunning = NO;
+    char byte = 0;
+    write(_streamPipe[1], &byte, 1);
+    pthread_join(_streamThread, NULL);
+    close(_streamPipe[0]);
+    close(_streamPipe[1]);
+    _streamPipe[0] = _streamPipe[1] = -1;
+    close(_streamSocket);
+    _streamSocket = -1;
+  }
+}
+
+NSUInteger LoggingGetRemoteStreamingClientCount() {
+  return _streamClientCount;
+}
+
+// Must be called without spinlock taken and from within an autorelease pool
+static void _OutputRecords(LogRecord* records, NSUInteger count) {
+  NSString* contents[kAsyncBatchSize];
+  struct iovec vectors[kAsyncBatchSize];
+  BOOL recordHistory = NO;
+  assert(count <= kAsyncBatchSize);
+  for (NSUInteger i = 0; i < count; ++i) {
+    contents[i] = [[NSString alloc] initWithFormat:@"[%s | %.3f] %@\n", _levelNames[records[i].level], records[i].timestamp - _startTime,
+                                                   records[i].message];
+    NSData* data = [contents[i] dataUsingEncoding:NSUTF8StringEncoding allowLossyConversion:YES];
+    vectors[i].iov_base = (void*)data.bytes;
+    vectors[i].iov_len = data.length;
+    if (records[i].level >= kLogLevel_Info) {  // Don't record debug or verbose levels
+      recordHistory = YES;
+    }
+  }
+  writev(_outputFD, vectors, (int)count);
+  if (_streamClientCount) {
+    _StreamMessages(records, vectors, count);
+  }
+  if (recordHistory && LoggingIsHistoryEnabled()) {
+    OSSpinLockLock(&_spinLock);
+    if (LoggingIsHistoryEnabled()) {
+      for (NSUInteger i = 0; i < count; ++i) {
+        if (records[i].level >= kLogLevel_Info) {
+          _AppendHistory(records[i].timestamp, records[i].level, [records[i].message UTF8String]);
+        }
+      }
+    }
+    OSSpinLockUnlock(&_spinLock);
+  }
+  if (_writeStream) {
+    OSSpinLockLock(&_spinLock);
+    for (NSUInteger i = 0; (i < count) && _writeStream; ++i) {
+      if (CFWriteStreamGetStatus(_writeStream) == kCFStreamStatusOpen) {
+        _WriteStream(contents[i]);
+      } else {
+        _CloseStreams();
+      }
+    }
+    OSSpinLockUnlock(&_spinLock);
+  }
+  for (NSUInteger i = 0; i < count; ++i) {
+    [contents[i] release];
+  }
+}
+
+// Lock-free bounded MPSC queue: producers claim slots by bumping the enqueue position, the drainer thread is the only consumer
+static BOOL _EnqueueRecord(CFTimeInterval timestamp, LogLevel level, NSString* message) {
+  int64_t position = _asyncEnqueuePosition;
+  while (1) {
+    AsyncEntry* entry = &_asyncQueue[position & (kAsyncQueueSize - 1)];
+    OSMemoryBarrier();
+    int64_t difference = entry->sequence - position;
+    if (difference == 0) {
+      if (OSAtomicCompareAndSwap64Barrier(position, position + 1, &_asyncEnqueuePosition)) {
+        entry->record.timestamp = timestamp;
+        entry->record.level = level;
+        entry->record.message = message;
+        OSMemoryBarrier();
+        entry->sequence = position + 1;
+        OSMemoryBarrier();  // Pairs with the drainer setting _asyncDrainerSleeping then re-checking the sequence so neither side misses the other
+        return YES;
+      }
+    } else if (difference < 0) {
+      return NO;  // Queue is full
+    }
+    position = _asyncEnqueuePosition;
+  }
+  return NO;
+}
+
+// Must only be called from drainer thread
+static BOOL _DequeueRecord(LogRecord* record) {
+  int64_t position = _asyncDequeuePosition;
+  AsyncEntry* entry = &_asyncQueue[position & (kAsyncQueueSize - 1)];
+  OSMemoryBarrier();
+  if (entry->sequence != position + 1) {
+    return NO;
+  }
+  *record = entry->record;
+  OSMemoryBarrier();
+  entry->sequence = position + kAsyncQueueSize;
+  _asyncDequeuePosition = position + 1;
+  return YES;
+}
+
+static inline void _WakeUpDrainer() {
+  if (_asyncDrainerSleeping && OSAtomicCompareAndSwap32Barrier(1, 0, &_asyncDrainerSleeping)) {
+    dispatch_semaphore_signal(_asyncSemaphore);
+  }
+}
+
+static void* _DrainerThread(void* context) {
+  int32_t reportedDroppedCount = 0;
+  while (1) {
+    NSAutoreleasePool* localPool = [[NSAutoreleasePool alloc] init];
+    LogRecord records[kAsyncBatchSize];
+    NSUInteger count = 0;
+    while ((count < kAsyncBatchSize) && _DequeueRecord(&records[count])) {
+      count += 1;
+    }
+    int32_t droppedCount = _asyncDroppedCount;
+    if (droppedCount != reportedDroppedCount) {
+      LogRecord record = {CFAbsoluteTimeGetCurrent(), kLogLevel_Warning,
+                          [NSString stringWithFormat:@"<%i MESSAGES DROPPED>", droppedCount - reportedDroppedCount]};
+      _OutputRecords(&record, 1);
+      reportedDroppedCount = droppedCount;
+    }
+    if (count > 0) {
+      _OutputRecords(records, count);
+      for (NSUInteger i = 0; i < count; ++i) {
+        [records[i].message release];
+      }
+      OSMemoryBarrier();
+      _asyncWrittenPosition = _asyncDequeuePosition;
+    }
+    [localPool release];
+    
+    if (count == 0) {
+      _asyncDrainerSleeping = 1;
+      OSMemoryBarrier();
+      if (_asyncQueue[_asyncDequeuePosition & (kAsyncQueueSize - 1)].sequence == _asyncDequeuePosition + 1) {
+        OSAtomicCompareAndSwap32Barrier(1, 0, &_asyncDrainerSleeping);  // If this fails, the semaphore was signaled and next wait returns immediately
+        continue;
+      }
+      dispatch_semaphore_wait(_asyncSemaphore, DISPATCH_TIME_FOREVER);
+    }
+  }
+  return NULL;
+}
+
+BOOL LoggingIsAsynchronousModeEnabled() {
+  return _asyncEnabled;
+}
+
+void LoggingEnableAsynchronousMode() {
+  OSSpinLockLock(&_spinLock);
+  if (_asyncQueue == NULL) {
+    _asyncQueue = calloc(kAsyncQueueSize, sizeof(AsyncEntry));
+    assert(_asyncQueue);
+    for (int64_t i = 0; i < kAsyncQueueSize; ++i) {
+      _asyncQueue[i].sequence = i;
+    }
+    _asyncSemaphore = dispatch_semaphore_create(0);
+    assert(_asyncSemaphore);
+    int result = pthread_create(&_asyncThread, NULL, _DrainerThread, NULL);
+    assert(result == 0);
+    pthread_detach(_asyncThread);
+  }
+  _asyncEnabled = YES;
+  OSSpinLockUnlock(&_spinLock);
+}
+
+void LoggingDisableAsynchronousMode() {
+  _asyncEnabled = NO;
+  LoggingFlushAsynchronousMessages();
+}
+
+void LoggingFlushAsynchronousMessages() {
+  if (_asyncQueue && !pthread_equal(pthread_self(), _asyncThread)) {
+    int64_t position = _asyncEnqueuePosition;
+    while (_asyncWrittenPosition < position) {
+      _WakeUpDrainer();
+      usleep(kAsyncFlushInterval);
+    }
+  }
+}
+
+NSUInteger LoggingGetDroppedMessageCount() {
+  return _asyncDroppedCount;
+}
+
 void LogMessage(LogLevel level, NSString* format, ...) {
   va_list arguments;
   va_start(arguments, format);
@@ -513,32 +1321,22 @@ void LogRawMessage(LogLevel level, NSString* message) {
   }
 #endif
   CFTimeInterval timestamp = CFAbsoluteTimeGetCurrent();
-  CFTimeInterval relativeTime = timestamp - _startTime;
-  NSString* content = [[NSString alloc] initWithFormat:@"[%s | %.3f] %@\n", _levelNames[level], relativeTime, message];
-  NSData* data = [content dataUsingEncoding:NSUTF8StringEncoding allowLossyConversion:YES];
-  write(_outputFD, data.bytes, data.length);
-  if (_loggingCallback) {
-    (*_loggingCallback)(timestamp, level, message, _loggingContext);
-  }
-  if (_database && (level >= kLogLevel_Info)) {  // Don't record debug or verbose levels
-    OSSpinLockLock(&_spinLock);
-    if (_database) {
-      _AppendHistory(timestamp, level, [message UTF8String]);
+  if (_asyncEnabled && (level < kLogLevel_Abort)) {
+    NSString* copy = [message copy];
+    if (_EnqueueRecord(timestamp, level, copy)) {
+      _WakeUpDrainer();
+    } else {
+      [copy release];
+      OSAtomicIncrement32Barrier(&_asyncDroppedCount);
     }
-    OSSpinLockUnlock(&_spinLock);
+  } else {
+    LoggingFlushAsynchronousMessages();  // Preserve ordering with messages still queued
+    LogRecord record = {timestamp, level, message};
+    _OutputRecords(&record, 1);
   }
-  if (_writeStream) {
-    OSSpinLockLock(&_spinLock);
-    if (_writeStream) {
-      if (CFWriteStreamGetStatus(_writeStream) == kCFStreamStatusOpen) {
-        _WriteStream(content);
-      } else {
-        _CloseStreams();
-      }
-    }
-    OSSpinLockUnlock(&_spinLock);
+  if (_loggingCallback) {
+    (*_loggingCallback)(timestamp, level, message, _loggingContext);
   }
-  [content release];
   
   if (level >= kLogLevel_Abort) {
     LoggingDisableHistory();  // Ensure database is in a clean state
@@ -0,0 +1,285 @@
+// Copyright 2011 Cooliris, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#import <fcntl.h>
+#import <unistd.h>
+#import <poll.h>
+#import <netinet/in.h>
+#import <arpa/inet.h>
+#import <sqlite3.h>
+
+#import "UnitTest.h"
+
+#define kBenchmarkIterations 20000
+#define kTestVersion 42
+#define kTestPort 21234
+#define kTimeOut 5.0
+
+@interface LoggingTests : UnitTest {
+@private
+  NSString* _path;
+  int _stdoutFD;
+}
+@end
+
+static void _CountCallback(NSUInteger appVersion, NSTimeInterval timestamp, LogLevel level, NSString* message, void* context) {
+  *(NSUInteger*)context += 1;
+}
+
+@implementation LoggingTests
+
+- (void) setUp {
+  _path = [[NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]] retain];
+  _stdoutFD = -1;
+}
+
+// Silence output so that benchmarks measure history backends only
+- (void) _redirectStdout {
+  fflush(stdout);
+  _stdoutFD = dup(STDOUT_FILENO);
+  int fd = open("/dev/null", O_WRONLY);
+  dup2(fd, STDOUT_FILENO);
+  close(fd);
+}
+
+- (void) _restoreStdout {
+  fflush(stdout);
+  dup2(_stdoutFD, STDOUT_FILENO);
+  close(_stdoutFD);
+  _stdoutFD = -1;
+}
+
+- (void) _testHistory {
+  AssertTrue(LoggingIsHistoryEnabled());
+  LogRawMessage(kLogLevel_Info, @"<history 1>");
+  LogRawMessage(kLogLevel_Verbose, @"<history 2>");  // Not recorded
+  LogRawMessage(kLogLevel_Warning, @"<history 3>");
+  
+  NSMutableArray* messages = [NSMutableArray array];
+  LoggingEnumerateHistoryMatching(0.0, 0.0, kLogLevel_Debug, 0, @"<HISTORY", NO, 0,
+                                  ^(NSUInteger appVersion, NSTimeInterval timestamp, LogLevel level, NSString* message) {
+    [messages addObject:message];
+  });
+  AssertEqualObjects(messages, ([NSArray arrayWithObjects:@"<history 1>", @"<history 3>", nil]));
+  
+  [messages removeAllObjects];
+  LoggingEnumerateHistoryMatching(0.0, 0.0, kLogLevel_Warning, kTestVersion, @"<history", YES, 1,
+                                  ^(NSUInteger appVersion, NSTimeInterval timestamp, LogLevel level, NSString* message) {
+    [messages addObject:message];
+  });
+  AssertEqualObjects(messages, [NSArray arrayWithObject:@"<history 3>"]);
+  
+  NSUInteger count = 0;
+  LoggingQueryHistory(_CountCallback, &count, 0.0, 0.0, kLogLevel_Debug, kTestVersion + 1, nil, NO, 0);
+  AssertEqual(count, (NSUInteger)0);
+  
+  LogRawMessage(kLogLevel_Info, @"<\u00DCnicode>");
+  count = 0;
+  LoggingQueryHistory(_CountCallback, &count, 0.0, 0.0, kLogLevel_Debug, 0, @"<\u00DCNICODE", NO, 0);
+  AssertEqual(count, (NSUInteger)1);
+  count = 0;
+  LoggingQueryHistory(_CountCallback, &count, 0.0, 0.0, kLogLevel_Debug, 0, @"<\u00FCnicode", NO, 0);  // Only ASCII is case-insensitive
+  AssertEqual(count, (NSUInteger)0);
+  
+  LoggingPurgeHistory(0.0);
+  count = 0;
+  LoggingReplayHistory(_CountCallback, &count, NO, 0);
+  AssertEqual(count, (NSUInteger)0);
+  
+  LoggingDisableHistory();
+  AssertFalse(LoggingIsHistoryEnabled());
+}
+
+- (void) testDatabaseHistory {
+  AssertTrue(LoggingEnableHistory(_path, kTestVersion));
+  [self _testHistory];
+}
+
+// Counts the rows visible to another connection i.e. committed ones
+- (int) _countCommittedMessages:(const char*)pattern {
+  sqlite3* database = NULL;
+  int count = -1;
+  if (sqlite3_open_v2([_path fileSystemRepresentation], &database, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK) {
+    sqlite3_stmt* statement = NULL;
+    if (sqlite3_prepare_v2(database, "SELECT COUNT(*) FROM history WHERE message LIKE ?1", -1, &statement, NULL) == SQLITE_OK) {
+      sqlite3_bind_text(statement, 1, pattern, -1, SQLITE_STATIC);
+      if (sqlite3_step(statement) == SQLITE_ROW) {
+        count = sqlite3_column_int(statement, 0);
+      }
+      sqlite3_finalize(statement);
+    }
+  }
+  sqlite3_close(database);
+  return count;
+}
+
+// Rows are committed in batches except errors which must flush the pending batch immediately
+- (void) testDatabaseHistoryBatching {
+  AssertTrue(LoggingEnableHistory(_path, kTestVersion));
+  LogRawMessage(kLogLevel_Info, @"<batch info>");
+  AssertEqual([self _countCommittedMessages:"<batch %"], 0);
+  LogRawMessage(kLogLevel_Error, @"<batch error>");
+  AssertEqual([self _countCommittedMessages:"<batch %"], 2);
+  LoggingDisableHistory();
+}
+
+- (void) testSegmentedHistory {
+  AssertTrue(LoggingEnableSegmentedHistory(_path, kTestVersion, 256));  // Force rotation on every few records
+  [self _testHistory];
+}
+
+- (void) testAsynchronousMode {
+  AssertTrue(LoggingEnableHistory(_path, kTestVersion));
+  LoggingEnableAsynchronousMode();
+  AssertTrue(LoggingIsAsynchronousModeEnabled());
+  for (int i = 0; i < 100; ++i) {
+    LOG_INFO(@"<async %i>", i);
+  }
+  LoggingFlushAsynchronousMessages();
+  NSUInteger count = 0;
+  LoggingQueryHistory(_CountCallback, &count, 0.0, 0.0, kLogLevel_Debug, 0, @"<async ", NO, 0);
+  AssertEqual(count + LoggingGetDroppedMessageCount(), (NSUInteger)100);
+  LoggingDisableAsynchronousMode();
+  AssertFalse(LoggingIsAsynchronousModeEnabled());
+  LoggingDisableHistory();
+}
+
+// A message logged once the drainer is idle must be written without any further logging or flushing
+- (void) testAsynchronousWakeUp {
+  AssertTrue(LoggingEnableHistory(_path, kTestVersion));
+  LoggingEnableAsynchronousMode();
+  for (int i = 0; i < 10; ++i) {
+    usleep(50000);  // Let the drainer go back to sleep
+    LogRawMessage(kLogLevel_Info, [NSString stringWithFormat:@"<wakeup %i>", i]);
+    NSUInteger count = 0;
+    CFAbsoluteTime time = CFAbsoluteTimeGetCurrent();
+    while ((count == 0) && (CFAbsoluteTimeGetCurrent() - time < kTimeOut)) {
+      usleep(1000);
+      LoggingQueryHistory(_CountCallback, &count, 0.0, 0.0, kLogLevel_Debug, 0, [NSString stringWithFormat:@"<wakeup %i>", i], NO, 0);
+    }
+    AssertEqual(count, (NSUInteger)1);
+  }
+  LoggingDisableAsynchronousMode();
+  LoggingDisableHistory();
+}
+
+- (int) _connectToPort:(int)port {
+  int fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+  struct sockaddr_in addr4;
+  bzero(&addr4, sizeof(addr4));
+  addr4.sin_len = sizeof(addr4);
+  addr4.sin_family = AF_INET;
+  addr4.sin_port = htons(port);
+  addr4.sin_addr.s_addr = inet_addr("127.0.0.1");
+  if (connect(fd, (struct sockaddr*)&addr4, sizeof(addr4)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+- (NSString*) _readFromSocket:(int)fd untilString:(NSString*)string {
+  NSMutableData* data = [NSMutableData data];
+  CFAbsoluteTime time = CFAbsoluteTimeGetCurrent();
+  while (CFAbsoluteTimeGetCurrent() - time < kTimeOut) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, 100) > 0) {
+      char buffer[1024];
+      ssize_t count = read(fd, buffer, sizeof(buffer));
+      if (count <= 0) {
+        break;
+      }
+      [data appendBytes:buffer length:count];
+      NSString* result = [[[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding] autorelease];
+      if ([result rangeOfString:string].location != NSNotFound) {
+        return result;
+      }
+    }
+  }
+  return nil;
+}
+
+- (void) testRemoteStreaming {
+  AssertTrue(LoggingEnableRemoteStreaming(kTestPort, kLogLevel_Debug));
+  AssertTrue(LoggingIsRemoteStreamingEnabled());
+  int fd1 = [self _connectToPort:kTestPort];
+  AssertTrue(fd1 >= 0);
+  int fd2 = [self _connectToPort:kTestPort];
+  AssertTrue(fd2 >= 0);
+  AssertEqual(write(fd2, "3\n", 2), (ssize_t)2);  // Only receive warnings and above
+  CFAbsoluteTime time = CFAbsoluteTimeGetCurrent();
+  while ((LoggingGetRemoteStreamingClientCount() < 2) && (CFAbsoluteTimeGetCurrent() - time < kTimeOut)) {
+    usleep(10000);
+  }
+  AssertEqual(LoggingGetRemoteStreamingClientCount(), (NSUInteger)2);
+  usleep(100000);  // Give the server time to process the level change
+  
+  LogRawMessage(kLogLevel_Info, @"<stream info>");
+  LogRawMessage(kLogLevel_Warning, @"<stream warning>");
+  NSString* string1 = [self _readFromSocket:fd1 untilString:@"<stream warning>"];
+  AssertNotNil(string1);
+  AssertTrue([string1 rangeOfString:@"<stream info>"].location != NSNotFound);
+  NSString* string2 = [self _readFromSocket:fd2 untilString:@"<stream warning>"];
+  AssertNotNil(string2);
+  AssertTrue([string2 rangeOfString:@"<stream info>"].location == NSNotFound);
+  
+  close(fd1);
+  close(fd2);
+  LoggingDisableRemoteStreaming();
+  AssertFalse(LoggingIsRemoteStreamingEnabled());
+  AssertEqual(LoggingGetRemoteStreamingClientCount(), (NSUInteger)0);
+}
+
+- (void) _benchmarkHistory:(NSString*)name {
+  [self _redirectStdout];
+  CFAbsoluteTime time = CFAbsoluteTimeGetCurrent();
+  for (int i = 0; i < kBenchmarkIterations; ++i) {
+    LogRawMessage(kLogLevel_Info, @"Lorem ipsum dolor sit amet, consectetur adipisicing elit, sed do eiusmod tempor incididunt");
+  }
+  CFAbsoluteTime appendTime = CFAbsoluteTimeGetCurrent() - time;
+  [self _restoreStdout];
+  
+  NSUInteger count = 0;
+  time = CFAbsoluteTimeGetCurrent();
+  LoggingReplayHistory(_CountCallback, &count, NO, 0);
+  CFAbsoluteTime forwardTime = CFAbsoluteTimeGetCurrent() - time;
+  time = CFAbsoluteTimeGetCurrent();
+  LoggingReplayHistory(_CountCallback, &count, YES, 0);
+  CFAbsoluteTime backwardTime = CFAbsoluteTimeGetCurrent() - time;
+  AssertGreaterThan(count, (NSUInteger)(2 * kBenchmarkIterations - 1));
+  
+  LOG_INFO(@"%@ history: %.0f appends/s, %.0f forward replays/s, %.0f backward replays/s", name,
+           kBenchmarkIterations / appendTime, kBenchmarkIterations / forwardTime, kBenchmarkIterations / backwardTime);
+  LoggingDisableHistory();
+}
+
+- (void) testHistoryBenchmark {
+  AssertTrue(LoggingEnableHistory(_path, kTestVersion));
+  [self _benchmarkHistory:@"Database"];
+  [[NSFileManager defaultManager] removeItemAtPath:_path error:NULL];
+  
+  AssertTrue(LoggingEnableSegmentedHistory(_path, kTestVersion, 0));
+  [self _benchmarkHistory:@"Segmented"];
+}
+
+- (void) cleanUp {
+  if (_stdoutFD >= 0) {
+    [self _restoreStdout];
+  }
+  LoggingDisableHistory();
+  [[NSFileManager defaultManager] removeItemAtPath:_path error:NULL];
+  [_path release];
+}
+
+@end
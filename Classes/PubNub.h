@@ -21,12 +21,20 @@
 - (void) pubnub:(PubNub*)pubnub didSucceedPublishingMessageToChannel:(NSString*)channel;
 - (void) pubnub:(PubNub*)pubnub didFailPublishingMessageToChannel:(NSString*)channel error:(NSString*)error;  // "error" may be nil
 - (void) pubnub:(PubNub*)pubnub didReceiveMessage:(id)message onChannel:(NSString*)channel;
+- (void) pubnub:(PubNub*)pubnub didReceiveMessages:(NSArray*)messages onChannel:(NSString*)channel;  // Called instead of the above if implemented
 - (void) pubnub:(PubNub*)pubnub didFetchHistory:(NSArray*)messages forChannel:(NSString*)channel;  // "messages" will be nil on failure
+- (void) pubnub:(PubNub*)pubnub didFetchPartialHistory:(NSArray*)messages forChannel:(NSString*)channel;  // Background decoding mode only
 - (void) pubnub:(PubNub*)pubnub didReceiveTime:(NSTimeInterval)time;  // "time" will be NAN on failure
 @end
 
 // All operations happen on the main thread
 // Messages must be JSON compatible and less than 1800 bytes once serialized
+// Published messages are queued and sent in order for each channel with a bounded number of concurrent requests, retrying on
+// network failures with exponential back-off - Serialization and signing happen on a background queue
+// In background decoding mode, responses are decoded on a background queue and history arrays are decoded as they are received
+// so that messages are passed in batches to -pubnub:didFetchPartialHistory:forChannel: before -pubnub:didFetchHistory:forChannel:
+// In multiplexing mode, all subscribed channels share a single long-poll request and time token instead of one request per channel
+// and subscribing or unsubscribing restarts that request (changes made in the same run loop iteration are coalesced)
 @interface PubNub : NSObject {
 @private
   id<PubNubDelegate> _delegate;
@@ -36,8 +44,23 @@
   NSString* _host;
   
   NSMutableSet* _connections;
+  BOOL _multiplexing;
+  NSMutableSet* _channels;
+  NSString* _timeToken;
+  
+  NSThread* _thread;
+  dispatch_queue_t _publishQueue;
+  NSMutableArray* _pendingMessages;
+  NSUInteger _maximumConcurrentPublishes;
+  BOOL _preparing;
+  BOOL _backgroundDecoding;
+  dispatch_queue_t _decodingQueue;
 }
 @property(nonatomic, assign) id<PubNubDelegate> delegate;
+@property(nonatomic, getter=isMultiplexingEnabled) BOOL multiplexingEnabled;  // Default is NO - Existing subscriptions are preserved
+@property(nonatomic) NSUInteger maximumConcurrentPublishes;  // Default is 4
+@property(nonatomic, readonly) NSUInteger pendingPublishCount;  // Including messages in flight
+@property(nonatomic, getter=isBackgroundDecodingEnabled) BOOL backgroundDecodingEnabled;  // Default is NO - Applies to new requests
 - (PubNub*) initWithSubscribeKey:(NSString*)subscribeKey useSSL:(BOOL)useSSL;
 - (PubNub*) initWithPublishKey:(NSString*)publishKey
                   subscribeKey:(NSString*)subscribeKey
@@ -23,15 +23,36 @@
 #define kConnectionTimeOut 200.0  // From https://github.com/jazzychad/CEPubnub/blob/master/CEPubnub/CEPubnubRequest.m
 #define kMinRetryInterval 5.0
 #define kInitialTimeToken @"0"
+#define kDefaultMaximumConcurrentPublishes 4
+#define kMaxPublishRetries 3
+#define kPublishRetryInterval 0.5  // Doubled on each retry
 
 typedef enum {
   kCommand_Undefined = 0,
   kCommand_SendMessage,
   kCommand_ReceiveMessage,
+  kCommand_ReceiveMultiplexedMessages,
   kCommand_FetchHistory,
   kCommand_GetTime
 } Command;
 
+// Incrementally splits a top-level JSON array into its elements and decodes each of them as soon as it is complete
+@interface PubNubJSONArrayParser : NSObject {
+@private
+  NSMutableData* _element;
+  NSMutableArray* _objects;
+  NSUInteger _depth;
+  BOOL _inString;
+  BOOL _escaped;
+  BOOL _complete;
+  BOOL _failed;
+}
+@property(nonatomic, readonly) NSArray* objects;  // All elements decoded so far
+@property(nonatomic, readonly, getter=isComplete) BOOL complete;
+@property(nonatomic, readonly, getter=hasFailed) BOOL failed;
+- (NSArray*) parseBytes:(const unsigned char*)bytes length:(NSUInteger)length;  // Returns the elements completed by these bytes
+@end
+
 @interface PubNubConnection : NSURLConnection {
 @private
   PubNub* _pubNub;
@@ -40,15 +61,47 @@ typedef enum {
   
   NSHTTPURLResponse* _response;
   NSMutableData* _data;
+  
+  NSThread* _thread;
+  dispatch_queue_t _decodingQueue;
+  PubNubJSONArrayParser* _parser;
+  BOOL _cancelled;
 }
 @property(nonatomic, readonly) Command command;
 @property(nonatomic, readonly) NSString* channel;
 @property(nonatomic, readonly) NSData* data;
 - (id) initWithPubNub:(PubNub*)pubNub url:(NSURL*)url command:(Command)command channel:(NSString*)channel;
+- (void) _decodeData:(NSData*)data;
+- (void) _finishDecoding;
+@end
+
+// Messages stay in the pending queue while in flight so that later messages on the same channel wait for them
+@interface PubNubMessage : NSObject {
+@private
+  NSString* _channel;
+  id _message;
+  NSURL* _url;
+  BOOL _prepared;
+  NSUInteger _retries;
+  CFAbsoluteTime _retryTime;
+  PubNubConnection* _connection;
+}
+@property(nonatomic, readonly) NSString* channel;
+@property(nonatomic, readonly) id message;
+@property(nonatomic, retain) NSURL* url;  // Set on the background queue then only accessed once prepared
+@property(nonatomic, getter=isPrepared) BOOL prepared;
+@property(nonatomic) NSUInteger retries;
+@property(nonatomic) CFAbsoluteTime retryTime;
+@property(nonatomic, assign) PubNubConnection* connection;
+- (id) initWithMessage:(id)message channel:(NSString*)channel;
 @end
 
 @interface PubNub ()
 - (void) connection:(PubNubConnection*)connection didCompleteWithResponse:(id)response;
+- (void) connection:(PubNubConnection*)connection didDecodePartialHistory:(NSArray*)messages;
+- (void) _prepareMessages:(NSArray*)messages;
+- (void) _pumpPublishQueue;
+- (dispatch_queue_t) _decodingQueue;  // NULL if background decoding is disabled
 @end
 
 static id _ReadJSONData(NSData* data) {
@@ -61,6 +114,16 @@ static id _ReadJSONData(NSData* data) {
   return object;
 }
 
+static id _ReadJSONElement(NSData* data) {
+  NSError* error = nil;
+  id object = [NSJSONSerialization JSONObjectWithData:data options:NSJSONReadingAllowFragments error:&error];
+  if (object == nil) {
+    LOG_ERROR(@"PubNub JSON deserializing failed: %@", error);
+    return nil;
+  }
+  return object;
+}
+
 static NSString* _WriteJSONString(id object) {
   NSError* error = nil;
   NSData* data = [NSJSONSerialization dataWithJSONObject:object options:0 error:&error];
@@ -71,6 +134,107 @@ static NSString* _WriteJSONString(id object) {
   return [[[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding] autorelease];
 }
 
+@implementation PubNubJSONArrayParser
+
+@synthesize objects=_objects, complete=_complete, failed=_failed;
+
+- (id) init {
+  if ((self = [super init])) {
+    _element = [[NSMutableData alloc] init];
+    _objects = [[NSMutableArray alloc] init];
+  }
+  return self;
+}
+
+- (void) dealloc {
+  [_element release];
+  [_objects release];
+  
+  [super dealloc];
+}
+
+- (BOOL) _flushElement:(NSMutableArray*)objects {
+  const unsigned char* bytes = _element.bytes;
+  NSUInteger length = _element.length;
+  while (length && isspace(bytes[length - 1])) {
+    --length;
+  }
+  if (length) {
+    _element.length = length;
+    id object = _ReadJSONElement(_element);
+    if (object == nil) {
+      return NO;
+    }
+    [objects addObject:object];
+    [_objects addObject:object];
+  }
+  _element.length = 0;
+  return YES;
+}
+
+- (NSArray*) parseBytes:(const unsigned char*)bytes length:(NSUInteger)length {
+  NSMutableArray* objects = [NSMutableArray array];
+  NSUInteger start = 0;
+  for (NSUInteger i = 0; (i < length) && !_complete && !_failed; ++i) {
+    unsigned char c = bytes[i];
+    if (_depth == 0) {  // Before the opening bracket
+      if (c == '[') {
+        _depth = 1;
+        start = i + 1;
+      } else if (!isspace(c)) {
+        _failed = YES;
+      }
+      continue;
+    }
+    if (_inString) {
+      if (_escaped) {
+        _escaped = NO;
+      } else if (c == '\\') {
+        _escaped = YES;
+      } else if (c == '"') {
+        _inString = NO;
+      }
+    } else if (c == '"') {
+      _inString = YES;
+    } else if ((c == '[') || (c == '{')) {
+      _depth += 1;
+    } else if ((c == ']') || (c == '}')) {
+      _depth -= 1;
+    }
+    if (_depth == 0) {  // Closing bracket
+      [_element appendBytes:(bytes + start) length:(i - start)];
+      _failed = (c != ']') || ![self _flushElement:objects];
+      _complete = YES;
+    } else if ((_depth == 1) && (c == ',') && !_inString) {
+      [_element appendBytes:(bytes + start) length:(i - start)];
+      _failed = ![self _flushElement:objects];
+      start = i + 1;
+    }
+  }
+  if (_depth && !_complete && !_failed && (length > start)) {
+    [_element appendBytes:(bytes + start) length:(length - start)];
+  }
+  return objects;
+}
+
+@end
+
+static void _DecodeData(void* context) {
+  NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+  NSArray* array = (NSArray*)context;
+  [(PubNubConnection*)[array objectAtIndex:0] _decodeData:[array objectAtIndex:1]];
+  [array release];
+  [pool release];
+}
+
+static void _FinishDecoding(void* context) {
+  NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+  PubNubConnection* connection = (PubNubConnection*)context;
+  [connection _finishDecoding];
+  [connection release];
+  [pool release];
+}
+
 @implementation PubNubConnection
 
 @synthesize command=_command, channel=_channel, data=_data;
@@ -85,6 +249,11 @@ static NSString* _WriteJSONString(id object) {
     _command = command;
     _pubNub = pubNub;
     _channel = [channel copy];
+    _thread = [[NSThread currentThread] retain];
+    _decodingQueue = [pubNub _decodingQueue];
+    if (_decodingQueue) {
+      dispatch_retain(_decodingQueue);
+    }
   }
   return self;
 }
@@ -93,17 +262,85 @@ static NSString* _WriteJSONString(id object) {
   [_channel release];
   [_response release];
   [_data release];
+  [_thread release];
+  if (_decodingQueue) {
+    dispatch_release(_decodingQueue);
+  }
+  [_parser release];
   
   [super dealloc];
 }
 
+// Responses decoded in the background are dropped if the connection was cancelled in the meantime as the PubNub may be gone
+- (void) cancel {
+  _cancelled = YES;
+  [super cancel];
+}
+
+- (BOOL) _isValidResponse {
+  if (_response.statusCode == 200) {
+    NSString* contentType = [[[_response allHeaderFields] objectForKey:@"Content-Type"] lowercaseString];
+    if ([contentType hasPrefix:@"text/javascript"] && [contentType containsString:@"utf-8"]) {  // Should be [text/javascript; charset="UTF-8"] but is sometimes different on 3G
+      return YES;
+    }
+    LOG_ERROR(@"PubNub request returned unexpected content type: %@", contentType);
+  } else {
+    LOG_ERROR(@"PubNub request failed with HTTP status code %i", _response.statusCode);
+  }
+  return NO;
+}
+
+- (void) _didDecodeResponse:(id)response {
+  if (!_cancelled) {
+    [_pubNub connection:self didCompleteWithResponse:response];
+  }
+}
+
+- (void) _didDecodePartialResponse:(NSArray*)objects {
+  if (!_cancelled) {
+    [_pubNub connection:self didDecodePartialHistory:objects];
+  }
+}
+
+// Called on the decoding queue
+- (void) _decodeData:(NSData*)data {
+  NSArray* objects = [_parser parseBytes:data.bytes length:data.length];
+  if (objects.count) {
+    [self performSelector:@selector(_didDecodePartialResponse:)
+                 onThread:_thread
+               withObject:objects
+            waitUntilDone:NO
+                    modes:[NSArray arrayWithObject:NSRunLoopCommonModes]];
+  }
+}
+
+// Called on the decoding queue
+- (void) _finishDecoding {
+  id response;
+  if (_parser) {
+    response = _parser.complete && !_parser.failed ? _parser.objects : nil;
+  } else {
+    response = _ReadJSONData(_data);
+  }
+  [self performSelector:@selector(_didDecodeResponse:)
+               onThread:_thread
+             withObject:response
+          waitUntilDone:NO
+                  modes:[NSArray arrayWithObject:NSRunLoopCommonModes]];
+}
+
 - (void) connection:(NSURLConnection*)connection didReceiveResponse:(NSURLResponse*)response {
   DCHECK(_response == nil);
   _response = (NSHTTPURLResponse*)[response retain];
+  if (_decodingQueue && (_command == kCommand_FetchHistory) && (_response.statusCode == 200)) {
+    _parser = [[PubNubJSONArrayParser alloc] init];
+  }
 }
 
 - (void) connection:(NSURLConnection*)connection didReceiveData:(NSData*)data {
-  if (_data == nil) {
+  if (_parser) {
+    dispatch_async_f(_decodingQueue, [[NSArray alloc] initWithObjects:self, data, nil], _DecodeData);
+  } else if (_data == nil) {
     _data = [[NSMutableData alloc] initWithData:data];
   } else {
     [_data appendData:data];
@@ -111,16 +348,13 @@ static NSString* _WriteJSONString(id object) {
 }
 
 - (void) connectionDidFinishLoading:(NSURLConnection*)connection {
-  if (_response.statusCode == 200) {
-    NSString* contentType = [[[_response allHeaderFields] objectForKey:@"Content-Type"] lowercaseString];
-    if ([contentType hasPrefix:@"text/javascript"] && [contentType containsString:@"utf-8"]) {  // Should be [text/javascript; charset="UTF-8"] but is sometimes different on 3G
-      [_pubNub connection:self didCompleteWithResponse:_ReadJSONData(_data)];
+  if ([self _isValidResponse]) {
+    if (_decodingQueue) {
+      dispatch_async_f(_decodingQueue, [self retain], _FinishDecoding);
     } else {
-      LOG_ERROR(@"PubNub request returned unexpected content type: %@", contentType);
-      [_pubNub connection:self didCompleteWithResponse:nil];
+      [_pubNub connection:self didCompleteWithResponse:_ReadJSONData(_data)];
     }
   } else {
-    LOG_ERROR(@"PubNub request failed with HTTP status code %i", _response.statusCode);
     [_pubNub connection:self didCompleteWithResponse:nil];
   }
 }
@@ -140,9 +374,41 @@ static NSString* _WriteJSONString(id object) {
 
 @end
 
+@implementation PubNubMessage
+
+@synthesize channel=_channel, message=_message, url=_url, prepared=_prepared, retries=_retries, retryTime=_retryTime,
+            connection=_connection;
+
+- (id) initWithMessage:(id)message channel:(NSString*)channel {
+  if ((self = [super init])) {
+    _message = [message retain];
+    _channel = [channel copy];
+  }
+  return self;
+}
+
+- (void) dealloc {
+  [_message release];
+  [_channel release];
+  [_url release];
+  
+  [super dealloc];
+}
+
+@end
+
+static void _PrepareMessages(void* context) {
+  NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+  NSArray* array = (NSArray*)context;
+  [(PubNub*)[array objectAtIndex:0] _prepareMessages:[array objectAtIndex:1]];
+  [array release];
+  [pool release];
+}
+
 @implementation PubNub
 
-@synthesize delegate=_delegate;
+@synthesize delegate=_delegate, multiplexingEnabled=_multiplexing, maximumConcurrentPublishes=_maximumConcurrentPublishes,
+            backgroundDecodingEnabled=_backgroundDecoding;
 
 - (PubNub*) initWithSubscribeKey:(NSString*)subscribeKey useSSL:(BOOL)useSSL {
   return [self initWithPublishKey:nil subscribeKey:subscribeKey secretKey:nil useSSL:useSSL origin:kDefaultOrigin];
@@ -167,6 +433,14 @@ static NSString* _WriteJSONString(id object) {
     _host = [[NSString alloc] initWithFormat:@"%@://%@", useSSL ? @"https" : @"http", origin];
     
     _connections = [[NSMutableSet alloc] init];
+    _channels = [[NSMutableSet alloc] init];
+    _timeToken = [kInitialTimeToken copy];
+    
+    _thread = [[NSThread currentThread] retain];
+    _publishQueue = dispatch_queue_create("PubNub.publish", NULL);
+    _pendingMessages = [[NSMutableArray alloc] init];
+    _maximumConcurrentPublishes = kDefaultMaximumConcurrentPublishes;
+    _decodingQueue = dispatch_queue_create("PubNub.decoding", NULL);
   }
   return self;
 }
@@ -177,6 +451,12 @@ static NSString* _WriteJSONString(id object) {
   }
   [_connections release];
   [NSObject cancelPreviousPerformRequestsWithTarget:self];
+  [_channels release];
+  [_timeToken release];
+  [_thread release];
+  dispatch_release(_publishQueue);
+  dispatch_release(_decodingQueue);
+  [_pendingMessages release];
   
   [_publishKey release];
   [_subscribeKey release];
@@ -186,27 +466,140 @@ static NSString* _WriteJSONString(id object) {
   [super dealloc];
 }
 
-- (void) publishMessage:(id)message toChannel:(NSString*)channel {
-  NSString* json = _WriteJSONString(message);
-  if ([json lengthOfBytesUsingEncoding:NSUTF8StringEncoding] > kMaxMessageLength) {
-    LOG_ABORT(@"PubNub message too long: %i bytes", json.length);
+- (dispatch_queue_t) _decodingQueue {
+  return _backgroundDecoding ? _decodingQueue : NULL;
+}
+
+- (NSUInteger) pendingPublishCount {
+  return _pendingMessages.count;
+}
+
+- (void) setMaximumConcurrentPublishes:(NSUInteger)count {
+  DCHECK(count > 0);
+  _maximumConcurrentPublishes = count;
+  [self _pumpPublishQueue];
+}
+
+// Called on the background queue
+- (void) _prepareMessages:(NSArray*)messages {
+  for (PubNubMessage* message in messages) {
+    NSString* json = _WriteJSONString(message.message);
+    if (json == nil) {
+      continue;
+    }
+    if ([json lengthOfBytesUsingEncoding:NSUTF8StringEncoding] > kMaxMessageLength) {
+      LOG_ABORT(@"PubNub message too long: %i bytes", json.length);
+    }
+    
+    NSString* signature;
+    if (_secretKey) {
+      signature = MD5HashedString([NSString stringWithFormat:@"%@/%@/%@/%@/%@", _publishKey, _subscribeKey, _secretKey,
+                                                             message.channel, json]);
+    } else {
+      signature = @"0";
+    }
+    NSString* url = [NSString stringWithFormat:@"%@/publish/%@/%@/%@/%@/0/%@", _host, _publishKey, _subscribeKey, signature,
+                                               [message.channel urlEscapedString], [json urlEscapedString]];
+    message.url = [NSURL URLWithString:url];
   }
-  
-  NSString* signature;
-  if (_secretKey) {
-    signature = MD5HashedString([NSString stringWithFormat:@"%@/%@/%@/%@/%@", _publishKey, _subscribeKey, _secretKey,
-                                                           channel, json]);
+  [self performSelector:@selector(_didPrepareMessages:)
+               onThread:_thread
+             withObject:messages
+          waitUntilDone:NO
+                  modes:[NSArray arrayWithObject:NSRunLoopCommonModes]];
+}
+
+// Messages published while a batch is being prepared are sent to the background queue together once it is done
+- (void) _prepareNextMessages {
+  if (_preparing == NO) {
+    NSMutableArray* messages = [[NSMutableArray alloc] init];
+    for (PubNubMessage* message in _pendingMessages) {
+      if (!message.prepared) {
+        [messages addObject:message];
+      }
+    }
+    if (messages.count) {
+      _preparing = YES;
+      dispatch_async_f(_publishQueue, [[NSArray alloc] initWithObjects:self, messages, nil], _PrepareMessages);
+    }
+    [messages release];
+  }
+}
+
+- (void) _notifyPublishingMessage:(PubNubMessage*)message success:(BOOL)success error:(NSString*)error {
+  if (success) {
+    LOG_VERBOSE(@"Sent message to PubNub channel \"%@\"", message.channel);
+    if ([_delegate respondsToSelector:@selector(pubnub:didSucceedPublishingMessageToChannel:)]) {
+      [_delegate pubnub:self didSucceedPublishingMessageToChannel:message.channel];
+    }
   } else {
-    signature = @"0";
+    if ([_delegate respondsToSelector:@selector(pubnub:didFailPublishingMessageToChannel:error:)]) {
+      [_delegate pubnub:self didFailPublishingMessageToChannel:message.channel error:error];
+    }
+  }
+}
+
+- (void) _didPrepareMessages:(NSArray*)messages {
+  _preparing = NO;
+  for (PubNubMessage* message in messages) {
+    message.prepared = YES;
+    if (message.url == nil) {
+      [[message retain] autorelease];
+      [_pendingMessages removeObject:message];
+      [self _notifyPublishingMessage:message success:NO error:nil];
+    }
+  }
+  [self _prepareNextMessages];
+  [self _pumpPublishQueue];
+}
+
+// Starts as many messages as the in-flight window allows, skipping channels which already have an earlier message pending
+- (void) _pumpPublishQueue {
+  [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(_pumpPublishQueue) object:nil];
+  NSUInteger count = 0;
+  for (PubNubMessage* message in _pendingMessages) {
+    if (message.connection) {
+      count += 1;
+    }
+  }
+  NSMutableSet* channels = [[NSMutableSet alloc] init];
+  CFAbsoluteTime time = CFAbsoluteTimeGetCurrent();
+  CFTimeInterval delay = 0.0;
+  for (PubNubMessage* message in _pendingMessages) {
+    if (count >= _maximumConcurrentPublishes) {
+      break;
+    }
+    if ([channels containsObject:message.channel]) {
+      continue;
+    }
+    [channels addObject:message.channel];
+    if (message.connection || !message.prepared) {
+      continue;
+    }
+    if (message.retryTime > time) {
+      delay = delay > 0.0 ? MIN(delay, message.retryTime - time) : message.retryTime - time;
+      continue;
+    }
+    PubNubConnection* connection = [[PubNubConnection alloc] initWithPubNub:self
+                                                                        url:message.url
+                                                                    command:kCommand_SendMessage
+                                                                    channel:message.channel];
+    message.connection = connection;
+    [_connections addObject:connection];
+    [connection release];
+    count += 1;
+  }
+  [channels release];
+  if (delay > 0.0) {
+    [self performSelector:@selector(_pumpPublishQueue) withObject:nil afterDelay:delay];
   }
-  NSString* url = [NSString stringWithFormat:@"%@/publish/%@/%@/%@/%@/0/%@", _host, _publishKey, _subscribeKey, signature,
-                                             [channel urlEscapedString], [json urlEscapedString]];
-  PubNubConnection* connection = [[PubNubConnection alloc] initWithPubNub:self
-                                                                      url:[NSURL URLWithString:url]
-                                                                  command:kCommand_SendMessage
-                                                                  channel:channel];
-  [_connections addObject:connection];
-  [connection release];
+}
+
+- (void) publishMessage:(id)message toChannel:(NSString*)channel {
+  PubNubMessage* pendingMessage = [[PubNubMessage alloc] initWithMessage:message channel:channel];
+  [_pendingMessages addObject:pendingMessage];
+  [pendingMessage release];
+  [self _prepareNextMessages];
 }
 
 - (void) _resubscribeToChannel:(NSString*)channel timeToken:(NSString*)timeToken {
@@ -223,9 +616,75 @@ static NSString* _WriteJSONString(id object) {
   [self _resubscribeToChannel:channel timeToken:kInitialTimeToken];
 }
 
+- (PubNubConnection*) _multiplexedConnection {
+  for (PubNubConnection* connection in _connections) {
+    if (connection.command == kCommand_ReceiveMultiplexedMessages) {
+      return connection;
+    }
+  }
+  return nil;
+}
+
+- (void) _resubscribeToChannels {
+  if (_channels.count) {
+    NSArray* channels = [[_channels allObjects] sortedArrayUsingSelector:@selector(compare:)];
+    NSMutableArray* escapedChannels = [[NSMutableArray alloc] initWithCapacity:channels.count];
+    for (NSString* channel in channels) {
+      [escapedChannels addObject:[channel urlEscapedString]];
+    }
+    NSString* url = [NSString stringWithFormat:@"%@/subscribe/%@/%@/0/%@", _host, _subscribeKey,
+                                               [escapedChannels componentsJoinedByString:@","], _timeToken];
+    PubNubConnection* connection = [[PubNubConnection alloc] initWithPubNub:self
+                                                                        url:[NSURL URLWithString:url]
+                                                                    command:kCommand_ReceiveMultiplexedMessages
+                                                                    channel:[channels componentsJoinedByString:@","]];
+    [_connections addObject:connection];
+    [connection release];
+    [escapedChannels release];
+  }
+}
+
+// Cancels the current long-poll request immediately but defers the new one so that consecutive changes only start one request
+- (void) _restartMultiplexedSubscription {
+  PubNubConnection* connection = [self _multiplexedConnection];
+  if (connection) {
+    [connection cancel];
+    [_connections removeObject:connection];
+  }
+  [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(_resubscribeToChannels) object:nil];
+  if (_channels.count) {
+    [self performSelector:@selector(_resubscribeToChannels) withObject:nil afterDelay:0.0];
+  } else {
+    [_timeToken release];
+    _timeToken = [kInitialTimeToken copy];
+  }
+}
+
+- (void) setMultiplexingEnabled:(BOOL)flag {
+  if (flag != _multiplexing) {
+    NSMutableSet* channels = [[NSMutableSet alloc] initWithSet:_channels];
+    for (PubNubConnection* connection in _connections) {
+      if (connection.command == kCommand_ReceiveMessage) {
+        [channels addObject:connection.channel];
+      }
+    }
+    [self unsubscribeFromAllChannels];
+    _multiplexing = flag;
+    for (NSString* channel in channels) {
+      [self subscribeToChannel:channel];
+    }
+    [channels release];
+  }
+}
+
 - (void) subscribeToChannel:(NSString*)channel {
   if (![self isSubscribedToChannel:channel]) {
-    [self _resubscribeToChannel:channel];
+    if (_multiplexing) {
+      [_channels addObject:channel];
+      [self _restartMultiplexedSubscription];
+    } else {
+      [self _resubscribeToChannel:channel];
+    }
     LOG_VERBOSE(@"Did subscribe to PubNub channel \"%@\"", channel);
   } else {
     DNOT_REACHED();
@@ -233,7 +692,21 @@ static NSString* _WriteJSONString(id object) {
 }
 
 - (void) unsubscribeFromChannel:(NSString*)channel {
-  for (PubNubConnection* connection in _connections) {
+  if (_multiplexing) {
+    if (channel) {
+      if ([_channels containsObject:channel]) {
+        LOG_VERBOSE(@"Did unsubscribe from PubNub channel \"%@\"", channel);
+        [_channels removeObject:channel];
+        [self _restartMultiplexedSubscription];
+      }
+    } else if (_channels.count) {
+      LOG_VERBOSE(@"Did unsubscribe from %i PubNub channels", _channels.count);
+      [_channels removeAllObjects];
+      [self _restartMultiplexedSubscription];
+    }
+    return;
+  }
+  for (PubNubConnection* connection in [_connections allObjects]) {
     if ((connection.command == kCommand_ReceiveMessage) && (!channel || [connection.channel isEqualToString:channel])) {
       LOG_VERBOSE(@"Did unsubscribe from PubNub channel \"%@\"", connection.channel);
       [connection cancel];
@@ -241,9 +714,13 @@ static NSString* _WriteJSONString(id object) {
     }
   }
   [NSObject cancelPreviousPerformRequestsWithTarget:self];
+  [self _pumpPublishQueue];  // Reschedule pending publish retries
 }
 
 - (BOOL) isSubscribedToChannel:(NSString*)channel {
+  if (_multiplexing) {
+    return [_channels containsObject:channel];
+  }
   for (PubNubConnection* connection in _connections) {
     if ((connection.command == kCommand_ReceiveMessage) && [connection.channel isEqualToString:channel]) {
       return YES;
@@ -279,30 +756,83 @@ static NSString* _WriteJSONString(id object) {
   [connection release];
 }
 
+// "channels" contains either a single channel or the channel of each message
+// Messages are delivered in batches per channel in order of first appearance if the delegate supports it
+- (void) _deliverMessages:(NSArray*)messages channels:(NSArray*)channels {
+  if ([_delegate respondsToSelector:@selector(pubnub:didReceiveMessages:onChannel:)]) {
+    NSMutableArray* batchChannels = [[NSMutableArray alloc] init];
+    NSMutableDictionary* batches = [[NSMutableDictionary alloc] init];
+    for (NSUInteger i = 0; i < messages.count; ++i) {
+      NSString* channel = [channels objectAtIndex:(channels.count > 1 ? i : 0)];
+      NSMutableArray* batch = [batches objectForKey:channel];
+      if (batch == nil) {
+        batch = [[NSMutableArray alloc] init];
+        [batches setObject:batch forKey:channel];
+        [batch release];
+        [batchChannels addObject:channel];
+      }
+      [batch addObject:[messages objectAtIndex:i]];
+    }
+    for (NSString* channel in batchChannels) {
+      if (!_multiplexing || [_channels containsObject:channel]) {  // Delegate may have unsubscribed in the meantime
+        [_delegate pubnub:self didReceiveMessages:[batches objectForKey:channel] onChannel:channel];
+      }
+    }
+    [batches release];
+    [batchChannels release];
+  } else if ([_delegate respondsToSelector:@selector(pubnub:didReceiveMessage:onChannel:)]) {
+    for (NSUInteger i = 0; i < messages.count; ++i) {
+      NSString* channel = [channels objectAtIndex:(channels.count > 1 ? i : 0)];
+      if (!_multiplexing || [_channels containsObject:channel]) {
+        [_delegate pubnub:self didReceiveMessage:[messages objectAtIndex:i] onChannel:channel];
+      }
+    }
+  }
+}
+
+- (void) connection:(PubNubConnection*)connection didDecodePartialHistory:(NSArray*)messages {
+  LOG_VERBOSE(@"Decoded %i history messages from PubNub channel \"%@\"", messages.count, connection.channel);
+  if ([_delegate respondsToSelector:@selector(pubnub:didFetchPartialHistory:forChannel:)]) {
+    [_delegate pubnub:self didFetchPartialHistory:messages forChannel:connection.channel];
+  }
+}
+
 - (void) connection:(PubNubConnection*)connection didCompleteWithResponse:(id)response {
   switch (connection.command) {
     
+    // Network failures are retried but messages rejected by PubNub are not
     case kCommand_SendMessage: {
+      [[connection retain] autorelease];
+      PubNubMessage* message = nil;
+      for (PubNubMessage* pendingMessage in _pendingMessages) {
+        if (pendingMessage.connection == connection) {
+          message = [[pendingMessage retain] autorelease];
+          break;
+        }
+      }
+      DCHECK(message);
+      message.connection = nil;
       BOOL success = NO;
       NSString* error = nil;
       if ([response isKindOfClass:[NSArray class]] && (([response count] == 2) || ([response count] == 3))) {
         success = [[response objectAtIndex:0] boolValue];
         if (success == NO) {
           error = [response objectAtIndex:1];
-        }
-      }
-      if (success) {
-        LOG_VERBOSE(@"Sent message to PubNub channel \"%@\"", connection.channel);
-        if ([_delegate respondsToSelector:@selector(pubnub:didSucceedPublishingMessageToChannel:)]) {
-          [_delegate pubnub:self didSucceedPublishingMessageToChannel:connection.channel];
-        }
-      } else {
-        if (response) {
           LOG_ERROR(@"Failed sending message to PubNub channel \"%@\": %@", connection.channel, error);
         }
-        if ([_delegate respondsToSelector:@selector(pubnub:didFailPublishingMessageToChannel:error:)]) {
-          [_delegate pubnub:self didFailPublishingMessageToChannel:connection.channel error:error];
-        }
+      } else if (message.retries < kMaxPublishRetries) {
+        message.retryTime = CFAbsoluteTimeGetCurrent() + kPublishRetryInterval * (1 << message.retries);
+        message.retries += 1;
+        LOG_VERBOSE(@"Retrying sending message to PubNub channel \"%@\" (%i)", connection.channel, message.retries);
+        message = nil;
+      }
+      if (message) {
+        [_pendingMessages removeObject:message];
+      }
+      [_connections removeObject:connection];
+      [self _pumpPublishQueue];
+      if (message) {
+        [self _notifyPublishingMessage:message success:success error:error];
       }
       break;
     }
@@ -310,12 +840,8 @@ static NSString* _WriteJSONString(id object) {
     case kCommand_ReceiveMessage: {
       NSString* timeToken = nil;
       if ([response isKindOfClass:[NSArray class]] && ([response count] == 2)) {
-        if ([_delegate respondsToSelector:@selector(pubnub:didReceiveMessage:onChannel:)]) {
-          LOG_VERBOSE(@"Received %i messages from PubNub channel \"%@\"", [[response objectAtIndex:0] count], connection.channel);
-          for (id message in [response objectAtIndex:0]) {
-            [_delegate pubnub:self didReceiveMessage:message onChannel:connection.channel];
-          }
-        }
+        LOG_VERBOSE(@"Received %i messages from PubNub channel \"%@\"", [[response objectAtIndex:0] count], connection.channel);
+        [self _deliverMessages:[response objectAtIndex:0] channels:[NSArray arrayWithObject:connection.channel]];
         timeToken = [response objectAtIndex:1];
       } else if (response) {
         LOG_ERROR(@"Unexpected subscribe response from PubNub");
@@ -332,6 +858,42 @@ static NSString* _WriteJSONString(id object) {
       break;
     }
     
+    // Response is [messages, time token] or [messages, time token, comma-separated channel of each message]
+    case kCommand_ReceiveMultiplexedMessages: {
+      [[connection retain] autorelease];  // Delegate could restart the subscription
+      NSString* timeToken = nil;
+      if ([response isKindOfClass:[NSArray class]] && (([response count] == 2) || ([response count] == 3))) {
+        NSArray* messages = [response objectAtIndex:0];
+        NSArray* channels = nil;
+        if ([response count] == 3) {
+          channels = [[response objectAtIndex:2] componentsSeparatedByString:@","];
+        } else if (![connection.channel containsString:@","]) {
+          channels = [NSArray arrayWithObject:connection.channel];
+        }
+        if (messages.count && ([channels count] != messages.count) && ([channels count] != 1)) {
+          LOG_ERROR(@"Unexpected multiplexed subscribe response from PubNub");
+        } else {
+          LOG_VERBOSE(@"Received %i messages from PubNub channels \"%@\"", messages.count, connection.channel);
+          [self _deliverMessages:messages channels:channels];
+        }
+        timeToken = [response objectAtIndex:1];
+      } else if (response) {
+        LOG_ERROR(@"Unexpected subscribe response from PubNub");
+      }
+      if ([_connections containsObject:connection]) {  // Subscription was not restarted from the delegate
+        if (timeToken) {
+          [_timeToken release];
+          _timeToken = [timeToken copy];
+        }
+        if (response) {
+          [self _resubscribeToChannels];
+        } else {
+          [self performSelector:@selector(_resubscribeToChannels) withObject:nil afterDelay:kMinRetryInterval];
+        }
+      }
+      break;
+    }
+    
     case kCommand_FetchHistory: {
       NSArray* history = nil;
       if ([response isKindOfClass:[NSArray class]]) {
@@ -12,7 +12,12 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#import <libkern/OSAtomic.h>
+#import <unistd.h>
+#import <poll.h>
+
 #import "PubNub.h"
+#import "UnitTestHTTPServer.h"
 #import "UnitTest.h"
 
 // WARNING: DO NOT re-use in your code: these keys are for testing of this PubNub class ONLY and not anything else
@@ -23,31 +28,281 @@
 #define kTimeOut 5.0
 #define kHistoryLimit 10
 
+#define kTestSubscribeTimeOut 1000  // Milliseconds
+
 @interface PubNubTests : UnitTest <PubNubDelegate> {
 @private
   NSString* _channel;
   id _result;
+  NSMutableArray* _received;
+  NSUInteger _publishedCount;
+  NSUInteger _failedCount;
+  NSMutableDictionary* _publishTimes;
+  CFTimeInterval _totalLatency;
+  
+  UnitTestHTTPServer* _server;
+  NSMutableArray* _messages;
+  long long _timeToken;
+  volatile int32_t _subscribeCount;
+  volatile int32_t _activeSubscribes;
+  volatile int32_t _maxActiveSubscribes;
+  volatile int32_t _activePublishes;
+  volatile int32_t _maxActivePublishes;
+  volatile int32_t _publishFailCount;
+  useconds_t _publishDelay;
+  useconds_t _chunkDelay;
+}
+- (void) _handleRequest:(const char*)buffer socket:(int)fd;
+@end
+
+static void _ServerFunction(int socket, const char* request, void* context) {
+  [(PubNubTests*)context _handleRequest:request socket:socket];
+}
+
+@interface PubNubBatchRecorder : NSObject <PubNubDelegate> {
+@private
+  NSMutableDictionary* _received;
+  NSUInteger _batchCount;
+  NSMutableArray* _partialHistory;
+  NSUInteger _partialCount;
+  NSUInteger _partialCountBeforeHistory;
+  NSArray* _history;
+}
+@property(nonatomic, readonly) NSMutableDictionary* received;
+@property(nonatomic, readonly) NSUInteger batchCount;
+@property(nonatomic, readonly) NSArray* partialHistory;
+@property(nonatomic, readonly) NSUInteger partialCount;
+@property(nonatomic, readonly) NSUInteger partialCountBeforeHistory;  // Number of partial batches delivered before the full history
+@property(nonatomic, readonly) NSArray* history;
+@end
+
+@implementation PubNubBatchRecorder
+
+@synthesize received=_received, batchCount=_batchCount, partialHistory=_partialHistory, partialCount=_partialCount,
+            partialCountBeforeHistory=_partialCountBeforeHistory, history=_history;
+
+- (id) init {
+  if ((self = [super init])) {
+    _received = [[NSMutableDictionary alloc] init];
+    _partialHistory = [[NSMutableArray alloc] init];
+  }
+  return self;
+}
+
+- (void) dealloc {
+  [_received release];
+  [_partialHistory release];
+  [_history release];
+  
+  [super dealloc];
+}
+
+- (void) pubnub:(PubNub*)pubnub didReceiveMessages:(NSArray*)messages onChannel:(NSString*)channel {
+  NSMutableArray* array = [_received objectForKey:channel];
+  if (array == nil) {
+    array = [NSMutableArray array];
+    [_received setObject:array forKey:channel];
+  }
+  [array addObjectsFromArray:messages];
+  _batchCount += 1;
+}
+
+- (void) pubnub:(PubNub*)pubnub didFetchPartialHistory:(NSArray*)messages forChannel:(NSString*)channel {
+  [_partialHistory addObjectsFromArray:messages];
+  _partialCount += 1;
+}
+
+- (void) pubnub:(PubNub*)pubnub didFetchHistory:(NSArray*)messages forChannel:(NSString*)channel {
+  _partialCountBeforeHistory = _partialCount;
+  _history = [messages retain];
 }
+
 @end
 
+static void _UpdateMaximum(volatile int32_t* active, volatile int32_t* maximum) {
+  int32_t value = OSAtomicIncrement32(active);
+  int32_t oldValue;
+  do {
+    oldValue = *maximum;
+  } while ((value > oldValue) && !OSAtomicCompareAndSwap32(oldValue, value, maximum));
+}
+
 @implementation PubNubTests
 
+// Minimal loopback stand-in for the PubNub REST API: messages are kept in memory as [time token, channel, JSON] and
+// subscribe requests are held until new messages are available on one of their channels or the long-poll times out
+// Publish requests are delayed by "_publishDelay" and the first "_publishFailCount" ones fail with a 404
+// Responses are written in 1 Kb chunks separated by "_chunkDelay"
+- (NSString*) _responseForPath:(NSString*)path clientSocket:(int)fd {
+  NSArray* components = [path componentsSeparatedByString:@"/"];
+  NSString* command = components.count > 1 ? [components objectAtIndex:1] : nil;
+  if ([command isEqualToString:@"publish"] && (components.count == 8)) {
+    if (OSAtomicDecrement32(&_publishFailCount) >= 0) {
+      return nil;
+    }
+    _UpdateMaximum(&_activePublishes, &_maxActivePublishes);
+    usleep(_publishDelay);
+    OSAtomicDecrement32(&_activePublishes);
+    NSString* channel = [[components objectAtIndex:5] stringByReplacingPercentEscapesUsingEncoding:NSUTF8StringEncoding];
+    NSString* json = [[components objectAtIndex:7] stringByReplacingPercentEscapesUsingEncoding:NSUTF8StringEncoding];
+    long long timeToken;
+    @synchronized(_messages) {
+      timeToken = ++_timeToken;
+      [_messages addObject:[NSArray arrayWithObjects:[NSNumber numberWithLongLong:timeToken], channel, json, nil]];
+    }
+    return [NSString stringWithFormat:@"[1,\"Sent\",\"%lli\"]", timeToken];
+  }
+  if ([command isEqualToString:@"subscribe"] && (components.count == 6)) {
+    NSString* channelList = [[components objectAtIndex:3] stringByReplacingPercentEscapesUsingEncoding:NSUTF8StringEncoding];
+    NSSet* channels = [NSSet setWithArray:[channelList componentsSeparatedByString:@","]];
+    long long timeToken = [[components objectAtIndex:5] longLongValue];
+    OSAtomicIncrement32(&_subscribeCount);
+    _UpdateMaximum(&_activeSubscribes, &_maxActiveSubscribes);
+    NSMutableArray* jsons = [NSMutableArray array];
+    NSMutableArray* messageChannels = [NSMutableArray array];
+    long long lastTimeToken = 0;
+    for (int i = 0; _server.running && (i < kTestSubscribeTimeOut / 10); ++i) {
+      @synchronized(_messages) {
+        lastTimeToken = _timeToken;
+        if (timeToken) {
+          for (NSArray* message in _messages) {
+            if (([[message objectAtIndex:0] longLongValue] > timeToken) && [channels containsObject:[message objectAtIndex:1]]) {
+              [messageChannels addObject:[message objectAtIndex:1]];
+              [jsons addObject:[message objectAtIndex:2]];
+            }
+          }
+        }
+      }
+      if ((timeToken == 0) || jsons.count) {
+        break;
+      }
+      struct pollfd pfd = {fd, POLLIN, 0};
+      if (poll(&pfd, 1, 10) > 0) {  // Client closed the connection
+        break;
+      }
+    }
+    OSAtomicDecrement32(&_activeSubscribes);
+    if (channels.count > 1) {
+      return [NSString stringWithFormat:@"[[%@],\"%lli\",\"%@\"]", [jsons componentsJoinedByString:@","], lastTimeToken,
+                                        [messageChannels componentsJoinedByString:@","]];
+    }
+    return [NSString stringWithFormat:@"[[%@],\"%lli\"]", [jsons componentsJoinedByString:@","], lastTimeToken];
+  }
+  if ([command isEqualToString:@"history"] && (components.count == 6)) {
+    NSString* channel = [[components objectAtIndex:3] stringByReplacingPercentEscapesUsingEncoding:NSUTF8StringEncoding];
+    NSUInteger limit = [[components objectAtIndex:5] integerValue];
+    NSMutableArray* jsons = [NSMutableArray array];
+    @synchronized(_messages) {
+      for (NSArray* message in [_messages reverseObjectEnumerator]) {
+        if ((jsons.count < limit) && [[message objectAtIndex:1] isEqualToString:channel]) {
+          [jsons insertObject:[message objectAtIndex:2] atIndex:0];
+        }
+      }
+    }
+    return [NSString stringWithFormat:@"[%@]", [jsons componentsJoinedByString:@","]];
+  }
+  if ([command isEqualToString:@"time"]) {
+    return @"[13000000000000000]";
+  }
+  return nil;
+}
+
+- (void) _handleRequest:(const char*)buffer socket:(int)fd {
+  char path[8192];
+  if (sscanf(buffer, "GET %8191s HTTP/", path) == 1) {
+    NSString* body = [self _responseForPath:[NSString stringWithUTF8String:path] clientSocket:fd];
+    NSString* response;
+    if (body) {
+      response = [NSString stringWithFormat:@"HTTP/1.1 200 OK\r\nContent-Type: text/javascript; charset=\"UTF-8\"\r\n"
+                                            @"Content-Length: %i\r\nConnection: close\r\n\r\n%@",
+                                            (int)[body lengthOfBytesUsingEncoding:NSUTF8StringEncoding], body];
+    } else {
+      response = @"HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    }
+    const char* bytes = [response UTF8String];
+    size_t length = strlen(bytes);
+    for (size_t offset = 0; offset < length; offset += 1024) {
+      if (write(fd, bytes + offset, MIN(1024, length - offset)) < 0) {
+        break;
+      }
+      usleep(_chunkDelay);
+    }
+  }
+}
+
 - (void) setUp {
   CFUUIDRef uuid = CFUUIDCreate(kCFAllocatorDefault);
   _channel = (NSString*)CFUUIDCreateString(kCFAllocatorDefault, uuid);
   CFRelease(uuid);
+  _received = [[NSMutableArray alloc] init];
+  _publishTimes = [[NSMutableDictionary alloc] init];
+  
+  _messages = [[NSMutableArray alloc] init];
+  _timeToken = 1000;
+  _server = [[UnitTestHTTPServer alloc] initWithFunction:_ServerFunction context:self];
+  AssertNotNil(_server);
+}
+
+- (PubNub*) _newLocalPubNub {
+  PubNub* pubNub = [[PubNub alloc] initWithPublishKey:@"demo"
+                                         subscribeKey:@"demo"
+                                            secretKey:nil
+                                               useSSL:NO
+                                               origin:[NSString stringWithFormat:@"127.0.0.1:%i", (int)_server.port]];
+  pubNub.delegate = self;
+  return pubNub;
+}
+
+- (void) _publishMessage:(id)message toChannel:(NSString*)channel withPubNub:(PubNub*)pubNub {
+  NSMutableArray* times = [_publishTimes objectForKey:channel];
+  if (times == nil) {
+    times = [NSMutableArray array];
+    [_publishTimes setObject:times forKey:channel];
+  }
+  [times addObject:[NSNumber numberWithDouble:CFAbsoluteTimeGetCurrent()]];
+  [pubNub publishMessage:message toChannel:channel];
+}
+
+- (BOOL) _waitForPublishedCount:(NSUInteger)count {
+  CFAbsoluteTime time = CFAbsoluteTimeGetCurrent();
+  while (_publishedCount + _failedCount < count) {
+    if (CFAbsoluteTimeGetCurrent() - time >= 4 * kTimeOut) {
+      return NO;
+    }
+    CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.05, true);
+  }
+  return YES;
+}
+
+- (BOOL) _waitForReceivedCount:(NSUInteger)count {
+  CFAbsoluteTime time = CFAbsoluteTimeGetCurrent();
+  while (_received.count < count) {
+    if (CFAbsoluteTimeGetCurrent() - time >= kTimeOut) {
+      return NO;
+    }
+    CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.05, true);
+  }
+  return YES;
 }
 
 - (void) pubnub:(PubNub*)pubnub didSucceedPublishingMessageToChannel:(NSString*)channel {
   _result = [NSNull null];
+  _publishedCount += 1;
+  NSMutableArray* times = [_publishTimes objectForKey:channel];
+  if (times.count) {
+    _totalLatency += CFAbsoluteTimeGetCurrent() - [[times objectAtIndex:0] doubleValue];
+    [times removeObjectAtIndex:0];
+  }
 }
 
 - (void) pubnub:(PubNub*)pubnub didFailPublishingMessageToChannel:(NSString*)channel error:(NSString*)error {
   _result = [error retain];
+  _failedCount += 1;
 }
 
 - (void) pubnub:(PubNub*)pubnub didReceiveMessage:(id)message onChannel:(NSString*)channel {
   _result = [message retain];
+  [_received addObject:[NSArray arrayWithObjects:channel, message, nil]];
 }
 
 - (void) pubnub:(PubNub*)pubnub didFetchHistory:(NSArray*)messages forChannel:(NSString*)channel {
@@ -152,7 +407,163 @@
   [self _testTime:NO];
 }
 
+- (void) testMultiplexedSubscribe {
+  PubNub* pubNub = [self _newLocalPubNub];
+  pubNub.multiplexingEnabled = YES;
+  for (int i = 0; i < 20; ++i) {
+    [pubNub subscribeToChannel:[NSString stringWithFormat:@"channel-%i", i]];
+  }
+  AssertTrue([pubNub isSubscribedToChannel:@"channel-7"]);
+  CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.5, false);
+  AssertEqual(_subscribeCount, (int32_t)2);  // Initial time token request then long-poll
+  
+  NSArray* message1 = [NSArray arrayWithObject:@"foo"];
+  NSDictionary* message2 = [NSDictionary dictionaryWithObject:[NSNumber numberWithInt:42] forKey:@"bar"];
+  [pubNub publishMessage:message1 toChannel:@"channel-3"];
+  [pubNub publishMessage:message2 toChannel:@"channel-17"];
+  [pubNub publishMessage:message1 toChannel:@"other"];
+  AssertTrue([self _waitForReceivedCount:2]);
+  NSSet* expected = [NSSet setWithObjects:[NSArray arrayWithObjects:@"channel-3", message1, nil],
+                                          [NSArray arrayWithObjects:@"channel-17", message2, nil], nil];
+  AssertEqualObjects([NSSet setWithArray:_received], expected);
+  AssertEqual(_maxActiveSubscribes, (int32_t)1);
+  
+  // Unsubscribing restarts the long-poll with the same time token
+  [_received removeAllObjects];
+  [pubNub unsubscribeFromChannel:@"channel-3"];
+  AssertFalse([pubNub isSubscribedToChannel:@"channel-3"]);
+  CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.2, false);
+  [pubNub publishMessage:message1 toChannel:@"channel-3"];
+  [pubNub publishMessage:message2 toChannel:@"channel-17"];
+  AssertTrue([self _waitForReceivedCount:1]);
+  CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.2, false);
+  AssertEqualObjects(_received, [NSArray arrayWithObject:[NSArray arrayWithObjects:@"channel-17", message2, nil]]);
+  
+  // Switching back to one request per channel keeps the subscriptions
+  pubNub.multiplexingEnabled = NO;
+  AssertTrue([pubNub isSubscribedToChannel:@"channel-17"]);
+  [pubNub unsubscribeFromAllChannels];
+  AssertFalse([pubNub isSubscribedToChannel:@"channel-17"]);
+  
+  [pubNub release];
+}
+
+- (void) testPublishPipeline {
+  PubNub* pubNub = [self _newLocalPubNub];
+  pubNub.maximumConcurrentPublishes = 3;
+  _publishDelay = 10000;
+  _publishFailCount = 3;
+  for (int i = 0; i < 60; ++i) {
+    [self _publishMessage:[NSArray arrayWithObject:[NSNumber numberWithInt:i]]
+                toChannel:[NSString stringWithFormat:@"channel-%i", i % 5]
+               withPubNub:pubNub];
+  }
+  AssertEqual(pubNub.pendingPublishCount, (NSUInteger)60);
+  AssertTrue([self _waitForPublishedCount:60]);
+  AssertEqual(_publishedCount, (NSUInteger)60);
+  AssertEqual(pubNub.pendingPublishCount, (NSUInteger)0);
+  AssertTrue(_maxActivePublishes <= 3);
+  
+  // Messages must have been received in order on each channel even with retries
+  int lastValues[5] = {-1, -1, -1, -1, -1};
+  for (NSArray* message in _messages) {
+    int value = [[[message objectAtIndex:2] substringWithRange:NSMakeRange(1, [[message objectAtIndex:2] length] - 2)] intValue];
+    AssertEqualObjects([message objectAtIndex:1], ([NSString stringWithFormat:@"channel-%i", value % 5]));
+    AssertGreaterThan(value, lastValues[value % 5]);
+    lastValues[value % 5] = value;
+  }
+  AssertEqual(_messages.count, (NSUInteger)60);
+  
+  [pubNub release];
+}
+
+- (void) testPublishBenchmark {
+  _publishDelay = 20000;
+  CFTimeInterval durations[2];
+  CFTimeInterval latencies[2];
+  NSUInteger windows[2] = {1, 8};
+  for (int w = 0; w < 2; ++w) {
+    PubNub* pubNub = [self _newLocalPubNub];
+    pubNub.maximumConcurrentPublishes = windows[w];
+    _publishedCount = 0;
+    _totalLatency = 0.0;
+    CFAbsoluteTime time = CFAbsoluteTimeGetCurrent();
+    for (int i = 0; i < 200; ++i) {
+      [self _publishMessage:[NSArray arrayWithObject:[NSNumber numberWithInt:i]]
+                  toChannel:[NSString stringWithFormat:@"channel-%i", i % 20]
+                 withPubNub:pubNub];
+    }
+    AssertTrue([self _waitForPublishedCount:200]);
+    durations[w] = CFAbsoluteTimeGetCurrent() - time;
+    latencies[w] = _totalLatency / 200;
+    [pubNub release];
+  }
+  LOG_INFO(@"PubNub publishing of 200 messages: %.0f messages/s (%.0f ms average latency) with 1 request in flight / "
+           @"%.0f messages/s (%.0f ms average latency) with 8 requests in flight", 200 / durations[0], latencies[0] * 1000.0,
+           200 / durations[1], latencies[1] * 1000.0);
+  AssertGreaterThan(durations[0], durations[1]);
+}
+
+- (void) testBackgroundDecoding {
+  PubNub* pubNub = [self _newLocalPubNub];
+  PubNubBatchRecorder* recorder = [[PubNubBatchRecorder alloc] init];
+  pubNub.delegate = recorder;
+  pubNub.backgroundDecodingEnabled = YES;
+  
+  // Streaming history
+  NSMutableArray* expected = [NSMutableArray array];
+  NSString* text = [@"" stringByPaddingToLength:200 withString:@"lorem ipsum, \"dolor\" [sit] {amet} " startingAtIndex:0];
+  for (int i = 0; i < 100; ++i) {
+    NSDictionary* message = [NSDictionary dictionaryWithObjectsAndKeys:[NSNumber numberWithInt:i], @"index", text, @"text", nil];
+    NSData* data = [NSJSONSerialization dataWithJSONObject:message options:0 error:NULL];
+    NSString* json = [[[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding] autorelease];
+    [_messages addObject:[NSArray arrayWithObjects:[NSNumber numberWithLongLong:++_timeToken], @"history", json, nil]];
+    [expected addObject:message];
+  }
+  _chunkDelay = 5000;
+  [pubNub fetchHistory:100 forChannel:@"history"];
+  CFAbsoluteTime time = CFAbsoluteTimeGetCurrent();
+  while ((recorder.history == nil) && (CFAbsoluteTimeGetCurrent() - time < kTimeOut)) {
+    CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.05, true);
+  }
+  AssertEqualObjects(recorder.history, expected);
+  AssertEqualObjects(recorder.partialHistory, expected);
+  AssertGreaterThan(recorder.partialCountBeforeHistory, (NSUInteger)1);
+  _chunkDelay = 0;
+  
+  // Batched delivery
+  pubNub.multiplexingEnabled = YES;
+  [pubNub subscribeToChannel:@"a"];
+  [pubNub subscribeToChannel:@"b"];
+  CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.5, false);
+  for (int i = 0; i < 10; ++i) {
+    [pubNub publishMessage:[NSArray arrayWithObject:[NSNumber numberWithInt:i]] toChannel:(i % 2 ? @"b" : @"a")];
+  }
+  time = CFAbsoluteTimeGetCurrent();
+  while (([[recorder.received objectForKey:@"a"] count] + [[recorder.received objectForKey:@"b"] count] < 10) &&
+         (CFAbsoluteTimeGetCurrent() - time < kTimeOut)) {
+    CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.05, true);
+  }
+  NSMutableArray* a = [NSMutableArray array];
+  NSMutableArray* b = [NSMutableArray array];
+  for (int i = 0; i < 10; ++i) {
+    [(i % 2 ? b : a) addObject:[NSArray arrayWithObject:[NSNumber numberWithInt:i]]];
+  }
+  AssertEqualObjects([recorder.received objectForKey:@"a"], a);
+  AssertEqualObjects([recorder.received objectForKey:@"b"], b);
+  AssertTrue(recorder.batchCount <= 10);
+  
+  [pubNub release];
+  [recorder release];
+}
+
 - (void) cleanUp {
+  [_server stop];
+  [_server release];
+  [_messages release];
+  
+  [_received release];
+  [_publishTimes release];
   [_result release];
   [_channel release];
 }
@@ -0,0 +1,92 @@
+// Copyright 2011 Cooliris, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#import <Foundation/Foundation.h>
+#import <libkern/OSAtomic.h>
+
+typedef enum {
+  kTaskPriority_Low = 0,
+  kTaskPriority_Normal,
+  kTaskPriority_High,
+  kTaskPriorityCount
+} TaskPriority;
+
+@class Task, TaskPool;
+
+typedef void (*TaskFunction)(void* context);
+typedef void (*TaskCompletionFunction)(Task* task, void* context);
+
+// Future returned for each submitted task
+@interface Task : NSObject {
+@private
+  TaskPool* _pool;
+  TaskPriority _priority;
+  BOOL _longRunning;
+  TaskFunction _function;
+  void* _context;
+  id _target;
+  SEL _selector;
+  id _argument;
+  BOOL _returnsObject;
+  id _block;
+  id _result;
+  OSSpinLock _lock;
+  volatile BOOL _finished;
+  TaskCompletionFunction _completionFunction;
+  void* _completionContext;
+  id _completionBlock;
+}
+@property(nonatomic, readonly) TaskPriority priority;
+@property(nonatomic, readonly, getter=isLongRunning) BOOL longRunning;
+@property(nonatomic, readonly, getter=isFinished) BOOL finished;
+@property(nonatomic, readonly) id result;  // Return value of the selector or block once finished (nil for functions)
+// The completion function is called on the worker thread right after the task finishes or immediately if it has already finished
+- (void) setCompletionFunction:(TaskCompletionFunction)function context:(void*)context;
+#if NS_BLOCKS_AVAILABLE
+- (void) setCompletionBlock:(void (^)(Task* task))block;
+#endif
+- (void) waitUntilFinished;  // When called from a worker thread, runs other tasks while waiting
+@end
+
+// Shared pool of worker threads where each worker has its own deque per priority: a worker pushes and pops the tasks it submits
+// at the back of its deques and idle workers steal from the front of the others, while tasks submitted from other threads go
+// through a shared queue - Higher priority tasks are always looked up first and each task runs in its own autorelease pool
+// Long-running tasks (e.g. run loops or blocking loops) get a compensating worker so that they never starve the pool
+@interface TaskPool : NSObject {
+@private
+  NSUInteger _workerCount;
+  NSArray* _workers;
+  OSSpinLock _workersLock;
+  NSMutableArray* _queues[kTaskPriorityCount];
+  NSMutableArray* _longRunningQueue;
+  OSSpinLock _queuesLock;
+  volatile int32_t _pendingCount;
+  volatile int32_t _longRunningCount;
+  volatile int32_t _sleepingCount;
+  volatile int32_t _waitingCount;
+  NSCondition* _condition;
+  NSCondition* _completionCondition;
+  NSUInteger _runningCount;
+  BOOL _stopped;
+}
+@property(nonatomic, readonly) NSUInteger workerCount;  // Not counting compensating workers
++ (TaskPool*) sharedPool;  // Sized to the number of active cores
+- (id) initWithWorkerCount:(NSUInteger)count;  // Pending tasks are discarded and running ones waited for when the pool is released
+- (Task*) submitTaskWithFunction:(TaskFunction)function context:(void*)context priority:(TaskPriority)priority;
+- (Task*) submitTaskWithTarget:(id)target selector:(SEL)selector argument:(id)argument priority:(TaskPriority)priority;
+#if NS_BLOCKS_AVAILABLE
+- (Task*) submitTaskWithPriority:(TaskPriority)priority block:(id (^)(void))block;
+#endif
+- (Task*) submitLongRunningTaskWithTarget:(id)target selector:(SEL)selector argument:(id)argument;
+@end
@@ -0,0 +1,537 @@
+// Copyright 2011 Cooliris, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#import <objc/runtime.h>
+#import <pthread.h>
+
+#import "TaskPool.h"
+#import "Logging.h"
+
+#define kHelpingWaitInterval 0.001
+
+static pthread_key_t _workerKey;
+
+@interface TaskPoolWorker : NSObject {
+@private
+  TaskPool* _pool;
+  NSMutableArray* _deques[kTaskPriorityCount];
+  OSSpinLock _lock;
+  NSUInteger _stealIndex;
+}
+@property(nonatomic, readonly) TaskPool* pool;  // Not retained
+@property(nonatomic) NSUInteger stealIndex;
+- (id) initWithPool:(TaskPool*)pool;
+- (void) pushTask:(Task*)task;
+- (Task*) popTaskWithPriority:(TaskPriority)priority;  // Back of the deque - Returns a retained task
+- (Task*) stealTaskWithPriority:(TaskPriority)priority;  // Front of the deque - Returns a retained task
+- (void) moveTasksToQueues:(NSMutableArray**)queues;
+@end
+
+@interface Task ()
+@property(nonatomic, assign) TaskPool* pool;
+- (id) initWithPriority:(TaskPriority)priority longRunning:(BOOL)longRunning;
+- (void) setFunction:(TaskFunction)function context:(void*)context;
+- (void) setTarget:(id)target selector:(SEL)selector argument:(id)argument;
+#if NS_BLOCKS_AVAILABLE
+- (void) setBlock:(id (^)(void))block;
+#endif
+- (void) run;
+@end
+
+@interface TaskPool ()
+- (void) _runWorker:(TaskPoolWorker*)worker;
+- (Task*) _dequeueTaskForWorker:(TaskPoolWorker*)worker allowLongRunning:(BOOL)allowLongRunning;
+- (void) _waitForTask:(Task*)task;
+- (void) _notifyTaskFinished:(Task*)task;
+@end
+
+@implementation TaskPoolWorker
+
+@synthesize pool=_pool, stealIndex=_stealIndex;
+
+- (id) initWithPool:(TaskPool*)pool {
+  if ((self = [super init])) {
+    _pool = pool;
+    for (int i = 0; i < kTaskPriorityCount; ++i) {
+      _deques[i] = [[NSMutableArray alloc] init];
+    }
+  }
+  return self;
+}
+
+- (void) dealloc {
+  for (int i = 0; i < kTaskPriorityCount; ++i) {
+    [_deques[i] release];
+  }
+
+  [super dealloc];
+}
+
+- (void) pushTask:(Task*)task {
+  OSSpinLockLock(&_lock);
+  [_deques[task.priority] addObject:task];
+  OSSpinLockUnlock(&_lock);
+}
+
+- (Task*) popTaskWithPriority:(TaskPriority)priority {
+  Task* task = nil;
+  OSSpinLockLock(&_lock);
+  NSMutableArray* deque = _deques[priority];
+  NSUInteger count = deque.count;
+  if (count) {
+    task = [[deque objectAtIndex:(count - 1)] retain];
+    [deque removeObjectAtIndex:(count - 1)];
+  }
+  OSSpinLockUnlock(&_lock);
+  return task;
+}
+
+- (Task*) stealTaskWithPriority:(TaskPriority)priority {
+  Task* task = nil;
+  OSSpinLockLock(&_lock);
+  NSMutableArray* deque = _deques[priority];
+  if (deque.count) {
+    task = [[deque objectAtIndex:0] retain];
+    [deque removeObjectAtIndex:0];
+  }
+  OSSpinLockUnlock(&_lock);
+  return task;
+}
+
+- (void) moveTasksToQueues:(NSMutableArray**)queues {
+  OSSpinLockLock(&_lock);
+  for (int i = 0; i < kTaskPriorityCount; ++i) {
+    [queues[i] addObjectsFromArray:_deques[i]];
+    [_deques[i] removeAllObjects];
+  }
+  OSSpinLockUnlock(&_lock);
+}
+
+@end
+
+@implementation Task
+
+@synthesize priority=_priority, longRunning=_longRunning, finished=_finished, result=_result, pool=_pool;
+
+- (id) initWithPriority:(TaskPriority)priority longRunning:(BOOL)longRunning {
+  if ((self = [super init])) {
+    _priority = priority;
+    _longRunning = longRunning;
+  }
+  return self;
+}
+
+- (void) dealloc {
+  [_target release];
+  [_argument release];
+  [_block release];
+  [_result release];
+  [_completionBlock release];
+
+  [super dealloc];
+}
+
+- (void) setFunction:(TaskFunction)function context:(void*)context {
+  _function = function;
+  _context = context;
+}
+
+- (void) setTarget:(id)target selector:(SEL)selector argument:(id)argument {
+  _target = [target retain];
+  _selector = selector;
+  _argument = [argument retain];
+  _returnsObject = [[target methodSignatureForSelector:selector] methodReturnType][0] == _C_ID;
+}
+
+#if NS_BLOCKS_AVAILABLE
+
+- (void) setBlock:(id (^)(void))block {
+  _block = [block copy];
+}
+
+#endif
+
+- (void) run {
+  NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+  id result = nil;
+  @try {
+    if (_function) {
+      (*_function)(_context);
+    } else if (_block) {
+#if NS_BLOCKS_AVAILABLE
+      result = ((id (^)(void))_block)();
+#endif
+    } else if (_returnsObject) {
+      result = [_target performSelector:_selector withObject:_argument];
+    } else {
+      [_target performSelector:_selector withObject:_argument];
+    }
+  }
+  @catch (NSException* exception) {
+    LOG_ERROR(@"Exception while running task: %@", exception);
+  }
+  _result = [result retain];
+  [pool release];
+
+  [_target release];  // Free memory immediately
+  _target = nil;
+  [_argument release];
+  _argument = nil;
+  [_block release];
+  _block = nil;
+
+  OSSpinLockLock(&_lock);
+  _finished = YES;
+  TaskCompletionFunction function = _completionFunction;
+  void* context = _completionContext;
+  id block = _completionBlock;
+  _completionFunction = NULL;
+  _completionBlock = nil;
+  OSSpinLockUnlock(&_lock);
+  [_pool _notifyTaskFinished:self];
+  if (function) {
+    (*function)(self, context);
+  }
+#if NS_BLOCKS_AVAILABLE
+  if (block) {
+    ((void (^)(Task*))block)(self);
+  }
+#endif
+  [block release];
+}
+
+- (void) setCompletionFunction:(TaskCompletionFunction)function context:(void*)context {
+  OSSpinLockLock(&_lock);
+  BOOL finished = _finished;
+  if (!finished) {
+    _completionFunction = function;
+    _completionContext = context;
+  }
+  OSSpinLockUnlock(&_lock);
+  if (finished) {
+    (*function)(self, context);
+  }
+}
+
+#if NS_BLOCKS_AVAILABLE
+
+- (void) setCompletionBlock:(void (^)(Task* task))block {
+  OSSpinLockLock(&_lock);
+  BOOL finished = _finished;
+  if (!finished) {
+    [_completionBlock release];
+    _completionBlock = [block copy];
+  }
+  OSSpinLockUnlock(&_lock);
+  if (finished) {
+    block(self);
+  }
+}
+
+#endif
+
+- (void) waitUntilFinished {
+  if (!_finished) {
+    [_pool _waitForTask:self];
+  }
+}
+
+@end
+
+@implementation TaskPool
+
+@synthesize workerCount=_workerCount;
+
++ (void) initialize {
+  if (self == [TaskPool class]) {
+    pthread_key_create(&_workerKey, NULL);
+  }
+}
+
++ (TaskPool*) sharedPool {
+  static TaskPool* pool = nil;
+  static dispatch_once_t token = 0;
+  dispatch_once(&token, ^{
+    pool = [[TaskPool alloc] initWithWorkerCount:[[NSProcessInfo processInfo] activeProcessorCount]];
+  });
+  return pool;
+}
+
+// Class method so that the thread does not retain the pool
++ (void) _workerMain:(TaskPoolWorker*)worker {
+  NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+  pthread_setspecific(_workerKey, worker);
+  [worker.pool _runWorker:worker];
+  pthread_setspecific(_workerKey, NULL);
+  [pool release];
+}
+
+- (void) _spawnWorker {
+  TaskPoolWorker* worker = [[TaskPoolWorker alloc] initWithPool:self];
+  OSSpinLockLock(&_workersLock);
+  NSArray* workers = [_workers arrayByAddingObject:worker];
+  [_workers release];
+  _workers = [workers retain];
+  OSSpinLockUnlock(&_workersLock);
+  [_condition lock];
+  _runningCount += 1;
+  [_condition unlock];
+  [NSThread detachNewThreadSelector:@selector(_workerMain:) toTarget:[TaskPool class] withObject:worker];
+  [worker release];
+}
+
+- (id) init {
+  return [self initWithWorkerCount:[[NSProcessInfo processInfo] activeProcessorCount]];
+}
+
+- (id) initWithWorkerCount:(NSUInteger)count {
+  CHECK(count > 0);
+  if ((self = [super init])) {
+    _workerCount = count;
+    _workers = [[NSArray alloc] init];
+    for (int i = 0; i < kTaskPriorityCount; ++i) {
+      _queues[i] = [[NSMutableArray alloc] init];
+    }
+    _longRunningQueue = [[NSMutableArray alloc] init];
+    _condition = [[NSCondition alloc] init];
+    _completionCondition = [[NSCondition alloc] init];
+    for (NSUInteger i = 0; i < count; ++i) {
+      [self _spawnWorker];
+    }
+  }
+  return self;
+}
+
+- (void) dealloc {
+  DCHECK(pthread_getspecific(_workerKey) == NULL);
+  [_condition lock];
+  _stopped = YES;
+  [_condition broadcast];
+  while (_runningCount) {
+    [_condition wait];
+  }
+  [_condition unlock];
+
+  [_workers release];
+  for (int i = 0; i < kTaskPriorityCount; ++i) {
+    [_queues[i] release];
+  }
+  [_longRunningQueue release];
+  [_condition release];
+  [_completionCondition release];
+
+  [super dealloc];
+}
+
+// Removes the worker if it was compensating for a long-running task that has now finished
+- (BOOL) _retireWorkerAfterLongRunningTask:(TaskPoolWorker*)worker {
+  BOOL retire = NO;
+  OSSpinLockLock(&_workersLock);
+  OSAtomicDecrement32(&_longRunningCount);
+  if (_workers.count > _workerCount + _longRunningCount) {
+    NSMutableArray* workers = [_workers mutableCopy];
+    [workers removeObjectIdenticalTo:worker];
+    [_workers release];
+    _workers = workers;
+    retire = YES;
+  }
+  OSSpinLockUnlock(&_workersLock);
+  if (retire) {
+    OSSpinLockLock(&_queuesLock);
+    [worker moveTasksToQueues:_queues];
+    OSSpinLockUnlock(&_queuesLock);
+  }
+  return retire;
+}
+
+- (void) _runWorker:(TaskPoolWorker*)worker {
+  while (1) {
+    Task* task = [self _dequeueTaskForWorker:worker allowLongRunning:YES];
+    if (task) {
+      BOOL longRunning = task.longRunning;
+      [task run];
+      [task release];
+      if (longRunning && [self _retireWorkerAfterLongRunningTask:worker]) {
+        break;
+      }
+      continue;
+    }
+
+    [_condition lock];
+    OSAtomicIncrement32Barrier(&_sleepingCount);
+    while ((_pendingCount == 0) && !_stopped) {
+      [_condition wait];
+    }
+    OSAtomicDecrement32Barrier(&_sleepingCount);
+    BOOL stopped = _stopped;
+    [_condition unlock];
+    if (stopped) {
+      break;
+    }
+  }
+
+  [_condition lock];
+  _runningCount -= 1;
+  [_condition broadcast];
+  [_condition unlock];
+}
+
+// Returns a retained task - Long-running tasks are never returned to workers helping while waiting for another task
+- (Task*) _dequeueTaskForWorker:(TaskPoolWorker*)worker allowLongRunning:(BOOL)allowLongRunning {
+  if (_pendingCount == 0) {
+    return nil;
+  }
+  Task* task = nil;
+  if (allowLongRunning) {
+    OSSpinLockLock(&_queuesLock);
+    if (_longRunningQueue.count) {
+      task = [[_longRunningQueue objectAtIndex:0] retain];
+      [_longRunningQueue removeObjectAtIndex:0];
+    }
+    OSSpinLockUnlock(&_queuesLock);
+  }
+  for (int priority = kTaskPriorityCount - 1; (priority >= 0) && !task; --priority) {
+    task = [worker popTaskWithPriority:priority];
+    if (task == nil) {
+      OSSpinLockLock(&_queuesLock);
+      NSMutableArray* queue = _queues[priority];
+      if (queue.count) {
+        task = [[queue objectAtIndex:0] retain];
+        [queue removeObjectAtIndex:0];
+      }
+      OSSpinLockUnlock(&_queuesLock);
+    }
+    if (task == nil) {
+      OSSpinLockLock(&_workersLock);
+      NSArray* workers = [_workers retain];
+      OSSpinLockUnlock(&_workersLock);
+      NSUInteger count = workers.count;
+      NSUInteger index = worker.stealIndex;
+      for (NSUInteger i = 0; (i < count) && !task; ++i) {
+        TaskPoolWorker* victim = [workers objectAtIndex:((index + i) % count)];
+        if (victim != worker) {
+          task = [victim stealTaskWithPriority:priority];
+        }
+      }
+      worker.stealIndex = index + 1;  // Spread thieves across victims
+      [workers release];
+    }
+  }
+  if (task) {
+    OSAtomicDecrement32(&_pendingCount);
+  }
+  return task;
+}
+
+// Tasks submitted from a worker of this pool go to its own deques, others to the shared queues
+- (Task*) _submitTask:(Task*)task {
+  task.pool = self;
+  TaskPoolWorker* worker = pthread_getspecific(_workerKey);
+  if (task.longRunning) {
+    OSSpinLockLock(&_workersLock);
+    OSAtomicIncrement32(&_longRunningCount);
+    OSSpinLockUnlock(&_workersLock);
+    [self _spawnWorker];
+    OSSpinLockLock(&_queuesLock);
+    [_longRunningQueue addObject:task];
+    OSSpinLockUnlock(&_queuesLock);
+  } else if (worker && (worker.pool == self)) {
+    [worker pushTask:task];
+  } else {
+    OSSpinLockLock(&_queuesLock);
+    [_queues[task.priority] addObject:task];
+    OSSpinLockUnlock(&_queuesLock);
+  }
+  OSAtomicIncrement32Barrier(&_pendingCount);
+  if (_sleepingCount) {
+    [_condition lock];
+    [_condition signal];
+    [_condition unlock];
+  }
+  return task;
+}
+
+- (Task*) submitTaskWithFunction:(TaskFunction)function context:(void*)context priority:(TaskPriority)priority {
+  DCHECK(function);
+  Task* task = [[Task alloc] initWithPriority:priority longRunning:NO];
+  [task setFunction:function context:context];
+  [self _submitTask:task];
+  return [task autorelease];
+}
+
+- (Task*) submitTaskWithTarget:(id)target selector:(SEL)selector argument:(id)argument priority:(TaskPriority)priority {
+  DCHECK(target && selector);
+  Task* task = [[Task alloc] initWithPriority:priority longRunning:NO];
+  [task setTarget:target selector:selector argument:argument];
+  [self _submitTask:task];
+  return [task autorelease];
+}
+
+#if NS_BLOCKS_AVAILABLE
+
+- (Task*) submitTaskWithPriority:(TaskPriority)priority block:(id (^)(void))block {
+  DCHECK(block);
+  Task* task = [[Task alloc] initWithPriority:priority longRunning:NO];
+  [task setBlock:block];
+  [self _submitTask:task];
+  return [task autorelease];
+}
+
+#endif
+
+- (Task*) submitLongRunningTaskWithTarget:(id)target selector:(SEL)selector argument:(id)argument {
+  DCHECK(target && selector);
+  Task* task = [[Task alloc] initWithPriority:kTaskPriority_High longRunning:YES];
+  [task setTarget:target selector:selector argument:argument];
+  [self _submitTask:task];
+  return [task autorelease];
+}
+
+// Workers keep running other tasks while waiting to avoid deadlocks on nested tasks
+- (void) _waitForTask:(Task*)task {
+  TaskPoolWorker* worker = pthread_getspecific(_workerKey);
+  if (worker && (worker.pool != self)) {
+    worker = nil;
+  }
+  while (!task.finished) {
+    Task* otherTask = worker ? [self _dequeueTaskForWorker:worker allowLongRunning:NO] : nil;
+    if (otherTask) {
+      [otherTask run];
+      [otherTask release];
+      continue;
+    }
+    [_completionCondition lock];
+    OSAtomicIncrement32Barrier(&_waitingCount);
+    if (!task.finished) {
+      if (worker) {
+        [_completionCondition waitUntilDate:[NSDate dateWithTimeIntervalSinceNow:kHelpingWaitInterval]];
+      } else {
+        [_completionCondition wait];
+      }
+    }
+    OSAtomicDecrement32Barrier(&_waitingCount);
+    [_completionCondition unlock];
+  }
+}
+
+- (void) _notifyTaskFinished:(Task*)task {
+  OSMemoryBarrier();
+  if (_waitingCount) {
+    [_completionCondition lock];
+    [_completionCondition broadcast];
+    [_completionCondition unlock];
+  }
+}
+
+@end
@@ -0,0 +1,238 @@
+// Copyright 2011 Cooliris, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#import <unistd.h>
+
+#import "TaskPool.h"
+#import "BackgroundThread.h"
+#import "UnitTest.h"
+
+#define kTaskCount 1000
+#define kBenchmarkTasks 100000
+#define kNestingDepth 6
+
+static void _IncrementFunction(void* context) {
+  OSAtomicIncrement32Barrier((volatile int32_t*)context);
+}
+
+static void _CompletionFunction(Task* task, void* context) {
+  OSAtomicIncrement32Barrier((volatile int32_t*)context);
+}
+
+static void _BenchmarkFunction(void* context) {
+  volatile int32_t* counter = (volatile int32_t*)context;
+  OSAtomicIncrement32(counter);
+}
+
+@interface TaskPoolTests : UnitTest {
+@private
+  TaskPool* _pool;
+  NSMutableArray* _order;
+  NSCondition* _gate;
+  BOOL _open;
+  volatile int32_t _counter;
+}
+@end
+
+@implementation TaskPoolTests
+
+- (void) _recordNumber:(NSNumber*)number {
+  @synchronized(_order) {
+    [_order addObject:number];
+  }
+}
+
+- (void) _waitForGate:(id)argument {
+  [_gate lock];
+  while (!_open) {
+    [_gate wait];
+  }
+  [_gate unlock];
+}
+
+- (NSNumber*) _fibonacci:(NSNumber*)number {
+  NSInteger n = [number integerValue];
+  if (n < 2) {
+    return number;
+  }
+  TaskPool* pool = _pool ? _pool : [TaskPool sharedPool];
+  Task* task1 = [pool submitTaskWithTarget:self selector:@selector(_fibonacci:) argument:[NSNumber numberWithInteger:(n - 1)] priority:kTaskPriority_Normal];
+  Task* task2 = [pool submitTaskWithTarget:self selector:@selector(_fibonacci:) argument:[NSNumber numberWithInteger:(n - 2)] priority:kTaskPriority_Normal];
+  [task2 waitUntilFinished];
+  [task1 waitUntilFinished];
+  return [NSNumber numberWithInteger:([task1.result integerValue] + [task2.result integerValue])];
+}
+
+- (void) _runLoop:(id)argument {
+  _counter += 1;
+  [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+}
+
+- (void) testFunctions {
+  TaskPool* pool = [[TaskPool alloc] initWithWorkerCount:4];
+  volatile int32_t counter = 0;
+  volatile int32_t completions = 0;
+  NSMutableArray* tasks = [NSMutableArray array];
+  for (int i = 0; i < kTaskCount; ++i) {
+    Task* task = [pool submitTaskWithFunction:_IncrementFunction context:(void*)&counter priority:(TaskPriority)(i % kTaskPriorityCount)];
+    [task setCompletionFunction:_CompletionFunction context:(void*)&completions];
+    [tasks addObject:task];
+  }
+  for (Task* task in tasks) {
+    [task waitUntilFinished];
+    AssertTrue(task.finished);
+    AssertNil(task.result);
+  }
+  AssertEqual(counter, kTaskCount);
+  while (completions < kTaskCount) {
+    usleep(1000);  // Completion functions are called after waiters are woken up
+  }
+
+  Task* task = [tasks lastObject];  // Already finished so called immediately
+  [task setCompletionFunction:_CompletionFunction context:(void*)&completions];
+  AssertEqual(completions, kTaskCount + 1);
+  [pool release];
+}
+
+- (void) testFutures {
+  TaskPool* pool = [TaskPool sharedPool];
+  Task* task = [pool submitTaskWithTarget:self selector:@selector(_fibonacci:) argument:[NSNumber numberWithInteger:15] priority:kTaskPriority_High];
+  [task waitUntilFinished];
+  AssertEqualObjects(task.result, [NSNumber numberWithInteger:610]);
+
+  task = [pool submitTaskWithTarget:self selector:@selector(_runLoop:) argument:nil priority:kTaskPriority_Low];  // Void return value
+  [task waitUntilFinished];
+  AssertNil(task.result);
+
+#if NS_BLOCKS_AVAILABLE
+  __block BOOL completed = NO;
+  task = [pool submitTaskWithPriority:kTaskPriority_Normal block:^id {
+    return [NSString stringWithFormat:@"%i", kNestingDepth];
+  }];
+  [task waitUntilFinished];
+  [task setCompletionBlock:^(Task* finishedTask) {
+    completed = YES;
+  }];
+  AssertTrue(completed);
+  AssertEqualObjects(task.result, @"6");
+#endif
+}
+
+// A single worker blocked on a gate must run the queued tasks in priority then FIFO order
+- (void) testPriorities {
+  TaskPool* pool = [[TaskPool alloc] initWithWorkerCount:1];
+  _order = [[NSMutableArray alloc] init];
+  _gate = [[NSCondition alloc] init];
+  _open = NO;
+  [pool submitTaskWithTarget:self selector:@selector(_waitForGate:) argument:nil priority:kTaskPriority_High];
+  usleep(50 * 1000);
+  NSMutableArray* tasks = [NSMutableArray array];
+  for (int i = 0; i < 9; ++i) {
+    [tasks addObject:[pool submitTaskWithTarget:self
+                                       selector:@selector(_recordNumber:)
+                                       argument:[NSNumber numberWithInt:i]
+                                       priority:(TaskPriority)(i % kTaskPriorityCount)]];
+  }
+  [_gate lock];
+  _open = YES;
+  [_gate broadcast];
+  [_gate unlock];
+  for (Task* task in tasks) {
+    [task waitUntilFinished];
+  }
+  NSArray* expected = [NSArray arrayWithObjects:[NSNumber numberWithInt:2], [NSNumber numberWithInt:5], [NSNumber numberWithInt:8],
+                                                [NSNumber numberWithInt:1], [NSNumber numberWithInt:4], [NSNumber numberWithInt:7],
+                                                [NSNumber numberWithInt:0], [NSNumber numberWithInt:3], [NSNumber numberWithInt:6], nil];
+  AssertEqualObjects(_order, expected);
+  [_gate release];
+  _gate = nil;
+  [_order release];
+  _order = nil;
+  [pool release];
+}
+
+// Nested tasks waiting on each other must not deadlock even with a single worker
+- (void) testNestedTasks {
+  _pool = [[TaskPool alloc] initWithWorkerCount:1];
+  Task* task = [_pool submitTaskWithTarget:self selector:@selector(_fibonacci:) argument:[NSNumber numberWithInteger:kNestingDepth] priority:kTaskPriority_Normal];
+  [task waitUntilFinished];
+  AssertEqualObjects(task.result, [NSNumber numberWithInteger:8]);
+  [_pool release];
+  _pool = nil;
+}
+
+// Long-running tasks must get compensating workers and not starve regular tasks
+- (void) testLongRunningTasks {
+  TaskPool* pool = [[TaskPool alloc] initWithWorkerCount:1];
+  _gate = [[NSCondition alloc] init];
+  _open = NO;
+  Task* longTask = [pool submitLongRunningTaskWithTarget:self selector:@selector(_waitForGate:) argument:nil];
+  volatile int32_t counter = 0;
+  Task* task = [pool submitTaskWithFunction:_IncrementFunction context:(void*)&counter priority:kTaskPriority_Normal];
+  [task waitUntilFinished];
+  AssertEqual(counter, 1);
+  AssertFalse(longTask.finished);
+  [_gate lock];
+  _open = YES;
+  [_gate broadcast];
+  [_gate unlock];
+  [longTask waitUntilFinished];
+  [_gate release];
+  _gate = nil;
+  [pool release];
+
+  _counter = 0;
+  BackgroundThread* thread = [[BackgroundThread alloc] initWithTarget:self selector:@selector(_runLoop:) argument:nil];
+  AssertTrue(thread.running);
+  [thread waitUntilDone];
+  AssertFalse(thread.running);
+  AssertEqual(_counter, 1);
+  [thread release];
+}
+
+- (void) testBenchmark {
+  TaskPool* pool = [TaskPool sharedPool];
+  volatile int32_t counter = 0;
+  CFAbsoluteTime time = CFAbsoluteTimeGetCurrent();
+  Task* lastTask = nil;
+  for (int i = 0; i < kBenchmarkTasks; ++i) {
+    NSAutoreleasePool* localPool = [[NSAutoreleasePool alloc] init];
+    [lastTask release];
+    lastTask = [[pool submitTaskWithFunction:_BenchmarkFunction context:(void*)&counter priority:kTaskPriority_Normal] retain];
+    [localPool release];
+  }
+  [lastTask waitUntilFinished];
+  [lastTask release];
+  while (counter < kBenchmarkTasks) {
+    usleep(100);
+  }
+  CFAbsoluteTime poolTime = CFAbsoluteTimeGetCurrent() - time;
+
+  counter = 0;
+  dispatch_group_t group = dispatch_group_create();
+  dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+  time = CFAbsoluteTimeGetCurrent();
+  for (int i = 0; i < kBenchmarkTasks; ++i) {
+    dispatch_group_async_f(group, queue, (void*)&counter, _BenchmarkFunction);
+  }
+  dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+  CFAbsoluteTime dispatchTime = CFAbsoluteTimeGetCurrent() - time;
+  dispatch_release(group);
+  AssertEqual(counter, kBenchmarkTasks);
+
+  LOG_INFO(@"Task throughput on %i workers: %.0f tasks/s with TaskPool, %.0f tasks/s with GCD",
+           (int)pool.workerCount, kBenchmarkTasks / poolTime, kBenchmarkTasks / dispatchTime);
+}
+
+@end
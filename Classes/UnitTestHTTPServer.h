@@ -0,0 +1,39 @@
+// Copyright 2011 Cooliris, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#import <Foundation/Foundation.h>
+#import <pthread.h>
+
+// Called on a dedicated thread for each connection with the request line and headers - The function writes the response
+// to the socket which is closed when it returns - Long-running handlers should return as soon as the server stops running
+typedef void (*UnitTestHTTPServerFunction)(int socket, const char* request, void* context);
+
+// Minimal HTTP server listening on an ephemeral loopback port for unit tests
+@interface UnitTestHTTPServer : NSObject {
+@private
+  UnitTestHTTPServerFunction _function;
+  void* _context;
+  int _socket;
+  NSUInteger _port;
+  volatile BOOL _running;
+  pthread_t _thread;
+  NSCondition* _condition;
+  NSUInteger _connectionCount;
+}
+@property(nonatomic, readonly) NSUInteger port;
+@property(nonatomic, readonly, getter=isRunning) BOOL running;
+- (id) initWithFunction:(UnitTestHTTPServerFunction)function context:(void*)context;  // Returns nil if the server cannot start
+- (NSURL*) URLWithPath:(NSString*)path;  // Path must start with "/"
+- (void) stop;  // Blocks until the accept thread and all connections have exited (called automatically on -dealloc)
+@end
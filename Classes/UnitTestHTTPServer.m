@@ -0,0 +1,164 @@
+// Copyright 2011 Cooliris, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#import <unistd.h>
+#import <poll.h>
+#import <netinet/in.h>
+#import <arpa/inet.h>
+
+#import "UnitTestHTTPServer.h"
+#import "Logging.h"
+
+#define kAcceptPollInterval 100  // Milliseconds
+#define kRequestBufferSize 8192
+
+typedef struct {
+  UnitTestHTTPServer* server;
+  int socket;
+} Connection;
+
+@interface UnitTestHTTPServer ()
+- (void) _acceptConnections;
+- (void) _handleConnection:(int)socket;
+@end
+
+static void* _AcceptThread(void* context) {
+  NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+  [(UnitTestHTTPServer*)context _acceptConnections];
+  [pool release];
+  return NULL;
+}
+
+static void* _ConnectionThread(void* context) {
+  NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+  Connection* connection = (Connection*)context;
+  [connection->server _handleConnection:connection->socket];
+  free(connection);
+  [pool release];
+  return NULL;
+}
+
+@implementation UnitTestHTTPServer
+
+@synthesize port=_port, running=_running;
+
+- (id) initWithFunction:(UnitTestHTTPServerFunction)function context:(void*)context {
+  CHECK(function);
+  if ((self = [super init])) {
+    _function = function;
+    _context = context;
+    _condition = [[NSCondition alloc] init];
+    
+    _socket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    struct sockaddr_in addr4;
+    bzero(&addr4, sizeof(addr4));
+    addr4.sin_len = sizeof(addr4);
+    addr4.sin_family = AF_INET;
+    addr4.sin_port = 0;  // Let the kernel pick an unused port
+    addr4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(addr4);
+    if ((_socket < 0) || bind(_socket, (struct sockaddr*)&addr4, sizeof(addr4)) || listen(_socket, 128) ||
+        getsockname(_socket, (struct sockaddr*)&addr4, &length)) {
+      LOG_ERROR(@"Failed starting test HTTP server (%s)", strerror(errno));
+      [self release];
+      return nil;
+    }
+    _port = ntohs(addr4.sin_port);
+    _running = YES;
+    if (pthread_create(&_thread, NULL, _AcceptThread, self)) {
+      _running = NO;
+      [self release];
+      return nil;
+    }
+  }
+  return self;
+}
+
+- (void) dealloc {
+  [self stop];
+  if (_socket >= 0) {
+    close(_socket);
+  }
+  [_condition release];
+  
+  [super dealloc];
+}
+
+- (NSURL*) URLWithPath:(NSString*)path {
+  return [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%i%@", (int)_port, path]];
+}
+
+- (void) stop {
+  if (_running) {
+    _running = NO;
+    pthread_join(_thread, NULL);
+    [_condition lock];
+    while (_connectionCount) {
+      [_condition wait];
+    }
+    [_condition unlock];
+  }
+}
+
+- (void) _acceptConnections {
+  while (_running) {
+    struct pollfd pfd = {_socket, POLLIN, 0};
+    if (poll(&pfd, 1, kAcceptPollInterval) > 0) {
+      int fd = accept(_socket, NULL, NULL);
+      if (fd >= 0) {
+        Connection* connection = malloc(sizeof(Connection));
+        connection->server = self;
+        connection->socket = fd;
+        [_condition lock];
+        _connectionCount += 1;
+        [_condition unlock];
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, _ConnectionThread, connection) == 0) {
+          pthread_detach(thread);
+        } else {
+          [self _handleConnection:fd];
+          free(connection);
+        }
+      }
+    }
+  }
+}
+
+- (void) _handleConnection:(int)socket {
+  int value = 1;
+  setsockopt(socket, SOL_SOCKET, SO_NOSIGPIPE, &value, sizeof(value));
+  char buffer[kRequestBufferSize];
+  size_t length = 0;
+  while (length < sizeof(buffer) - 1) {
+    ssize_t count = read(socket, buffer + length, sizeof(buffer) - 1 - length);
+    if (count <= 0) {
+      break;
+    }
+    length += count;
+    buffer[length] = 0;
+    if (strstr(buffer, "\r\n\r\n")) {
+      break;
+    }
+  }
+  buffer[length] = 0;
+  (*_function)(socket, buffer, _context);
+  close(socket);
+  
+  [_condition lock];
+  _connectionCount -= 1;
+  [_condition broadcast];
+  [_condition unlock];
+}
+
+@end